@@ -0,0 +1,136 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "array_value.c"
+
+// Reductions of a stream of numbers, e.g. `sum(d)`, all worked out in
+// one pass without keeping the numbers.
+//
+// Sums are compensated (Kahan), so adding many small numbers to a large
+// total doesn't lose them. The spread is kept as a running mean and sum
+// of squared differences from it (Welford), which doesn't cancel out
+// like a sum of squares does. Numbers go through ARRAY_LANES at a time,
+// each lane with its own of all of these, and lanes, or parts of a
+// stream worked on separately, combine at the end.
+
+typedef enum AggregateType AggregateType;
+enum AggregateType {
+    AGGREGATE_SUM,
+    AGGREGATE_MEAN,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_STDDEV,
+};
+
+#define N_AGGREGATES 5
+
+const char *aggregate_names[N_AGGREGATES] = {"sum", "mean", "min", "max", "stddev"};
+
+typedef struct Aggregate Aggregate;
+struct Aggregate {
+    size_t count;
+    // The sum is `sum - compensation`
+    double sum;
+    double compensation;
+    double mean;
+    double m2;
+    double min;
+    double max;
+};
+
+const Aggregate aggregate_empty = { .min = INFINITY, .max = -INFINITY };
+
+// Add `value` to the compensated sum `*sum - *compensation`.
+void compensated_add(double *sum, double *compensation, double value) {
+    double y = value - *compensation;
+    double t = *sum + y;
+    *compensation = (t - *sum) - y;
+    *sum = t;
+}
+
+void aggregate_add_to_sum(Aggregate *agg, double value) {
+    compensated_add(&agg->sum, &agg->compensation, value);
+}
+
+void aggregate_add(Aggregate *agg, double value) {
+    agg->count++;
+    aggregate_add_to_sum(agg, value);
+    double delta = value - agg->mean;
+    agg->mean += delta / agg->count;
+    agg->m2 += delta * (value - agg->mean);
+    agg->min = value < agg->min ? value : agg->min;
+    agg->max = value > agg->max ? value : agg->max;
+}
+
+// What `a` would be after adding everything `b` has had added.
+Aggregate aggregate_combine(Aggregate a, Aggregate b) {
+    if (b.count == 0) return a;
+    if (a.count == 0) return b;
+    Aggregate combined = a;
+    combined.count = a.count + b.count;
+    aggregate_add_to_sum(&combined, b.sum);
+    aggregate_add_to_sum(&combined, -b.compensation);
+    double delta = b.mean - a.mean;
+    combined.mean = a.mean + delta * b.count / combined.count;
+    combined.m2 = a.m2 + b.m2 + delta * delta * ((double)a.count * b.count / combined.count);
+    combined.min = b.min < a.min ? b.min : a.min;
+    combined.max = b.max > a.max ? b.max : a.max;
+    return combined;
+}
+
+// Add `n` numbers, which don't need to be aligned.
+void aggregate_add_values(Aggregate *agg, const double *values, size_t n) {
+    size_t n_vectors = n / ARRAY_LANES;
+    if (n_vectors > 0) {
+        ArrayLanes sum = {0}, compensation = {0}, mean = {0}, m2 = {0};
+        ArrayLanes min = (ArrayLanes) {0} + INFINITY;
+        ArrayLanes max = (ArrayLanes) {0} - INFINITY;
+        for (size_t i = 0; i < n_vectors; i++) {
+            ArrayLanes x;
+            memcpy(&x, values + i * ARRAY_LANES, sizeof(x));
+            ArrayLanes y = x - compensation;
+            ArrayLanes t = sum + y;
+            compensation = (t - sum) - y;
+            sum = t;
+            ArrayLanes delta = x - mean;
+            mean += delta / (double)(i + 1);
+            m2 += delta * (x - mean);
+            array_lanes_min(&min, &x);
+            array_lanes_max(&max, &x);
+        }
+        for (size_t lane = 0; lane < ARRAY_LANES; lane++) {
+            *agg = aggregate_combine(*agg, (Aggregate) {
+                .count = n_vectors,
+                .sum = sum[lane],
+                .compensation = compensation[lane],
+                .mean = mean[lane],
+                .m2 = m2[lane],
+                .min = min[lane],
+                .max = max[lane],
+            });
+        }
+    }
+    for (size_t i = n_vectors * ARRAY_LANES; i < n; i++) {
+        aggregate_add(agg, values[i]);
+    }
+}
+
+// The standard deviation is the sample one, and 0 for a single number.
+double aggregate_result(Aggregate agg, AggregateType type) {
+    switch (type) {
+        case AGGREGATE_SUM:
+            return agg.sum - agg.compensation;
+        case AGGREGATE_MEAN:
+            return (agg.sum - agg.compensation) / agg.count;
+        case AGGREGATE_MIN:
+            return agg.min;
+        case AGGREGATE_MAX:
+            return agg.max;
+        case AGGREGATE_STDDEV:
+            return agg.count > 1 ? sqrt(agg.m2 / (agg.count - 1)) : 0;
+    }
+    return 0;
+}
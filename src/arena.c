@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "debug.c"
+#include "trace.c"
 
 typedef struct ArenaBlock ArenaBlock;
 struct ArenaBlock {
@@ -52,12 +53,29 @@ void *arena_alloc(Arena *arena, size_t size) {
     assert(prev != NULL);
     size_t new_size = prev->size * 2 >= size ? prev->size * 2 : size;
     debug("Allocating new block, curr_size: %zu new_size: %zu requested: %zu\n", prev->size, new_size, size);
+    trace_instant(TRACE_ARENA, "new_block", NULL, new_size);
     ArenaBlock *new_block = arena_block_create(new_size);
     new_block->used += size;
     prev->next = new_block;
     return (void *)new_block->memory;
 }
 
+// Like `arena_alloc`, but the result is aligned to `align` (a power of
+// two), e.g. for atomics, which can't straddle cache lines.
+void *arena_alloc_aligned(Arena *arena, size_t size, size_t align) {
+    void *ptr = arena_alloc(arena, size + align - 1);
+    return (void *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+// Total bytes handed out so far, not including unused block space.
+size_t arena_used(Arena *arena) {
+    size_t used = 0;
+    for (ArenaBlock *block = arena->first; block != NULL; block = block->next) {
+        used += block->used;
+    }
+    return used;
+}
+
 void arena_free(Arena *arena) {
     ArenaBlock *next;
     for (ArenaBlock *block = arena->first; block != NULL; block = next) {
@@ -66,10 +84,9 @@ void arena_free(Arena *arena) {
     }
 }
 
+// Reset the arena for reuse, keeping its blocks around.
 void arena_clear(Arena *arena) {
-    ArenaBlock *next;
-    for (ArenaBlock *block = arena->first; block != NULL; block = next) {
-        next = block->next;
-        block->size = 0;
+    for (ArenaBlock *block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
     }
 }
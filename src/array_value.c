@@ -0,0 +1,120 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include "arena.c"
+#include "string.c"
+#include "unit.c"
+
+// A series of numbers that share one unit, e.g. `[1, 2.5, 7] km`, kept
+// in one contiguous buffer. Arithmetic on arrays goes element by
+// element: the units of each operation are worked out once for the
+// whole array, then the numbers go through in vectors of ARRAY_LANES.
+
+#define ARRAY_LANES 4
+
+typedef double ArrayLanes __attribute__((vector_size(ARRAY_LANES * sizeof(double))));
+// What comparing lanes gives: all ones where it holds, zeros elsewhere
+typedef __typeof__((ArrayLanes) {0} < (ArrayLanes) {0}) ArrayMask;
+
+typedef struct ArrayValue ArrayValue;
+struct ArrayValue {
+    // Aligned for, and padded with zeros to, a whole number of lanes
+    double *values;
+    size_t length;
+};
+
+size_t array_value_n_lanes(size_t length) {
+    return (length + ARRAY_LANES - 1) / ARRAY_LANES;
+}
+
+// `length` zeros.
+ArrayValue array_value_new(size_t length, Arena *arena) {
+    size_t size = array_value_n_lanes(length) * sizeof(ArrayLanes);
+    double *values = arena_alloc_aligned(arena, size, sizeof(ArrayLanes));
+    memset(values, 0, size);
+    return (ArrayValue) { .values = values, .length = length };
+}
+
+// An array of just `value`.
+ArrayValue array_value_of(double value, Arena *arena) {
+    ArrayValue array = array_value_new(1, arena);
+    array.values[0] = value;
+    return array;
+}
+
+ArrayValue array_value_copy(ArrayValue array, Arena *arena) {
+    ArrayValue copy = array_value_new(array.length, arena);
+    memcpy(copy.values, array.values, array.length * sizeof(double));
+    return copy;
+}
+
+// `array`, or if it's a single number, that number `length` times.
+ArrayValue array_value_broadcast(ArrayValue array, size_t length, Arena *arena) {
+    if (array.length != 1 || length == 1) return array;
+    ArrayValue broadcast = array_value_new(length, arena);
+    ArrayLanes *lanes = (ArrayLanes *)broadcast.values;
+    for (size_t i = 0; i < array_value_n_lanes(length); i++) {
+        lanes[i] = (ArrayLanes) {0} + array.values[0];
+    }
+    return broadcast;
+}
+
+// Lower `*acc` to `x` in each lane where `x` is smaller. Vectors are
+// passed by pointer so the calling convention doesn't depend on whether
+// the target has wide enough registers for them.
+void array_lanes_min(ArrayLanes *acc, const ArrayLanes *x) {
+    ArrayMask less = *x < *acc;
+    *acc = (ArrayLanes)((less & (ArrayMask)*x) | (~less & (ArrayMask)*acc));
+}
+
+// Raise `*acc` to `x` in each lane where `x` is bigger.
+void array_lanes_max(ArrayLanes *acc, const ArrayLanes *x) {
+    ArrayMask greater = *x > *acc;
+    *acc = (ArrayLanes)((greater & (ArrayMask)*x) | (~greater & (ArrayMask)*acc));
+}
+
+ArrayValue array_value_neg(ArrayValue array, Arena *arena) {
+    ArrayValue result = array_value_new(array.length, arena);
+    const ArrayLanes *in = (const ArrayLanes *)array.values;
+    ArrayLanes *out = (ArrayLanes *)result.values;
+    for (size_t i = 0; i < array_value_n_lanes(array.length); i++) {
+        out[i] = -in[i];
+    }
+    return result;
+}
+
+// `array` converted from unit `from` to unit `to`, which is one
+// multiply-add per element unless the conversion isn't affine.
+ArrayValue array_value_convert(ArrayValue array, Unit from, Unit to, Arena *arena) {
+    if (units_identical(from, to)) return array;
+    ArrayValue result = array_value_new(array.length, arena);
+    double scale, offset;
+    if (!unit_convert_affine(from, to, &scale, &offset)) {
+        for (size_t i = 0; i < array.length; i++) {
+            result.values[i] = unit_convert(array.values[i], from, to, arena);
+        }
+        return result;
+    }
+    const ArrayLanes *in = (const ArrayLanes *)array.values;
+    ArrayLanes *out = (ArrayLanes *)result.values;
+    for (size_t i = 0; i < array_value_n_lanes(array.length); i++) {
+        out[i] = in[i] * scale + offset;
+    }
+    return result;
+}
+
+// Whether `a` and `b` hold exactly the same numbers.
+bool array_values_identical(ArrayValue a, ArrayValue b) {
+    return a.length == b.length && (a.length == 0 || memcmp(a.values, b.values, a.length * sizeof(double)) == 0);
+}
+
+// E.g. "[1, 2.5, 7]".
+String display_array_value(ArrayValue array, Arena *arena) {
+    String s = string_new("[", arena);
+    for (size_t i = 0; i < array.length; i++) {
+        s = string_concat(s, string_new_fmt(arena, i == 0 ? "%g" : ", %g", array.values[i]), arena);
+    }
+    return string_concat_static(s, "]", arena);
+}
@@ -0,0 +1,208 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "arena.c"
+#include "concurrent_map.c"
+#include "hash_map.c"
+#include "server.c"
+
+// Benchmark the concurrent map against a HashMap behind a mutex, with
+// every thread looking up and inserting variables in one shared map,
+// like users of one shared session would. Then measure round trip
+// latency of requests to the socket server, and how much faster a
+// sweep evaluates a range than a line per value.
+//
+// Run with `make bench`.
+
+#define BENCH_KEYS 1024
+#define BENCH_OPS (1 << 21)
+#define BENCH_MAX_THREADS 64
+#define BENCH_REQUESTS 100000
+#define BENCH_SWEEP_LINES 100000
+#define BENCH_SWEEP_POINTS 100000000
+
+typedef enum BenchMapType BenchMapType;
+enum BenchMapType {
+    BENCH_MUTEX_HASH_MAP,
+    BENCH_CONCURRENT_MAP,
+};
+
+typedef struct BenchShared BenchShared;
+struct BenchShared {
+    BenchMapType type;
+    HashMap hash_map;
+    Arena hash_map_arena;
+    pthread_mutex_t hash_map_lock;
+    ConcurrentMap *concurrent_map;
+    // Out of 100
+    unsigned lookup_percent;
+    size_t ops_per_thread;
+    char keys[BENCH_KEYS][16];
+};
+
+typedef struct BenchThread BenchThread;
+struct BenchThread {
+    BenchShared *shared;
+    Arena arena;
+    uint64_t seed;
+    // So lookups can't be optimized out
+    double sum;
+};
+
+uint64_t bench_rand(uint64_t *state) {
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void *bench_thread(void *thread_opaque) {
+    BenchThread *thread = (BenchThread *)thread_opaque;
+    BenchShared *shared = thread->shared;
+    for (size_t i = 0; i < shared->ops_per_thread; i++) {
+        uint64_t r = bench_rand(&thread->seed);
+        const unsigned char *key = (unsigned char *)shared->keys[r % BENCH_KEYS];
+        bool lookup = (r >> 32) % 100 < shared->lookup_percent;
+        double value = (double)i;
+        if (shared->type == BENCH_MUTEX_HASH_MAP) {
+            pthread_mutex_lock(&shared->hash_map_lock);
+            if (lookup) {
+                thread->sum += *(double *)hash_map_get(shared->hash_map, key);
+            } else {
+                hash_map_insert(&shared->hash_map, key, &value, &shared->hash_map_arena);
+            }
+            pthread_mutex_unlock(&shared->hash_map_lock);
+        } else if (lookup) {
+            thread->sum += *(double *)concurrent_map_get(shared->concurrent_map, key, CONCURRENT_MAP_LATEST);
+        } else {
+            concurrent_map_insert(shared->concurrent_map, key, &value, 0, &thread->arena);
+        }
+    }
+    return NULL;
+}
+
+// Returns millions of operations per second
+double bench_run(BenchMapType type, size_t n_threads, unsigned lookup_percent) {
+    static BenchShared shared;
+    shared.type = type;
+    shared.lookup_percent = lookup_percent;
+    shared.ops_per_thread = BENCH_OPS / n_threads;
+    shared.hash_map_arena = arena_create();
+    shared.hash_map = hash_map_new(sizeof(double), &shared.hash_map_arena);
+    shared.concurrent_map = concurrent_map_new(sizeof(double), &shared.hash_map_arena);
+    pthread_mutex_init(&shared.hash_map_lock, NULL);
+    for (size_t i = 0; i < BENCH_KEYS; i++) {
+        snprintf(shared.keys[i], sizeof(shared.keys[i]), "var%zu", i);
+        double value = 0;
+        hash_map_insert(&shared.hash_map, (unsigned char *)shared.keys[i], &value, &shared.hash_map_arena);
+        concurrent_map_insert(shared.concurrent_map, (unsigned char *)shared.keys[i], &value, 0,
+                              &shared.hash_map_arena);
+    }
+
+    BenchThread threads[BENCH_MAX_THREADS];
+    pthread_t handles[BENCH_MAX_THREADS];
+    double start = bench_now();
+    for (size_t i = 0; i < n_threads; i++) {
+        threads[i] = (BenchThread) { .shared = &shared, .arena = arena_create(), .seed = i + 1 };
+        assert(pthread_create(&handles[i], NULL, bench_thread, &threads[i]) == 0);
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    double elapsed = bench_now() - start;
+
+    for (size_t i = 0; i < n_threads; i++) {
+        arena_free(&threads[i].arena);
+    }
+    pthread_mutex_destroy(&shared.hash_map_lock);
+    arena_free(&shared.hash_map_arena);
+    return (double)(shared.ops_per_thread * n_threads) / elapsed / 1e6;
+}
+
+int bench_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Round trips of one request at a time over one connection
+void bench_server_latency(size_t n_workers) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/calc_bench_%d.sock", getpid());
+    Server server;
+    assert(server_start(&server, path, n_workers));
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    static double latencies[BENCH_REQUESTS];
+    const char request[] = "bench 5 km + 2 mi -> m\n";
+    char response[256];
+    for (size_t i = 0; i < BENCH_REQUESTS; i++) {
+        double start = bench_now();
+        assert(write(fd, request, sizeof(request) - 1) == sizeof(request) - 1);
+        // Responses are small enough to arrive in one read
+        assert(read(fd, response, sizeof(response)) > 0);
+        latencies[i] = (bench_now() - start) * 1e6;
+    }
+    close(fd);
+    server_stop(&server);
+
+    qsort(latencies, BENCH_REQUESTS, sizeof(double), bench_compare_double);
+    double total = 0;
+    for (size_t i = 0; i < BENCH_REQUESTS; i++) total += latencies[i];
+    printf("%8zu %9.2f us %9.2f us %9.2f us\n", n_workers, total / BENCH_REQUESTS,
+           latencies[BENCH_REQUESTS / 2], latencies[BENCH_REQUESTS * 99 / 100]);
+}
+
+// Points per second, evaluating `v km/h -> m/s` one line per v, then
+// with one sweep over all of them
+void bench_sweep() {
+    Arena repl_arena = arena_create();
+    Memory mem = memory_new(&repl_arena);
+    char line[MAX_INPUT];
+    char output[MAX_OUTPUT];
+    double start = bench_now();
+    for (size_t i = 0; i < BENCH_SWEEP_LINES; i++) {
+        snprintf(line, sizeof(line), "%zu km/h -> m/s", i);
+        execute_line(line, output, sizeof(output), &mem, &repl_arena);
+    }
+    double lines_per_s = BENCH_SWEEP_LINES / (bench_now() - start);
+    snprintf(line, sizeof(line), "sweep v = 1..%d: v km/h -> m/s", BENCH_SWEEP_POINTS);
+    start = bench_now();
+    execute_line(line, output, sizeof(output), &mem, &repl_arena);
+    double sweep_per_s = BENCH_SWEEP_POINTS / (bench_now() - start);
+    printf("%14.2f M/s %14.2f M/s %8.0fx\n", lines_per_s / 1e6, sweep_per_s / 1e6, sweep_per_s / lines_per_s);
+    memory_free(&mem);
+    arena_free(&repl_arena);
+}
+
+int main() {
+    const unsigned lookup_percents[] = {100, 90, 50};
+    printf("%8s %8s %14s %14s\n", "threads", "lookups", "mutex HashMap", "ConcurrentMap");
+    for (size_t i = 0; i < sizeof(lookup_percents) / sizeof(lookup_percents[0]); i++) {
+        for (size_t n_threads = 1; n_threads <= BENCH_MAX_THREADS; n_threads *= 2) {
+            double mutex_mops = bench_run(BENCH_MUTEX_HASH_MAP, n_threads, lookup_percents[i]);
+            double concurrent_mops = bench_run(BENCH_CONCURRENT_MAP, n_threads, lookup_percents[i]);
+            printf("%8zu %7u%% %9.2f Mop/s %9.2f Mop/s\n", n_threads, lookup_percents[i],
+                   mutex_mops, concurrent_mops);
+        }
+    }
+
+    printf("\n%8s %12s %12s %12s\n", "workers", "mean", "p50", "p99");
+    for (size_t n_workers = 1; n_workers <= 4; n_workers *= 2) {
+        bench_server_latency(n_workers);
+    }
+
+    printf("\n%18s %18s %9s\n", "lines", "sweep", "speedup");
+    bench_sweep();
+    return 0;
+}
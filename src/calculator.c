@@ -0,0 +1,295 @@
+// Not `#pragma once`, since this is also the main file of `make lib`
+#ifndef CALCULATOR_C
+#define CALCULATOR_C
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "calculator.h"
+#include "execute.c"
+
+// Memory as of some compaction, and the arena everything written to it
+// since lives in. Writers only ever write to the newest one.
+typedef struct CalcGeneration CalcGeneration;
+struct CalcGeneration {
+    Arena arena;
+    Memory memory;
+    // Latest version of `memory` that readers may see
+    _Atomic uint64_t version;
+    // How much of `arena` the compacted memory took up
+    size_t compacted_size;
+    // Older generations waiting for their readers to finish
+    CalcGeneration *retired;
+};
+
+// How many readers can read without locks at once. Any more take the
+// write lock, which keeps generations from being freed while they read.
+#define CALC_MAX_READERS 64
+// Below this, memory isn't worth compacting
+#define CALC_COMPACT_MIN_SIZE (64 * 1024)
+
+// A single session: everything one user's lines can see and change.
+struct CalcContext {
+    // Shared by every line. Readers look things up without locks,
+    // as of the latest version when they started.
+    _Atomic(CalcGeneration *) generation;
+    // The generation each lock-free reader is reading, or NULL, so it
+    // isn't freed under them
+    _Atomic(CalcGeneration *) readers[CALC_MAX_READERS];
+    // Serializes lines that change memory, so that e.g. `x = x + 1`
+    // reads and writes x without another write in between.
+    pthread_mutex_t write_lock;
+};
+
+CalcGeneration *calc_generation_new(void) {
+    CalcGeneration *generation = malloc(sizeof(CalcGeneration));
+    assert(generation != NULL);
+    generation->arena = arena_create();
+    generation->compacted_size = 0;
+    generation->retired = NULL;
+    return generation;
+}
+
+void calc_generation_free(CalcGeneration *generation) {
+    arena_free(&generation->arena);
+    free(generation);
+}
+
+CALC_API CalcContext *calc_create(void) {
+    CalcContext *ctx = malloc(sizeof(CalcContext));
+    if (ctx == NULL) return NULL;
+    CalcGeneration *generation = calc_generation_new();
+    generation->memory = memory_new(&generation->arena);
+    atomic_init(&generation->version, generation->memory.version);
+    atomic_init(&ctx->generation, generation);
+    for (size_t i = 0; i < CALC_MAX_READERS; i++) {
+        atomic_init(&ctx->readers[i], NULL);
+    }
+    pthread_mutex_init(&ctx->write_lock, NULL);
+    return ctx;
+}
+
+CALC_API void calc_destroy(CalcContext *ctx) {
+    if (ctx == NULL) return;
+    pthread_mutex_destroy(&ctx->write_lock);
+    CalcGeneration *generation = atomic_load(&ctx->generation);
+    // Every generation shares the names
+    memory_free(&generation->memory);
+    while (generation != NULL) {
+        CalcGeneration *retired = generation->retired;
+        calc_generation_free(generation);
+        generation = retired;
+    }
+    free(ctx);
+}
+
+// Memory as of the latest published version.
+Memory calc_snapshot(CalcGeneration *generation) {
+    Memory snapshot = generation->memory;
+    snapshot.version = atomic_load(&generation->version);
+    return snapshot;
+}
+
+// Start reading the current generation without locks, and return the
+// reader slot to pass to `calc_read_end`, or -1 if every slot is taken.
+int calc_read_begin(CalcContext *ctx, CalcGeneration **generation) {
+    for (int i = 0; i < CALC_MAX_READERS; i++) {
+        CalcGeneration *free_slot = NULL;
+        *generation = atomic_load(&ctx->generation);
+        if (!atomic_compare_exchange_strong(&ctx->readers[i], &free_slot, *generation)) continue;
+        // A writer that retired it before seeing it in our slot
+        // published a newer one first, so we'd see that here
+        CalcGeneration *current;
+        while ((current = atomic_load(&ctx->generation)) != *generation) {
+            *generation = current;
+            atomic_store(&ctx->readers[i], current);
+        }
+        return i;
+    }
+    return -1;
+}
+
+void calc_read_end(CalcContext *ctx, int slot) {
+    atomic_store(&ctx->readers[slot], NULL);
+}
+
+// Free the retired generations nobody's reading anymore. Must hold the
+// write lock.
+void calc_reclaim(CalcContext *ctx) {
+    CalcGeneration *generation = atomic_load(&ctx->generation);
+    CalcGeneration **retired = &generation->retired;
+    while (*retired != NULL) {
+        bool read = false;
+        for (size_t i = 0; i < CALC_MAX_READERS && !read; i++) {
+            read = atomic_load(&ctx->readers[i]) == *retired;
+        }
+        if (read) {
+            retired = &(*retired)->retired;
+        } else {
+            CalcGeneration *done = *retired;
+            *retired = done->retired;
+            calc_generation_free(done);
+        }
+    }
+}
+
+// Make everything `mem` wrote visible to readers at once. Then, once
+// the generation's arena has doubled since it was compacted, copy only
+// what's current into a new one, and free the old ones once their
+// readers finish. Must hold the write lock.
+void calc_publish(CalcContext *ctx, Memory mem) {
+    CalcGeneration *generation = atomic_load(&ctx->generation);
+    atomic_store(&generation->version, mem.version);
+    size_t size = arena_used(&generation->arena);
+    if (size >= CALC_COMPACT_MIN_SIZE && size >= 2 * generation->compacted_size) {
+        CalcGeneration *compacted = calc_generation_new();
+        compacted->memory = memory_compact(mem, &compacted->arena);
+        atomic_init(&compacted->version, mem.version);
+        compacted->compacted_size = arena_used(&compacted->arena);
+        compacted->retired = generation;
+        atomic_store(&ctx->generation, compacted);
+    }
+    calc_reclaim(ctx);
+}
+
+// `calc_execute` using `scratch` for everything that only lives as long
+// as the line, clearing it afterwards. Callers that execute many lines,
+// like the server's workers, keep one around instead of allocating and
+// freeing an arena per line.
+uint32_t calc_execute_scratch(CalcContext *ctx, const char *input, char *output,
+                              size_t output_len, double *value, Arena *scratch) {
+    trace_event(TRACE_EXECUTE, TRACE_BEGIN, "execute_line", input, 0);
+    TokenString tokens = tokenize(input, scratch);
+    ExecuteResult result;
+    CalcGeneration *generation;
+    int slot = tokens_change_memory(tokens) ? -1 : calc_read_begin(ctx, &generation);
+    Memory snapshot;
+    // Formulas are recomputed when read, by whoever reads them first,
+    // which has to be a writer.
+    if (slot >= 0 && memory_formulas_ready(snapshot = calc_snapshot(generation), tokens)) {
+        // Any number of readers share memory, without waiting on
+        // writers or each other. They keep seeing the version they
+        // started with, even if a writer publishes a newer one.
+        result = execute_tokens(tokens, output, output_len, &snapshot, NULL, scratch);
+        calc_read_end(ctx, slot);
+    } else {
+        if (slot >= 0) calc_read_end(ctx, slot);
+        pthread_mutex_lock(&ctx->write_lock);
+        generation = atomic_load(&ctx->generation);
+        Memory mem = calc_snapshot(generation);
+        result = execute_tokens(tokens, output, output_len, &mem, &generation->arena, scratch);
+        calc_publish(ctx, mem);
+        pthread_mutex_unlock(&ctx->write_lock);
+    }
+    if (value != NULL && result.has_value) *value = result.value;
+    uint32_t flags = execute_result_flags(result);
+    arena_clear(scratch);
+    trace_end(TRACE_EXECUTE, "execute_line");
+    return flags;
+}
+
+CALC_API uint32_t calc_execute(CalcContext *ctx, const char *input, char *output,
+                               size_t output_len, double *value) {
+    Arena arena = arena_create();
+    uint32_t flags = calc_execute_scratch(ctx, input, output, output_len, value, &arena);
+    arena_free(&arena);
+    return flags;
+}
+
+CALC_API size_t calc_execute_batch(CalcContext *ctx, const char *input, size_t input_len,
+                                   CalcBatchResult *results, size_t max_results,
+                                   char *strings, size_t strings_len) {
+    // Publishing once at the end means readers
+    // see either none or all of a batch's changes.
+    pthread_mutex_lock(&ctx->write_lock);
+    CalcGeneration *generation = atomic_load(&ctx->generation);
+    Memory mem = calc_snapshot(generation);
+    size_t n = execute_batch(input, input_len, results, max_results, strings, strings_len,
+                             &mem, &generation->arena);
+    calc_publish(ctx, mem);
+    pthread_mutex_unlock(&ctx->write_lock);
+    return n;
+}
+
+// A prepared statement, and the arena everything it needs lives in.
+struct CalcStatement {
+    Arena arena;
+    Statement statement;
+    // For the rare conversions that need one while executing
+    Arena scratch;
+};
+
+CALC_API CalcStatement *calc_prepare(CalcContext *ctx, const char *input, char *output,
+                                     size_t output_len) {
+    CalcStatement *stmt = malloc(sizeof(CalcStatement));
+    if (stmt == NULL) return NULL;
+    stmt->arena = arena_create();
+    stmt->scratch = arena_create();
+    TokenString tokens = tokenize(input, &stmt->arena);
+    CalcGeneration *generation;
+    int slot = -1;
+    Memory snapshot;
+    bool ok;
+    if (tokens_are_command(tokens) || tokens_change_memory(tokens)) {
+        snprintf(output, output_len, "Only expressions can be prepared");
+        ok = false;
+    } else if ((slot = calc_read_begin(ctx, &generation)) >= 0
+               && memory_formulas_ready(snapshot = calc_snapshot(generation), tokens)) {
+        ok = statement_prepare(tokens, snapshot, &stmt->statement, "Prepared statements", output, output_len, &stmt->arena);
+        calc_read_end(ctx, slot);
+    } else {
+        if (slot >= 0) calc_read_end(ctx, slot);
+        pthread_mutex_lock(&ctx->write_lock);
+        generation = atomic_load(&ctx->generation);
+        Memory mem = calc_snapshot(generation);
+        ok = execute_refresh(tokens, output, output_len, &mem, &generation->arena, &stmt->arena)
+            && statement_prepare(tokens, mem, &stmt->statement, "Prepared statements", output, output_len, &stmt->arena);
+        calc_publish(ctx, mem);
+        pthread_mutex_unlock(&ctx->write_lock);
+    }
+    if (!ok) {
+        calc_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+CALC_API int calc_param_index(CalcStatement *stmt, const char *name) {
+    Token param = token_new_variable((char *)name);
+    for (uint32_t i = 0; i < stmt->statement.n_params; i++) {
+        if (token_same_name(stmt->statement.params[i], param)) return i;
+    }
+    return -1;
+}
+
+CALC_API uint32_t calc_bind(CalcStatement *stmt, int index, double value) {
+    if (index < 0 || (uint32_t)index >= stmt->statement.n_params) return CALC_ERROR;
+    statement_bind(&stmt->statement, index, value);
+    return 0;
+}
+
+CALC_API uint32_t calc_execute_prepared(CalcStatement *stmt, char *output, size_t output_len,
+                                        double *value) {
+    Statement *statement = &stmt->statement;
+    double result;
+    bool ok = statement_run(statement, &result, output, output_len, &stmt->scratch);
+    arena_clear(&stmt->scratch);
+    if (!ok) {
+        return CALC_ERROR;
+    }
+    if (!statement->is_number) {
+        snprintf(output, output_len, "%s", statement->unit);
+        return 0;
+    }
+    if (value != NULL) *value = result;
+    snprintf(output, output_len, "%g %s", result, statement->unit);
+    return CALC_HAS_VALUE;
+}
+
+CALC_API void calc_finalize(CalcStatement *stmt) {
+    if (stmt == NULL) return;
+    arena_free(&stmt->arena);
+    arena_free(&stmt->scratch);
+    free(stmt);
+}
+
+#endif
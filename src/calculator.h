@@ -0,0 +1,101 @@
+#pragma once
+
+// Embedding API for the calculator.
+//
+// Build with `make lib` and link against build/libcalculator.a or
+// build/libcalculator.so. Every session lives in its own CalcContext,
+// which owns all of its names, variables, units and memory, and frees
+// them with it. The only state sessions share is the tracer, which is
+// off unless enabled, so a process can host any number of sessions,
+// and different contexts can be used from different threads at the
+// same time. The same
+// context can be shared between threads too: lines that only read
+// memory evaluate in parallel against a consistent snapshot, without
+// locks, while lines that change it (assignments, addunit, batches) take
+// turns publishing a new snapshot.
+//
+// Old values are kept for readers still on older snapshots. Once a
+// context has written twice as much as what's current (and at least
+// 64 KiB), what's current is copied aside and the rest freed as soon as
+// nobody reads it, so a context that keeps reassigning the same
+// variables stays about twice the size of what they hold.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CALC_API __attribute__((visibility("default")))
+
+typedef struct CalcContext CalcContext;
+typedef struct CalcStatement CalcStatement;
+
+// The line failed to parse or evaluate, output has the error message
+#define CALC_ERROR 1
+// The line evaluated to a number (including assignments)
+#define CALC_HAS_VALUE 2
+// The line was quit/exit
+#define CALC_QUIT 4
+// Not enough space left for the output in a batch, so it was dropped
+#define CALC_TRUNCATED 8
+// The line added a variable or unit
+#define CALC_CHANGED_MEMORY 16
+
+// One result of `calc_execute_batch`. Fixed size and layout so it can be
+// read directly from foreign memory, e.g. from JS with a DataView:
+// offset 0: value (f64), 8: output offset, 12: output length,
+// 16: unit offset, 20: unit length, 24: flags (all u32).
+typedef struct CalcBatchResult CalcBatchResult;
+struct CalcBatchResult {
+    double value;
+    // Offsets are into the `strings` region passed to the batch call,
+    // lengths don't include the null terminator.
+    uint32_t output_offset;
+    uint32_t output_len;
+    uint32_t unit_offset;
+    uint32_t unit_len;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+// Returns NULL if we're out of memory.
+CALC_API CalcContext *calc_create(void);
+
+CALC_API void calc_destroy(CalcContext *ctx);
+
+// Execute a single line, writing the text result to `output`.
+// Returns CALC_* flags, and if `value` isn't NULL, sets it
+// to the result when CALC_HAS_VALUE is set.
+CALC_API uint32_t calc_execute(CalcContext *ctx, const char *input, char *output,
+                               size_t output_len, double *value);
+
+// Execute each newline separated line of `input` in order, writing one
+// result per line into `results` and the output/unit strings into
+// `strings`. Stops early on quit or when `results` is full. Returns the
+// number of lines executed.
+CALC_API size_t calc_execute_batch(CalcContext *ctx, const char *input, size_t input_len,
+                                   CalcBatchResult *results, size_t max_results,
+                                   char *strings, size_t strings_len);
+
+// Compile `input`, an expression with named placeholders like
+// `?speed km/h -> mi/h`, to execute many times with different values.
+// Parsing and unit checking happen once here, so binding and executing
+// only do arithmetic. Variables are read now, not when it's executed.
+// Returns NULL, with the error in `output`, if it can't be prepared.
+// The statement must be finalized before `ctx` is destroyed, and used
+// by one thread at a time.
+CALC_API CalcStatement *calc_prepare(CalcContext *ctx, const char *input, char *output,
+                                     size_t output_len);
+
+// Index of placeholder `name`, without the `?`, to bind it with, or -1
+// if the statement doesn't have it.
+CALC_API int calc_param_index(CalcStatement *stmt, const char *name);
+
+// Set the placeholder at `index` to `value` for the following executes.
+// Returns CALC_ERROR if there's no such placeholder, 0 otherwise.
+CALC_API uint32_t calc_bind(CalcStatement *stmt, int index, double value);
+
+// Execute a prepared statement with the values bound to it, like
+// `calc_execute`. Every placeholder has to be bound.
+CALC_API uint32_t calc_execute_prepared(CalcStatement *stmt, char *output, size_t output_len,
+                                        double *value);
+
+CALC_API void calc_finalize(CalcStatement *stmt);
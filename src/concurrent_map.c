@@ -0,0 +1,255 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.c"
+#include "hash_map.c"
+
+// Hash map with string keys and small fixed size values, for when many
+// threads look things up while others insert.
+//
+// Lookups never lock or wait. Inserts claim an empty slot with a
+// compare-and-swap, and only wait on each other while the table is
+// being resized. Nothing is ever removed: updating a key pushes a new
+// value in front of the old one, tagged with a version, so a reader can
+// keep looking things up as of the version it started with while newer
+// values are being written. Old tables and values stay in the arenas
+// they were allocated from, so whatever a reader is looking at stays
+// valid as long as the map's arenas do.
+//
+// That means a map holds every value ever written to it, until its
+// arenas are freed. Maps whose keys keep being updated are bounded by
+// whoever owns them, by copying only what's current into a new map
+// once nobody reads the old one, e.g. `memory_compact`.
+
+// Look up the newest value regardless of version
+#define CONCURRENT_MAP_LATEST UINT64_MAX
+
+typedef struct ConcurrentValue ConcurrentValue;
+struct ConcurrentValue {
+    uint64_t version;
+    // Version the key was first set at, which outlives older values
+    // when they're dropped by copying the map
+    uint64_t first_version;
+    ConcurrentValue *prev;
+    alignas(max_align_t) unsigned char data[];
+};
+
+typedef struct ConcurrentSlot ConcurrentSlot;
+struct ConcurrentSlot {
+    // Set once, when an insert claims the slot
+    _Atomic(const unsigned char *) key;
+    // NULL until the claiming insert publishes its value
+    _Atomic(ConcurrentValue *) value;
+};
+
+typedef struct ConcurrentTable ConcurrentTable;
+struct ConcurrentTable {
+    size_t capacity;
+    ConcurrentSlot slots[];
+};
+
+typedef struct ConcurrentMap ConcurrentMap;
+struct ConcurrentMap {
+    _Atomic(ConcurrentTable *) table;
+    // Number of keys, including ones whose only
+    // value is newer than what a reader can see.
+    _Atomic size_t size;
+    size_t value_size;
+    // Held shared by inserts, exclusively by resizes
+    pthread_rwlock_t resize_lock;
+};
+
+ConcurrentTable *concurrent_table_new(size_t capacity, Arena *arena) {
+    assert(is_pow_two(capacity));
+    size_t size = sizeof(ConcurrentTable) + capacity * sizeof(ConcurrentSlot);
+    ConcurrentTable *table = arena_alloc_aligned(arena, size, alignof(ConcurrentTable));
+    table->capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&table->slots[i].key, NULL);
+        atomic_init(&table->slots[i].value, NULL);
+    }
+    return table;
+}
+
+ConcurrentMap *concurrent_map_new(size_t value_size, Arena *arena) {
+    ConcurrentMap *map = arena_alloc_aligned(arena, sizeof(ConcurrentMap), alignof(ConcurrentMap));
+    atomic_init(&map->table, concurrent_table_new(HASH_MAP_INIT_CAPACITY, arena));
+    atomic_init(&map->size, 0);
+    map->value_size = value_size;
+    pthread_rwlock_init(&map->resize_lock, NULL);
+    return map;
+}
+
+size_t concurrent_map_size(ConcurrentMap *map) {
+    return atomic_load(&map->size);
+}
+
+// Newest value at or before `version`, or NULL if there isn't one.
+void *concurrent_value_at(ConcurrentValue *value, uint64_t version) {
+    while (value != NULL && value->version > version) {
+        value = value->prev;
+    }
+    return value != NULL ? value->data : NULL;
+}
+
+// The slot of the key that's the first `len` bytes of `key`, which
+// doesn't need to end there.
+ConcurrentSlot *concurrent_table_find_len(ConcurrentTable *table, const unsigned char *key, size_t len) {
+    size_t idx = djb2_hash_len(key, len, table->capacity);
+    for (size_t i = 0; i < table->capacity; i++) {
+        const unsigned char *slot_key = atomic_load_explicit(&table->slots[idx].key, memory_order_acquire);
+        // Slots are never emptied and inserts take the first empty
+        // slot they probe, so `key` can't be past an empty one.
+        if (slot_key == NULL) return NULL;
+        if (strncmp((char *)slot_key, (char *)key, len) == 0 && slot_key[len] == '\0') return &table->slots[idx];
+        idx = (idx + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+ConcurrentSlot *concurrent_table_find(ConcurrentTable *table, const unsigned char *key) {
+    return concurrent_table_find_len(table, key, strlen((char *)key));
+}
+
+// The value of `key` as of `version`, or NULL if it wasn't in the map yet.
+void *concurrent_map_get(ConcurrentMap *map, const unsigned char *key, uint64_t version) {
+    ConcurrentTable *table = atomic_load_explicit(&map->table, memory_order_acquire);
+    ConcurrentSlot *slot = concurrent_table_find(table, key);
+    if (slot == NULL) return NULL;
+    return concurrent_value_at(atomic_load_explicit(&slot->value, memory_order_acquire), version);
+}
+
+// `concurrent_map_get` of the first `len` bytes of `key`.
+void *concurrent_map_get_len(ConcurrentMap *map, const unsigned char *key, size_t len, uint64_t version) {
+    ConcurrentTable *table = atomic_load_explicit(&map->table, memory_order_acquire);
+    ConcurrentSlot *slot = concurrent_table_find_len(table, key, len);
+    if (slot == NULL) return NULL;
+    return concurrent_value_at(atomic_load_explicit(&slot->value, memory_order_acquire), version);
+}
+
+bool concurrent_map_contains(ConcurrentMap *map, const unsigned char *key, uint64_t version) {
+    return concurrent_map_get(map, key, version) != NULL;
+}
+
+// The map's own copy of `key`, which lives as long as the map does.
+const unsigned char *concurrent_map_get_key(ConcurrentMap *map, const unsigned char *key) {
+    ConcurrentSlot *slot = concurrent_table_find(atomic_load(&map->table), key);
+    return slot != NULL ? atomic_load(&slot->key) : NULL;
+}
+
+void concurrent_map_resize(ConcurrentMap *map, ConcurrentTable *full, Arena *arena) {
+    pthread_rwlock_wrlock(&map->resize_lock);
+    // Someone else may have resized while we waited
+    if (atomic_load(&map->table) == full) {
+        ConcurrentTable *table = concurrent_table_new(full->capacity * 2, arena);
+        for (size_t i = 0; i < full->capacity; i++) {
+            const unsigned char *key = atomic_load(&full->slots[i].key);
+            if (key == NULL) continue;
+            size_t idx = djb2_hash(key, table->capacity);
+            while (atomic_load_explicit(&table->slots[idx].key, memory_order_relaxed) != NULL) {
+                idx = (idx + 1) & (table->capacity - 1);
+            }
+            atomic_store_explicit(&table->slots[idx].key, key, memory_order_relaxed);
+            atomic_store_explicit(&table->slots[idx].value, atomic_load(&full->slots[i].value),
+                                  memory_order_relaxed);
+        }
+        atomic_store_explicit(&map->table, table, memory_order_release);
+    }
+    pthread_rwlock_unlock(&map->resize_lock);
+}
+
+// Set `key` to `value` as of `version`. Threads inserting at the same
+// time must each pass their own `arena`, and the arenas have to live as
+// long as the map. `value` MUST have the map's `value_size`.
+void concurrent_map_insert(ConcurrentMap *map, const unsigned char *key, void *value,
+                           uint64_t version, Arena *arena) {
+    ConcurrentValue *new_value = arena_alloc_aligned(arena, sizeof(ConcurrentValue) + map->value_size,
+                                                     alignof(ConcurrentValue));
+    new_value->version = version;
+    memcpy(new_value->data, value, map->value_size);
+    unsigned char *key_alloc = NULL;
+    while (true) {
+        pthread_rwlock_rdlock(&map->resize_lock);
+        ConcurrentTable *table = atomic_load(&map->table);
+        if ((float)atomic_load(&map->size) / (float)table->capacity >= HASH_MAP_RESIZE_THRESHOLD) {
+            pthread_rwlock_unlock(&map->resize_lock);
+            concurrent_map_resize(map, table, arena);
+            continue;
+        }
+        size_t idx = djb2_hash(key, table->capacity);
+        ConcurrentSlot *slot = NULL;
+        for (size_t i = 0; i < table->capacity && slot == NULL; i++) {
+            ConcurrentSlot *curr = &table->slots[idx];
+            const unsigned char *slot_key = atomic_load(&curr->key);
+            if (slot_key == NULL) {
+                if (key_alloc == NULL) {
+                    size_t key_len = strlen((char *)key) + 1;
+                    key_alloc = arena_alloc(arena, key_len);
+                    memcpy(key_alloc, key, key_len);
+                }
+                if (atomic_compare_exchange_strong(&curr->key, &slot_key, key_alloc)) {
+                    atomic_fetch_add(&map->size, 1);
+                    slot = curr;
+                    break;
+                }
+                // Lost the race for this slot, `slot_key` is the winner's
+            }
+            if (strcmp((char *)slot_key, (char *)key) == 0) {
+                slot = curr;
+            }
+            idx = (idx + 1) & (table->capacity - 1);
+        }
+        if (slot == NULL) {
+            // Enough inserts raced past the size check to fill the table
+            pthread_rwlock_unlock(&map->resize_lock);
+            concurrent_map_resize(map, table, arena);
+            continue;
+        }
+        ConcurrentValue *prev = atomic_load(&slot->value);
+        do {
+            new_value->prev = prev;
+            new_value->first_version = prev != NULL ? prev->first_version : version;
+        } while (!atomic_compare_exchange_weak(&slot->value, &prev, new_value));
+        pthread_rwlock_unlock(&map->resize_lock);
+        return;
+    }
+}
+
+// For walking every key visible as of some version:
+// ConcurrentIter iter = concurrent_map_iter(map, version);
+// while (concurrent_map_iter_next(&iter)) { iter.key, iter.value }
+typedef struct ConcurrentIter ConcurrentIter;
+struct ConcurrentIter {
+    ConcurrentTable *table;
+    uint64_t version;
+    size_t idx;
+    const unsigned char *key;
+    void *value;
+    // Version the key was first set at
+    uint64_t first_version;
+};
+
+ConcurrentIter concurrent_map_iter(ConcurrentMap *map, uint64_t version) {
+    return (ConcurrentIter) { .table = atomic_load(&map->table), .version = version };
+}
+
+bool concurrent_map_iter_next(ConcurrentIter *iter) {
+    while (iter->idx < iter->table->capacity) {
+        ConcurrentSlot *slot = &iter->table->slots[iter->idx++];
+        const unsigned char *key = atomic_load(&slot->key);
+        if (key == NULL) continue;
+        ConcurrentValue *newest = atomic_load(&slot->value);
+        void *value = concurrent_value_at(newest, iter->version);
+        if (value == NULL) continue;
+        iter->key = key;
+        iter->value = value;
+        iter->first_version = newest->first_version;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arena.c"
+#include "evaluate.c"
+#include "execute.c"
+#include "memory.c"
+#include "parse.c"
+#include "tokenize.c"
+#include "unit.c"
+
+// Convert one column of a CSV file from one unit to another, e.g.
+// `--convert-csv=speed:km/h:m/s`, writing the rest of the file as is.
+//
+// The file is mapped rather than read, and split into chunks that end
+// at newlines, a round of them at a time, one per thread. Each thread
+// writes its chunk's converted lines to a buffer of its own, and the
+// buffers are written out in order, whole, before the next round. The
+// conversion is worked out once as a factor and an offset.
+//
+// Cells that aren't numbers, e.g. the header or empty ones, are left as
+// they are. Quoted cells can have commas in them, but not newlines.
+// Converted numbers are exactly what converting them one at a time
+// gives, e.g. `36 C -> F`, and are written with as few digits as read
+// back as exactly the same double, so writing them loses nothing. A
+// conversion that does nothing, e.g. m to m, leaves the file byte for
+// byte the same.
+
+#define CSV_CHUNK_SIZE (4 << 20)
+#define CSV_MAX_THREADS 64
+
+typedef struct CsvConversion CsvConversion;
+struct CsvConversion {
+    // From 0
+    size_t column;
+    Unit from;
+    Unit to;
+    // When the conversion is affine, it's `scale * value + offset`
+    bool affine;
+    double scale;
+    double offset;
+    // Whether every value converts to itself
+    bool identity;
+};
+
+typedef struct CsvChunk CsvChunk;
+struct CsvChunk {
+    const CsvConversion *conversion;
+    pthread_t thread;
+    const char *start;
+    const char *end;
+    char *output;
+    size_t output_len;
+    size_t output_capacity;
+    // For conversions that aren't affine
+    Arena arena;
+};
+
+void csv_chunk_write(CsvChunk *chunk, const char *s, size_t len) {
+    if (chunk->output_len + len > chunk->output_capacity) {
+        size_t capacity = chunk->output_capacity == 0 ? 4096 : chunk->output_capacity;
+        while (chunk->output_len + len > capacity) capacity *= 2;
+        chunk->output = realloc(chunk->output, capacity);
+        assert(chunk->output != NULL);
+        chunk->output_capacity = capacity;
+    }
+    memcpy(chunk->output + chunk->output_len, s, len);
+    chunk->output_len += len;
+}
+
+// Where the cell starting at `s` ends: at the next comma or the end of
+// the line, skipping over anything in quotes.
+const char *csv_cell_end(const char *s, const char *line_end) {
+    bool quoted = false;
+    for (; s < line_end; s++) {
+        if (*s == '"') quoted = !quoted;
+        else if (*s == ',' && !quoted) break;
+    }
+    return s;
+}
+
+// Read a cell that's just a number, e.g. `-3.5e2`.
+bool csv_read_number(const char *s, size_t len, double *number) {
+    size_t pos = 0;
+    bool negative = len > 0 && s[0] == '-';
+    if (len > 0 && (s[0] == '-' || s[0] == '+')) pos++;
+    if (pos >= len || !is_digit(s[pos])) return false;
+    if (!next_number(s, &pos, len, number) || pos != len) return false;
+    if (negative) *number = -*number;
+    return true;
+}
+
+// Write `value` to `s` with the fewest significant digits that read
+// back as exactly `value`, at most 17, which always do.
+int csv_format_number(char *s, size_t len, double value) {
+    int n = 0;
+    for (int digits = 15; digits <= 17; digits++) {
+        n = snprintf(s, len, "%.*g", digits, value);
+        if (strtod(s, NULL) == value) break;
+    }
+    return n;
+}
+
+void csv_convert_line(CsvChunk *chunk, const char *line, const char *line_end) {
+    const CsvConversion *conversion = chunk->conversion;
+    const char *cell = line;
+    for (size_t i = 0; i < conversion->column && cell < line_end; i++) {
+        cell = csv_cell_end(cell, line_end);
+        if (cell < line_end) cell++;
+    }
+    const char *cell_end = csv_cell_end(cell, line_end);
+    // Keep spaces, and a carriage return from a \r\n line ending, around the number
+    const char *number_start = cell;
+    const char *number_end = cell_end;
+    while (number_start < number_end && *number_start == ' ') number_start++;
+    while (number_end > number_start && (number_end[-1] == ' ' || number_end[-1] == '\r')) number_end--;
+    double value;
+    if (!csv_read_number(number_start, number_end - number_start, &value)) {
+        csv_chunk_write(chunk, line, line_end - line);
+        return;
+    }
+    if (conversion->affine) {
+        value = value * conversion->scale + conversion->offset;
+    } else {
+        value = unit_convert(value, conversion->from, conversion->to, &chunk->arena);
+    }
+    char number[32];
+    int number_len = csv_format_number(number, sizeof(number), value);
+    csv_chunk_write(chunk, line, number_start - line);
+    csv_chunk_write(chunk, number, number_len);
+    csv_chunk_write(chunk, number_end, line_end - number_end);
+}
+
+void *csv_convert_chunk(void *chunk_opaque) {
+    CsvChunk *chunk = (CsvChunk *)chunk_opaque;
+    chunk->output_len = 0;
+    for (const char *line = chunk->start; line < chunk->end; ) {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *line_end = newline != NULL ? newline : chunk->end;
+        csv_convert_line(chunk, line, line_end);
+        if (newline != NULL) csv_chunk_write(chunk, "\n", 1);
+        line = line_end + 1;
+    }
+    arena_clear(&chunk->arena);
+    return NULL;
+}
+
+// Convert the CSV in `data` to `output_fd`, in chunks of about
+// `chunk_size` bytes, on up to `n_threads` threads including this one.
+void csv_convert(const char *data, size_t size, const CsvConversion *conversion, size_t chunk_size,
+                 size_t n_threads, FILE *output_fd) {
+    if (conversion->identity) {
+        fwrite(data, 1, size, output_fd);
+        return;
+    }
+    if (n_threads > CSV_MAX_THREADS) n_threads = CSV_MAX_THREADS;
+    if (n_threads == 0) n_threads = 1;
+    CsvChunk *chunks = calloc(n_threads, sizeof(CsvChunk));
+    assert(chunks != NULL);
+    for (size_t i = 0; i < n_threads; i++) {
+        chunks[i] = (CsvChunk) { .conversion = conversion, .arena = arena_create() };
+    }
+    size_t pos = 0;
+    while (pos < size) {
+        size_t n_chunks = 0;
+        for (; n_chunks < n_threads && pos < size; n_chunks++) {
+            size_t end = size - pos > chunk_size ? pos + chunk_size : size;
+            const char *newline = memchr(data + end - 1, '\n', size - end + 1);
+            end = newline != NULL ? (size_t)(newline - data) + 1 : size;
+            chunks[n_chunks].start = data + pos;
+            chunks[n_chunks].end = data + end;
+            pos = end;
+        }
+        for (size_t i = 1; i < n_chunks; i++) {
+            assert(pthread_create(&chunks[i].thread, NULL, csv_convert_chunk, &chunks[i]) == 0);
+        }
+        csv_convert_chunk(&chunks[0]);
+        for (size_t i = 0; i < n_chunks; i++) {
+            if (i > 0) pthread_join(chunks[i].thread, NULL);
+            fwrite(chunks[i].output, 1, chunks[i].output_len, output_fd);
+        }
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        free(chunks[i].output);
+        arena_free(&chunks[i].arena);
+    }
+    free(chunks);
+}
+
+// A unit on its own, e.g. `km/h`.
+bool csv_read_unit(const char *s, Memory mem, Unit *unit, Arena *arena) {
+    TokenString tokens = tokenize(s, arena);
+    if (tokens.length == 0 || tokens_are_command(tokens) || tokens_change_memory(tokens)) return false;
+    Expression expr = parse(tokens, mem, arena);
+    String err = string_empty(arena);
+    if (!execute_prepare(&expr, mem, &err, arena) || expr_is_number(expr.type)) return false;
+    *unit = check_unit(expr, mem, &err, arena);
+    return !is_unit_unknown(*unit);
+}
+
+// Which column `name` is: a number from 1, or a name in the header,
+// the first line of `data`.
+bool csv_find_column(const char *name, const char *data, size_t size, size_t *column) {
+    if (size == 0) return false;
+    const char *newline = memchr(data, '\n', size);
+    const char *line_end = newline != NULL ? newline : data + size;
+    if (line_end > data && line_end[-1] == '\r') line_end--;
+    char *end;
+    unsigned long number = strtoul(name, &end, 10);
+    bool numbered = is_digit(name[0]) && *end == '\0';
+    size_t name_len = strlen(name);
+    const char *cell = data;
+    size_t i = 0;
+    for (; cell <= line_end; i++) {
+        const char *cell_end = csv_cell_end(cell, line_end);
+        const char *s = cell;
+        size_t len = cell_end - cell;
+        if (len >= 2 && s[0] == '"' && s[len - 1] == '"') {
+            s++;
+            len -= 2;
+        }
+        if (!numbered && len == name_len && memcmp(s, name, len) == 0) {
+            *column = i;
+            return true;
+        }
+        cell = cell_end + 1;
+    }
+    // `i` is now how many columns the header has
+    if (!numbered || number == 0 || number > i) return false;
+    *column = number - 1;
+    return true;
+}
+
+const char convert_csv_msg[] = "Conversions look like: --convert-csv=COLUMN:FROM:TO, e.g. speed:km/h:m/s or 3:mi:km";
+
+// `-f FILE --convert-csv=COLUMN:FROM:TO`: write FILE to `output_fd` with
+// the column converted, on `n_threads` threads. Returns nonzero, with
+// why on stderr, if it can't, including when FILE is `-`, since stdin
+// can't be mapped.
+int convert_csv(const char *path, const char *spec, size_t n_threads, FILE *output_fd) {
+    if (strcmp(path, "-") == 0) {
+        fprintf(stderr, "Can't convert stdin: --convert-csv maps its file, so it needs -f FILE\n");
+        return 1;
+    }
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    // The units are after the last two colons, so column names can have them
+    const char *to_sep = strrchr(spec, ':');
+    const char *from_sep = NULL;
+    for (const char *s = spec; to_sep != NULL && s < to_sep; s++) {
+        if (*s == ':') from_sep = s;
+    }
+    CsvConversion conversion = {0};
+    bool ok = from_sep != NULL && from_sep > spec
+        && csv_read_unit(string_new_fmt(&arena, "%.*s", (int)(to_sep - from_sep - 1), from_sep + 1).s, mem, &conversion.from, &arena)
+        && csv_read_unit(to_sep + 1, mem, &conversion.to, &arena);
+    if (!ok) {
+        fprintf(stderr, "%s\n", convert_csv_msg);
+        memory_free(&mem);
+        arena_free(&arena);
+        return 1;
+    }
+    String err = string_empty(&arena);
+    if (!unit_convert_valid(conversion.from, conversion.to, &err, &arena)) {
+        fprintf(stderr, "%s\n", err.s);
+        memory_free(&mem);
+        arena_free(&arena);
+        return 1;
+    }
+    conversion.affine = unit_convert_affine(conversion.from, conversion.to, &conversion.scale, &conversion.offset);
+    conversion.identity = units_identical(conversion.from, conversion.to)
+        || (conversion.affine && conversion.scale == 1 && conversion.offset == 0);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open file: %s\n", path);
+        if (fd >= 0) close(fd);
+        memory_free(&mem);
+        arena_free(&arena);
+        return 1;
+    }
+    size_t size = st.st_size;
+    const char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map file: %s\n", path);
+        memory_free(&mem);
+        arena_free(&arena);
+        return 1;
+    }
+    if (data != NULL) madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    const char *column = string_new_fmt(&arena, "%.*s", (int)(from_sep - spec), spec).s;
+    int status = 0;
+    if (!csv_find_column(column, data, size, &conversion.column)) {
+        fprintf(stderr, "No such column: %s\n", column);
+        status = 1;
+    } else if (size > 0) {
+        csv_convert(data, size, &conversion, CSV_CHUNK_SIZE, n_threads, output_fd);
+    }
+    if (data != NULL) munmap((void *)data, size);
+    memory_free(&mem);
+    arena_free(&arena);
+    return status;
+}
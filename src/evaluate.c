@@ -1,39 +1,53 @@
 #pragma once
 
 #include <math.h>
+#include <stdalign.h>
 #include <stdarg.h>
 #include "memory.c"
 #include "unit.c"
 
-void substitute_variables(Expression *expr, Memory mem) {
-    if (expr->type == EXPR_VAR && memory_contains_var(mem, expr->expr.var_name)) {
+// Work counters so `explain` can show what a formula costs.
+typedef struct EvalStats EvalStats;
+struct EvalStats {
+    size_t nodes_visited;
+    size_t check_unit_calls;
+    size_t unit_conversions;
+};
+
+static _Thread_local EvalStats eval_stats = {0};
+
+void eval_stats_reset() {
+    eval_stats = (EvalStats) {0};
+}
+
+void substitute_variables(Expression *expr, Memory mem, Arena *arena) {
+    if (expr->type == EXPR_VAR && memory_contains_var(mem, expr->expr.symbol)) {
         debug("Substituting variable: %s\n", expr->expr.var_name);
-        *expr = memory_get_var(mem, expr->expr.var_name);
+        *expr = memory_value_expr(memory_get_var(mem, expr->expr.symbol), arena);
     } else if (expr->type == EXPR_SET_VAR) {
         debug("Substituting variables for set var expr\n");
-        substitute_variables(expr->expr.binary_expr.right, mem);
-    } else if (expr->type == EXPR_NEG) {
-        debug("Substituting variables for negation expr\n");
-        substitute_variables(expr->expr.unary_expr.right, mem);
+        substitute_variables(expr->expr.binary_expr.right, mem, arena);
+    } else if (expr->type == EXPR_NEG || expr->type == EXPR_AGGREGATE) {
+        debug("Substituting variables for unary expr\n");
+        substitute_variables(expr->expr.unary_expr.right, mem, arena);
     } else if (expr_is_bin(expr->type)) {
         debug("Substituting variables for binary expr: %s\n", display_expr_op(expr->type));
-        substitute_variables(expr->expr.binary_expr.left, mem);
-        substitute_variables(expr->expr.binary_expr.right, mem);
+        substitute_variables(expr->expr.binary_expr.left, mem, arena);
+        substitute_variables(expr->expr.binary_expr.right, mem, arena);
     } else {
         debug("No variable substitution for type: %s\n", display_expr_op(expr->type));
     }
 }
 
 void substitute_units(Expression *expr, Memory mem, Arena *arena) {
-    unsigned char *unit_name = expr->expr.var_name;
-    if (expr->type == EXPR_VAR && memory_contains_unit(mem, unit_name)) {
-        debug("Substituting unit: %s\n", unit_name);
-        *expr = expr_new_unit(memory_get_unit(mem, unit_name), arena);
+    if (expr->type == EXPR_VAR && memory_contains_unit(mem, expr->expr.symbol)) {
+        debug("Substituting unit: %s\n", expr->expr.var_name);
+        *expr = expr_new_unit(memory_get_unit(mem, expr->expr.symbol), arena);
     } else if (expr->type == EXPR_SET_VAR) {
         debug("Substituting units for set var expr\n");
         substitute_units(expr->expr.binary_expr.right, mem, arena);
-    } else if (expr->type == EXPR_NEG) {
-        debug("Substituting units for negation expr\n");
+    } else if (expr->type == EXPR_NEG || expr->type == EXPR_AGGREGATE) {
+        debug("Substituting units for unary expr\n");
         substitute_units(expr->expr.unary_expr.right, mem, arena);
     } else if (expr_is_bin(expr->type)) {
         debug("Substituting units for binary expr: %s\n", display_expr_op(expr->type));
@@ -59,6 +73,7 @@ const char invalid_comp_unit_msg[] = "Expected to combine two units, instead got
 const char invalid_math_msg[] = "Expected to %s two numbers, instead got left: %s right: %s";
 const char invalid_pow_msg[] = "Expected to raise unit to degree, instead got left: %s right: %s";
 const char invalid_set_var_msg[] = "Expected to set variable, instead got left: %s right: %s";
+const char invalid_aggregate_msg[] = "Expected to %s numbers, instead got: %s";
 
 bool check_valid_expr(Expression expr, String *err, Arena *arena) {
     if (err->len > 0) return false;
@@ -67,15 +82,27 @@ bool check_valid_expr(Expression expr, String *err, Arena *arena) {
     ExprType left_type = EXPR_INVALID;
     ExprType right_type = EXPR_INVALID;
     switch (expr.type) {
-        case EXPR_CONSTANT: case EXPR_UNIT: case EXPR_VAR:
+        case EXPR_CONSTANT: case EXPR_ARRAY: case EXPR_UNIT: case EXPR_VAR:
             return true;
         case EXPR_NEG:
             right_type = expr.expr.unary_expr.right->type;
-            if (right_type == EXPR_CONSTANT || right_type == EXPR_NEG || right_type == EXPR_CONST_UNIT) {
+            if (right_type == EXPR_CONSTANT || right_type == EXPR_ARRAY || right_type == EXPR_NEG
+                || right_type == EXPR_AGGREGATE || right_type == EXPR_CONST_UNIT) {
                 return true;
             }
             *err = string_new_fmt(arena, invalid_neg_msg, display_expr_op(right_type));
             return false;
+        case EXPR_AGGREGATE:
+            right_type = expr.expr.unary_expr.right->type;
+            if (!check_valid_expr(*expr.expr.unary_expr.right, err, arena)) {
+                return false;
+            }
+            if (expr_is_number(right_type)) {
+                return true;
+            }
+            *err = string_new_fmt(arena, invalid_aggregate_msg,
+                aggregate_names[expr.expr.unary_expr.aggregate], display_expr_op(right_type));
+            return false;
         case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
         case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
         case EXPR_SET_VAR: case EXPR_INT_DIV:
@@ -97,7 +124,7 @@ bool check_valid_expr(Expression expr, String *err, Arena *arena) {
           display_expr_op(expr.type), display_expr_op(left_type), display_expr_op(right_type));
     switch (expr.type) {
         case EXPR_CONST_UNIT:
-            if ((left_type == EXPR_CONSTANT || left_type == EXPR_CONST_UNIT ||
+            if ((left_type == EXPR_CONSTANT || left_type == EXPR_ARRAY || left_type == EXPR_CONST_UNIT ||
                 left_type == EXPR_NEG) && (expr_is_unit(right_type))) {
                 return true;
             }
@@ -135,6 +162,10 @@ bool check_valid_expr(Expression expr, String *err, Arena *arena) {
                 display_expr_op(left_type), display_expr_op(right_type));
             return false;
         case EXPR_POW:
+            if (expr_has_array(*expr.expr.binary_expr.right)) {
+                *err = string_new_fmt(arena, "Unit degrees can't be arrays");
+                return false;
+            }
             if (expr_is_unit(left_type) && (right_type == EXPR_CONSTANT
                 || right_type == EXPR_NEG || right_type == EXPR_CONST_UNIT)) {
                 return true;
@@ -198,58 +229,35 @@ bool unit_convert_valid(Unit a, Unit b, String *err, Arena *arena) {
 }
 
 double evaluate(Expression expr, Memory mem, String *err, Arena *arena);
+double evaluate_aggregate_unit(Expression expr, Memory mem, Unit *unit, String *err, Arena *arena);
 
-Unit check_unit(Expression expr, Memory mem, String *err, Arena *arena) {
-    if (expr.type == EXPR_CONSTANT) {
-        debug("constant: %lf\n", expr.expr.constant);
-        return unit_new_none(arena);
-    } else if (expr.type == EXPR_UNIT) {
-        debug("unit: %s\n", display_unit(expr.expr.unit, arena));
-        return expr.expr.unit;
-    } else if (expr.type == EXPR_VAR) {
-        debug("var: %s\n", expr.expr.var_name);
-        if (!memory_contains_var(mem, expr.expr.var_name)) {
-            *err = string_new_fmt(arena, "Variable not defined: %s", expr.expr.var_name);
-            return unit_new_unknown(arena);
-        }
-        Expression var_expr = memory_get_var(mem, expr.expr.var_name);
-        return check_unit(var_expr, mem, err, arena);
-    } else if (expr.type == EXPR_NEG) {
-        debug("neg\n");
-        return check_unit(*expr.expr.unary_expr.right, mem, err, arena);
-    } else if (expr.type == EXPR_INVALID) {
-        debug("empty, quit, or invalid, no unit: %d\n", expr.type);
-        return unit_new_unknown(arena);
-    }
-
-    Unit left = check_unit(*expr.expr.binary_expr.left, mem, err, arena);
-    Unit right = check_unit(*expr.expr.binary_expr.right, mem, err, arena);
+// The unit of applying binary `op` to operands with units `left` and
+// `right`, where `degree` is the right operand's value for EXPR_POW.
+Unit check_unit_op(ExprType op, Unit left, Unit right, double degree, String *err, Arena *arena) {
     debug("left: %s, right: %s\n", display_unit(left, arena), display_unit(right, arena));
-
     Unit unit = unit_new_unknown(arena);
     if (is_unit_unknown(left) || is_unit_unknown(right)) {
         // Already printed reason to err when checking unit of left/right
         debug("unit unknown\n");
         unit = unit_new_unknown(arena);
-    } else if (expr.type == EXPR_POW) {
+    } else if (op == EXPR_POW) {
         if (is_unit_none(left) || !is_unit_none(right)) {
             *err = string_new_fmt(arena, "Expected single degree unit ^ constant: %s ^ %s",
                 display_unit(left, arena), display_unit(right, arena));
             return unit_new_unknown(arena);
         }
-        debug("pow: %s ^ %lf\n", display_unit(left, arena), expr.expr.binary_expr.right->expr.constant);
+        debug("pow: %s ^ %lf\n", display_unit(left, arena), degree);
         Unit left_dup = unit_new(left.types, left.degrees, left.length, arena);
-        double degree = evaluate(*expr.expr.binary_expr.right, mem, err, arena);
         for (size_t i = 0; i < left_dup.length; i++) {
             left_dup.degrees[i] *= degree;
         }
         unit = left_dup;
-    } else if (expr.type == EXPR_CONVERT) {
+    } else if (op == EXPR_CONVERT) {
         if (!unit_convert_valid(left, right, err, arena)) {
             return unit_new_unknown(arena);
         }
         unit = right;
-    } else if (expr.type == EXPR_ADD || expr.type == EXPR_SUB) {
+    } else if (op == EXPR_ADD || op == EXPR_SUB) {
         if (unit_convert_valid(right, left, err, arena)) {
             debug("units convertible for add/sub\n");
             unit = left;
@@ -263,17 +271,17 @@ Unit check_unit(Expression expr, Memory mem, String *err, Arena *arena) {
     } else if (is_unit_none(right)) {
         debug("unit right none\n");
         unit = left;
-    } else if (expr.type == EXPR_MUL) {
+    } else if (op == EXPR_MUL) {
         debug("combining units for mul\n");
         unit = unit_combine(left, right, false, arena);
-    } else if (expr.type == EXPR_COMP_UNIT || expr.type == EXPR_CONST_UNIT) {
+    } else if (op == EXPR_COMP_UNIT || op == EXPR_CONST_UNIT) {
         debug("combining units for comp\n");
         unit = unit_combine(left, right, true, arena);
         if (is_unit_unknown(unit)) {
             *err = string_new_fmt(arena, "Cannot compose units of same category: Left: %s Right: %s",
                 display_unit(left, arena), display_unit(right, arena));
         }
-    } else if (expr.type == EXPR_DIV || expr.type == EXPR_INT_DIV || expr.type == EXPR_DIV_UNIT) {
+    } else if (op == EXPR_DIV || op == EXPR_INT_DIV || op == EXPR_DIV_UNIT) {
         debug("dividing units\n");
         // TODO: reject div unit for same category
         Unit right_dup = unit_new(right.types, right.degrees, right.length, arena);
@@ -283,65 +291,384 @@ Unit check_unit(Expression expr, Memory mem, String *err, Arena *arena) {
         unit = unit_combine(left, right_dup, false, arena);
     } else {
         *err = string_new_fmt(arena, "Units do not match: %s %s %s", display_unit(left, arena),
-           display_expr_op(expr.type), display_unit(right, arena));
+           display_expr_op(op), display_unit(right, arena));
         unit = unit_new_unknown(arena);
     }
     return unit;
 }
 
-double evaluate(Expression expr, Memory mem, String *err, Arena *arena) {
+Unit check_unit(Expression expr, Memory mem, String *err, Arena *arena) {
+    eval_stats.check_unit_calls++;
+    if (expr.type == EXPR_CONSTANT) {
+        debug("constant: %lf\n", expr.expr.constant);
+        return unit_new_none(arena);
+    } else if (expr.type == EXPR_ARRAY) {
+        debug("array of %zu\n", expr.expr.array.length);
+        return unit_new_none(arena);
+    } else if (expr.type == EXPR_UNIT) {
+        debug("unit: %s\n", display_unit(expr.expr.unit, arena));
+        return expr.expr.unit;
+    } else if (expr.type == EXPR_VAR) {
+        debug("var: %s\n", expr.expr.var_name);
+        if (!memory_contains_var(mem, expr.expr.symbol)) {
+            *err = string_new_fmt(arena, "Variable not defined: %s", expr.expr.var_name);
+            return unit_new_unknown(arena);
+        }
+        return memory_get_var(mem, expr.expr.symbol).unit;
+    } else if (expr.type == EXPR_NEG || expr.type == EXPR_AGGREGATE) {
+        debug("%s\n", display_expr_op(expr.type));
+        return check_unit(*expr.expr.unary_expr.right, mem, err, arena);
+    } else if (expr.type == EXPR_INVALID) {
+        debug("empty, quit, or invalid, no unit: %d\n", expr.type);
+        return unit_new_unknown(arena);
+    }
+
+    Unit left = check_unit(*expr.expr.binary_expr.left, mem, err, arena);
+    Unit right = check_unit(*expr.expr.binary_expr.right, mem, err, arena);
+    double degree = 0;
+    if (expr.type == EXPR_POW && !is_unit_unknown(left) && !is_unit_none(left) && is_unit_none(right)) {
+        degree = evaluate(*expr.expr.binary_expr.right, mem, err, arena);
+    }
+    return check_unit_op(expr.type, left, right, degree, err, arena);
+}
+
+// The value of applying arithmetic `op` to operands `left` and `right`,
+// with units `left_unit` and `right_unit`.
+double evaluate_op(ExprType op, double left, double right, Unit left_unit, Unit right_unit, String *err, Arena *arena) {
+    eval_stats.unit_conversions++;
+    if (op == EXPR_CONVERT) {
+        return unit_convert(left, left_unit, right_unit, arena);
+    }
+    right = unit_convert(right, right_unit, left_unit, arena);
+    switch (op) {
+        case EXPR_ADD:
+            return left + right;
+        case EXPR_SUB:
+            return left - right;
+        case EXPR_MUL:
+            return left * right;
+        case EXPR_DIV: case EXPR_INT_DIV:
+            if (right == 0) {
+                *err = string_new_fmt(arena, "Cannot divide by zero");
+                return 0;
+            }
+            return op == EXPR_DIV ? left / right : floor(left / right);
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+// The value of `expr`, with its unit set in `unit` as it goes, so each
+// node's unit is worked out once rather than again by every ancestor.
+double evaluate_unit(Expression expr, Memory mem, Unit *unit, String *err, Arena *arena) {
     double left = 0;
     double right = 0;
     Unit left_unit, right_unit;
+    eval_stats.nodes_visited++;
     switch (expr.type) {
         case EXPR_CONSTANT:
+            *unit = unit_new_none(arena);
             return expr.expr.constant;
+        case EXPR_ARRAY: // See evaluate_elements
+            assert(false);
+            return 0;
         case EXPR_VAR:
-            return evaluate(memory_get_var(mem, expr.expr.var_name), mem, err, arena);
-        case EXPR_POW: // Pow only means unit degrees for now
+            if (!memory_contains_var(mem, expr.expr.symbol)) {
+                *err = string_new_fmt(arena, "Variable not defined: %s", expr.expr.var_name);
+                *unit = unit_new_unknown(arena);
+                return 0;
+            }
+            *unit = memory_get_var(mem, expr.expr.symbol).unit;
+            return memory_get_var(mem, expr.expr.symbol).value;
         case EXPR_UNIT:
+            *unit = expr.expr.unit;
+            return 0;
+        case EXPR_POW: // Pow only means unit degrees for now
         case EXPR_COMP_UNIT:
         case EXPR_DIV_UNIT:
+            *unit = check_unit(expr, mem, err, arena);
             return 0;
         case EXPR_NEG:
-            return -evaluate(*expr.expr.unary_expr.right, mem, err, arena);
+            return -evaluate_unit(*expr.expr.unary_expr.right, mem, unit, err, arena);
+        case EXPR_AGGREGATE:
+            return evaluate_aggregate_unit(expr, mem, unit, err, arena);
         case EXPR_CONST_UNIT:
-            return evaluate(*expr.expr.binary_expr.left, mem, err, arena);
+            left = evaluate_unit(*expr.expr.binary_expr.left, mem, &left_unit, err, arena);
+            evaluate_unit(*expr.expr.binary_expr.right, mem, &right_unit, err, arena);
+            *unit = check_unit_op(expr.type, left_unit, right_unit, 0, err, arena);
+            return left;
         case EXPR_SET_VAR:
             assert(false);
         case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_DIV: case EXPR_INT_DIV:
-            left_unit = check_unit(*expr.expr.binary_expr.left, mem, err, arena);
-            right_unit = check_unit(*expr.expr.binary_expr.right, mem, err, arena);
-            left = evaluate(*expr.expr.binary_expr.left, mem, err, arena);
-            right = evaluate(*expr.expr.binary_expr.right, mem, err, arena);
-            break;
+            left = evaluate_unit(*expr.expr.binary_expr.left, mem, &left_unit, err, arena);
+            right = evaluate_unit(*expr.expr.binary_expr.right, mem, &right_unit, err, arena);
+            *unit = check_unit_op(expr.type, left_unit, right_unit, 0, err, arena);
+            return evaluate_op(expr.type, left, right, left_unit, right_unit, err, arena);
         case EXPR_CONVERT:
-            // TODO: Return a unit tree from check_unit so we don't have to run this
-            // (and allocate memory) again?
-            left_unit = check_unit(*expr.expr.binary_expr.left, mem, err, arena);
-            right_unit = check_unit(*expr.expr.binary_expr.right, mem, err, arena);
-            left = evaluate(*expr.expr.binary_expr.left, mem, err, arena);
-            return unit_convert(left, left_unit, right_unit, arena);
+            left = evaluate_unit(*expr.expr.binary_expr.left, mem, &left_unit, err, arena);
+            evaluate_unit(*expr.expr.binary_expr.right, mem, &right_unit, err, arena);
+            *unit = check_unit_op(expr.type, left_unit, right_unit, 0, err, arena);
+            return evaluate_op(expr.type, left, 0, left_unit, right_unit, err, arena);
         case EXPR_INVALID:
             assert(false);
             return 0;
     }
-    right = unit_convert(right, right_unit, left_unit, arena);
-    switch (expr.type) {
+    return 0;
+}
+
+double evaluate(Expression expr, Memory mem, String *err, Arena *arena) {
+    Unit unit;
+    return evaluate_unit(expr, mem, &unit, err, arena);
+}
+
+// `op` of `left` and `right` element by element, with units `left_unit`
+// and `right_unit`. A single number applies to every element of the
+// other side.
+ArrayValue evaluate_elements_op(ExprType op, ArrayValue left, ArrayValue right, Unit left_unit, Unit right_unit,
+                                String *err, Arena *arena) {
+    eval_stats.unit_conversions++;
+    if (op == EXPR_CONVERT) {
+        return array_value_convert(left, left_unit, right_unit, arena);
+    }
+    if (left.length != right.length && left.length != 1 && right.length != 1) {
+        *err = string_new_fmt(arena, "Arrays have different lengths: %zu and %zu", left.length, right.length);
+        return left;
+    }
+    right = array_value_convert(right, right_unit, left_unit, arena);
+    if (op == EXPR_DIV || op == EXPR_INT_DIV) {
+        for (size_t i = 0; i < right.length; i++) {
+            if (right.values[i] == 0) {
+                *err = string_new_fmt(arena, "Cannot divide by zero");
+                return left;
+            }
+        }
+    }
+    size_t length = left.length > right.length ? left.length : right.length;
+    left = array_value_broadcast(left, length, arena);
+    right = array_value_broadcast(right, length, arena);
+    ArrayValue result = array_value_new(length, arena);
+    const ArrayLanes *a = (const ArrayLanes *)left.values;
+    const ArrayLanes *b = (const ArrayLanes *)right.values;
+    ArrayLanes *out = (ArrayLanes *)result.values;
+    size_t n_lanes = array_value_n_lanes(length);
+    switch (op) {
         case EXPR_ADD:
-            return left + right;
+            for (size_t i = 0; i < n_lanes; i++) out[i] = a[i] + b[i];
+            break;
         case EXPR_SUB:
-            return left - right;
+            for (size_t i = 0; i < n_lanes; i++) out[i] = a[i] - b[i];
+            break;
         case EXPR_MUL:
-            return left * right;
+            for (size_t i = 0; i < n_lanes; i++) out[i] = a[i] * b[i];
+            break;
         case EXPR_DIV: case EXPR_INT_DIV:
-            if (right == 0) {
-                *err = string_new_fmt(arena, "Cannot divide by zero");
-                return 0;
+            // Only the padding can be zero here
+            for (size_t i = 0; i < n_lanes; i++) out[i] = a[i] / b[i];
+            if (op == EXPR_INT_DIV) {
+                for (size_t i = 0; i < length; i++) result.values[i] = floor(result.values[i]);
             }
-            return expr.type == EXPR_DIV ? left / right : floor(left / right);
+            break;
         default:
             assert(false);
-            return 0;
     }
+    return result;
+}
+
+// Like `evaluate_unit`, for expressions with arrays in them. Plain
+// numbers come out as arrays of one.
+ArrayValue evaluate_elements_unit(Expression expr, Memory mem, Unit *unit, String *err, Arena *arena) {
+    ArrayValue left, right;
+    Unit left_unit, right_unit;
+    eval_stats.nodes_visited++;
+    switch (expr.type) {
+        case EXPR_CONSTANT:
+            *unit = unit_new_none(arena);
+            return array_value_of(expr.expr.constant, arena);
+        case EXPR_ARRAY:
+            *unit = unit_new_none(arena);
+            return expr.expr.array;
+        case EXPR_VAR: {
+            if (!memory_contains_var(mem, expr.expr.symbol)) {
+                *err = string_new_fmt(arena, "Variable not defined: %s", expr.expr.var_name);
+                *unit = unit_new_unknown(arena);
+                return array_value_of(0, arena);
+            }
+            MemoryValue var = memory_get_var(mem, expr.expr.symbol);
+            *unit = var.unit;
+            return var.array.length > 0 ? var.array : array_value_of(var.value, arena);
+        }
+        case EXPR_UNIT:
+            *unit = expr.expr.unit;
+            return array_value_of(0, arena);
+        case EXPR_POW:
+        case EXPR_COMP_UNIT:
+        case EXPR_DIV_UNIT:
+            *unit = check_unit(expr, mem, err, arena);
+            return array_value_of(0, arena);
+        case EXPR_NEG:
+            return array_value_neg(evaluate_elements_unit(*expr.expr.unary_expr.right, mem, unit, err, arena), arena);
+        case EXPR_AGGREGATE:
+            return array_value_of(evaluate_aggregate_unit(expr, mem, unit, err, arena), arena);
+        case EXPR_CONST_UNIT:
+            left = evaluate_elements_unit(*expr.expr.binary_expr.left, mem, &left_unit, err, arena);
+            evaluate_elements_unit(*expr.expr.binary_expr.right, mem, &right_unit, err, arena);
+            *unit = check_unit_op(expr.type, left_unit, right_unit, 0, err, arena);
+            return left;
+        case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_DIV: case EXPR_INT_DIV: case EXPR_CONVERT:
+            left = evaluate_elements_unit(*expr.expr.binary_expr.left, mem, &left_unit, err, arena);
+            right = evaluate_elements_unit(*expr.expr.binary_expr.right, mem, &right_unit, err, arena);
+            *unit = check_unit_op(expr.type, left_unit, right_unit, 0, err, arena);
+            if (err->len > 0) return left;
+            return evaluate_elements_op(expr.type, left, right, left_unit, right_unit, err, arena);
+        case EXPR_SET_VAR: case EXPR_INVALID:
+            assert(false);
+    }
+    *unit = unit_new_unknown(arena);
+    return array_value_of(0, arena);
+}
+
+ArrayValue evaluate_elements(Expression expr, Memory mem, String *err, Arena *arena) {
+    Unit unit;
+    return evaluate_elements_unit(expr, mem, &unit, err, arena);
+}
+
+// Reduce what an EXPR_AGGREGATE's operand evaluates to in one pass,
+// setting `unit` to the operand's.
+double evaluate_aggregate_unit(Expression expr, Memory mem, Unit *unit, String *err, Arena *arena) {
+    ArrayValue values = evaluate_elements_unit(*expr.expr.unary_expr.right, mem, unit, err, arena);
+    if (err->len > 0) return 0;
+    Aggregate agg = aggregate_empty;
+    aggregate_add_values(&agg, values.values, values.length);
+    return aggregate_result(agg, expr.expr.unary_expr.aggregate);
+}
+
+// Work out the unit and value of every node of `array` in order, so
+// children are done before their parents. Sets `unit` and `value` to
+// the root's and returns true, or returns false if it can't be
+// evaluated, with the reason in `err` if there is one.
+bool evaluate_array(ExprArray array, Memory mem, Unit *unit, double *value, String *err, Arena *arena) {
+    Unit *units = arena_alloc_aligned(arena, array.length * sizeof(Unit), alignof(Unit));
+    double *values = arena_alloc_aligned(arena, array.length * sizeof(double), alignof(double));
+    for (uint32_t i = 0; i < array.length; i++) {
+        ExprNode node = array.nodes[i];
+        eval_stats.nodes_visited++;
+        values[i] = 0;
+        switch ((ExprType)node.type) {
+            case EXPR_CONSTANT:
+                units[i] = unit_new_none(arena);
+                values[i] = array.constants[node.left];
+                break;
+            case EXPR_UNIT:
+                units[i] = array.units[node.left];
+                break;
+            case EXPR_ARRAY: case EXPR_AGGREGATE:
+                // Left to `evaluate_elements`
+                return false;
+            case EXPR_VAR: {
+                const MemoryValue *var = memory_find_var(mem, array.symbols[node.left]);
+                if (var == NULL) {
+                    *err = string_new_fmt(arena, "Variable not defined: %s", array.var_names[node.left]);
+                    return false;
+                }
+                if (var->array.length > 0) return false;
+                units[i] = var->unit;
+                values[i] = var->value;
+                break;
+            }
+            case EXPR_NEG:
+                units[i] = units[node.right];
+                values[i] = -values[node.right];
+                break;
+            case EXPR_INVALID:
+                *err = array.errors[node.left];
+                return false;
+            case EXPR_SET_VAR:
+                assert(false);
+                return false;
+            case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+            case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+            case EXPR_INT_DIV:
+                units[i] = check_unit_op(node.type, units[node.left], units[node.right],
+                    values[node.right], err, arena);
+                if (node.type == EXPR_CONST_UNIT) {
+                    values[i] = values[node.left];
+                } else if (expr_is_number(node.type)) {
+                    values[i] = evaluate_op(node.type, values[node.left], values[node.right],
+                        units[node.left], units[node.right], err, arena);
+                }
+                break;
+        }
+        if (is_unit_unknown(units[i]) || err->len > 0) {
+            return false;
+        }
+    }
+    *unit = units[array.length - 1];
+    *value = values[array.length - 1];
+    return true;
+}
+
+// Whether replacing a `child` of `parent` with a constant could make
+// `parent` valid when it isn't, e.g. `-(1 + 2)` isn't, but `-3` would be.
+bool fold_changes_validity(ExprType parent, bool right, ExprType child) {
+    if (parent == EXPR_NEG || (parent == EXPR_CONST_UNIT && !right) || (parent == EXPR_POW && right)) {
+        return child != EXPR_CONSTANT && child != EXPR_NEG && child != EXPR_CONST_UNIT;
+    }
+    if (parent == EXPR_COMP_UNIT && right) {
+        return child != EXPR_UNIT && child != EXPR_POW;
+    }
+    return false;
+}
+
+bool fold_constants_inner(Expression *expr, bool replace, Memory mem, Arena *arena) {
+    bool constant = false;
+    Expression *left = expr->expr.binary_expr.left;
+    Expression *right = expr->expr.binary_expr.right;
+    switch (expr->type) {
+        case EXPR_CONSTANT: case EXPR_UNIT:
+            return true;
+        case EXPR_ARRAY: case EXPR_VAR: case EXPR_INVALID:
+            return false;
+        case EXPR_SET_VAR:
+            fold_constants_inner(right, true, mem, arena);
+            return false;
+        case EXPR_NEG: case EXPR_AGGREGATE:
+            right = expr->expr.unary_expr.right;
+            constant = fold_constants_inner(right, !fold_changes_validity(expr->type, true, right->type), mem, arena);
+            break;
+        case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+        case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+        case EXPR_INT_DIV:
+            constant = fold_constants_inner(left, !fold_changes_validity(expr->type, false, left->type), mem, arena);
+            constant &= fold_constants_inner(right, !fold_changes_validity(expr->type, true, right->type), mem, arena);
+            break;
+    }
+    if (!constant || !replace) return false;
+    // Already as folded as it gets
+    if (expr->type == EXPR_CONST_UNIT && left->type == EXPR_CONSTANT && right->type == EXPR_UNIT) {
+        return true;
+    }
+    // Constant children are single nodes by now, so this is cheap
+    String err = string_empty(arena);
+    if (!check_valid_expr(*expr, &err, arena)) return false;
+    Unit unit = check_unit(*expr, mem, &err, arena);
+    if (is_unit_unknown(unit) || err.len > 0) return false;
+    if (!expr_is_number(expr->type)) {
+        *expr = expr_new_unit_full(unit, arena);
+        return true;
+    }
+    double value = evaluate(*expr, mem, &err, arena);
+    if (err.len > 0) return false;
+    *expr = expr_new_const_unit(value, expr_new_unit_full(unit, arena), arena);
+    return true;
+}
+
+// Replace every subtree of `expr` that doesn't refer to a variable with
+// what it evaluates to: a single EXPR_CONST_UNIT for numbers, or
+// EXPR_UNIT for units, so evaluating it again only does the work that
+// depends on variables. Subtrees that fail to evaluate are left to fail
+// when the rest is evaluated. Expects units to have been substituted,
+// and variables not to have been.
+void fold_constants(Expression *expr, Memory mem, Arena *arena) {
+    fold_constants_inner(expr, true, mem, arena);
 }
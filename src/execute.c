@@ -1,25 +1,37 @@
+#pragma once
 
 #include <ctype.h>
+#include <math.h>
+#include <stdalign.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include "arena.c"
+#include "calculator.h"
 #include "evaluate.c"
+#include "explain.c"
 #include "expression.c"
 #include "memory.c"
 #include "parse.c"
+#include "statement.c"
+#include "sweep.c"
 #include "tokenize.c"
 
 const char help_msg[] = "Hello! This is a simple program \
 for evaluating expressions with units. Type any of the following \
 and press enter:\n\n\
 [expression] -> Evaluates the expression\n\
+[name] := [expression] -> Defines a formula, kept up to date with its variables\n\
 help -> Shows this message\n\
 examples -> Shows example expressions\n\
 units -> Shows builtin units\n\
 memory -> Shows variables in memory\n\
-addunit [unit] -> Adds a new unit";
+addunit [unit] -> Adds a new unit\n\
+explain [expression] -> Shows how an expression is evaluated\n\
+sweep [name] = [start]..[end] step [size]: [expression] -> Evaluates the expression over a range";
 
 // TODO: more math
 const char examples_msg[] = "Math: 1 + 2 * 3 - 4 / 5\n\
@@ -27,130 +39,771 @@ Math with units: 1km/2s*3km+4km^2s^-1\n\
 Convert units: 10 m/s^2 -> km/h^2\n\
 Auto-convert units: 10 km - 2 m + 12 mi\n\
 Variables: x = 9 + 10\n\
+Arrays: [1, 2.5, 7] km -> mi\n\
+Aggregates: sum([1, 2.5, 7] km) -> mi\n\
+Formulas: y := x * 3 km\n\
 Unit aliases: n = kg m s^-2\n\
 User-defined units: addunit foo\n\
+Explain: explain 5 km + 2 mi -> m\n\
+Sweeps: sweep v = 1..1000000: v km/h -> m/s\n\
 See docs for more info.";
 
-bool execute_line_inner(const char *input, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
-    TokenString tokens = tokenize(input, arena);
+// Big enough for `explain` on long expressions.
+#define MAX_OUTPUT 4096
 
-    memset(output, 0, output_len);
+// What happened when executing a line, besides the text in `output`.
+typedef struct ExecuteResult ExecuteResult;
+struct ExecuteResult {
+    bool quit;
+    bool error;
+    // Set when the line evaluated to a number (including assignments)
+    bool has_value;
+    double value;
+    // Set instead of `value` when the line evaluated to an array. Lives
+    // in the per-line arena.
+    ArrayValue array;
+    // Display string of the result's unit, or NULL if there wasn't one.
+    // Lives in the per-line arena.
+    const char *unit;
+    // Set when the line added a variable or unit to memory
+    bool changed_memory;
+};
+
+const ExecuteResult execute_ok = { .quit = false };
+const ExecuteResult execute_error = { .error = true };
+
+// Whether executing `tokens` could change memory. Lines that
+// can't are safe to run against a shared, read-only memory.
+bool tokens_change_memory(TokenString tokens) {
+    if (tokens.length == 0 || tokens.tokens[0].type == TOK_EXPLAIN || tokens.tokens[0].type == TOK_SWEEP) {
+        return false;
+    }
+    if (tokens.tokens[0].type == TOK_ADD_UNIT) {
+        return true;
+    }
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type == TOK_EQUALS || tokens.tokens[i].type == TOK_BIND) return true;
+    }
+    return false;
+}
+
+// Whether `tokens` defines a formula, e.g. `y := x * 3 km`.
+bool tokens_are_bind(TokenString tokens) {
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type == TOK_BIND) return true;
+    }
+    return false;
+}
+
+// Whether `tokens` is a command like help or addunit, rather than an
+// expression that needs parsing.
+bool tokens_are_command(TokenString tokens) {
     if (tokens.length == 0) {
+        return true;
+    }
+    TokenType first = tokens.tokens[0].type;
+    if (tokens_are_bind(tokens)) {
+        return true;
+    }
+    if (tokens.length == 1) {
+        return first == TOK_QUIT || first == TOK_HELP || first == TOK_EXAMPLES
+            || first == TOK_SHOW_UNITS || first == TOK_MEMORY
+            || first == TOK_EXPLAIN || first == TOK_SWEEP;
+    }
+    return first == TOK_EXPLAIN || first == TOK_SWEEP || (tokens.length == 2 && first == TOK_ADD_UNIT);
+}
+
+// Substitute what's in memory into `expr`, and check it makes sense.
+bool execute_prepare(Expression *expr, Memory mem, String *err, Arena *arena) {
+    trace_begin(TRACE_PARSE, "substitute_variables");
+    substitute_variables(expr, mem, arena);
+    trace_end(TRACE_PARSE, "substitute_variables");
+    trace_begin(TRACE_PARSE, "substitute_units");
+    substitute_units(expr, mem, arena);
+    trace_end(TRACE_PARSE, "substitute_units");
+    display_expr(0, *expr, arena);
+    trace_begin(TRACE_PARSE, "check_valid_expr");
+    bool valid = check_valid_expr(*expr, err, arena);
+    trace_end(TRACE_PARSE, "check_valid_expr");
+    return valid;
+}
+
+// Evaluate a prepared expression into `result`, and if `stored` isn't
+// NULL, what a variable set to it holds, allocated in `repl_arena`.
+bool execute_value(Expression value, Memory mem, ExecuteResult *result, MemoryValue *stored,
+                   String *err, Arena *repl_arena, Arena *arena) {
+    trace_begin(TRACE_EVALUATE, "check_unit");
+    Unit unit = check_unit(value, mem, err, arena);
+    trace_end(TRACE_EVALUATE, "check_unit");
+    if (is_unit_unknown(unit)) {
         return false;
     }
-    if (tokens.length == 1 && tokens.tokens[0].type == TOK_QUIT) {
-        memset(output, 0, output_len);
+    result->unit = display_unit(unit, arena);
+    if (!expr_is_number(value.type)) {
+        if (stored != NULL) *stored = memory_value_unit(unit, repl_arena);
         return true;
     }
-    if (tokens.length == 1 && tokens.tokens[0].type == TOK_HELP) {
-        memcpy(output, help_msg, sizeof(help_msg));
+    if (expr_has_array(value)) {
+        trace_begin(TRACE_EVALUATE, "evaluate_elements");
+        result->array = evaluate_elements(value, mem, err, arena);
+        trace_end(TRACE_EVALUATE, "evaluate_elements");
+        if (err->len > 0) {
+            return false;
+        }
+        if (stored != NULL) *stored = memory_value_array(result->array, unit, repl_arena);
+        return true;
+    }
+
+    trace_begin(TRACE_EVALUATE, "evaluate");
+    result->value = evaluate(value, mem, err, arena);
+    result->has_value = true;
+    trace_end(TRACE_EVALUATE, "evaluate");
+    if (err->len > 0) {
         return false;
     }
-    if (tokens.length == 1 && tokens.tokens[0].type == TOK_EXAMPLES) {
-        memcpy(output, examples_msg, sizeof(examples_msg));
+    if (stored != NULL) {
+        *stored = memory_value_number(result->value, unit, repl_arena);
+    }
+    return true;
+}
+
+// Execute a parsed expression line, i.e. anything but a command.
+ExecuteResult execute_expr(Expression expr, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    memset(output, 0, output_len);
+    String err = string_empty(arena);
+    if (!execute_prepare(&expr, *mem, &err, arena)) {
+        snprintf(output, output_len, "%s", err.s);
+        return execute_error;
+    }
+
+    const unsigned char *var_name = NULL;
+    Expression value = expr;
+    if (expr.type == EXPR_SET_VAR) {
+        var_name = expr.expr.binary_expr.left->expr.var_name;
+        value = *expr.expr.binary_expr.right;
+    }
+
+    ExecuteResult result = { .quit = false };
+    MemoryValue stored;
+    if (!execute_value(value, *mem, &result, var_name != NULL ? &stored : NULL, &err, repl_arena, arena)) {
+        snprintf(output, output_len, "%s", err.s);
+        return execute_error;
+    }
+    if (var_name == NULL && result.has_value) {
+        snprintf(output, output_len, "%g %s", result.value, result.unit);
+        return result;
+    } else if (var_name == NULL && result.array.length > 0) {
+        snprintf(output, output_len, "%s %s", display_array_value(result.array, arena).s, result.unit);
+        return result;
+    } else if (var_name == NULL) {
+        snprintf(output, output_len, "%s", result.unit);
+        return result;
+    }
+
+    Symbol var = memory_intern(*mem, var_name, strlen((const char *)var_name), &err, arena);
+    if (var == SYMBOL_NONE) {
+        snprintf(output, output_len, "%s", err.s);
+        return execute_error;
+    }
+    String msg = display_var(var_name, stored, false, arena);
+    snprintf(output, output_len, "%s", msg.s);
+    memory_add_var(mem, var, stored, repl_arena);
+    result.changed_memory = true;
+    return result;
+}
+
+// Parse a formula's `tokens` against `mem` for `Formula.compiled`, with
+// `classes` to check it against later, keeping them in `repl_arena`.
+const Expression *execute_compile_formula(TokenString tokens, Memory mem, const uint8_t **classes,
+                                          Arena *repl_arena, Arena *arena) {
+    trace_begin(TRACE_PARSE, "compile_formula");
+    uint8_t *token_classes = arena_alloc(repl_arena, tokens.length);
+    for (size_t i = 0; i < tokens.length; i++) {
+        token_classes[i] = token_classify(tokens.tokens[i], mem);
+    }
+    *classes = token_classes;
+    Expression expr = parse(tokens, mem, arena);
+    substitute_units(&expr, mem, arena);
+    fold_constants(&expr, mem, arena);
+    const Expression *shared = expr_table_share(mem.exprs, expr, repl_arena);
+    trace_end(TRACE_PARSE, "compile_formula");
+    return shared;
+}
+
+// Whether `formula->compiled` is what its tokens parse to now.
+bool execute_compiled_valid(const Formula *formula, Memory mem) {
+    for (size_t i = 0; i < formula->tokens.length; i++) {
+        if (token_classify(formula->tokens.tokens[i], mem) != formula->classes[i]) return false;
+    }
+    return true;
+}
+
+const char *execute_formula_expr(Expression expr, Memory mem, ExecuteResult *result, MemoryValue *stored,
+                                 Arena *repl_arena, Arena *arena) {
+    String err = string_empty(arena);
+    if (!execute_prepare(&expr, mem, &err, arena)) {
+        return err.s;
+    }
+    if (expr.type == EXPR_SET_VAR) {
+        return "Formulas can't assign variables";
+    }
+    if (!execute_value(expr, mem, result, stored, &err, repl_arena, arena)) {
+        return err.s;
+    }
+    return NULL;
+}
+
+// Evaluate what a formula compiled to in one pass over its program.
+// It was valid when defined, and stays valid while the classes of its
+// tokens stay the same, so variables are read as they're reached
+// instead of substituted.
+bool execute_compiled(const Formula *formula, Memory mem, ExecuteResult *result, MemoryValue *stored,
+                      Arena *repl_arena, Arena *arena) {
+    const Expression *root = formula->compiled;
+    bool is_number = root->type == EXPR_VAR ? memory_get_var(mem, root->expr.symbol).is_number
+                                            : expr_is_number(root->type);
+    String err = string_empty(arena);
+    Unit unit;
+    double value;
+    trace_begin(TRACE_EVALUATE, "evaluate_array");
+    bool ok = evaluate_array(formula->program, mem, &unit, &value, &err, arena);
+    trace_end(TRACE_EVALUATE, "evaluate_array");
+    if (!ok) {
         return false;
     }
+    result->unit = display_unit(unit, arena);
+    if (!is_number) {
+        if (stored != NULL) *stored = memory_value_unit(unit, repl_arena);
+        return true;
+    }
+    result->value = value;
+    result->has_value = true;
+    if (stored != NULL) *stored = memory_value_number(value, unit, repl_arena);
+    return true;
+}
+
+// Evaluate a formula's expression against `mem`, starting from what it
+// compiled to if `formula` isn't NULL and it's still valid. Returns NULL,
+// or the error it ran into.
+const char *execute_formula(TokenString tokens, const Formula *formula, Memory mem, ExecuteResult *result,
+                            MemoryValue *stored, Arena *repl_arena, Arena *arena) {
+    if (formula != NULL && execute_compiled_valid(formula, mem)) {
+        if (execute_compiled(formula, mem, result, stored, repl_arena, arena)) {
+            return NULL;
+        }
+        // Parse it again for the error, which can mention parts that
+        // were folded
+        *result = (ExecuteResult) { .quit = false };
+    }
+    trace_begin(TRACE_PARSE, "parse");
+    Expression expr = parse(tokens, mem, arena);
+    trace_end(TRACE_PARSE, "parse");
+    return execute_formula_expr(expr, mem, result, stored, repl_arena, arena);
+}
+
+// Bring the formula `var` up to date, after whatever it refers to.
+// Returns NULL, or why it has no value.
+const char *execute_refresh_formula(Symbol var, Memory *mem, Arena *repl_arena, Arena *arena) {
+    const Formula *formula = memory_get_formula(*mem, var);
+    if (formula == NULL || !formula->dirty) {
+        return formula != NULL ? formula->error : NULL;
+    }
+    trace_begin(TRACE_EVALUATE, "refresh_formula");
+    const char *error = NULL;
+    for (size_t i = 0; i < formula->tokens.length && error == NULL; i++) {
+        if (formula->tokens.tokens[i].type == TOK_VAR) {
+            error = execute_refresh_formula(formula->symbols[i], mem, repl_arena, arena);
+        }
+    }
+    ExecuteResult result = { .quit = false };
+    MemoryValue stored;
+    if (error == NULL) {
+        error = execute_formula(formula->tokens, formula, *mem, &result, &stored, repl_arena, arena);
+        if (error != NULL) {
+            error = string_new_fmt(arena, "Formula %s: %s", memory_name(*mem, var), error).s;
+        }
+    }
+    memory_update_formula(mem, var, error == NULL ? &stored : NULL, error, repl_arena);
+    trace_end(TRACE_EVALUATE, "refresh_formula");
+    return memory_get_formula(*mem, var)->error;
+}
+
+// Bring every formula `tokens` reads up to date. Returns false, with the
+// error in `output`, if one of them has no value. Lines that can't change
+// memory, which have no `repl_arena`, are expected to have checked
+// `memory_formulas_ready` instead.
+bool execute_refresh(TokenString tokens, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    if (repl_arena == NULL) {
+        return true;
+    }
+    // Not what an assignment assigns to
+    size_t start = tokens.length > 1 && (tokens.tokens[1].type == TOK_EQUALS || tokens.tokens[1].type == TOK_BIND);
+    for (size_t i = start; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        const char *error = execute_refresh_formula(memory_lookup_token(*mem, tokens.tokens[i]), mem, repl_arena, arena);
+        if (error != NULL) {
+            snprintf(output, output_len, "%s", error);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether any formula reachable from `tokens` refers to the variable
+// `target`. `symbols` are the symbols of `tokens` if they're a formula's,
+// or NULL to look them up. `visited` has room for `n_symbols` + 1.
+bool execute_formula_reaches(TokenString tokens, const Symbol *symbols, Token target, Memory mem, bool *visited,
+                             uint32_t n_symbols) {
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        Token token = tokens.tokens[i];
+        if (token_same_name(token, target)) return true;
+        Symbol var = symbols != NULL ? symbols[i] : memory_lookup_token(mem, token);
+        // Names added since `n_symbols` was read aren't in any formula in `mem`
+        if (var == SYMBOL_NONE || var > n_symbols || visited[var]) continue;
+        visited[var] = true;
+        const Formula *formula = memory_get_formula(mem, var);
+        if (formula != NULL
+            && execute_formula_reaches(formula->tokens, formula->symbols, target, mem, visited, n_symbols)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The symbol of every variable in `tokens`, interned, or SYMBOL_NONE for
+// other tokens, in `arena`. Returns NULL, with why in `err`, if there's
+// no room for them.
+const Symbol *execute_intern_tokens(TokenString tokens, Memory mem, String *err, Arena *arena) {
+    Symbol *symbols = arena_alloc_aligned(arena, tokens.length * sizeof(Symbol), alignof(Symbol));
+    for (size_t i = 0; i < tokens.length; i++) {
+        symbols[i] = SYMBOL_NONE;
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        symbols[i] = memory_intern(mem, tokens.tokens[i].var_name, tokens.tokens[i].var_len, err, arena);
+        if (symbols[i] == SYMBOL_NONE) return NULL;
+    }
+    return symbols;
+}
+
+// `name := expression`
+ExecuteResult execute_bind(TokenString tokens, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    memset(output, 0, output_len);
+    size_t n_assigns = 0;
+    for (size_t i = 0; i < tokens.length; i++) {
+        n_assigns += tokens.tokens[i].type == TOK_EQUALS || tokens.tokens[i].type == TOK_BIND;
+    }
+    if (tokens.length < 3 || tokens.tokens[0].type != TOK_VAR || tokens.tokens[1].type != TOK_BIND
+        || n_assigns > 1) {
+        snprintf(output, output_len, "Formulas look like: name := expression");
+        return execute_error;
+    }
+    unsigned char *var_name = token_name(tokens.tokens[0], arena);
+    if (memory_contains_unit(*mem, memory_lookup_token(*mem, tokens.tokens[0]))) {
+        snprintf(output, output_len, "\"%s\" is already a unit", var_name);
+        return execute_error;
+    }
+    TokenString rest = { .tokens = tokens.tokens + 2, .length = tokens.length - 2 };
+    uint32_t n_symbols = symbol_count(mem->symbols);
+    bool *visited = arena_alloc(arena, n_symbols + 1);
+    memset(visited, 0, n_symbols + 1);
+    if (execute_formula_reaches(rest, NULL, tokens.tokens[0], *mem, visited, n_symbols)) {
+        snprintf(output, output_len, "Formula can't depend on itself: %s", var_name);
+        return execute_error;
+    }
+    if (!execute_refresh(tokens, output, output_len, mem, repl_arena, arena)) {
+        return execute_error;
+    }
+    ExecuteResult result = { .quit = false };
+    MemoryValue stored;
+    const char *error = execute_formula(rest, NULL, *mem, &result, &stored, repl_arena, arena);
+    if (error != NULL) {
+        snprintf(output, output_len, "%s", error);
+        return execute_error;
+    }
+    // Only now is the formula going to be stored
+    String err = string_empty(arena);
+    const Symbol *symbols = execute_intern_tokens(rest, *mem, &err, repl_arena);
+    Symbol var = symbols != NULL ? memory_intern(*mem, tokens.tokens[0].var_name, tokens.tokens[0].var_len, &err, arena)
+                                 : SYMBOL_NONE;
+    if (var == SYMBOL_NONE) {
+        snprintf(output, output_len, "%s", err.s);
+        return execute_error;
+    }
+    const uint8_t *classes;
+    const Expression *compiled = execute_compile_formula(rest, *mem, &classes, repl_arena, arena);
+    memory_add_formula(mem, var, rest, symbols, compiled, classes, stored, repl_arena);
+    String msg = display_var(var_name, stored, false, arena);
+    snprintf(output, output_len, "%s", msg.s);
+    result.changed_memory = true;
+    return result;
+}
+
+// Read a bound of a sweep's range, e.g. `-2.5`, at `*i`.
+bool sweep_read_number(TokenString tokens, size_t *i, double *number) {
+    bool negative = *i < tokens.length && tokens.tokens[*i].type == TOK_SUB;
+    if (negative) (*i)++;
+    if (*i >= tokens.length || tokens.tokens[*i].type != TOK_NUM) return false;
+    *number = negative ? -tokens.tokens[*i].number : tokens.tokens[*i].number;
+    (*i)++;
+    return true;
+}
+
+#define SWEEP_MAX_POINTS 1000000000
+
+// `sweep x = start..end step size: expression`, which evaluates the
+// expression for every x from start to end (the step defaults to 1),
+// and shows a summary. The expression is prepared once with x as its
+// placeholder, then run over chunks of x at a time on every core.
+ExecuteResult execute_sweep(TokenString tokens, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    memset(output, 0, output_len);
+    double start = 0, end = 0, step = 1;
+    size_t i = 3;
+    bool ok = tokens.length > 3 && tokens.tokens[1].type == TOK_VAR && tokens.tokens[2].type == TOK_EQUALS
+        && sweep_read_number(tokens, &i, &start)
+        && i < tokens.length && tokens.tokens[i++].type == TOK_RANGE
+        && sweep_read_number(tokens, &i, &end);
+    if (ok && i < tokens.length && tokens.tokens[i].type == TOK_STEP) {
+        i++;
+        ok = sweep_read_number(tokens, &i, &step);
+    }
+    ok = ok && i < tokens.length && tokens.tokens[i++].type == TOK_COLON && i < tokens.length;
+    if (!ok) {
+        snprintf(output, output_len, "Sweeps look like: sweep x = 1..100 step 0.5: expression");
+        return execute_error;
+    }
+    if (!isfinite(start) || !isfinite(end) || !isfinite(step)) {
+        snprintf(output, output_len, "Sweep bounds have to be finite: %g..%g step %g", start, end, step);
+        return execute_error;
+    }
+    if (!(step > 0) || end < start) {
+        snprintf(output, output_len, "Sweep has no points: %g..%g step %g", start, end, step);
+        return execute_error;
+    }
+    double n_points = floor((end - start) / step + 1e-9) + 1;
+    // Written so that NaN, e.g. from a step too small to add, fails too
+    if (!(n_points <= SWEEP_MAX_POINTS)) {
+        snprintf(output, output_len, "Sweep has too many points: %g, at most %d", n_points, SWEEP_MAX_POINTS);
+        return execute_error;
+    }
+
+    // What's swept is the expression's placeholder
+    Token var = tokens.tokens[1];
+    TokenString rest = { .tokens = tokens.tokens + i, .length = tokens.length - i };
+    rest = tokens_copy(rest, arena);
+    for (size_t j = 0; j < rest.length; j++) {
+        if (rest.tokens[j].type == TOK_PARAM) {
+            snprintf(output, output_len, "Placeholders only work in prepared statements: ?%.*s",
+                     (int)rest.tokens[j].var_len, rest.tokens[j].var_name);
+            return execute_error;
+        }
+        if (rest.tokens[j].type == TOK_VAR && token_same_name(rest.tokens[j], var)) rest.tokens[j].type = TOK_PARAM;
+    }
+    if (tokens_are_command(rest) || tokens_change_memory(rest)) {
+        snprintf(output, output_len, "Sweeps can only evaluate expressions");
+        return execute_error;
+    }
+    if (!execute_refresh(rest, output, output_len, mem, repl_arena, arena)) {
+        return execute_error;
+    }
+    Statement stmt;
+    if (!statement_prepare(rest, *mem, &stmt, "Sweeps", output, output_len, arena)) {
+        return execute_error;
+    }
+    if (!stmt.is_number) {
+        snprintf(output, output_len, "Sweeps need an expression with a value, not just a unit: %s", stmt.unit);
+        return execute_error;
+    }
+
+    trace_begin(TRACE_EVALUATE, "sweep");
+    size_t n = n_points;
+    Aggregate summary;
+    ok = sweep_run(&stmt, start, step, n, sweep_default_threads(), &summary, output, output_len);
+    trace_end(TRACE_EVALUATE, "sweep");
+    if (!ok) {
+        return execute_error;
+    }
+    const char *space = stmt.unit[0] != '\0' ? " " : "";
+    snprintf(output, output_len, "%zu points: min %g%s%s, max %g%s%s, mean %g%s%s, stddev %g%s%s", n,
+             aggregate_result(summary, AGGREGATE_MIN), space, stmt.unit,
+             aggregate_result(summary, AGGREGATE_MAX), space, stmt.unit,
+             aggregate_result(summary, AGGREGATE_MEAN), space, stmt.unit,
+             aggregate_result(summary, AGGREGATE_STDDEV), space, stmt.unit);
+    return (ExecuteResult) { .unit = stmt.unit };
+}
+
+ExecuteResult execute_tokens(TokenString tokens, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    if (!tokens_are_command(tokens)) {
+        if (!execute_refresh(tokens, output, output_len, mem, repl_arena, arena)) {
+            return execute_error;
+        }
+        trace_begin(TRACE_PARSE, "parse");
+        Expression expr = parse(tokens, *mem, arena);
+        trace_end(TRACE_PARSE, "parse");
+        return execute_expr(expr, output, output_len, mem, repl_arena, arena);
+    }
+    memset(output, 0, output_len);
+    if (tokens.length == 0) {
+        return execute_ok;
+    }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_QUIT) {
+        return (ExecuteResult) { .quit = true };
+    }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_HELP) {
+        snprintf(output, output_len, "%s", help_msg);
+        return execute_ok;
+    }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_EXAMPLES) {
+        snprintf(output, output_len, "%s", examples_msg);
+        return execute_ok;
+    }
     if (tokens.length == 1 && tokens.tokens[0].type == TOK_SHOW_UNITS) {
         String units_str = show_all_builtin_units(arena);
-        if (mem->units.size > 0) {
+        String user_defined = memory_show_units(*mem, arena);
+        if (user_defined.len > 0) {
             units_str = string_concat_static(units_str, "\n", arena);
-            String user_defined = memory_show_units(*mem, arena);
             units_str = string_concat(units_str, user_defined, arena);
         }
-        memcpy(output, units_str.s, units_str.len);
-        return false;
+        snprintf(output, output_len, "%s", units_str.s);
+        return execute_ok;
     }
     if (tokens.length == 1 && tokens.tokens[0].type == TOK_MEMORY) {
         String memory_str = memory_show(*mem, arena);
-        memcpy(output, memory_str.s, memory_str.len);
-        if (memory_str.len == 0) {
-            memcpy(output, "No variables in memory", 22);
+        snprintf(output, output_len, "%s", memory_str.len > 0 ? memory_str.s : "No variables in memory");
+        return execute_ok;
+    }
+    if (tokens_are_bind(tokens)) {
+        return execute_bind(tokens, output, output_len, mem, repl_arena, arena);
+    }
+    if (tokens.tokens[0].type == TOK_SWEEP) {
+        return execute_sweep(tokens, output, output_len, mem, repl_arena, arena);
+    }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_EXPLAIN) {
+        snprintf(output, output_len, "Explanations look like: explain expression, e.g. explain 5 km + 2 mi -> m");
+        return execute_error;
+    }
+    if (tokens.tokens[0].type == TOK_EXPLAIN) {
+        TokenString rest = { .tokens = tokens.tokens + 1, .length = tokens.length - 1 };
+        if (!execute_refresh(rest, output, output_len, mem, repl_arena, arena)) {
+            return execute_error;
         }
-        return false;
+        String explanation = explain(rest, *mem, arena);
+        snprintf(output, output_len, "%s", explanation.s);
+        return execute_ok;
     }
     if (tokens.length == 2 && tokens.tokens[0].type == TOK_ADD_UNIT
         && tokens.tokens[1].type != TOK_VAR) {
         snprintf(output, output_len, "Invalid unit name: %s", token_string(tokens.tokens[1], arena).s);
-        return false;
+        return execute_error;
     }
     if (tokens.length == 2 && tokens.tokens[0].type == TOK_ADD_UNIT) {
         if (tokens.tokens[1].type == TOK_UNIT) {
             snprintf(output, output_len, "\"%s\" is already a builtin unit", token_string(tokens.tokens[1], arena).s);
-            return false;
+            return execute_error;
         }
         if (tokens.tokens[1].type != TOK_VAR) {
             snprintf(output, output_len, "Invalid unit name: %s", token_string(tokens.tokens[1], arena).s);
-            return false;
+            return execute_error;
         }
-        unsigned char *unit_name = tokens.tokens[1].var_name;
-        if (memory_contains_var(*mem, unit_name)) {
+        unsigned char *unit_name = token_name(tokens.tokens[1], arena);
+        Symbol unit = memory_lookup_token(*mem, tokens.tokens[1]);
+        if (memory_contains_var(*mem, unit)) {
             snprintf(output, output_len, "\"%s\" is already a variable", unit_name);
-        } else if (memory_contains_unit(*mem, unit_name)) {
+            return execute_error;
+        } else if (memory_contains_unit(*mem, unit)) {
             snprintf(output, output_len, "Unit already exists: %s", unit_name);
-        } else {
-            memory_add_unit(mem, unit_name, repl_arena);
-            snprintf(output, output_len, "Added unit: %s", unit_name);
+            return execute_error;
         }
-        return false;
+        String err = string_empty(arena);
+        unit = memory_intern(*mem, tokens.tokens[1].var_name, tokens.tokens[1].var_len, &err, arena);
+        if (unit == SYMBOL_NONE) {
+            snprintf(output, output_len, "%s", err.s);
+            return execute_error;
+        }
+        memory_add_unit(mem, unit, repl_arena);
+        snprintf(output, output_len, "Added unit: %s", unit_name);
+        return (ExecuteResult) { .changed_memory = true };
     }
+    assert(false);
+    return execute_error;
+}
 
-    Expression expr = parse(tokens, *mem, arena);
-    substitute_variables(&expr, *mem);
-    substitute_units(&expr, *mem, arena);
-    display_expr(0, expr, arena);
-    String err = string_empty(arena);
-    if (!check_valid_expr(expr, &err, arena)) {
-        memcpy(output, err.s, err.len);
-        return false;
-    }
+ExecuteResult execute_line_inner(const char *input, char *output, size_t output_len, Memory *mem, Arena *repl_arena, Arena *arena) {
+    return execute_tokens(tokenize(input, arena), output, output_len, mem, repl_arena, arena);
+}
 
-    unsigned char *var_name = NULL;
-    Expression value = expr;
-    if (expr.type == EXPR_SET_VAR) {
-        var_name = expr.expr.binary_expr.left->expr.var_name;
-        value = *expr.expr.binary_expr.right;
-    }
+bool execute_line(const char *input, char *output, size_t output_len, Memory *mem, Arena *repl_arena) {
+    trace_event(TRACE_EXECUTE, TRACE_BEGIN, "execute_line", input, 0);
+    Arena arena = arena_create();
+    ExecuteResult result = execute_line_inner(input, output, output_len, mem, repl_arena, &arena);
+    arena_free(&arena);
+    trace_end(TRACE_EXECUTE, "execute_line");
+    return result.quit;
+}
 
-    Unit unit = check_unit(value, *mem, &err, arena);
-    if (is_unit_unknown(unit)) {
-        memcpy(output, err.s, err.len);
-        return false;
+// `execute_line` of the `length` bytes at `input`, e.g. a line of a
+// mapped file, without copying them.
+bool execute_line_view(const char *input, size_t length, char *output, size_t output_len, Memory *mem, Arena *repl_arena) {
+    if (trace_enabled(TRACE_EXECUTE)) {
+        // Only tracing needs the line on its own
+        char line[MAX_INPUT + 1];
+        snprintf(line, sizeof(line), "%.*s", (int)(length < MAX_INPUT ? length : MAX_INPUT), input);
+        trace_event(TRACE_EXECUTE, TRACE_BEGIN, "execute_line", line, 0);
     }
+    Arena arena = arena_create();
+    ExecuteResult result = execute_tokens(tokenize_view(input, length, &arena), output, output_len, mem, repl_arena, &arena);
+    arena_free(&arena);
+    trace_end(TRACE_EXECUTE, "execute_line");
+    return result.quit;
+}
 
-    if (!expr_is_number(value.type) && expr.type != EXPR_SET_VAR) {
-        snprintf(output, output_len, "%s", display_unit(unit, arena));
-        return false;
-    } else if (!expr_is_number(value.type) && expr.type == EXPR_SET_VAR) {
-        value = expr_new_unit_full(unit, repl_arena);
-        String msg = display_var(var_name, value, false, arena);
-        memcpy(output, msg.s, msg.len);
-        memory_add_var(mem, var_name, value, repl_arena);
-        return false;
+uint32_t execute_result_flags(ExecuteResult result) {
+    return (result.error ? CALC_ERROR : 0)
+        | (result.has_value ? CALC_HAS_VALUE : 0)
+        | (result.quit ? CALC_QUIT : 0)
+        | (result.changed_memory ? CALC_CHANGED_MEMORY : 0);
+}
+
+// Execute each newline separated line of `input` in order, writing one
+// packed result per line into `results` and the output/unit strings into
+// `strings`, so a caller can execute a whole worksheet in one call.
+// Outputs are written directly into `strings` without an intermediate
+// copy. Stops early on quit or when `results` is full. Returns the
+// number of lines executed.
+size_t execute_batch(const char *input, size_t input_len, CalcBatchResult *results, size_t max_results,
+                     char *strings, size_t strings_len, Memory *mem, Arena *repl_arena) {
+    Arena arena = arena_create();
+    size_t strings_used = 0;
+    size_t n_results = 0;
+    size_t pos = 0;
+    while (pos < input_len && n_results < max_results) {
+        const char *newline = memchr(input + pos, '\n', input_len - pos);
+        size_t len = newline != NULL ? (size_t)(newline - (input + pos)) : input_len - pos;
+        // Null terminate for the tokenizer. Anything past MAX_INPUT
+        // is rejected as too long anyways.
+        char line[MAX_INPUT + 2] = {0};
+        memcpy(line, input + pos, len < MAX_INPUT + 1 ? len : MAX_INPUT + 1);
+        pos += len + 1;
+
+        CalcBatchResult *result = &results[n_results++];
+        *result = (CalcBatchResult) {0};
+        // We still execute lines whose output won't fit,
+        // so later lines see their effects on memory.
+        char overflow[MAX_OUTPUT];
+        char *output = strings + strings_used;
+        size_t output_len = MAX_OUTPUT;
+        if (strings_len - strings_used < MAX_OUTPUT) {
+            result->flags |= CALC_TRUNCATED;
+            output = overflow;
+        }
+
+        trace_event(TRACE_EXECUTE, TRACE_BEGIN, "execute_line", line, 0);
+        ExecuteResult executed = execute_line_inner(line, output, output_len, mem, repl_arena, &arena);
+        trace_end(TRACE_EXECUTE, "execute_line");
+
+        result->value = executed.value;
+        result->flags |= execute_result_flags(executed);
+        if (!(result->flags & CALC_TRUNCATED)) {
+            result->output_offset = strings_used;
+            result->output_len = strnlen(output, output_len);
+            strings_used += result->output_len + 1;
+        }
+        size_t unit_len = executed.unit != NULL ? strlen(executed.unit) : 0;
+        if (unit_len > 0 && strings_len - strings_used > unit_len) {
+            result->unit_offset = strings_used;
+            result->unit_len = unit_len;
+            memcpy(strings + strings_used, executed.unit, unit_len + 1);
+            strings_used += unit_len + 1;
+        }
+        arena_clear(&arena);
+        if (executed.quit) break;
     }
+    arena_free(&arena);
+    return n_results;
+}
 
-    double result = evaluate(value, *mem, &err, arena);
-    if (err.len > 0) {
-        memcpy(output, err.s, err.len);
+// One extra for the newline, one for a character past
+// MAX_INPUT so the tokenizer can report the line as too long.
+#define MAX_LINE (MAX_INPUT + 2)
+
+// Read the next line of `input_fd` without its newline, dropping
+// anything past MAX_LINE. Returns false at the end of the input.
+bool batch_read_line(FILE *input_fd, char line[MAX_LINE]) {
+    if (fgets(line, MAX_LINE, input_fd) == NULL) {
         return false;
     }
-    if (expr.type != EXPR_SET_VAR) {
-        snprintf(output, output_len, "%g %s", result, display_unit(unit, arena));
-        return false;
+    size_t len = strcspn(line, "\n");
+    if (line[len] != '\n') {
+        int c;
+        while ((c = fgetc(input_fd)) != '\n' && c != EOF);
     }
+    line[len] = '\0';
+    return true;
+}
 
-    value = expr_new_const_unit(result, expr_new_unit_full(unit, repl_arena),
-        repl_arena);
-    String msg = display_var(var_name, value, false, arena);
-    memcpy(output, msg.s, msg.len);
-    memory_add_var(mem, var_name, value, repl_arena);
-    return false;
+// Execute each line of `input_fd` in order, e.g. a script file,
+// printing outputs to `output_fd`. When tracing, only every
+// `trace_sample`th line is recorded so that big batches don't
+// overflow the trace buffers.
+void batch(FILE *input_fd, FILE *output_fd, size_t trace_sample) {
+    Arena repl_arena = arena_create();
+    Memory memory = memory_new(&repl_arena);
+    trace_set_thread_name("main");
+    char line[MAX_LINE];
+    size_t line_num = 0;
+    bool done = false;
+    while (!done && batch_read_line(input_fd, line)) {
+        trace_set_muted(trace_sample > 1 && line_num % trace_sample != 0);
+        line_num++;
+        char output[MAX_OUTPUT] = {0};
+        done = execute_line(line, output, sizeof(output), &memory, &repl_arena);
+        if (strnlen(output, sizeof(output)) > 0) fprintf(output_fd, "%s\n", output);
+    }
+    trace_set_muted(false);
+    memory_free(&memory);
+    arena_free(&repl_arena);
 }
 
-bool execute_line(const char *input, char *output, size_t output_len, Memory *mem, Arena *repl_arena) {
-    Arena arena = arena_create();
-    bool quit = execute_line_inner(input, output, output_len, mem, repl_arena, &arena);
-    arena_free(&arena);
-    return quit;
+// `batch` of the `size` bytes at `data`, e.g. a mapped script file,
+// tokenizing each line where it is.
+void batch_view(const char *data, size_t size, FILE *output_fd, size_t trace_sample) {
+    Arena repl_arena = arena_create();
+    Memory memory = memory_new(&repl_arena);
+    trace_set_thread_name("main");
+    size_t line_num = 0;
+    bool done = false;
+    for (const char *line = data; !done && line < data + size; ) {
+        const char *newline = memchr(line, '\n', data + size - line);
+        const char *line_end = newline != NULL ? newline : data + size;
+        trace_set_muted(trace_sample > 1 && line_num % trace_sample != 0);
+        line_num++;
+        char output[MAX_OUTPUT] = {0};
+        done = execute_line_view(line, line_end - line, output, sizeof(output), &memory, &repl_arena);
+        if (strnlen(output, sizeof(output)) > 0) fprintf(output_fd, "%s\n", output);
+        line = line_end + 1;
+    }
+    trace_set_muted(false);
+    memory_free(&memory);
+    arena_free(&repl_arena);
+}
+
+// `batch`, but when `input_fd` is a regular file that hasn't been read
+// from, it's mapped instead of read, so lines aren't copied anywhere
+// before they're tokenized.
+void batch_file(FILE *input_fd, FILE *output_fd, size_t trace_sample) {
+    int fd = fileno(input_fd);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || ftell(input_fd) != 0) {
+        batch(input_fd, output_fd, trace_sample);
+        return;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        batch(input_fd, output_fd, trace_sample);
+        return;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    batch_view(data, st.st_size, output_fd, trace_sample);
+    munmap((void *)data, st.st_size);
 }
 
 typedef enum UserInputType UserInputType;
@@ -320,7 +973,7 @@ void repl(FILE *input_fd) {
         if (input.len == 0) {
             continue;
         }
-        char output[512] = {0};
+        char output[MAX_OUTPUT] = {0};
         done = execute_line(input.data, output, sizeof(output), &memory, &repl_arena);
         if (strnlen(output, sizeof(output)) > 0) printf("%s\n", output);
 
@@ -341,6 +994,7 @@ void repl(FILE *input_fd) {
         }
         history.pos = history.len;
     }
+    memory_free(&memory);
     arena_free(&repl_arena);
 }
 
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdbool.h>
+#include "arena.c"
+#include "evaluate.c"
+#include "expression.c"
+#include "memory.c"
+#include "parse.c"
+#include "string.c"
+#include "tokenize.c"
+#include "unit.c"
+
+// `explain [expression]`: show how an expression would be evaluated
+// and how much work it takes, without changing memory.
+
+String explain_line(String s, size_t depth, Arena *arena) {
+    for (size_t i = 0; i < depth; i++) {
+        s = string_concat_static(s, "  ", arena);
+    }
+    return s;
+}
+
+String explain_node_label(Expression expr, Arena *arena) {
+    switch (expr.type) {
+        case EXPR_CONSTANT:
+            return string_new_fmt(arena, "%g", expr.expr.constant);
+        case EXPR_ARRAY:
+            return display_array_value(expr.expr.array, arena);
+        case EXPR_UNIT:
+            return string_new_fmt(arena, "unit %s", display_unit(expr.expr.unit, arena));
+        case EXPR_VAR:
+            return string_new_fmt(arena, "var %s", expr.expr.var_name);
+        case EXPR_AGGREGATE:
+            return string_new((char *)aggregate_names[expr.expr.unary_expr.aggregate], arena);
+        default:
+            return string_new((char *)display_expr_op(expr.type), arena);
+    }
+}
+
+// Describe converting a value in unit `from` to unit `to` as
+// a linear function, or an empty string if it's a no-op.
+String explain_conversion(Unit from, Unit to, Arena *arena) {
+    if (is_unit_none(from) || is_unit_unknown(from) || is_unit_unknown(to)) {
+        return string_empty(arena);
+    }
+    double offset = unit_convert(0, from, to, arena);
+    double factor = unit_convert(1, from, to, arena) - offset;
+    if (factor == 1 && offset == 0) {
+        return string_empty(arena);
+    }
+    if (offset == 0) {
+        return string_new_fmt(arena, " (convert %s -> %s: x %g)",
+            display_unit(from, arena), display_unit(to, arena), factor);
+    }
+    return string_new_fmt(arena, " (convert %s -> %s: x %g %c %g)",
+        display_unit(from, arena), display_unit(to, arena), factor,
+        offset < 0 ? '-' : '+', fabs(offset));
+}
+
+String explain_expr(String s, Expression expr, size_t depth, Memory mem, Arena *arena) {
+    s = explain_line(s, depth, arena);
+    s = string_concat(s, explain_node_label(expr, arena), arena);
+    String err = string_empty(arena);
+    Unit unit = check_unit(expr, mem, &err, arena);
+    if (!is_unit_none(unit) && expr.type != EXPR_UNIT) {
+        s = string_concat(s, string_new_fmt(arena, " [%s]", display_unit(unit, arena)), arena);
+    }
+    if (expr.type == EXPR_ADD || expr.type == EXPR_SUB || expr.type == EXPR_CONVERT) {
+        // Add/sub convert the right side into the left side's unit,
+        // convert converts the left side into the right side's unit.
+        Unit left = check_unit(*expr.expr.binary_expr.left, mem, &err, arena);
+        Unit right = check_unit(*expr.expr.binary_expr.right, mem, &err, arena);
+        String conversion = expr.type == EXPR_CONVERT
+            ? explain_conversion(left, right, arena)
+            : explain_conversion(right, left, arena);
+        s = string_concat(s, conversion, arena);
+    }
+    s = string_concat_static(s, "\n", arena);
+    if (expr.type == EXPR_NEG || expr.type == EXPR_AGGREGATE) {
+        s = explain_expr(s, *expr.expr.unary_expr.right, depth + 1, mem, arena);
+    } else if (expr_is_bin(expr.type)) {
+        s = explain_expr(s, *expr.expr.binary_expr.left, depth + 1, mem, arena);
+        s = explain_expr(s, *expr.expr.binary_expr.right, depth + 1, mem, arena);
+    }
+    return s;
+}
+
+// List variables and user-defined units referenced by `expr`
+// before substitution.
+String explain_references(String s, Expression expr, Memory mem, Arena *arena) {
+    if (expr.type == EXPR_VAR && memory_contains_var(mem, expr.expr.symbol)) {
+        s = string_concat_static(s, "  ", arena);
+        s = string_concat(s, display_var(expr.expr.var_name,
+            memory_get_var(mem, expr.expr.symbol), true, arena), arena);
+    } else if (expr.type == EXPR_VAR && memory_contains_unit(mem, expr.expr.symbol)) {
+        s = string_concat(s, string_new_fmt(arena, "  %s = user-defined unit\n",
+            expr.expr.var_name), arena);
+    } else if (expr.type == EXPR_VAR) {
+        s = string_concat(s, string_new_fmt(arena, "  %s = undefined\n",
+            expr.expr.var_name), arena);
+    } else if (expr.type == EXPR_NEG || expr.type == EXPR_AGGREGATE) {
+        s = explain_references(s, *expr.expr.unary_expr.right, mem, arena);
+    } else if (expr_is_bin(expr.type) && expr.type != EXPR_SET_VAR) {
+        s = explain_references(s, *expr.expr.binary_expr.left, mem, arena);
+        s = explain_references(s, *expr.expr.binary_expr.right, mem, arena);
+    } else if (expr.type == EXPR_SET_VAR) {
+        s = explain_references(s, *expr.expr.binary_expr.right, mem, arena);
+    }
+    return s;
+}
+
+String explain(TokenString tokens, Memory mem, Arena *arena) {
+    Expression expr = parse(tokens, mem, arena);
+    String s = string_new("Substitutions:\n", arena);
+    size_t no_substitutions_len = s.len;
+    s = explain_references(s, expr, mem, arena);
+    if (s.len == no_substitutions_len) {
+        s = string_concat_static(s, "  none\n", arena);
+    }
+
+    substitute_variables(&expr, mem, arena);
+    substitute_units(&expr, mem, arena);
+    String err = string_empty(arena);
+    if (!check_valid_expr(expr, &err, arena)) {
+        return string_concat(s, err, arena);
+    }
+    Expression value = expr;
+    if (expr.type == EXPR_SET_VAR) {
+        s = string_concat(s, string_new_fmt(arena, "Assigns to: %s\n",
+            expr.expr.binary_expr.left->expr.var_name), arena);
+        value = *expr.expr.binary_expr.right;
+    }
+
+    // Measure the same work `execute_line` would do, before
+    // we do a bunch of extra work to display the tree.
+    size_t arena_used_start = arena_used(arena);
+    eval_stats_reset();
+    Unit unit = check_unit(value, mem, &err, arena);
+    double result = 0;
+    ArrayValue elements = {0};
+    if (!is_unit_unknown(unit) && expr_is_number(value.type) && expr_has_array(value)) {
+        elements = evaluate_elements(value, mem, &err, arena);
+    } else if (!is_unit_unknown(unit) && expr_is_number(value.type)) {
+        result = evaluate(value, mem, &err, arena);
+    }
+    EvalStats stats = eval_stats;
+    size_t arena_bytes = arena_used(arena) - arena_used_start;
+
+    s = string_concat_static(s, "Plan:\n", arena);
+    s = explain_expr(s, value, 1, mem, arena);
+    if (err.len > 0) {
+        s = string_concat_static(s, "Error: ", arena);
+        s = string_concat(s, err, arena);
+        s = string_concat_static(s, "\n", arena);
+    } else if (elements.length > 0) {
+        s = string_concat(s, string_new_fmt(arena, "Result: %s %s\n",
+            display_array_value(elements, arena).s, display_unit(unit, arena)), arena);
+    } else if (expr_is_number(value.type)) {
+        s = string_concat(s, string_new_fmt(arena, "Result: %g %s\n",
+            result, display_unit(unit, arena)), arena);
+    } else {
+        s = string_concat(s, string_new_fmt(arena, "Result: %s\n",
+            display_unit(unit, arena)), arena);
+    }
+    return string_concat(s, string_new_fmt(arena,
+        "Cost: %zu nodes visited, %zu check_unit calls, %zu unit conversions, %zu arena bytes",
+        stats.nodes_visited, stats.check_unit_calls, stats.unit_conversions, arena_bytes), arena);
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.c"
+#include "expression.c"
+#include "unit.c"
+
+// An expression flattened into one contiguous array of small nodes that
+// refer to their children by index, so evaluating it is one pass over
+// memory that's next to each other.
+//
+// Children always come before their parents, and the root is last.
+// Leaves keep their payload in a side table, at the index in their
+// node's `left`: constants in `constants`, units in `units`, variables
+// in `symbols`, and their names in `var_names`, and error messages in
+// `errors`. Aggregates keep which one they are in `left`. A subtree
+// shared in the expression it was built from is only in the array once.
+// Arrays of numbers are left to the tree, so their nodes have no
+// payload.
+//
+// It's built from a tree the parser already made, only for what's
+// evaluated over and over: formulas and prepared statements. Units,
+// names and error messages in the side tables point to where the tree
+// had them, so an array only lives as long as those do, and copying it
+// means copying them too.
+
+typedef struct ExprNode ExprNode;
+struct ExprNode {
+    uint8_t type;
+    // Children, or the index into the side table for leaves.
+    // Negation's child is `right`.
+    uint32_t left;
+    uint32_t right;
+};
+
+typedef struct ExprArray ExprArray;
+struct ExprArray {
+    ExprNode *nodes;
+    uint32_t length;
+    double *constants;
+    Unit *units;
+    Symbol *symbols;
+    const unsigned char **var_names;
+    String *errors;
+};
+
+#define EXPR_ARRAY_INIT_CAPACITY 16
+
+// Growable buffers for building an array, copied into an arena once
+// they're done.
+typedef struct ExprArrayBuilder ExprArrayBuilder;
+struct ExprArrayBuilder {
+    ExprNode *nodes;
+    size_t n_nodes, nodes_capacity;
+    double *constants;
+    size_t n_constants, constants_capacity;
+    Unit *units;
+    size_t n_units, units_capacity;
+    Symbol *symbols;
+    size_t n_symbols, symbols_capacity;
+    const unsigned char **var_names;
+    size_t n_var_names, var_names_capacity;
+    String *errors;
+    size_t n_errors, errors_capacity;
+    // Nodes already in the array, by address, and their index
+    const Expression **seen;
+    uint32_t *seen_idxs;
+    size_t seen_capacity;
+};
+
+// Append `item` to `*items`, growing it if needed, and return its index.
+uint32_t expr_array_push(void **items, size_t *length, size_t *capacity, const void *item, size_t size) {
+    if (*length == *capacity) {
+        *capacity = *capacity == 0 ? EXPR_ARRAY_INIT_CAPACITY : *capacity * 2;
+        *items = realloc(*items, *capacity * size);
+        assert(*items != NULL);
+    }
+    memcpy((char *)*items + *length * size, item, size);
+    return (*length)++;
+}
+
+size_t expr_array_seen_slot(ExprArrayBuilder *builder, const Expression *node) {
+    size_t idx = ((uintptr_t)node >> 4) & (builder->seen_capacity - 1);
+    while (builder->seen[idx] != NULL && builder->seen[idx] != node) {
+        idx = (idx + 1) & (builder->seen_capacity - 1);
+    }
+    return idx;
+}
+
+void expr_array_mark_seen(ExprArrayBuilder *builder, const Expression *node, uint32_t node_idx) {
+    if ((builder->n_nodes + 1) * 2 > builder->seen_capacity) {
+        const Expression **seen = builder->seen;
+        uint32_t *seen_idxs = builder->seen_idxs;
+        size_t capacity = builder->seen_capacity;
+        builder->seen_capacity = capacity == 0 ? EXPR_ARRAY_INIT_CAPACITY * 2 : capacity * 2;
+        builder->seen = calloc(builder->seen_capacity, sizeof(Expression *));
+        builder->seen_idxs = malloc(builder->seen_capacity * sizeof(uint32_t));
+        assert(builder->seen != NULL && builder->seen_idxs != NULL);
+        for (size_t i = 0; i < capacity; i++) {
+            if (seen[i] == NULL) continue;
+            size_t slot = expr_array_seen_slot(builder, seen[i]);
+            builder->seen[slot] = seen[i];
+            builder->seen_idxs[slot] = seen_idxs[i];
+        }
+        free(seen);
+        free(seen_idxs);
+    }
+    size_t slot = expr_array_seen_slot(builder, node);
+    builder->seen[slot] = node;
+    builder->seen_idxs[slot] = node_idx;
+}
+
+uint32_t expr_array_add(ExprArrayBuilder *builder, const Expression *expr) {
+    if (builder->seen_capacity > 0) {
+        size_t slot = expr_array_seen_slot(builder, expr);
+        if (builder->seen[slot] != NULL) return builder->seen_idxs[slot];
+    }
+    ExprNode node = { .type = expr->type };
+    switch (expr->type) {
+        case EXPR_CONSTANT:
+            node.left = expr_array_push((void **)&builder->constants, &builder->n_constants,
+                &builder->constants_capacity, &expr->expr.constant, sizeof(double));
+            break;
+        case EXPR_UNIT:
+            node.left = expr_array_push((void **)&builder->units, &builder->n_units,
+                &builder->units_capacity, &expr->expr.unit, sizeof(Unit));
+            break;
+        case EXPR_VAR:
+            node.left = expr_array_push((void **)&builder->symbols, &builder->n_symbols,
+                &builder->symbols_capacity, &expr->expr.symbol, sizeof(Symbol));
+            expr_array_push((void **)&builder->var_names, &builder->n_var_names,
+                &builder->var_names_capacity, &expr->expr.var_name, sizeof(unsigned char *));
+            break;
+        case EXPR_INVALID:
+            node.left = expr_array_push((void **)&builder->errors, &builder->n_errors,
+                &builder->errors_capacity, &expr->expr.err, sizeof(String));
+            break;
+        case EXPR_ARRAY:
+            break;
+        case EXPR_NEG:
+            node.right = expr_array_add(builder, expr->expr.unary_expr.right);
+            break;
+        case EXPR_AGGREGATE:
+            node.left = expr->expr.unary_expr.aggregate;
+            node.right = expr_array_add(builder, expr->expr.unary_expr.right);
+            break;
+        case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+        case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+        case EXPR_SET_VAR: case EXPR_INT_DIV:
+            node.left = expr_array_add(builder, expr->expr.binary_expr.left);
+            node.right = expr_array_add(builder, expr->expr.binary_expr.right);
+            break;
+    }
+    uint32_t node_idx = expr_array_push((void **)&builder->nodes, &builder->n_nodes,
+        &builder->nodes_capacity, &node, sizeof(ExprNode));
+    expr_array_mark_seen(builder, expr, node_idx);
+    return node_idx;
+}
+
+void *expr_array_copy(const void *items, size_t length, size_t size, size_t align, Arena *arena) {
+    if (length == 0) return NULL;
+    void *copy = arena_alloc_aligned(arena, length * size, align);
+    memcpy(copy, items, length * size);
+    return copy;
+}
+
+// Flatten `expr` into an array allocated in `arena`. Its units, names
+// and error messages aren't copied, so they need to live as long.
+ExprArray expr_array_new(const Expression *expr, Arena *arena) {
+    ExprArrayBuilder builder = {0};
+    expr_array_add(&builder, expr);
+    ExprArray array = {
+        .nodes = expr_array_copy(builder.nodes, builder.n_nodes, sizeof(ExprNode), alignof(ExprNode), arena),
+        .length = builder.n_nodes,
+        .constants = expr_array_copy(builder.constants, builder.n_constants, sizeof(double), alignof(double), arena),
+        .units = expr_array_copy(builder.units, builder.n_units, sizeof(Unit), alignof(Unit), arena),
+        .symbols = expr_array_copy(builder.symbols, builder.n_symbols, sizeof(Symbol), alignof(Symbol), arena),
+        .var_names = expr_array_copy(builder.var_names, builder.n_var_names, sizeof(unsigned char *),
+                                     alignof(unsigned char *), arena),
+        .errors = expr_array_copy(builder.errors, builder.n_errors, sizeof(String), alignof(String), arena),
+    };
+    free(builder.nodes);
+    free(builder.constants);
+    free(builder.units);
+    free(builder.symbols);
+    free(builder.var_names);
+    free(builder.errors);
+    free(builder.seen);
+    free(builder.seen_idxs);
+    return array;
+}
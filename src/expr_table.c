@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.c"
+#include "expression.c"
+#include "string.c"
+#include "unit.c"
+
+// Hash-consed expression nodes: every distinct subtree is stored once,
+// so equal subtrees are the same pointer. That makes comparing trees
+// O(1), and means each distinct subtree is only in a formula's
+// `ExprArray` once.
+//
+// Nodes are compared by their own payload and the addresses of their
+// children, which are already unique. Unit ids of user defined units
+// are only unique within a memory, so a table belongs to one.
+
+#define EXPR_TABLE_INIT_CAPACITY 64
+
+typedef struct ExprTable ExprTable;
+struct ExprTable {
+    const Expression **slots;
+    size_t capacity;
+    size_t size;
+};
+
+ExprTable *expr_table_new(Arena *arena) {
+    ExprTable *table = arena_alloc_aligned(arena, sizeof(ExprTable), alignof(ExprTable));
+    table->capacity = EXPR_TABLE_INIT_CAPACITY;
+    table->size = 0;
+    table->slots = arena_alloc_aligned(arena, table->capacity * sizeof(Expression *), alignof(Expression *));
+    memset(table->slots, 0, table->capacity * sizeof(Expression *));
+    return table;
+}
+
+uint64_t expr_hash_mix(uint64_t hash, uint64_t value) {
+    // FNV-1a over whole words
+    return (hash ^ value) * 0x100000001b3;
+}
+
+uint64_t expr_node_hash(Expression node) {
+    uint64_t hash = expr_hash_mix(0xcbf29ce484222325, node.type);
+    uint64_t bits = 0;
+    switch (node.type) {
+        case EXPR_CONSTANT:
+            memcpy(&bits, &node.expr.constant, sizeof(bits));
+            return expr_hash_mix(hash, bits);
+        case EXPR_ARRAY:
+            for (size_t i = 0; i < node.expr.array.length; i++) {
+                memcpy(&bits, &node.expr.array.values[i], sizeof(bits));
+                hash = expr_hash_mix(hash, bits);
+            }
+            return hash;
+        case EXPR_UNIT:
+            for (size_t i = 0; i < node.expr.unit.length; i++) {
+                hash = expr_hash_mix(hash, node.expr.unit.types[i].type);
+                hash = expr_hash_mix(hash, (uint64_t)node.expr.unit.degrees[i]);
+            }
+            return hash;
+        case EXPR_VAR:
+            if (node.expr.symbol != SYMBOL_NONE) return expr_hash_mix(hash, node.expr.symbol);
+            // Names that were never stored have no symbol
+            for (const unsigned char *c = node.expr.var_name; *c != '\0'; c++) hash = expr_hash_mix(hash, *c);
+            return hash;
+        case EXPR_NEG:
+            return expr_hash_mix(hash, (uintptr_t)node.expr.unary_expr.right);
+        case EXPR_AGGREGATE:
+            hash = expr_hash_mix(hash, node.expr.unary_expr.aggregate);
+            return expr_hash_mix(hash, (uintptr_t)node.expr.unary_expr.right);
+        case EXPR_INVALID:
+            return hash;
+        case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+        case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+        case EXPR_SET_VAR: case EXPR_INT_DIV:
+            hash = expr_hash_mix(hash, (uintptr_t)node.expr.binary_expr.left);
+            return expr_hash_mix(hash, (uintptr_t)node.expr.binary_expr.right);
+    }
+    return hash;
+}
+
+// Whether `a` and `b` are the same node, given unique children.
+bool expr_node_equal(Expression a, Expression b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case EXPR_CONSTANT:
+            return memcmp(&a.expr.constant, &b.expr.constant, sizeof(double)) == 0;
+        case EXPR_ARRAY:
+            return array_values_identical(a.expr.array, b.expr.array);
+        case EXPR_UNIT:
+            return units_identical(a.expr.unit, b.expr.unit);
+        case EXPR_VAR:
+            if (a.expr.symbol != SYMBOL_NONE || b.expr.symbol != SYMBOL_NONE) return a.expr.symbol == b.expr.symbol;
+            return strcmp((const char *)a.expr.var_name, (const char *)b.expr.var_name) == 0;
+        case EXPR_NEG:
+            return a.expr.unary_expr.right == b.expr.unary_expr.right;
+        case EXPR_AGGREGATE:
+            return a.expr.unary_expr.aggregate == b.expr.unary_expr.aggregate
+                && a.expr.unary_expr.right == b.expr.unary_expr.right;
+        case EXPR_INVALID:
+            return false;
+        case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+        case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+        case EXPR_SET_VAR: case EXPR_INT_DIV:
+            return a.expr.binary_expr.left == b.expr.binary_expr.left
+                && a.expr.binary_expr.right == b.expr.binary_expr.right;
+    }
+    return false;
+}
+
+void expr_table_resize(ExprTable *table, Arena *arena) {
+    size_t capacity = table->capacity * 2;
+    const Expression **slots = arena_alloc_aligned(arena, capacity * sizeof(Expression *), alignof(Expression *));
+    memset(slots, 0, capacity * sizeof(Expression *));
+    for (size_t i = 0; i < table->capacity; i++) {
+        const Expression *node = table->slots[i];
+        if (node == NULL) continue;
+        size_t idx = expr_node_hash(*node) & (capacity - 1);
+        while (slots[idx] != NULL) idx = (idx + 1) & (capacity - 1);
+        slots[idx] = node;
+    }
+    table->slots = slots;
+    table->capacity = capacity;
+}
+
+// The node in `table` equal to `node`, whose children must already be
+// in `table`, adding a copy allocated in `arena` if there isn't one.
+// Invalid nodes are never shared.
+const Expression *expr_table_intern(ExprTable *table, Expression node, Arena *arena) {
+    if (node.type != EXPR_INVALID) {
+        uint64_t hash = expr_node_hash(node);
+        size_t idx = hash & (table->capacity - 1);
+        while (table->slots[idx] != NULL) {
+            if (expr_node_equal(*table->slots[idx], node)) return table->slots[idx];
+            idx = (idx + 1) & (table->capacity - 1);
+        }
+    }
+    Expression *copy = arena_alloc_aligned(arena, sizeof(Expression), alignof(Expression));
+    *copy = node;
+    if (node.type == EXPR_UNIT) {
+        copy->expr.unit = unit_copy(node.expr.unit, arena);
+    } else if (node.type == EXPR_ARRAY) {
+        copy->expr.array = array_value_copy(node.expr.array, arena);
+    } else if (node.type == EXPR_VAR && node.expr.symbol == SYMBOL_NONE) {
+        // Only interned names live as long as memory
+        size_t len = strlen((const char *)node.expr.var_name) + 1;
+        unsigned char *var_name = arena_alloc(arena, len);
+        memcpy(var_name, node.expr.var_name, len);
+        copy->expr.var_name = var_name;
+    } else if (node.type == EXPR_INVALID) {
+        copy->expr.err = string_new(node.expr.err.s, arena);
+    }
+    if (node.type == EXPR_INVALID) return copy;
+    if ((table->size + 1) * 10 > table->capacity * 7) {
+        expr_table_resize(table, arena);
+    }
+    size_t idx = expr_node_hash(*copy) & (table->capacity - 1);
+    while (table->slots[idx] != NULL) idx = (idx + 1) & (table->capacity - 1);
+    table->slots[idx] = copy;
+    table->size++;
+    return copy;
+}
+
+// `expr` with every subtree replaced by the one in `table`, adding the
+// ones that aren't there yet.
+const Expression *expr_table_share(ExprTable *table, Expression expr, Arena *arena) {
+    if (expr.type == EXPR_NEG || expr.type == EXPR_AGGREGATE) {
+        expr.expr.unary_expr.right = (Expression *)expr_table_share(table, *expr.expr.unary_expr.right, arena);
+    } else if (expr_is_bin(expr.type)) {
+        expr.expr.binary_expr.left = (Expression *)expr_table_share(table, *expr.expr.binary_expr.left, arena);
+        expr.expr.binary_expr.right = (Expression *)expr_table_share(table, *expr.expr.binary_expr.right, arena);
+    }
+    return expr_table_intern(table, expr, arena);
+}
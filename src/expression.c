@@ -2,9 +2,11 @@
 
 #include <stdbool.h>
 #include "arena.c"
+#include "array_value.c"
 #include "tokenize.c"
 #include "unit.c"
 #include "string.c"
+#include "symbol.c"
 
 typedef struct Expression Expression;
 typedef struct Constant Constant;
@@ -18,6 +20,8 @@ struct Constant {
 
 struct UnaryExpr {
     Expression *right;
+    // Which one, for EXPR_AGGREGATE
+    AggregateType aggregate;
 };
 
 struct BinaryExpr {
@@ -27,8 +31,11 @@ struct BinaryExpr {
 
 typedef enum {
     EXPR_CONSTANT,
+    EXPR_ARRAY,
     EXPR_UNIT,
     EXPR_NEG,
+    // Reduces an array to one number, e.g. `sum(x)`
+    EXPR_AGGREGATE,
     EXPR_CONST_UNIT,
     EXPR_COMP_UNIT,
     EXPR_DIV_UNIT,
@@ -46,7 +53,13 @@ typedef enum {
 
 typedef union {
     double constant;
-    unsigned char *var_name;
+    ArrayValue array;
+    // What memory stores the variable under, or SYMBOL_NONE if nothing
+    // ever was stored under `var_name`
+    struct {
+        const unsigned char *var_name;
+        Symbol symbol;
+    };
     Unit unit;
     UnaryExpr unary_expr;
     BinaryExpr binary_expr;
@@ -58,17 +71,20 @@ struct Expression {
     ExprData expr;
 };
 
-Expression expr_new_var(unsigned char *var_name, Arena *arena) {
-    size_t name_len = strnlen((char *)var_name, MAX_INPUT) + 1;
-    Expression expr = { .type = EXPR_VAR, .expr = { .var_name = arena_alloc(arena, name_len) }};
-    memcpy(expr.expr.var_name, var_name, name_len);
-    return expr;
+// `var_name` has to live as long as the expression.
+Expression expr_new_var(const unsigned char *var_name, Symbol symbol) {
+    return (Expression) { .type = EXPR_VAR, .expr = { .var_name = var_name, .symbol = symbol }};
 }
 
 Expression expr_new_const(double value) {
     return (Expression) { .type = EXPR_CONSTANT, .expr = { .constant = value }};
 }
 
+// Its numbers are shared, not copied.
+Expression expr_new_array(ArrayValue array) {
+    return (Expression) { .type = EXPR_ARRAY, .expr = { .array = array }};
+}
+
 Expression expr_new_unit_full(Unit unit, Arena *arena) {
     // Duplicate to avoid mismatched unit x expression lifetime
     Unit unit_dup = unit_new(unit.types, unit.degrees, unit.length, arena);
@@ -89,6 +105,13 @@ Expression expr_new_neg(Expression right_value, Arena *arena) {
     return (Expression) { .type = EXPR_NEG, .expr = { .unary_expr = { .right = right }}};
 }
 
+Expression expr_new_aggregate(AggregateType aggregate, Expression right_value, Arena *arena) {
+    Expression expr = expr_new_neg(right_value, arena);
+    expr.type = EXPR_AGGREGATE;
+    expr.expr.unary_expr.aggregate = aggregate;
+    return expr;
+}
+
 Expression expr_new_bin(ExprType type, Expression left_value, Expression right_value, Arena *arena) {
     Expression *left = arena_alloc(arena, sizeof(Expression));
     Expression *right = arena_alloc(arena, sizeof(Expression));
@@ -115,8 +138,8 @@ Expression expr_new_invalid(String err) {
 
 bool expr_is_bin(ExprType type) {
     switch (type) {
-        case EXPR_CONSTANT: case EXPR_UNIT: case EXPR_NEG: case EXPR_VAR:
-        case EXPR_INVALID:
+        case EXPR_CONSTANT: case EXPR_ARRAY: case EXPR_UNIT: case EXPR_NEG: case EXPR_AGGREGATE:
+        case EXPR_VAR: case EXPR_INVALID:
             return false;
         case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_DIV_UNIT:
         case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_DIV: case EXPR_INT_DIV:
@@ -129,8 +152,8 @@ bool expr_is_unit(ExprType type) {
     switch (type) {
         case EXPR_UNIT: case EXPR_COMP_UNIT: case EXPR_POW: case EXPR_DIV_UNIT:
             return true;
-        case EXPR_CONSTANT: case EXPR_NEG: case EXPR_CONST_UNIT: case EXPR_VAR:
-        case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_INT_DIV:
+        case EXPR_CONSTANT: case EXPR_ARRAY: case EXPR_NEG: case EXPR_AGGREGATE: case EXPR_CONST_UNIT:
+        case EXPR_VAR: case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_INT_DIV:
         case EXPR_DIV: case EXPR_CONVERT: case EXPR_SET_VAR:
         case EXPR_INVALID:
             return false;
@@ -139,7 +162,7 @@ bool expr_is_unit(ExprType type) {
 
 bool expr_is_number(ExprType type) {
     switch (type) {
-        case EXPR_CONSTANT: case EXPR_NEG: case EXPR_CONST_UNIT:
+        case EXPR_CONSTANT: case EXPR_ARRAY: case EXPR_NEG: case EXPR_AGGREGATE: case EXPR_CONST_UNIT:
         case EXPR_ADD: case EXPR_SUB: case EXPR_MUL:
         case EXPR_DIV: case EXPR_INT_DIV: case EXPR_CONVERT:
             return true;
@@ -150,6 +173,17 @@ bool expr_is_number(ExprType type) {
     }
 }
 
+// Whether there's an array in `expr` that isn't reduced to a number.
+bool expr_has_array(Expression expr) {
+    if (expr.type == EXPR_ARRAY) return true;
+    if (expr.type == EXPR_AGGREGATE) return false;
+    if (expr.type == EXPR_NEG) return expr_has_array(*expr.expr.unary_expr.right);
+    if (expr_is_bin(expr.type)) {
+        return expr_has_array(*expr.expr.binary_expr.left) || expr_has_array(*expr.expr.binary_expr.right);
+    }
+    return false;
+}
+
 #define EXPR_OP_MAX 13
 
 const char *display_expr_op(ExprType type) {
@@ -167,7 +201,9 @@ const char *display_expr_op(ExprType type) {
         case EXPR_CONST_UNIT: return "const x unit";
         case EXPR_COMP_UNIT: return "unit x unit";
         case EXPR_NEG: return "negation";
+        case EXPR_AGGREGATE: return "aggregate";
         case EXPR_CONSTANT: return "const";
+        case EXPR_ARRAY: return "array";
         case EXPR_UNIT: return "unit";
         case EXPR_INVALID: return "invalid";
     }
@@ -182,6 +218,8 @@ void display_expr(size_t offset, Expression expr, Arena *arena) {
     // TODO: reuse display_expr_op here
     if (expr.type == EXPR_CONSTANT) {
         debug("%lf\n", expr.expr.constant);
+    } else if (expr.type == EXPR_ARRAY) {
+        debug("array of %zu\n", expr.expr.array.length);
     } else if (expr.type == EXPR_UNIT) {
         debug("%s\n", display_unit(expr.expr.unit, arena));
     } else if (expr.type == EXPR_VAR) {
@@ -189,6 +227,9 @@ void display_expr(size_t offset, Expression expr, Arena *arena) {
     } else if (expr.type == EXPR_NEG) {
         debug("neg\n");
         display_expr(offset + 1, *expr.expr.unary_expr.right, arena);
+    } else if (expr.type == EXPR_AGGREGATE) {
+        debug("%s\n", aggregate_names[expr.expr.unary_expr.aggregate]);
+        display_expr(offset + 1, *expr.expr.unary_expr.right, arena);
     } else if (expr.type == EXPR_INVALID) {
         debug("invalid: %s\n", expr.expr.err.s);
     } else {
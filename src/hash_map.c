@@ -16,6 +16,15 @@ size_t djb2_hash(const unsigned char *key, size_t capacity) {
     return hash & (capacity - 1);
 }
 
+// The same hash as `djb2_hash` of the first `len` bytes of `key`.
+size_t djb2_hash_len(const unsigned char *key, size_t len, size_t capacity) {
+    size_t hash = 5381;
+    for (size_t i = 0; i < len; i++){
+        hash = ((hash << 5) + hash) + key[i];
+    }
+    return hash & (capacity - 1);
+}
+
 typedef struct KeyValue KeyValue;
 struct KeyValue {
     const unsigned char *key;
@@ -111,7 +120,12 @@ bool hash_map_contains(HashMap map, const unsigned char *key) {
     size_t init_idx = djb2_hash(key, map.capacity);
     size_t idx = init_idx;
     for (size_t i = 0; i < map.capacity; i++) {
-        if (map.exists[idx] && strcmp((char *)map.items[idx].key, (char *)key) == 0) {
+        // Nothing is ever removed and inserts take the first
+        // empty slot, so `key` can't be past an empty one.
+        if (!map.exists[idx]) {
+            return false;
+        }
+        if (strcmp((char *)map.items[idx].key, (char *)key) == 0) {
             return true;
         }
         idx = (idx + 1) & (map.capacity - 1);
@@ -123,7 +137,10 @@ void *hash_map_get(HashMap map, const unsigned char *key) {
     size_t init_idx = djb2_hash(key, map.capacity);
     size_t idx = init_idx;
     for (size_t i = 0; i < map.capacity; i++) {
-        if (map.exists[idx] && strcmp((char *)map.items[idx].key, (char *)key) == 0) {
+        if (!map.exists[idx]) {
+            return NULL;
+        }
+        if (strcmp((char *)map.items[idx].key, (char *)key) == 0) {
             return map.items[idx].value;
         }
         idx = (idx + 1) & (map.capacity - 1);
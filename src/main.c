@@ -1,19 +1,82 @@
 
 #include <stdio.h>
+#include <unistd.h>
+#include "convert_csv.c"
 #include "execute.c"
+#include "options.c"
+#include "pipeline.c"
+#include "scheduler.c"
+#include "server.c"
+#include "stream.c"
+#include "watch.c"
+
+const char usage_msg[] = "Usage: %s [options] [--] [input in quotes]\n\
+Options:\n\
+  -f FILE               Execute each line of FILE (- for stdin)\n\
+  --trace=FILE          Write a Chrome trace (chrome://tracing, Perfetto) to FILE\n\
+  --trace-sample=N      Only trace every Nth line of a file\n\
+  --pipeline            Tokenize, parse and evaluate lines of a file on separate threads\n\
+  --parallel            Execute lines of a file that don't depend on each other in parallel\n\
+  --watch               Execute FILE again when it's saved, only redoing lines whose inputs changed\n\
+  --window=SIZE         Summarize FILE's `timestamp value unit` lines over the last SIZE lines, or time, e.g. 5min\n\
+  --convert-csv=C:F:T   Write CSV FILE with column C (a name or number from 1) converted from F to T, e.g. speed:km/h:m/s\n\
+  --serve=PATH          Serve sessions on the Unix socket PATH until interrupted\n\
+  --workers=N           Number of worker threads when serving, or with --parallel or --convert-csv (default: one per core)\n";
 
 int main(int argc, char **argv) {
-    if (argc == 1) {
-        repl(stdin);
-    } else if (argc == 2) {
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    Options options = { .trace_sample = 1, .n_workers = n_cores > 0 ? (size_t)n_cores : 1 };
+    if (!options_parse(argc, argv, &options)) {
+        printf(usage_msg, argv[0]);
+        return 1;
+    }
+    if (options.trace_path != NULL) {
+        FILE *trace_file = fopen(options.trace_path, "w");
+        if (trace_file == NULL) {
+            printf("Could not open trace file: %s\n", options.trace_path);
+            return 1;
+        }
+        trace_set_all(true);
+        trace_start(trace_file, TRACE_FORMAT_CHROME);
+    } else {
+        trace_init_from_env();
+    }
+
+    int status = 0;
+    if (options.socket_path != NULL) {
+        status = serve(options.socket_path, options.n_workers);
+    } else if (options.conversion_spec != NULL) {
+        status = convert_csv(options.script_path, options.conversion_spec, options.n_workers, stdout);
+    } else if (options.watching) {
+        status = watch(options.script_path, stdout);
+    } else if (options.script_path != NULL) {
+        FILE *script = strcmp(options.script_path, "-") == 0 ? stdin : fopen(options.script_path, "r");
+        if (script == NULL) {
+            printf("Could not open file: %s\n", options.script_path);
+            trace_shutdown();
+            return 1;
+        }
+        if (options.window_spec != NULL) {
+            status = stream(script, stdout, options.window_spec);
+        } else if (options.parallel) {
+            batch_parallel(script, stdout, options.n_workers, options.trace_sample);
+        } else if (options.pipelined) {
+            batch_pipelined(script, stdout, options.trace_sample);
+        } else {
+            batch_file(script, stdout, options.trace_sample);
+        }
+        if (script != stdin) fclose(script);
+    } else if (options.input != NULL) {
         Arena arena = arena_create();
         Memory memory = memory_new(&arena);
-        char output[512] = {0};
-        execute_line(argv[1], output, sizeof(output), &memory, &arena);
+        char output[MAX_OUTPUT] = {0};
+        execute_line(options.input, output, sizeof(output), &memory, &arena);
         if (strnlen(output, sizeof(output)) > 0) printf("%s\n", output);
+        memory_free(&memory);
         arena_free(&arena);
     } else {
-        printf("Usage: %s [input in quotes]\n", argv[0]);
+        repl(stdin);
     }
-    return 0;
+    trace_shutdown();
+    return status;
 }
@@ -1,115 +1,480 @@
 #pragma once
 
+#include <stdalign.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "debug.c"
+#include "expr_array.c"
+#include "expr_table.c"
 #include "expression.c"
-#include "hash_map.c"
 #include "string.c"
+#include "symbol.c"
+#include "symbol_map.c"
+#include "tokenize.c"
 #include "unit.c"
 
 // Structures for tracking user defined things
 // we want to track between different executions.
 
+// What a variable holds, already worked out: a number with a unit,
+// e.g. `x = 3 km`, an array of them, e.g. `x = [1, 2] km`, or just a
+// unit, e.g. `x = km`. Reading a variable while evaluating is one
+// lookup by its symbol, with nothing to walk.
+typedef struct MemoryValue MemoryValue;
+struct MemoryValue {
+    double value; // 0 when it's just a unit or an array
+    ArrayValue array; // Empty unless it's an array
+    Unit unit;
+    bool is_number;
+};
+
+// A number with `unit`, which is duplicated into `arena`.
+MemoryValue memory_value_number(double value, Unit unit, Arena *arena) {
+    Unit unit_dup = unit_new(unit.types, unit.degrees, unit.length, arena);
+    return (MemoryValue) { .value = value, .unit = unit_dup, .is_number = true };
+}
+
+// `array` with `unit`, which are both duplicated into `arena`.
+MemoryValue memory_value_array(ArrayValue array, Unit unit, Arena *arena) {
+    MemoryValue value = memory_value_number(0, unit, arena);
+    value.array = array_value_copy(array, arena);
+    return value;
+}
+
+// Just `unit`, which is duplicated into `arena`.
+MemoryValue memory_value_unit(Unit unit, Arena *arena) {
+    Unit unit_dup = unit_new(unit.types, unit.degrees, unit.length, arena);
+    return (MemoryValue) { .unit = unit_dup, .is_number = false };
+}
+
+// `value` as an expression, for substituting it into one, with nodes
+// allocated in `arena`. Its unit and array are shared, not copied.
+Expression memory_value_expr(MemoryValue value, Arena *arena) {
+    Expression unit = { .type = EXPR_UNIT, .expr = { .unit = value.unit }};
+    if (value.array.length > 0) {
+        return expr_new_bin(EXPR_CONST_UNIT, expr_new_array(value.array), unit, arena);
+    }
+    return value.is_number ? expr_new_const_unit(value.value, unit, arena) : unit;
+}
+
+// A variable whose value is recomputed from an expression when anything
+// it refers to changes, e.g. `y := x * 3 km`. Changing x only marks y,
+// and whatever refers to y, dirty. They're recomputed when a line reads
+// them, so a change costs as much as what depends on it, once.
+typedef struct Formula Formula;
+struct Formula {
+    // NULL once the variable is assigned normally
+    TokenString tokens;
+    // The symbol of each of `tokens` that's a variable, or SYMBOL_NONE
+    const Symbol *symbols;
+    // `tokens` parsed with units substituted and constant parts folded,
+    // so recomputing only evaluates what depends on variables, in
+    // `Memory.exprs`. What it parses to depends on what its variables
+    // are, so it's only valid while `token_classify` gives `classes`
+    // for each token.
+    const Expression *compiled;
+    const uint8_t *classes;
+    // `compiled` flattened, which is what's evaluated
+    ExprArray program;
+    // For showing the formula, e.g. "x * 3 km"
+    const char *source;
+    // Something it refers to changed since it was computed. Then so
+    // has something everything that refers to it refers to, so they're
+    // all dirty too.
+    bool dirty;
+    // Why computing it failed, or NULL
+    const char *error;
+};
+
+// Names of formulas that refer to a variable, newest first. Can include
+// formulas that have been redefined since and don't anymore.
+typedef struct MemoryDependent MemoryDependent;
+struct MemoryDependent {
+    Symbol symbol;
+    MemoryDependent *next;
+};
+
 typedef struct Memory Memory;
 struct Memory {
-    HashMap vars; // string -> Expression
-    HashMap units; // string -> int
+    // Names of everything stored in memory, see `symbol.c`
+    SymbolTable *symbols;
+    SymbolMap *vars; // symbol -> MemoryValue
+    SymbolMap *units; // symbol -> int
+    SymbolMap *formulas; // symbol -> Formula
+    SymbolMap *dependents; // symbol -> MemoryDependent *
+    // What formulas compile to, shared between them. Only written when
+    // defining a formula, which nothing else runs alongside.
+    ExprTable *exprs;
+    // Reads see everything written up to and including `version`, and
+    // each write is tagged with the next one. Copies of a memory share
+    // its names, variables and units, so one writer can keep changing
+    // memory while other copies keep reading the version they started
+    // with.
+    uint64_t version;
 };
 
+// Memory that stores what's put in it in `arena`. Has to be freed with
+// `memory_free`, as well as the arena.
 Memory memory_new(Arena *arena) {
     return (Memory) {
-        .vars = hash_map_new(sizeof(Expression), arena),
-        .units = hash_map_new(sizeof(int), arena),
+        .symbols = symbol_table_new(),
+        .vars = symbol_map_new(sizeof(MemoryValue), arena),
+        .units = symbol_map_new(sizeof(int), arena),
+        .formulas = symbol_map_new(sizeof(Formula), arena),
+        .dependents = symbol_map_new(sizeof(MemoryDependent *), arena),
+        .exprs = expr_table_new(arena),
+        .version = 0,
     };
 }
 
-bool memory_contains_unit(Memory mem, unsigned char *unit_name) {
-    debug("Checking for unit: %s\n", unit_name);
-    for (size_t i = 0; i < mem.units.capacity; i++) {
-        if (mem.units.exists[i]) {
-            debug("Key: %s\n", mem.units.items[i].key);
-        }
+// Frees what `memory_new` didn't allocate in the arena, for every copy
+// of `mem`.
+void memory_free(Memory *mem) {
+    symbol_table_free(mem->symbols);
+    mem->symbols = NULL;
+}
+
+// The symbol something named by the `len` bytes at `name` is stored
+// under, or SYMBOL_NONE if nothing ever was.
+Symbol memory_lookup(Memory mem, const unsigned char *name, size_t len) {
+    return symbol_lookup_len(mem.symbols, name, len);
+}
+
+const char memory_full_msg[] = "Too many names, a session can have at most %d";
+
+// The symbol to store something named by the `len` bytes at `name`
+// under. If there's no room for another name, returns SYMBOL_NONE and
+// says so in `err`.
+Symbol memory_intern(Memory mem, const unsigned char *name, size_t len, String *err, Arena *arena) {
+    Symbol symbol = symbol_intern_len(mem.symbols, name, len);
+    if (symbol == SYMBOL_NONE) {
+        *err = string_new_fmt(arena, memory_full_msg, SYMBOL_MAX_NAMES);
     }
-    bool result = hash_map_contains(mem.units, unit_name);
-    debug("found unit: %d\n", result);
+    return symbol;
+}
+
+// The symbol of the variable `token` names, if anything's stored under it.
+Symbol memory_lookup_token(Memory mem, Token token) {
+    return memory_lookup(mem, token.var_name, token.var_len);
+}
+
+const unsigned char *memory_name(Memory mem, Symbol symbol) {
+    return symbol_name(mem.symbols, symbol);
+}
+
+bool memory_contains_unit(Memory mem, Symbol unit) {
+    if (unit == SYMBOL_NONE) return false;
+    bool result = symbol_map_contains(mem.units, unit, mem.version);
+    debug("Checking for unit: %s found: %d\n", memory_name(mem, unit), result);
+    trace_instant(TRACE_MEMORY, "contains_unit", (char *)memory_name(mem, unit), result);
     return result;
 }
 
-void memory_add_unit(Memory *mem, unsigned char *unit_name, Arena *arena) {
-    assert(!memory_contains_unit(*mem, unit_name));
-    int unit_type = unit_type_user_min() + mem->units.size;
-    hash_map_insert(&mem->units, unit_name, (void *)&unit_type, arena);
+void memory_add_unit(Memory *mem, Symbol unit, Arena *arena) {
+    assert(!memory_contains_unit(*mem, unit));
+    int unit_type = unit_type_user_min() + symbol_map_size(mem->units);
+    trace_instant(TRACE_MEMORY, "add_unit", (char *)memory_name(*mem, unit), unit_type);
+    mem->version++;
+    symbol_map_insert(mem->units, unit, (void *)&unit_type, mem->version, arena);
 }
 
-const UnitBasic memory_get_unit(Memory mem, unsigned char *unit_name) {
-    assert(hash_map_contains(mem.units, (unsigned char *)unit_name));
-    int unit_type = *(int *)hash_map_get(mem.units, (unsigned char *)unit_name);
-    return (UnitBasic) { .type = unit_type, .name = (char *)unit_name };
+const UnitBasic memory_get_unit(Memory mem, Symbol unit) {
+    assert(memory_contains_unit(mem, unit));
+    int unit_type = *(int *)symbol_map_get(mem.units, unit, mem.version);
+    return (UnitBasic) { .type = unit_type, .name = (char *)memory_name(mem, unit) };
 }
 
-void memory_add_var(Memory *mem, unsigned char *var_name, Expression value, Arena *arena) {
-    hash_map_insert(&mem->vars, var_name, (void *)&value, arena);
+// The formula `var` is defined by, or NULL if it's a regular variable.
+const Formula *memory_get_formula(Memory mem, Symbol var) {
+    Formula *formula = symbol_map_get(mem.formulas, var, mem.version);
+    return formula != NULL && formula->tokens.tokens != NULL ? formula : NULL;
 }
 
-bool memory_contains_var(Memory mem, unsigned char *var_name) {
-    debug("Checking for var: %s\n", var_name);
-    for (size_t i = 0; i < mem.vars.capacity; i++) {
-        if (mem.vars.exists[i]) {
-            debug("Key: %s\n", mem.vars.items[i].key);
+bool formula_refers_to(const Formula *formula, Symbol var) {
+    for (size_t i = 0; i < formula->tokens.length; i++) {
+        if (formula->symbols[i] == var) return true;
+    }
+    return false;
+}
+
+void memory_put_formula(Memory *mem, Symbol var, Formula formula, Arena *arena) {
+    mem->version++;
+    symbol_map_insert(mem->formulas, var, (void *)&formula, mem->version, arena);
+}
+
+void memory_put_var(Memory *mem, Symbol var, MemoryValue value, Arena *arena) {
+    mem->version++;
+    symbol_map_insert(mem->vars, var, (void *)&value, mem->version, arena);
+}
+
+// Mark whatever refers to `var` dirty, since it changed.
+void memory_mark_dependents(Memory *mem, Symbol var, Arena *arena) {
+    MemoryDependent **dependents = symbol_map_get(mem->dependents, var, mem->version);
+    for (MemoryDependent *dep = dependents != NULL ? *dependents : NULL; dep != NULL; dep = dep->next) {
+        const Formula *formula = memory_get_formula(*mem, dep->symbol);
+        // If it's already dirty, so is everything depending on it
+        if (formula == NULL || formula->dirty || !formula_refers_to(formula, var)) continue;
+        trace_instant(TRACE_MEMORY, "mark_dirty", (char *)memory_name(*mem, dep->symbol), 0);
+        Formula dirty = *formula;
+        dirty.dirty = true;
+        dirty.error = NULL;
+        memory_put_formula(mem, dep->symbol, dirty, arena);
+        memory_mark_dependents(mem, dep->symbol, arena);
+    }
+}
+
+void memory_add_var(Memory *mem, Symbol var, MemoryValue value, Arena *arena) {
+    trace_instant(TRACE_MEMORY, "add_var", (char *)memory_name(*mem, var), 0);
+    if (memory_get_formula(*mem, var) != NULL) {
+        memory_put_formula(mem, var, (Formula) {0}, arena);
+    }
+    memory_put_var(mem, var, value, arena);
+    memory_mark_dependents(mem, var, arena);
+}
+
+// Define `var` by the formula `tokens`, whose current value is `value`.
+// `symbols` has the symbol of each token that's a variable, and lives
+// in `arena`.
+void memory_add_formula(Memory *mem, Symbol var, TokenString tokens, const Symbol *symbols,
+                        const Expression *compiled, const uint8_t *classes, MemoryValue value, Arena *arena) {
+    trace_instant(TRACE_MEMORY, "add_formula", (char *)memory_name(*mem, var), 0);
+    Formula formula = {
+        .tokens = tokens_copy(tokens, arena),
+        .symbols = symbols,
+        .compiled = compiled,
+        .classes = classes,
+        .program = expr_array_new(compiled, arena),
+        .source = tokens_display(tokens, arena).s,
+    };
+    memory_put_formula(mem, var, formula, arena);
+    memory_put_var(mem, var, value, arena);
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        Symbol refers_to = symbols[i];
+        MemoryDependent **dependents = symbol_map_get(mem->dependents, refers_to, mem->version);
+        MemoryDependent *head = dependents != NULL ? *dependents : NULL;
+        bool found = false;
+        for (MemoryDependent *dep = head; dep != NULL && !found; dep = dep->next) {
+            found = dep->symbol == var;
         }
+        if (found) continue;
+        MemoryDependent *dep = arena_alloc_aligned(arena, sizeof(MemoryDependent), alignof(MemoryDependent));
+        *dep = (MemoryDependent) {
+            .symbol = var,
+            .next = head,
+        };
+        mem->version++;
+        symbol_map_insert(mem->dependents, refers_to, (void *)&dep, mem->version, arena);
+    }
+    memory_mark_dependents(mem, var, arena);
+}
+
+// Copy of `s` in `arena`, or NULL if it's NULL.
+const char *memory_copy_string(const char *s, Arena *arena) {
+    if (s == NULL) return NULL;
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+// Store what a dirty formula computed to now, or the error
+// it ran into if `value` is NULL. Doesn't mark dependents
+// dirty, since they have been since the formula was.
+void memory_update_formula(Memory *mem, Symbol var, const MemoryValue *value,
+                           const char *error, Arena *arena) {
+    trace_instant(TRACE_MEMORY, "update_formula", (char *)memory_name(*mem, var), value != NULL);
+    Formula formula = *memory_get_formula(*mem, var);
+    formula.dirty = false;
+    formula.error = NULL;
+    if (value != NULL) {
+        memory_put_var(mem, var, *value, arena);
+    } else {
+        formula.error = memory_copy_string(error, arena);
     }
-    bool result = hash_map_contains(mem.vars, (unsigned char *)var_name);
-    debug("found var: %d\n", result);
+    memory_put_formula(mem, var, formula, arena);
+}
+
+// Whether every formula `tokens` refers to is up to date and has a value.
+bool memory_formulas_ready(Memory mem, TokenString tokens) {
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        const Formula *formula = memory_get_formula(mem, memory_lookup_token(mem, tokens.tokens[i]));
+        if (formula != NULL && (formula->dirty || formula->error != NULL)) return false;
+    }
+    return true;
+}
+
+bool memory_contains_var(Memory mem, Symbol var) {
+    if (var == SYMBOL_NONE) return false;
+    bool result = symbol_map_contains(mem.vars, var, mem.version);
+    debug("Checking for var: %s found: %d\n", memory_name(mem, var), result);
+    trace_instant(TRACE_MEMORY, "contains_var", (char *)memory_name(mem, var), result);
     return result;
 }
 
-const Expression memory_get_var(Memory mem, unsigned char *var_name) {
-    assert(hash_map_contains(mem.vars, var_name));
-    return *(Expression *)hash_map_get(mem.vars, var_name);
+// What `var` holds, or NULL if it isn't defined.
+const MemoryValue *memory_find_var(Memory mem, Symbol var) {
+    return symbol_map_get(mem.vars, var, mem.version);
+}
+
+const MemoryValue memory_get_var(Memory mem, Symbol var) {
+    MemoryValue *value = symbol_map_get(mem.vars, var, mem.version);
+    assert(value != NULL);
+    return *value;
 }
 
-String display_var(const unsigned char *var_name, const Expression value, bool newline, Arena *arena) {
-    if (value.type == EXPR_CONST_UNIT) {
-        double constant = value.expr.binary_expr.left->expr.constant;
-        Unit unit = value.expr.binary_expr.right->expr.unit;
-        return string_new_fmt(arena, "%s = %g%s%s%s", var_name, constant, is_unit_none(unit) ? "" : " ", display_unit(unit, arena), newline ? "\n" : "");
-    } else if (value.type == EXPR_UNIT) {
-        Unit unit = value.expr.unit;
-        return string_new_fmt(arena, "%s = %s%s", var_name, display_unit(unit, arena), newline ? "\n" : "");
+String display_var(const unsigned char *var_name, const MemoryValue value, bool newline, Arena *arena) {
+    if (value.array.length > 0) {
+        return string_new_fmt(arena, "%s = %s%s%s%s", var_name, display_array_value(value.array, arena).s,
+                              is_unit_none(value.unit) ? "" : " ", display_unit(value.unit, arena),
+                              newline ? "\n" : "");
     }
-    assert(false);
-    return string_empty(arena);
+    if (value.is_number) {
+        return string_new_fmt(arena, "%s = %g%s%s%s", var_name, value.value, is_unit_none(value.unit) ? "" : " ",
+                              display_unit(value.unit, arena), newline ? "\n" : "");
+    }
+    return string_new_fmt(arena, "%s = %s%s", var_name, display_unit(value.unit, arena), newline ? "\n" : "");
+}
+
+// Copy of a variable's stored value in `arena`, that doesn't refer to
+// memory it came from, e.g. to store it in another.
+MemoryValue memory_copy_value(const MemoryValue value, Arena *arena) {
+    MemoryValue copy = value;
+    copy.unit = unit_copy(value.unit, arena);
+    if (value.array.length > 0) copy.array = array_value_copy(value.array, arena);
+    return copy;
 }
 
-// Show all the variables in memory
+// Copy of a formula in `arena`, with its compiled expression in `exprs`.
+Formula memory_copy_formula(Formula formula, ExprTable *exprs, Arena *arena) {
+    Formula copy = formula;
+    copy.error = memory_copy_string(formula.error, arena);
+    if (formula.tokens.tokens == NULL) return copy;
+    size_t length = formula.tokens.length;
+    Symbol *symbols = arena_alloc_aligned(arena, length * sizeof(Symbol), alignof(Symbol));
+    memcpy(symbols, formula.symbols, length * sizeof(Symbol));
+    uint8_t *classes = arena_alloc(arena, length);
+    memcpy(classes, formula.classes, length);
+    copy.tokens = tokens_copy(formula.tokens, arena);
+    copy.symbols = symbols;
+    copy.classes = classes;
+    copy.compiled = expr_table_share(exprs, *formula.compiled, arena);
+    copy.program = expr_array_new(copy.compiled, arena);
+    copy.source = memory_copy_string(formula.source, arena);
+    return copy;
+}
+
+// What `mem` holds as of its version, copied into new maps in `arena`
+// without the older values `mem` keeps for readers of older versions.
+// The copy shares `mem`'s names, and keeps when each variable was first
+// defined, so `memory_show` lists them in the same order. Once nothing
+// reads `mem` anymore, what it was written to can be freed, so a memory
+// that's compacted whenever its arena doubles only ever holds about
+// twice what's current, however many times it's been written.
+Memory memory_compact(Memory mem, Arena *arena) {
+    Memory copy = {
+        .symbols = mem.symbols,
+        .vars = symbol_map_new(sizeof(MemoryValue), arena),
+        .units = symbol_map_new(sizeof(int), arena),
+        .formulas = symbol_map_new(sizeof(Formula), arena),
+        .dependents = symbol_map_new(sizeof(MemoryDependent *), arena),
+        .exprs = expr_table_new(arena),
+        .version = mem.version,
+    };
+    SymbolIter iter = symbol_map_iter(mem.vars, mem.version);
+    while (symbol_map_iter_next(&iter)) {
+        MemoryValue value = memory_copy_value(*(MemoryValue *)iter.value, arena);
+        symbol_map_insert_first(copy.vars, iter.symbol, (void *)&value, mem.version, iter.first_version, arena);
+    }
+    iter = symbol_map_iter(mem.units, mem.version);
+    while (symbol_map_iter_next(&iter)) {
+        symbol_map_insert_first(copy.units, iter.symbol, iter.value, mem.version, iter.first_version, arena);
+    }
+    iter = symbol_map_iter(mem.formulas, mem.version);
+    while (symbol_map_iter_next(&iter)) {
+        Formula formula = memory_copy_formula(*(Formula *)iter.value, copy.exprs, arena);
+        symbol_map_insert_first(copy.formulas, iter.symbol, (void *)&formula, mem.version, iter.first_version, arena);
+    }
+    iter = symbol_map_iter(mem.dependents, mem.version);
+    while (symbol_map_iter_next(&iter)) {
+        MemoryDependent *head = NULL;
+        MemoryDependent **tail = &head;
+        for (MemoryDependent *dep = *(MemoryDependent **)iter.value; dep != NULL; dep = dep->next) {
+            *tail = arena_alloc_aligned(arena, sizeof(MemoryDependent), alignof(MemoryDependent));
+            **tail = (MemoryDependent) { .symbol = dep->symbol, .next = NULL };
+            tail = &(*tail)->next;
+        }
+        symbol_map_insert_first(copy.dependents, iter.symbol, (void *)&head, mem.version, iter.first_version, arena);
+    }
+    return copy;
+}
+
+// Whether two stored values are exactly the same.
+bool memory_values_identical(const MemoryValue a, const MemoryValue b) {
+    return a.is_number == b.is_number && a.value == b.value && array_values_identical(a.array, b.array)
+        && units_identical(a.unit, b.unit);
+}
+
+typedef struct MemoryShowVar MemoryShowVar;
+struct MemoryShowVar {
+    Symbol symbol;
+    MemoryValue value;
+    uint64_t first_version;
+};
+
+int memory_show_var_compare(const void *a, const void *b) {
+    uint64_t x = ((const MemoryShowVar *)a)->first_version;
+    uint64_t y = ((const MemoryShowVar *)b)->first_version;
+    return (x > y) - (x < y);
+}
+
+// Show all the variables in memory, in the order they were first
+// defined. Where they are in the map depends on the order they were
+// inserted in, which isn't the same from run to run when lines that
+// define them run in parallel.
 String memory_show(Memory mem, Arena *arena) {
+    size_t capacity = symbol_map_size(mem.vars);
+    MemoryShowVar *vars = arena_alloc_aligned(arena, (capacity > 0 ? capacity : 1) * sizeof(MemoryShowVar),
+                                              alignof(MemoryShowVar));
+    size_t n_vars = 0;
+    SymbolIter iter = symbol_map_iter(mem.vars, mem.version);
+    // Symbols inserted since `capacity` was read aren't visible at our version
+    while (n_vars < capacity && symbol_map_iter_next(&iter)) {
+        vars[n_vars++] = (MemoryShowVar) {
+            .symbol = iter.symbol,
+            .value = *(MemoryValue *)iter.value,
+            .first_version = iter.first_version,
+        };
+    }
+    qsort(vars, n_vars, sizeof(MemoryShowVar), memory_show_var_compare);
+
     String s = string_empty(arena);
-    size_t seen = 0;
-    for (size_t i = 0; i < mem.vars.capacity; i++) {
-        if (mem.vars.exists[i]) {
-            KeyValue item = mem.vars.items[i];
-            String line = display_var(item.key, *(Expression *)item.value, seen < mem.vars.size - 1, arena);
-            debug("Memory show: %s\n", line.s);
-            s = string_concat(s, line, arena);
-            seen += 1;
+    for (size_t i = 0; i < n_vars; i++) {
+        if (s.len > 0) {
+            s = string_concat_static(s, "\n", arena);
         }
+        const Formula *formula = memory_get_formula(mem, vars[i].symbol);
+        const unsigned char *name = memory_name(mem, vars[i].symbol);
+        String line = formula != NULL
+            ? string_new_fmt(arena, "%s := %s", name, formula->source)
+            : display_var(name, vars[i].value, false, arena);
+        debug("Memory show: %s\n", line.s);
+        s = string_concat(s, line, arena);
     }
     return s;
 }
 
+// Empty if there are no user-defined units
 String memory_show_units(Memory mem, Arena *arena) {
     String s = string_new("User-defined: ", arena);
-    bool first = true;
-    for (size_t i = 0; i < mem.units.capacity; i++) {
-        if (mem.units.exists[i]) {
-            if (first) {
-                first = false;
-            } else {
-                s = string_concat_static(s, ", ", arena);
-            }
-            KeyValue item = mem.units.items[i];
-            s = string_concat_static(s, (char *)item.key, arena);
+    size_t no_units_len = s.len;
+    SymbolIter iter = symbol_map_iter(mem.units, mem.version);
+    while (symbol_map_iter_next(&iter)) {
+        if (s.len > no_units_len) {
+            s = string_concat_static(s, ", ", arena);
         }
+        s = string_concat_static(s, (char *)memory_name(mem, iter.symbol), arena);
     }
-    return s;
+    return s.len > no_units_len ? s : string_empty(arena);
 }
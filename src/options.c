@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Command line options for `main`.
+typedef struct Options Options;
+struct Options {
+    const char *input;
+    const char *script_path;
+    const char *trace_path;
+    size_t trace_sample;
+    bool pipelined;
+    bool parallel;
+    bool watching;
+    const char *socket_path;
+    const char *window_spec;
+    const char *conversion_spec;
+    size_t n_workers;
+};
+
+// Read `argv` into `options`, which start out as their defaults.
+// Anything that isn't an option is the input, even if it starts with a
+// `-`, like `-3 + 2`, and everything after `--` is too. Returns false
+// if they don't make sense, for the usage to be shown.
+bool options_parse(int argc, char **argv, Options *options) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--") == 0 && i + 2 == argc && options->input == NULL) {
+            options->input = argv[++i];
+        } else if (strcmp(arg, "-f") == 0) {
+            if (i + 1 == argc) return false;
+            options->script_path = argv[++i];
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            options->trace_path = arg + 8;
+        } else if (sscanf(arg, "--trace-sample=%zu", &options->trace_sample) == 1 && options->trace_sample > 0) {
+            continue;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            options->pipelined = true;
+        } else if (strcmp(arg, "--parallel") == 0) {
+            options->parallel = true;
+        } else if (strcmp(arg, "--watch") == 0) {
+            options->watching = true;
+        } else if (strncmp(arg, "--window=", 9) == 0 && arg[9] != '\0') {
+            options->window_spec = arg + 9;
+        } else if (strncmp(arg, "--convert-csv=", 14) == 0 && arg[14] != '\0') {
+            options->conversion_spec = arg + 14;
+        } else if (strncmp(arg, "--serve=", 8) == 0 && arg[8] != '\0') {
+            options->socket_path = arg + 8;
+        } else if (sscanf(arg, "--workers=%zu", &options->n_workers) == 1 && options->n_workers > 0) {
+            continue;
+        } else if (options->input == NULL && strncmp(arg, "--", 2) != 0) {
+            options->input = arg;
+        } else {
+            return false;
+        }
+    }
+    if (options->watching && (options->script_path == NULL || strcmp(options->script_path, "-") == 0)) return false;
+    if ((options->conversion_spec != NULL || options->window_spec != NULL) && options->script_path == NULL) return false;
+    return true;
+}
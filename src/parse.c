@@ -14,8 +14,11 @@ bool is_bin_op(TokenType type) {
         case TOK_EQUALS:
             return true;
         case TOK_END: case TOK_INVALID: case TOK_QUIT: case TOK_HELP:
-        case TOK_NUM: case TOK_VAR: case TOK_WHITESPACE: case TOK_UNIT:
+        case TOK_NUM: case TOK_ARRAY: case TOK_AGGREGATE: case TOK_LPAREN: case TOK_RPAREN:
+        case TOK_VAR: case TOK_PARAM: case TOK_WHITESPACE: case TOK_UNIT:
         case TOK_MEMORY: case TOK_SHOW_UNITS: case TOK_EXAMPLES: case TOK_ADD_UNIT:
+        case TOK_EXPLAIN: case TOK_BIND: case TOK_SWEEP: case TOK_STEP: case TOK_RANGE:
+        case TOK_COLON:
             return false;
     }
 }
@@ -30,10 +33,11 @@ int precedence(TokenType op, size_t idx, bool prev_is_bin_op, bool curr_is_num,
     if (op == TOK_DIV && !next_is_unit) return 7;
     if (op == TOK_INT_DIV) return 7;
     if (op == TOK_SUB && !prev_is_bin_op) return 6; // Normal negation
+    if (op == TOK_AGGREGATE && idx == 0) return 6;
     // This function will only be called when we are checking
     // for tokens with length > 1, so this signals a constant
     // with something after it.
-    if (op == TOK_NUM && idx == 0) return 5;
+    if ((op == TOK_NUM || op == TOK_ARRAY) && idx == 0) return 5;
     if (op == TOK_VAR && idx == 0 && curr_is_num) return 5;
     if (op == TOK_DIV) return 4;
     if (op == TOK_UNIT && idx != 0) return 3;
@@ -49,7 +53,7 @@ bool left_associative(TokenType op, size_t idx, bool prev_is_bin_op, bool curr_i
     if (op == TOK_ADD) return true;
     if (op == TOK_SUB && idx != 0 && !prev_is_bin_op) return true;
     if (op == TOK_MUL || op == TOK_DIV || op == TOK_INT_DIV) return true;
-    if (op == TOK_NUM) return false;
+    if (op == TOK_NUM || op == TOK_ARRAY) return false;
     if (op == TOK_UNIT && idx != 0) return true;
     if (op == TOK_VAR && idx != 0 && curr_is_unit) return true;
     if (op == TOK_CARET) return true;
@@ -57,19 +61,37 @@ bool left_associative(TokenType op, size_t idx, bool prev_is_bin_op, bool curr_i
 }
 
 bool token_is_num(Token token, Memory mem) {
-    return token.type == TOK_NUM ||
-        (token.type == TOK_VAR &&
-        memory_contains_var(mem, token.var_name) &&
-        expr_is_number(memory_get_var(mem, token.var_name).type));
+    if (token.type == TOK_NUM || token.type == TOK_ARRAY) return true;
+    if (token.type != TOK_VAR) return false;
+    Symbol var = memory_lookup_token(mem, token);
+    return memory_contains_var(mem, var) && memory_get_var(mem, var).is_number;
 }
 
 bool token_is_unit(Token token, Memory mem) {
-    return token.type == TOK_UNIT ||
-        (token.type == TOK_VAR &&
-        memory_contains_var(mem, token.var_name) &&
-        expr_is_unit(memory_get_var(mem, token.var_name).type)) ||
-        (token.type == TOK_VAR &&
-        memory_contains_unit(mem, token.var_name));
+    if (token.type == TOK_UNIT) return true;
+    if (token.type != TOK_VAR) return false;
+    Symbol var = memory_lookup_token(mem, token);
+    return (memory_contains_var(mem, var) && !memory_get_var(mem, var).is_number)
+        || memory_contains_unit(mem, var);
+}
+
+// Everything about memory that parsing a token depends on, so a parse
+// can be reused while what this returns for each token stays the same.
+uint8_t token_classify(Token token, Memory mem) {
+    if (token.type != TOK_VAR) return 0;
+    return (token_is_num(token, mem) ? 1 : 0) | (token_is_unit(token, mem) ? 2 : 0);
+}
+
+// Whether `tokens` from `start` to the end are in one pair of
+// parentheses.
+bool parse_parenthesized(TokenString tokens, size_t start) {
+    if (start + 1 >= tokens.length || tokens.tokens[start].type != TOK_LPAREN) return false;
+    size_t depth = 0;
+    for (size_t i = start; i < tokens.length; i++) {
+        if (tokens.tokens[i].type == TOK_LPAREN) depth++;
+        if (tokens.tokens[i].type == TOK_RPAREN && --depth == 0) return i == tokens.length - 1;
+    }
+    return false;
 }
 
 // Only time this should return EXPR_INVALID
@@ -93,9 +115,22 @@ Expression parse(TokenString tokens, Memory mem, Arena *arena) {
         debug("constant\n");
         return expr_new_const(tokens.tokens[0].number);
     }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_ARRAY) {
+        debug("array\n");
+        return expr_new_array(tokens.tokens[0].array);
+    }
     if (tokens.length == 1 && tokens.tokens[0].type == TOK_VAR) {
         debug("variable\n");
-        return expr_new_var(tokens.tokens[0].var_name, arena);
+        Symbol var = memory_lookup_token(mem, tokens.tokens[0]);
+        // Names that were never stored aren't interned
+        const unsigned char *var_name = var != SYMBOL_NONE
+            ? memory_name(mem, var) : token_name(tokens.tokens[0], arena);
+        return expr_new_var(var_name, var);
+    }
+    if (tokens.length == 1 && tokens.tokens[0].type == TOK_PARAM) {
+        return expr_new_invalid(string_new_fmt(arena,
+            "Placeholders only work in prepared statements: ?%.*s",
+            (int)tokens.tokens[0].var_len, tokens.tokens[0].var_name));
     }
     if (tokens.length == 1) {
         String err_msg = string_new_fmt(arena,
@@ -105,10 +140,16 @@ Expression parse(TokenString tokens, Memory mem, Arena *arena) {
         return expr_new_invalid(err_msg);
     }
 
-    // Find the thing we should parse next
+    // Find the thing we should parse next, outside of parentheses
     size_t op_idx = 0;
     int best_precedence = 0;
+    size_t depth = 0;
     for (size_t i = 0; i < tokens.length; i++) {
+        TokenType type = tokens.tokens[i].type;
+        if (type == TOK_RPAREN && depth > 0) depth--;
+        bool nested = depth > 0 || type == TOK_LPAREN || type == TOK_RPAREN;
+        if (type == TOK_LPAREN) depth++;
+        if (nested) continue;
         bool prev_is_bin_op = i == 0 ? false : is_bin_op(tokens.tokens[i - 1].type);
         bool curr_is_num = token_is_num(tokens.tokens[i], mem);
         bool curr_is_unit = token_is_unit(tokens.tokens[i], mem);
@@ -125,6 +166,16 @@ Expression parse(TokenString tokens, Memory mem, Arena *arena) {
     }
     TokenType op = tokens.tokens[op_idx].type;
 
+    if (op == TOK_AGGREGATE && op_idx == 0) {
+        AggregateType aggregate = tokens.tokens[0].aggregate;
+        if (!parse_parenthesized(tokens, 1)) {
+            return expr_new_invalid(string_new_fmt(arena,
+                "Aggregates look like: %s(expression)", aggregate_names[aggregate]));
+        }
+        TokenString inner_tokens = { .tokens = tokens.tokens + 2, .length = tokens.length - 3 };
+        return expr_new_aggregate(aggregate, parse(inner_tokens, mem, arena), arena);
+    }
+
     if (op == TOK_SUB && op_idx == 0) {
         TokenString right_tokens = (TokenString) { .tokens = tokens.tokens + 1, .length = tokens.length - 1};
         Expression right = parse(right_tokens, mem, arena);
@@ -146,7 +197,7 @@ Expression parse(TokenString tokens, Memory mem, Arena *arena) {
         type = EXPR_DIV_UNIT;
     } else if (op == TOK_INT_DIV) {
         type = EXPR_INT_DIV;
-    } else if (op == TOK_NUM || (op == TOK_VAR && token_is_num(tokens.tokens[op_idx], mem))) {
+    } else if (op == TOK_NUM || op == TOK_ARRAY || (op == TOK_VAR && token_is_num(tokens.tokens[op_idx], mem))) {
         type = EXPR_CONST_UNIT;
     } else if (op == TOK_UNIT || (op == TOK_VAR && token_is_unit(tokens.tokens[op_idx], mem))) {
         type = EXPR_COMP_UNIT;
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "arena.c"
+#include "execute.c"
+#include "memory.c"
+#include "parse.c"
+#include "tokenize.c"
+
+// Execute a stream of lines on three threads at once: the caller reads
+// and tokenizes, a second thread parses, and a third evaluates and
+// prints, handing lines along through bounded single producer/single
+// consumer queues. Output and memory end up exactly as if the lines
+// were executed one by one.
+//
+// Parsing depends on memory, e.g. `2 x` parses differently if x is a
+// number or a unit, so the parse stage can run ahead of assignments it
+// hasn't seen the effect of yet. It parses against the latest version
+// the evaluate stage has published, and records how it classified each
+// variable. The evaluate stage checks those against memory as of the
+// line before, and parses the line again itself if any changed, which
+// only happens when an earlier line in flight changed what kind of
+// thing a name is.
+
+// Lines in flight, a power of two
+#define PIPELINE_DEPTH 64
+// Spins before yielding, and yields before sleeping, see `backoff`
+#define PIPELINE_SPINS 64
+#define PIPELINE_YIELDS 64
+#define PIPELINE_SLEEP_NS 50000
+
+// Lock-free queue for exactly one pushing and one popping thread.
+typedef struct SpscQueue SpscQueue;
+struct SpscQueue {
+    // Next slot to pop, only written by the consumer
+    alignas(64) _Atomic size_t head;
+    // Next slot to push, only written by the producer
+    alignas(64) _Atomic size_t tail;
+    void *slots[PIPELINE_DEPTH];
+};
+
+// Returns false if the queue is full.
+bool spsc_push(SpscQueue *queue, void *item) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == PIPELINE_DEPTH) {
+        return false;
+    }
+    queue->slots[tail & (PIPELINE_DEPTH - 1)] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Returns NULL if the queue is empty.
+void *spsc_pop(SpscQueue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return NULL;
+    }
+    void *item = queue->slots[head & (PIPELINE_DEPTH - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+// Wait a little before the `attempt`th retry of something another thread
+// has to do first. Backs off from spinning to sleeping, so idle threads
+// don't burn a core waiting on e.g. slow input.
+void backoff(size_t attempt) {
+    if (attempt < PIPELINE_SPINS) return;
+    if (attempt < PIPELINE_SPINS + PIPELINE_YIELDS) {
+        sched_yield();
+    } else {
+        nanosleep(&(struct timespec) { .tv_nsec = PIPELINE_SLEEP_NS }, NULL);
+    }
+}
+
+// Pop, waiting until there's something to pop.
+void *spsc_pop_wait(SpscQueue *queue) {
+    for (size_t i = 0; true; i++) {
+        void *item = spsc_pop(queue);
+        if (item != NULL) return item;
+        backoff(i);
+    }
+}
+
+typedef struct PipelineLine PipelineLine;
+struct PipelineLine {
+    // Everything for this line, cleared when the line is recycled
+    Arena arena;
+    size_t line_num;
+    // Marks the end of the input, nothing else is set
+    bool eof;
+    char input[MAX_LINE];
+    TokenString tokens;
+    // Set if the parse stage parsed `expr`, i.e. the line isn't a command
+    bool parsed;
+    Expression expr;
+    // How the parse stage classified each token, see `token_classify`
+    uint8_t *classes;
+};
+
+typedef struct Pipeline Pipeline;
+struct Pipeline {
+    // Read -> parse -> evaluate, and evaluate -> read to recycle lines.
+    // Each holds every line, so pushes never fail.
+    SpscQueue tokenized;
+    SpscQueue parsed;
+    SpscQueue free;
+    // Never written once the stages start: the evaluate stage works on
+    // its own copy, and the parse stage reads it as of `version`.
+    Memory memory;
+    Arena repl_arena;
+    _Atomic uint64_t version;
+    _Atomic bool quit;
+    FILE *output_fd;
+    size_t trace_sample;
+    // Lines the evaluate stage had to parse again
+    size_t reparsed;
+    PipelineLine lines[PIPELINE_DEPTH];
+};
+
+void pipeline_mute(Pipeline *pipeline, PipelineLine *line) {
+    trace_set_muted(pipeline->trace_sample > 1 && line->line_num % pipeline->trace_sample != 0);
+}
+
+void *pipeline_parse_stage(void *pipeline_opaque) {
+    Pipeline *pipeline = (Pipeline *)pipeline_opaque;
+    trace_set_thread_name("parse");
+    while (true) {
+        PipelineLine *line = spsc_pop_wait(&pipeline->tokenized);
+        // The line belongs to the next stage once it's pushed
+        bool eof = line->eof;
+        if (!eof && !tokens_are_command(line->tokens)) {
+            pipeline_mute(pipeline, line);
+            Memory snapshot = pipeline->memory;
+            snapshot.version = atomic_load(&pipeline->version);
+            line->classes = arena_alloc(&line->arena, line->tokens.length);
+            for (size_t i = 0; i < line->tokens.length; i++) {
+                line->classes[i] = token_classify(line->tokens.tokens[i], snapshot);
+            }
+            trace_begin(TRACE_PARSE, "parse");
+            line->expr = parse(line->tokens, snapshot, &line->arena);
+            trace_end(TRACE_PARSE, "parse");
+            line->parsed = true;
+        }
+        assert(spsc_push(&pipeline->parsed, line));
+        if (eof) return NULL;
+    }
+}
+
+// Whether the parse stage saw memory the same way it is now.
+bool pipeline_parse_valid(PipelineLine *line, Memory mem) {
+    for (size_t i = 0; i < line->tokens.length; i++) {
+        if (line->classes[i] != token_classify(line->tokens.tokens[i], mem)) return false;
+    }
+    return true;
+}
+
+void *pipeline_evaluate_stage(void *pipeline_opaque) {
+    Pipeline *pipeline = (Pipeline *)pipeline_opaque;
+    trace_set_thread_name("evaluate");
+    Memory mem = pipeline->memory;
+    while (true) {
+        PipelineLine *line = spsc_pop_wait(&pipeline->parsed);
+        if (line->eof) return NULL;
+        // Lines after a quit were read before the reader noticed
+        if (!atomic_load(&pipeline->quit)) {
+            pipeline_mute(pipeline, line);
+            trace_event(TRACE_EXECUTE, TRACE_BEGIN, "execute_line", line->input, 0);
+            char output[MAX_OUTPUT] = {0};
+            ExecuteResult result;
+            // Formulas that need recomputing are recomputed before parsing
+            if (line->parsed && memory_formulas_ready(mem, line->tokens) && pipeline_parse_valid(line, mem)) {
+                result = execute_expr(line->expr, output, sizeof(output), &mem,
+                                      &pipeline->repl_arena, &line->arena);
+            } else {
+                pipeline->reparsed += line->parsed;
+                result = execute_tokens(line->tokens, output, sizeof(output), &mem,
+                                        &pipeline->repl_arena, &line->arena);
+            }
+            trace_end(TRACE_EXECUTE, "execute_line");
+            atomic_store(&pipeline->version, mem.version);
+            if (strnlen(output, sizeof(output)) > 0) fprintf(pipeline->output_fd, "%s\n", output);
+            if (result.quit) atomic_store(&pipeline->quit, true);
+        }
+        arena_clear(&line->arena);
+        assert(spsc_push(&pipeline->free, line));
+    }
+}
+
+// Like `batch`, but pipelined across three threads.
+// Returns how many lines had to be parsed again.
+size_t batch_pipelined(FILE *input_fd, FILE *output_fd, size_t trace_sample) {
+    Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+    assert(pipeline != NULL);
+    pipeline->repl_arena = arena_create();
+    pipeline->memory = memory_new(&pipeline->repl_arena);
+    atomic_init(&pipeline->version, pipeline->memory.version);
+    pipeline->output_fd = output_fd;
+    pipeline->trace_sample = trace_sample;
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+        pipeline->lines[i].arena = arena_create();
+        assert(spsc_push(&pipeline->free, &pipeline->lines[i]));
+    }
+    pthread_t parse_thread;
+    pthread_t evaluate_thread;
+    assert(pthread_create(&parse_thread, NULL, pipeline_parse_stage, pipeline) == 0);
+    assert(pthread_create(&evaluate_thread, NULL, pipeline_evaluate_stage, pipeline) == 0);
+
+    trace_set_thread_name("tokenize");
+    size_t line_num = 0;
+    while (true) {
+        PipelineLine *line = spsc_pop_wait(&pipeline->free);
+        *line = (PipelineLine) { .arena = line->arena, .line_num = line_num++ };
+        if (atomic_load(&pipeline->quit) || !batch_read_line(input_fd, line->input)) {
+            line->eof = true;
+            assert(spsc_push(&pipeline->tokenized, line));
+            break;
+        }
+        pipeline_mute(pipeline, line);
+        line->tokens = tokenize(line->input, &line->arena);
+        assert(spsc_push(&pipeline->tokenized, line));
+    }
+    trace_set_muted(false);
+
+    pthread_join(parse_thread, NULL);
+    pthread_join(evaluate_thread, NULL);
+    size_t reparsed = pipeline->reparsed;
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+        arena_free(&pipeline->lines[i].arena);
+    }
+    memory_free(&pipeline->memory);
+    arena_free(&pipeline->repl_arena);
+    free(pipeline);
+    return reparsed;
+}
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.c"
+#include "execute.c"
+#include "memory.c"
+#include "pipeline.c"
+#include "symbol.c"
+#include "tokenize.c"
+#include "work_deque.c"
+
+// Execute a script's lines in parallel where they don't depend on each
+// other, with the same output and memory as executing them in order.
+//
+// Memory is versioned, so any line can run against memory exactly as it
+// was after the line before it: line i reads as of the starting version
+// plus i, and tags what it writes with the version after that. Lines
+// later in the script never see what it reads being overwritten, so the
+// only orderings that matter are reading or overwriting a variable after
+// the line that last assigned it. Commands that look at or change all of
+// memory, assignments too odd to tell the target of without parsing, and
+// lines that touch formulas or what they refer to, since those can change
+// any number of variables, wait for everything before them, and
+// everything after waits for them. Versions after a barrier count on from
+// wherever it left off.
+//
+// Lines whose dependencies are done go on the deque of the worker that
+// finished the last one, and idle workers steal from each other. The
+// caller prints outputs in order as lines finish.
+
+typedef struct ScheduleLine ScheduleLine;
+struct ScheduleLine {
+    TokenString tokens;
+    // Lines this one depends on that haven't finished yet
+    _Atomic size_t pending;
+    // This line's dependents are `successors[successors_start..successors_end]`
+    size_t successors_start;
+    size_t successors_end;
+    // The barrier before this line, or SIZE_MAX
+    size_t barrier;
+    // Version of memory after this line, set before `done`
+    uint64_t end_version;
+    // NULL if there wasn't any, set before `done`
+    const char *output;
+    _Atomic bool done;
+};
+
+typedef struct Schedule Schedule;
+
+typedef struct ScheduleWorker ScheduleWorker;
+struct ScheduleWorker {
+    Schedule *schedule;
+    pthread_t thread;
+    WorkDeque deque;
+    // For what this worker stores in memory, lives as long as the memory
+    Arena repl_arena;
+    // Outputs, until the schedule is freed
+    Arena output_arena;
+    // Everything else, cleared after each line
+    Arena scratch;
+    // Where to start looking for work to steal
+    size_t steal_from;
+};
+
+struct Schedule {
+    ScheduleLine *lines;
+    size_t n_lines;
+    size_t *successors;
+    // Memory before the first line. Lines read and write it at their
+    // own versions, so this copy never changes.
+    Memory memory;
+    _Atomic size_t remaining;
+    ScheduleWorker *workers;
+    size_t n_workers;
+    size_t trace_sample;
+};
+
+// The names in a script, as symbols of a table of their own, since
+// nothing's stored under them yet, and what's known about each so far.
+typedef struct ScheduleNames ScheduleNames;
+struct ScheduleNames {
+    SymbolTable *symbols;
+    // Indexed by symbol, with room for `capacity`
+    // Whether it's a formula or something a formula refers to
+    bool *reactive;
+    // The line that last assigned it, or SIZE_MAX
+    size_t *last_assigned;
+    size_t capacity;
+    // Set once a name didn't fit, after which everything's a barrier
+    bool full;
+};
+
+ScheduleNames schedule_names_new(void) {
+    return (ScheduleNames) { .symbols = symbol_table_new() };
+}
+
+void schedule_names_free(ScheduleNames *names) {
+    symbol_table_free(names->symbols);
+    free(names->reactive);
+    free(names->last_assigned);
+}
+
+// The symbol of the variable `token`, adding it if it's new, or
+// SYMBOL_NONE if there's no room for it.
+Symbol schedule_name(ScheduleNames *names, Token token) {
+    Symbol symbol = symbol_intern_len(names->symbols, token.var_name, token.var_len);
+    if (symbol == SYMBOL_NONE) {
+        names->full = true;
+        return symbol;
+    }
+    if (symbol >= names->capacity) {
+        size_t capacity = names->capacity == 0 ? 64 : names->capacity * 2;
+        while (capacity <= symbol) capacity *= 2;
+        names->reactive = realloc(names->reactive, capacity * sizeof(bool));
+        names->last_assigned = realloc(names->last_assigned, capacity * sizeof(size_t));
+        assert(names->reactive != NULL && names->last_assigned != NULL);
+        for (size_t i = names->capacity; i < capacity; i++) {
+            names->reactive[i] = false;
+            names->last_assigned[i] = SIZE_MAX;
+        }
+        names->capacity = capacity;
+    }
+    return symbol;
+}
+
+// Add every variable in `tokens`, and if they're a formula, remember
+// they're reactive.
+void schedule_add_names(ScheduleNames *names, TokenString tokens) {
+    bool is_bind = tokens_are_bind(tokens);
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        Symbol symbol = schedule_name(names, tokens.tokens[i]);
+        if (symbol != SYMBOL_NONE && is_bind) names->reactive[symbol] = true;
+    }
+}
+
+// Lines that wait for everything before them, and that everything after
+// waits for. Other commands don't depend on memory, except `explain`,
+// which only reads. Whether names are reactive is as of the line
+// before.
+bool schedule_is_barrier(TokenString tokens, ScheduleNames *names) {
+    if (names->full) {
+        return true;
+    }
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type != TOK_VAR) continue;
+        Symbol symbol = symbol_lookup_len(names->symbols, tokens.tokens[i].var_name, tokens.tokens[i].var_len);
+        if (symbol != SYMBOL_NONE && names->reactive[symbol]) {
+            return true;
+        }
+    }
+    if (tokens_are_bind(tokens)) {
+        return true;
+    }
+    if (tokens_are_command(tokens)) {
+        return tokens.length > 0 && (tokens.tokens[0].type == TOK_MEMORY
+            || tokens.tokens[0].type == TOK_SHOW_UNITS || tokens.tokens[0].type == TOK_ADD_UNIT);
+    }
+    size_t n_equals = 0;
+    for (size_t i = 0; i < tokens.length; i++) {
+        n_equals += tokens.tokens[i].type == TOK_EQUALS;
+    }
+    if (n_equals == 0) return false;
+    // Anything but `var = expression`
+    return n_equals > 1 || tokens.length < 3 || tokens.tokens[0].type != TOK_VAR
+        || tokens.tokens[1].type != TOK_EQUALS;
+}
+
+// Whether a line that isn't a barrier assigns its first token.
+bool schedule_assigns(TokenString tokens) {
+    return !tokens_are_command(tokens) && tokens.length >= 2 && tokens.tokens[1].type == TOK_EQUALS;
+}
+
+typedef struct ScheduleEdges ScheduleEdges;
+struct ScheduleEdges {
+    size_t *from;
+    size_t *to;
+    size_t len;
+    size_t capacity;
+};
+
+void schedule_push_edge(ScheduleEdges *edges, size_t from, size_t to) {
+    if (edges->len == edges->capacity) {
+        edges->capacity = edges->capacity == 0 ? 64 : edges->capacity * 2;
+        edges->from = realloc(edges->from, edges->capacity * sizeof(size_t));
+        edges->to = realloc(edges->to, edges->capacity * sizeof(size_t));
+        assert(edges->from != NULL && edges->to != NULL);
+    }
+    edges->from[edges->len] = from;
+    edges->to[edges->len] = to;
+    edges->len++;
+}
+
+// Add an edge into the newest line, whose edges start at `line_start`,
+// unless it already has it. Lines that aren't barriers only have a few.
+void schedule_add_edge(ScheduleEdges *edges, size_t line_start, size_t from, size_t to) {
+    for (size_t i = line_start; i < edges->len; i++) {
+        if (edges->from[i] == from) return;
+    }
+    schedule_push_edge(edges, from, to);
+}
+
+// Work out which of `tokens` lines depend on which, to run them against
+// `memory` on `n_workers` threads. The tokens must outlive the schedule.
+Schedule *schedule_new(TokenString *tokens, size_t n_lines, Memory memory, size_t n_workers) {
+    Schedule *schedule = calloc(1, sizeof(Schedule));
+    assert(schedule != NULL);
+    schedule->lines = calloc(n_lines, sizeof(ScheduleLine));
+    assert(n_lines == 0 || schedule->lines != NULL);
+    schedule->n_lines = n_lines;
+    schedule->memory = memory;
+    atomic_init(&schedule->remaining, n_lines);
+
+    // Which line last assigned each name, and which are formulas or
+    // what they refer to, which is never reset
+    ScheduleNames names = schedule_names_new();
+    size_t last_barrier = SIZE_MAX;
+    ScheduleEdges edges = {0};
+    for (size_t i = 0; i < n_lines; i++) {
+        TokenString line = tokens[i];
+        schedule->lines[i].tokens = line;
+        schedule->lines[i].barrier = last_barrier;
+        size_t line_start = edges.len;
+        bool is_barrier = schedule_is_barrier(line, &names);
+        schedule_add_names(&names, line);
+        // So is a line with a name that didn't fit
+        if (is_barrier || names.full) {
+            for (size_t j = last_barrier == SIZE_MAX ? 0 : last_barrier; j < i; j++) {
+                schedule_push_edge(&edges, j, i);
+            }
+            last_barrier = i;
+        } else {
+            if (last_barrier != SIZE_MAX) {
+                schedule_add_edge(&edges, line_start, last_barrier, i);
+            }
+            // Reads, and for an assignment, what it overwrites. Lines
+            // before the last barrier are already waited for.
+            for (size_t j = 0; j < line.length; j++) {
+                if (line.tokens[j].type != TOK_VAR) continue;
+                size_t assigned = names.last_assigned[schedule_name(&names, line.tokens[j])];
+                if (assigned != SIZE_MAX && (last_barrier == SIZE_MAX || assigned > last_barrier)) {
+                    schedule_add_edge(&edges, line_start, assigned, i);
+                }
+            }
+            if (schedule_assigns(line)) {
+                names.last_assigned[schedule_name(&names, line.tokens[0])] = i;
+            }
+        }
+        atomic_init(&schedule->lines[i].pending, edges.len - line_start);
+        atomic_init(&schedule->lines[i].done, false);
+    }
+    schedule_names_free(&names);
+
+    // Group edges by the line they're from
+    for (size_t i = 0; i < edges.len; i++) {
+        schedule->lines[edges.from[i]].successors_end++;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < n_lines; i++) {
+        size_t count = schedule->lines[i].successors_end;
+        schedule->lines[i].successors_start = start;
+        schedule->lines[i].successors_end = start;
+        start += count;
+    }
+    schedule->successors = malloc((edges.len > 0 ? edges.len : 1) * sizeof(size_t));
+    assert(schedule->successors != NULL);
+    for (size_t i = 0; i < edges.len; i++) {
+        schedule->successors[schedule->lines[edges.from[i]].successors_end++] = edges.to[i];
+    }
+    free(edges.from);
+    free(edges.to);
+
+    size_t capacity = 1;
+    while (capacity < n_lines) capacity *= 2;
+    schedule->n_workers = n_workers;
+    schedule->workers = calloc(n_workers, sizeof(ScheduleWorker));
+    assert(schedule->workers != NULL);
+    for (size_t i = 0; i < n_workers; i++) {
+        schedule->workers[i] = (ScheduleWorker) {
+            .schedule = schedule,
+            .deque = work_deque_new(capacity),
+            .repl_arena = arena_create(),
+            .output_arena = arena_create(),
+            .scratch = arena_create(),
+            .steal_from = i + 1,
+        };
+    }
+    // Deal out the lines that are ready to start with
+    size_t next_worker = 0;
+    for (size_t i = 0; i < n_lines; i++) {
+        if (atomic_load(&schedule->lines[i].pending) > 0) continue;
+        work_deque_push(&schedule->workers[next_worker].deque, i);
+        next_worker = (next_worker + 1) % n_workers;
+    }
+    return schedule;
+}
+
+void schedule_execute_line(ScheduleWorker *worker, size_t idx) {
+    Schedule *schedule = worker->schedule;
+    ScheduleLine *line = &schedule->lines[idx];
+    trace_set_muted(schedule->trace_sample > 1 && idx % schedule->trace_sample != 0);
+    trace_begin(TRACE_EXECUTE, "execute_line");
+    Memory mem = schedule->memory;
+    if (line->barrier == SIZE_MAX) {
+        mem.version += idx;
+    } else {
+        mem.version = schedule->lines[line->barrier].end_version + (idx - line->barrier - 1);
+    }
+    char output[MAX_OUTPUT];
+    execute_tokens(line->tokens, output, sizeof(output), &mem, &worker->repl_arena, &worker->scratch);
+    trace_end(TRACE_EXECUTE, "execute_line");
+    line->end_version = mem.version;
+    size_t len = strnlen(output, sizeof(output));
+    if (len > 0) {
+        char *copy = arena_alloc(&worker->output_arena, len + 1);
+        memcpy(copy, output, len + 1);
+        line->output = copy;
+    }
+    arena_clear(&worker->scratch);
+    atomic_store_explicit(&line->done, true, memory_order_release);
+
+    for (size_t i = line->successors_start; i < line->successors_end; i++) {
+        size_t successor = schedule->successors[i];
+        if (atomic_fetch_sub(&schedule->lines[successor].pending, 1) == 1) {
+            work_deque_push(&worker->deque, successor);
+        }
+    }
+    atomic_fetch_sub(&schedule->remaining, 1);
+}
+
+bool schedule_steal(ScheduleWorker *worker, size_t *idx) {
+    Schedule *schedule = worker->schedule;
+    for (size_t i = 0; i < schedule->n_workers; i++) {
+        ScheduleWorker *victim = &schedule->workers[(worker->steal_from + i) % schedule->n_workers];
+        if (victim != worker && work_deque_steal(&victim->deque, idx)) {
+            worker->steal_from = (worker->steal_from + i) % schedule->n_workers;
+            return true;
+        }
+    }
+    return false;
+}
+
+void *schedule_worker(void *worker_opaque) {
+    ScheduleWorker *worker = (ScheduleWorker *)worker_opaque;
+    trace_set_thread_name("worker");
+    size_t idle = 0;
+    while (atomic_load(&worker->schedule->remaining) > 0) {
+        size_t idx;
+        if (work_deque_pop(&worker->deque, &idx) || schedule_steal(worker, &idx)) {
+            schedule_execute_line(worker, idx);
+            idle = 0;
+        } else {
+            backoff(idle++);
+        }
+    }
+    trace_set_muted(false);
+    return NULL;
+}
+
+// Execute every line, printing outputs in order to `output_fd` as they're ready.
+void schedule_run(Schedule *schedule, FILE *output_fd, size_t trace_sample) {
+    schedule->trace_sample = trace_sample;
+    for (size_t i = 0; i < schedule->n_workers; i++) {
+        ScheduleWorker *worker = &schedule->workers[i];
+        assert(pthread_create(&worker->thread, NULL, schedule_worker, worker) == 0);
+    }
+    for (size_t i = 0; i < schedule->n_lines; i++) {
+        ScheduleLine *line = &schedule->lines[i];
+        for (size_t attempt = 0; !atomic_load_explicit(&line->done, memory_order_acquire); attempt++) {
+            backoff(attempt);
+        }
+        if (line->output != NULL) fprintf(output_fd, "%s\n", line->output);
+    }
+    for (size_t i = 0; i < schedule->n_workers; i++) {
+        pthread_join(schedule->workers[i].thread, NULL);
+    }
+}
+
+// Anything lines stored in memory is freed too.
+void schedule_free(Schedule *schedule) {
+    for (size_t i = 0; i < schedule->n_workers; i++) {
+        ScheduleWorker *worker = &schedule->workers[i];
+        free(worker->deque.tasks);
+        arena_free(&worker->repl_arena);
+        arena_free(&worker->output_arena);
+        arena_free(&worker->scratch);
+    }
+    free(schedule->workers);
+    free(schedule->successors);
+    free(schedule->lines);
+    free(schedule);
+}
+
+// Like `batch`, but with independent lines executed in parallel on
+// `n_workers` threads. Reads the whole input before executing anything.
+void batch_parallel(FILE *input_fd, FILE *output_fd, size_t n_workers, size_t trace_sample) {
+    Arena arena = arena_create();
+    Memory memory = memory_new(&arena);
+    trace_set_thread_name("main");
+    size_t n_lines = 0;
+    size_t capacity = 64;
+    TokenString *lines = malloc(capacity * sizeof(TokenString));
+    assert(lines != NULL);
+    char line[MAX_LINE];
+    while (batch_read_line(input_fd, line)) {
+        trace_set_muted(trace_sample > 1 && n_lines % trace_sample != 0);
+        // Tokens refer to the line, and `line` is reused
+        TokenString tokens = tokenize(string_new_fmt(&arena, "%s", line).s, &arena);
+        // Nothing after a quit is executed
+        if (tokens.length == 1 && tokens.tokens[0].type == TOK_QUIT) break;
+        if (n_lines == capacity) {
+            capacity *= 2;
+            lines = realloc(lines, capacity * sizeof(TokenString));
+            assert(lines != NULL);
+        }
+        lines[n_lines++] = tokens;
+    }
+    trace_set_muted(false);
+
+    Schedule *schedule = schedule_new(lines, n_lines, memory, n_workers);
+    schedule_run(schedule, output_fd, trace_sample);
+    schedule_free(schedule);
+    free(lines);
+    memory_free(&memory);
+    arena_free(&arena);
+}
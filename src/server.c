@@ -0,0 +1,367 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "arena.c"
+#include "calculator.c"
+#include "concurrent_map.c"
+#include "execute.c"
+
+// Daemon mode: serve many clients and sessions from one process over a
+// Unix domain socket, so clients don't pay for process startup and
+// setting up memory on every line.
+//
+// Each request is one line, `<session> <input>`, and gets one response,
+// `<flags> <length>\n<output>\n`, where flags are the CALC_* flags from
+// calculator.h and length is the length of the output. Sessions are
+// created the first time they're used and live as long as the server.
+// Requests on one connection are answered in order. `quit` closes the
+// connection.
+//
+// All workers wait on one epoll instance. Connections are registered
+// with EPOLLONESHOT, so each wakeup hands one connection to exactly one
+// worker, which executes everything the client sent on its own thread
+// and then rearms the connection. There's no dispatcher thread to hand
+// requests through.
+
+#define SERVER_MAX_WORKERS 256
+#define SERVER_MAX_SESSION_NAME 64
+// Session name, space, input and newline, plus one
+// more so we can tell when a line is too long.
+#define SERVER_MAX_REQUEST (SERVER_MAX_SESSION_NAME + MAX_INPUT + 3)
+// Workers check for shutdown at least this often
+#define SERVER_POLL_MS 100
+// Drop clients that stop reading responses for this long
+#define SERVER_WRITE_TIMEOUT_MS 1000
+
+typedef struct Connection Connection;
+struct Connection {
+    int fd;
+    char in[SERVER_MAX_REQUEST];
+    size_t in_len;
+    // Skipping the rest of a line that was too long
+    bool discarding;
+    // Bumped by each worker that hands the connection back to epoll,
+    // so the next worker to pick it up sees what the last one wrote.
+    // The kernel orders the handoff too, but C doesn't know that.
+    _Atomic unsigned handoffs;
+    // Every open connection, so shutdown can close them
+    Connection *prev;
+    Connection *next;
+};
+
+typedef struct Server Server;
+struct Server {
+    const char *path;
+    int listen_fd;
+    int epoll_fd;
+    _Atomic bool stop;
+    size_t n_workers;
+    pthread_t workers[SERVER_MAX_WORKERS];
+    // Session name -> CalcContext *
+    ConcurrentMap *sessions;
+    // For the sessions map, only used while holding `sessions_lock`
+    Arena arena;
+    // Only taken to create sessions, lookups don't lock
+    pthread_mutex_t sessions_lock;
+    pthread_mutex_t connections_lock;
+    Connection *connections;
+};
+
+// Buffers up responses so a client that sends many
+// requests at once gets them back in one write.
+typedef struct ServerOutput ServerOutput;
+struct ServerOutput {
+    char data[MAX_OUTPUT * 2];
+    size_t len;
+};
+
+CalcContext *server_session(Server *server, const char *name) {
+    CalcContext **found = concurrent_map_get(server->sessions, (unsigned char *)name, CONCURRENT_MAP_LATEST);
+    if (found != NULL) return *found;
+    pthread_mutex_lock(&server->sessions_lock);
+    found = concurrent_map_get(server->sessions, (unsigned char *)name, CONCURRENT_MAP_LATEST);
+    CalcContext *ctx = found != NULL ? *found : NULL;
+    if (ctx == NULL) {
+        ctx = calc_create();
+        assert(ctx != NULL);
+        concurrent_map_insert(server->sessions, (unsigned char *)name, &ctx, 0, &server->arena);
+    }
+    pthread_mutex_unlock(&server->sessions_lock);
+    return ctx;
+}
+
+bool server_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, SERVER_WRITE_TIMEOUT_MS) <= 0) return false;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool server_flush(Connection *conn, ServerOutput *out) {
+    bool ok = server_write_all(conn->fd, out->data, out->len);
+    out->len = 0;
+    return ok;
+}
+
+bool server_respond(Connection *conn, ServerOutput *out, uint32_t flags, const char *output) {
+    size_t output_len = strnlen(output, MAX_OUTPUT);
+    // Header, output and newline
+    if (out->len + output_len + 32 > sizeof(out->data) && !server_flush(conn, out)) {
+        return false;
+    }
+    out->len += snprintf(out->data + out->len, sizeof(out->data) - out->len, "%u %zu\n", flags, output_len);
+    memcpy(out->data + out->len, output, output_len);
+    out->len += output_len;
+    out->data[out->len++] = '\n';
+    return true;
+}
+
+// Execute one request line. Returns false if the connection should close.
+bool server_request(Server *server, Connection *conn, ServerOutput *out, char *line, Arena *scratch) {
+    char *input = strchr(line, ' ');
+    if (input != NULL) {
+        *input = '\0';
+        input++;
+    } else {
+        input = line + strlen(line);
+    }
+    size_t name_len = strlen(line);
+    if (name_len == 0 || name_len > SERVER_MAX_SESSION_NAME) {
+        return server_respond(conn, out, CALC_ERROR, "Invalid session name");
+    }
+    CalcContext *ctx = server_session(server, line);
+    char output[MAX_OUTPUT];
+    uint32_t flags = calc_execute_scratch(ctx, input, output, sizeof(output), NULL, scratch);
+    return server_respond(conn, out, flags, output) && !(flags & CALC_QUIT);
+}
+
+// Execute every complete line in the connection's buffer.
+// Returns false if the connection should close.
+bool server_requests(Server *server, Connection *conn, ServerOutput *out, Arena *scratch) {
+    size_t start = 0;
+    while (start < conn->in_len) {
+        char *newline = memchr(conn->in + start, '\n', conn->in_len - start);
+        if (newline == NULL) break;
+        *newline = '\0';
+        char *line = conn->in + start;
+        start = newline - conn->in + 1;
+        if (conn->discarding) {
+            conn->discarding = false;
+            continue;
+        }
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+        if (!server_request(server, conn, out, line, scratch)) return false;
+    }
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+    if (conn->in_len == sizeof(conn->in)) {
+        // No newline in a full buffer
+        if (!conn->discarding && !server_respond(conn, out, CALC_ERROR, "Request too long")) {
+            return false;
+        }
+        conn->discarding = true;
+        conn->in_len = 0;
+    }
+    return true;
+}
+
+void server_close(Server *server, Connection *conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    pthread_mutex_lock(&server->connections_lock);
+    if (conn->prev != NULL) conn->prev->next = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+    if (server->connections == conn) server->connections = conn->next;
+    pthread_mutex_unlock(&server->connections_lock);
+    free(conn);
+}
+
+// Read and execute everything the client has sent so far,
+// then hand the connection back to epoll.
+void server_handle(Server *server, Connection *conn, Arena *scratch) {
+    atomic_load_explicit(&conn->handoffs, memory_order_acquire);
+    ServerOutput out = { .len = 0 };
+    bool open = true;
+    while (open) {
+        size_t space = sizeof(conn->in) - conn->in_len;
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, space);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            open = false;
+            break;
+        }
+        conn->in_len += n;
+        open = server_requests(server, conn, &out, scratch);
+        // A short read means we've drained the socket, and rearming
+        // reports anything that arrived since, so save a syscall
+        if ((size_t)n < space) break;
+    }
+    if (out.len > 0) open &= server_flush(conn, &out);
+    if (!open) {
+        server_close(server, conn);
+        return;
+    }
+    atomic_fetch_add_explicit(&conn->handoffs, 1, memory_order_release);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+void server_accept(Server *server) {
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) break;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        Connection *conn = calloc(1, sizeof(Connection));
+        assert(conn != NULL);
+        conn->fd = fd;
+        atomic_store_explicit(&conn->handoffs, 0, memory_order_release);
+        pthread_mutex_lock(&server->connections_lock);
+        conn->next = server->connections;
+        if (server->connections != NULL) server->connections->prev = conn;
+        server->connections = conn;
+        pthread_mutex_unlock(&server->connections_lock);
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+    // The listener has no Connection, it's the event with NULL data
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &event);
+}
+
+typedef struct ServerWorker ServerWorker;
+struct ServerWorker {
+    Server *server;
+    size_t id;
+};
+
+void *server_worker(void *worker_opaque) {
+    ServerWorker worker = *(ServerWorker *)worker_opaque;
+    free(worker_opaque);
+    Server *server = worker.server;
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %zu", worker.id);
+    trace_set_thread_name(thread_name);
+    Arena scratch = arena_create();
+    while (!atomic_load(&server->stop)) {
+        struct epoll_event event;
+        int n = epoll_wait(server->epoll_fd, &event, 1, SERVER_POLL_MS);
+        if (n <= 0) continue;
+        if (event.data.ptr == NULL) {
+            server_accept(server);
+        } else {
+            server_handle(server, (Connection *)event.data.ptr, &scratch);
+        }
+    }
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Listen on `path` and start `n_workers` workers. Prints and returns
+// false if the socket can't be set up.
+bool server_start(Server *server, const char *path, size_t n_workers) {
+    *server = (Server) {
+        .path = path,
+        .n_workers = n_workers < SERVER_MAX_WORKERS ? n_workers : SERVER_MAX_WORKERS,
+        .arena = arena_create(),
+        .connections = NULL,
+    };
+    atomic_init(&server->stop, false);
+    server->sessions = concurrent_map_new(sizeof(CalcContext *), &server->arena);
+    pthread_mutex_init(&server->sessions_lock, NULL);
+    pthread_mutex_init(&server->connections_lock, NULL);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // Replace a socket left behind by a server that didn't shut down
+    unlink(path);
+    if (server->listen_fd < 0
+        || bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(server->listen_fd, SOMAXCONN) < 0) {
+        printf("Could not listen on %s: %s\n", path, strerror(errno));
+        if (server->listen_fd >= 0) close(server->listen_fd);
+        return false;
+    }
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(server->epoll_fd >= 0);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = NULL };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+
+    for (size_t i = 0; i < server->n_workers; i++) {
+        ServerWorker *worker = malloc(sizeof(ServerWorker));
+        assert(worker != NULL);
+        *worker = (ServerWorker) { .server = server, .id = i };
+        assert(pthread_create(&server->workers[i], NULL, server_worker, worker) == 0);
+    }
+    return true;
+}
+
+void server_stop(Server *server) {
+    atomic_store(&server->stop, true);
+    for (size_t i = 0; i < server->n_workers; i++) {
+        pthread_join(server->workers[i], NULL);
+    }
+    close(server->listen_fd);
+    unlink(server->path);
+    for (Connection *conn = server->connections; conn != NULL;) {
+        Connection *next = conn->next;
+        close(conn->fd);
+        free(conn);
+        conn = next;
+    }
+    close(server->epoll_fd);
+    ConcurrentIter iter = concurrent_map_iter(server->sessions, CONCURRENT_MAP_LATEST);
+    while (concurrent_map_iter_next(&iter)) {
+        calc_destroy(*(CalcContext **)iter.value);
+    }
+    pthread_mutex_destroy(&server->sessions_lock);
+    pthread_mutex_destroy(&server->connections_lock);
+    arena_free(&server->arena);
+}
+
+// Serve on `path` until SIGINT or SIGTERM.
+int serve(const char *path, size_t n_workers) {
+    // Only this thread handles the signals, workers inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    Server server;
+    if (!server_start(&server, path, n_workers)) {
+        return 1;
+    }
+    printf("Listening on %s with %zu workers\n", path, server.n_workers);
+    fflush(stdout);
+    int sig;
+    sigwait(&signals, &sig);
+    server_stop(&server);
+    return 0;
+}
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <math.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.c"
+#include "evaluate.c"
+#include "expr_array.c"
+#include "parse.c"
+#include "tokenize.c"
+
+// An expression with named placeholders, e.g. `?speed km/h -> mi/h`,
+// compiled once to run many times with different values, like a SQL
+// prepared statement.
+//
+// Preparing does everything a line does up to evaluating it: parse,
+// substitute, validate and work out the unit of every node, treating
+// placeholders as plain numbers. It also works out everything that
+// doesn't depend on a placeholder, and how each conversion that does
+// depend on one scales its operand. Running it is then just arithmetic
+// over the nodes that depend on a placeholder, with no allocation.
+//
+// Variables and units are read when it's prepared, so later changes to
+// them don't affect it.
+
+// How a node that depends on a placeholder converts its operand into
+// the unit it works in: the right operand for arithmetic, the left for
+// conversions.
+typedef struct StatementStep StatementStep;
+struct StatementStep {
+    uint32_t node;
+    // The conversion is `scale * value + offset`...
+    double scale;
+    double offset;
+    // ...unless it isn't affine, e.g. for negative degrees of
+    // temperatures, in which case it goes through `unit_convert`.
+    bool affine;
+    Unit from;
+    Unit to;
+};
+
+typedef struct Statement Statement;
+struct Statement {
+    ExprArray program;
+    // The value of every node, which is only recomputed for nodes that
+    // depend on a placeholder
+    double *values;
+    // Nodes that depend on a placeholder, in order
+    StatementStep *steps;
+    uint32_t n_steps;
+    // Distinct placeholders in the order they first appear, and whether
+    // each has been bound
+    Token *params;
+    bool *bound;
+    uint32_t n_params;
+    // For every time a placeholder appears: which one, and its node
+    uint32_t *slot_params;
+    uint32_t *slot_nodes;
+    uint32_t n_slots;
+    bool is_number;
+    // Display string of the result's unit
+    const char *unit;
+};
+
+// Add every constant leaf under `expr` to `leaves` in the order
+// `expr_array_new` adds them to the array's constants.
+void statement_collect_constants(Expression *expr, Expression **leaves, size_t *n_leaves, size_t max_leaves) {
+    if (expr->type == EXPR_CONSTANT) {
+        if (*n_leaves < max_leaves) leaves[*n_leaves] = expr;
+        (*n_leaves)++;
+    } else if (expr->type == EXPR_NEG || expr->type == EXPR_AGGREGATE) {
+        statement_collect_constants(expr->expr.unary_expr.right, leaves, n_leaves, max_leaves);
+    } else if (expr_is_bin(expr->type)) {
+        statement_collect_constants(expr->expr.binary_expr.left, leaves, n_leaves, max_leaves);
+        statement_collect_constants(expr->expr.binary_expr.right, leaves, n_leaves, max_leaves);
+    }
+}
+
+// Work out how to convert a value from `from` to `to`.
+StatementStep statement_step_new(uint32_t node, Unit from, Unit to, Arena *arena) {
+    StatementStep step = { .node = node, .from = from, .to = to };
+    step.affine = unit_convert_affine(from, to, &step.scale, &step.offset);
+    return step;
+}
+
+// Prepare `tokens` into `stmt`, reading variables and units from `mem`.
+// Everything `stmt` needs is allocated in `arena`, which has to live as
+// long as it. Returns false, with the reason in `output`, if it can't
+// be prepared. `what` is what's being prepared, for those reasons, e.g.
+// "Sweeps". `tokens` must be an expression that doesn't change memory,
+// and formulas it reads must be up to date.
+bool statement_prepare(TokenString tokens, Memory mem, Statement *stmt, const char *what, char *output,
+                       size_t output_len, Arena *arena) {
+    memset(output, 0, output_len);
+    *stmt = (Statement) {0};
+
+    // Placeholders parse as numbers. Remember which constant each one
+    // became, in the order constants appear.
+    TokenString parsed = tokens_copy(tokens, arena);
+    Token *numbers = arena_alloc_aligned(arena, tokens.length * sizeof(Token), alignof(Token));
+    size_t n_numbers = 0;
+    for (size_t i = 0; i < parsed.length; i++) {
+        if (parsed.tokens[i].type != TOK_NUM && parsed.tokens[i].type != TOK_PARAM) continue;
+        numbers[n_numbers++] = parsed.tokens[i];
+        if (parsed.tokens[i].type == TOK_PARAM) parsed.tokens[i] = token_new_num(0);
+    }
+    Expression expr = parse(parsed, mem, arena);
+    Expression **leaves = arena_alloc_aligned(arena, n_numbers * sizeof(Expression *), alignof(Expression *));
+    size_t n_leaves = 0;
+    statement_collect_constants(&expr, leaves, &n_leaves, n_numbers);
+
+    String err = string_empty(arena);
+    substitute_variables(&expr, mem, arena);
+    substitute_units(&expr, mem, arena);
+    if (!check_valid_expr(expr, &err, arena)) {
+        snprintf(output, output_len, "%s", err.s);
+        return false;
+    }
+    if (n_leaves != n_numbers) {
+        snprintf(output, output_len, "Couldn't find every placeholder in the expression");
+        return false;
+    }
+
+    // Which placeholder each constant is, if any, after substituting
+    // added constants of its own
+    size_t n_constants = 0;
+    statement_collect_constants(&expr, NULL, &n_constants, 0);
+    Expression **constants = arena_alloc_aligned(arena, n_constants * sizeof(Expression *), alignof(Expression *));
+    n_constants = 0;
+    statement_collect_constants(&expr, constants, &n_constants, SIZE_MAX);
+    const Token **constant_params = arena_alloc_aligned(arena, n_constants * sizeof(Token *), alignof(Token *));
+    for (size_t i = 0; i < n_constants; i++) {
+        constant_params[i] = NULL;
+        for (size_t j = 0; j < n_leaves; j++) {
+            if (leaves[j] == constants[i] && numbers[j].type == TOK_PARAM) {
+                constant_params[i] = &numbers[j];
+            }
+        }
+    }
+
+    ExprArray program = expr_array_new(&expr, arena);
+    stmt->program = program;
+    stmt->values = arena_alloc_aligned(arena, program.length * sizeof(double), alignof(double));
+    stmt->steps = arena_alloc_aligned(arena, program.length * sizeof(StatementStep), alignof(StatementStep));
+    stmt->params = arena_alloc_aligned(arena, n_leaves * sizeof(Token), alignof(Token));
+    stmt->bound = arena_alloc(arena, n_leaves * sizeof(bool));
+    stmt->slot_params = arena_alloc_aligned(arena, n_leaves * sizeof(uint32_t), alignof(uint32_t));
+    stmt->slot_nodes = arena_alloc_aligned(arena, n_leaves * sizeof(uint32_t), alignof(uint32_t));
+    Unit *units = arena_alloc_aligned(arena, program.length * sizeof(Unit), alignof(Unit));
+    bool *depends = arena_alloc(arena, program.length * sizeof(bool));
+    for (uint32_t i = 0; i < program.length; i++) {
+        ExprNode node = program.nodes[i];
+        stmt->values[i] = 0;
+        depends[i] = false;
+        switch ((ExprType)node.type) {
+            case EXPR_CONSTANT: {
+                units[i] = unit_new_none(arena);
+                stmt->values[i] = program.constants[node.left];
+                const Token *param = constant_params[node.left];
+                if (param == NULL) break;
+                depends[i] = true;
+                uint32_t p = 0;
+                while (p < stmt->n_params && !token_same_name(stmt->params[p], *param)) p++;
+                if (p == stmt->n_params) {
+                    stmt->params[stmt->n_params] = *param;
+                    stmt->bound[stmt->n_params] = false;
+                    stmt->n_params++;
+                }
+                stmt->slot_params[stmt->n_slots] = p;
+                stmt->slot_nodes[stmt->n_slots] = i;
+                stmt->n_slots++;
+                break;
+            }
+            case EXPR_UNIT:
+                // Units of variables are shared with memory, which
+                // may be compacted while the statement lives
+                program.units[node.left] = unit_copy(program.units[node.left], arena);
+                units[i] = program.units[node.left];
+                break;
+            case EXPR_ARRAY:
+                snprintf(output, output_len, "%s can't use arrays", what);
+                return false;
+            case EXPR_AGGREGATE:
+                snprintf(output, output_len, "%s can't use aggregates", what);
+                return false;
+            case EXPR_VAR:
+                snprintf(output, output_len, "Variable not defined: %s", program.var_names[node.left]);
+                return false;
+            case EXPR_NEG:
+                units[i] = units[node.right];
+                stmt->values[i] = -stmt->values[node.right];
+                depends[i] = depends[node.right];
+                if (depends[i]) stmt->steps[stmt->n_steps++] = (StatementStep) { .node = i };
+                break;
+            case EXPR_INVALID:
+                snprintf(output, output_len, "%s", program.errors[node.left].s);
+                return false;
+            case EXPR_SET_VAR:
+                assert(false);
+                return false;
+            case EXPR_CONST_UNIT: case EXPR_COMP_UNIT: case EXPR_ADD: case EXPR_SUB:
+            case EXPR_MUL: case EXPR_DIV: case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT:
+            case EXPR_INT_DIV:
+                if (node.type == EXPR_POW && depends[node.right]) {
+                    snprintf(output, output_len, "Placeholders can't be unit degrees");
+                    return false;
+                }
+                units[i] = check_unit_op(node.type, units[node.left], units[node.right],
+                    stmt->values[node.right], &err, arena);
+                if (is_unit_unknown(units[i]) || err.len > 0) {
+                    snprintf(output, output_len, "%s", err.s);
+                    return false;
+                }
+                depends[i] = depends[node.left] || depends[node.right];
+                if (node.type == EXPR_CONST_UNIT) {
+                    stmt->values[i] = stmt->values[node.left];
+                    if (depends[i]) stmt->steps[stmt->n_steps++] = (StatementStep) { .node = i };
+                } else if (node.type == EXPR_CONVERT && depends[i]) {
+                    stmt->steps[stmt->n_steps++] = statement_step_new(i, units[node.left], units[node.right], arena);
+                } else if (expr_is_number(node.type) && depends[i]) {
+                    stmt->steps[stmt->n_steps++] = statement_step_new(i, units[node.right], units[node.left], arena);
+                } else if (expr_is_number(node.type)) {
+                    stmt->values[i] = evaluate_op(node.type, stmt->values[node.left], stmt->values[node.right],
+                        units[node.left], units[node.right], &err, arena);
+                    if (err.len > 0) {
+                        snprintf(output, output_len, "%s", err.s);
+                        return false;
+                    }
+                }
+                break;
+        }
+    }
+    stmt->is_number = expr_is_number(expr.type);
+    stmt->unit = display_unit(units[program.length - 1], arena);
+    return true;
+}
+
+// Set every place placeholder `param` appears to `value`.
+void statement_bind(Statement *stmt, uint32_t param, double value) {
+    for (uint32_t i = 0; i < stmt->n_slots; i++) {
+        if (stmt->slot_params[i] == param) stmt->values[stmt->slot_nodes[i]] = value;
+    }
+    stmt->bound[param] = true;
+}
+
+double statement_convert(const StatementStep *step, double value, Arena *arena) {
+    if (step->affine) return step->scale * value + step->offset;
+    return unit_convert(value, step->from, step->to, arena);
+}
+
+// Evaluate `stmt` with what's bound to its placeholders. Returns false,
+// with the reason in `output`, if one isn't bound or it divides by zero.
+// Only conversions that aren't affine use `arena`, and only for debug
+// logs.
+bool statement_run(Statement *stmt, double *value, char *output, size_t output_len, Arena *arena) {
+    for (uint32_t i = 0; i < stmt->n_params; i++) {
+        if (!stmt->bound[i]) {
+            snprintf(output, output_len, "Placeholder not bound: ?%.*s", (int)stmt->params[i].var_len,
+                     stmt->params[i].var_name);
+            return false;
+        }
+    }
+    double *values = stmt->values;
+    for (uint32_t i = 0; i < stmt->n_steps; i++) {
+        const StatementStep *step = &stmt->steps[i];
+        ExprNode node = stmt->program.nodes[step->node];
+        double left = values[node.left];
+        double right = values[node.right];
+        double result = 0;
+        switch ((ExprType)node.type) {
+            case EXPR_NEG:
+                result = -right;
+                break;
+            case EXPR_CONST_UNIT:
+                result = left;
+                break;
+            case EXPR_CONVERT:
+                result = statement_convert(step, left, arena);
+                break;
+            case EXPR_ADD:
+                result = left + statement_convert(step, right, arena);
+                break;
+            case EXPR_SUB:
+                result = left - statement_convert(step, right, arena);
+                break;
+            case EXPR_MUL:
+                result = left * statement_convert(step, right, arena);
+                break;
+            case EXPR_DIV: case EXPR_INT_DIV:
+                right = statement_convert(step, right, arena);
+                if (right == 0) {
+                    snprintf(output, output_len, "Cannot divide by zero");
+                    return false;
+                }
+                result = node.type == EXPR_DIV ? left / right : floor(left / right);
+                break;
+            default:
+                assert(false);
+                return false;
+        }
+        values[step->node] = result;
+    }
+    *value = values[stmt->program.length - 1];
+    return true;
+}
+
+// Running a statement over many values of its placeholder, a chunk of
+// them at a time, e.g. for `sweep`. Every node that depends on the
+// placeholder gets a buffer with its value for each value in the chunk,
+// and each step is one pass over small vectors of them, which compile
+// to SIMD instructions.
+
+#define STATEMENT_LANES 4
+#define STATEMENT_CHUNK 1024
+
+typedef double StatementLanes __attribute__((vector_size(STATEMENT_LANES * sizeof(double))));
+
+typedef struct StatementChunk StatementChunk;
+struct StatementChunk {
+    // Where the placeholder's values go, up to STATEMENT_CHUNK of them
+    double *input;
+    // Each node's values over the chunk, or NULL if it doesn't depend
+    // on the placeholder and isn't an operand of one that does, whose
+    // values are its value repeated.
+    double **lanes;
+    // For conversions that aren't affine
+    double *converted;
+};
+
+double *statement_lanes_new(Arena *arena) {
+    return arena_alloc_aligned(arena, STATEMENT_CHUNK * sizeof(double), sizeof(StatementLanes));
+}
+
+// The values of `node` over a chunk, repeating its value if it doesn't
+// depend on the placeholder.
+double *statement_lanes_of(const Statement *stmt, StatementChunk *chunk, uint32_t node, Arena *arena) {
+    if (chunk->lanes[node] == NULL) {
+        chunk->lanes[node] = statement_lanes_new(arena);
+        for (size_t j = 0; j < STATEMENT_CHUNK; j++) {
+            chunk->lanes[node][j] = stmt->values[node];
+        }
+    }
+    return chunk->lanes[node];
+}
+
+// Buffers for running `stmt`, which has at most one placeholder, in
+// chunks, allocated in `arena`.
+StatementChunk statement_chunk_new(const Statement *stmt, Arena *arena) {
+    assert(stmt->n_params <= 1);
+    ExprArray program = stmt->program;
+    StatementChunk chunk = {
+        .input = statement_lanes_new(arena),
+        .lanes = arena_alloc_aligned(arena, program.length * sizeof(double *), alignof(double *)),
+        .converted = statement_lanes_new(arena),
+    };
+    for (uint32_t i = 0; i < program.length; i++) {
+        chunk.lanes[i] = NULL;
+    }
+    for (uint32_t i = 0; i < stmt->n_slots; i++) {
+        chunk.lanes[stmt->slot_nodes[i]] = chunk.input;
+    }
+    for (uint32_t i = 0; i < stmt->n_steps; i++) {
+        ExprNode node = program.nodes[stmt->steps[i].node];
+        if (node.type == EXPR_CONST_UNIT) {
+            // Same values as the number it's of
+            chunk.lanes[stmt->steps[i].node] = statement_lanes_of(stmt, &chunk, node.left, arena);
+            continue;
+        }
+        if (node.type != EXPR_NEG) statement_lanes_of(stmt, &chunk, node.left, arena);
+        if (node.type != EXPR_CONVERT) statement_lanes_of(stmt, &chunk, node.right, arena);
+        chunk.lanes[stmt->steps[i].node] = statement_lanes_new(arena);
+    }
+    statement_lanes_of(stmt, &chunk, program.length - 1, arena);
+    return chunk;
+}
+
+// `scale * values + offset` for a step's operand, as vectors.
+const StatementLanes *statement_convert_lanes(const StatementStep *step, StatementChunk *chunk,
+                                              const double *values, size_t n_vectors, Arena *arena) {
+    StatementLanes *converted = (StatementLanes *)chunk->converted;
+    if (step->affine) {
+        const StatementLanes *in = (const StatementLanes *)values;
+        for (size_t v = 0; v < n_vectors; v++) {
+            converted[v] = in[v] * step->scale + step->offset;
+        }
+    } else {
+        for (size_t j = 0; j < n_vectors * STATEMENT_LANES; j++) {
+            chunk->converted[j] = unit_convert(values[j], step->from, step->to, arena);
+        }
+    }
+    return converted;
+}
+
+// Evaluate `stmt` for each of the first `n` values in `chunk->input`,
+// at least one and at most STATEMENT_CHUNK. Returns the results, or
+// NULL, with the reason in `output`, if one of them divides by zero.
+const double *statement_run_chunk(const Statement *stmt, StatementChunk *chunk, size_t n,
+                                  char *output, size_t output_len, Arena *arena) {
+    assert(n > 0 && n <= STATEMENT_CHUNK);
+    // Whole vectors, padded with a value that's really there, so the
+    // padding can't divide by zero when nothing else does
+    size_t n_vectors = (n + STATEMENT_LANES - 1) / STATEMENT_LANES;
+    for (size_t j = n; j < n_vectors * STATEMENT_LANES; j++) {
+        chunk->input[j] = chunk->input[n - 1];
+    }
+    for (uint32_t i = 0; i < stmt->n_steps; i++) {
+        const StatementStep *step = &stmt->steps[i];
+        ExprNode node = stmt->program.nodes[step->node];
+        if (node.type == EXPR_CONST_UNIT) continue;
+        StatementLanes *out = (StatementLanes *)chunk->lanes[step->node];
+        const StatementLanes *left = (const StatementLanes *)chunk->lanes[node.left];
+        const StatementLanes *right = (const StatementLanes *)chunk->lanes[node.right];
+        if (node.type == EXPR_NEG) {
+            for (size_t v = 0; v < n_vectors; v++) out[v] = -right[v];
+            continue;
+        }
+        if (node.type == EXPR_CONVERT) {
+            const StatementLanes *converted = statement_convert_lanes(step, chunk, chunk->lanes[node.left],
+                                                                      n_vectors, arena);
+            for (size_t v = 0; v < n_vectors; v++) out[v] = converted[v];
+            continue;
+        }
+        right = statement_convert_lanes(step, chunk, chunk->lanes[node.right], n_vectors, arena);
+        switch ((ExprType)node.type) {
+            case EXPR_ADD:
+                for (size_t v = 0; v < n_vectors; v++) out[v] = left[v] + right[v];
+                break;
+            case EXPR_SUB:
+                for (size_t v = 0; v < n_vectors; v++) out[v] = left[v] - right[v];
+                break;
+            case EXPR_MUL:
+                for (size_t v = 0; v < n_vectors; v++) out[v] = left[v] * right[v];
+                break;
+            case EXPR_DIV: case EXPR_INT_DIV:
+                for (size_t j = 0; j < n; j++) {
+                    if (chunk->converted[j] == 0) {
+                        snprintf(output, output_len, "Cannot divide by zero");
+                        return NULL;
+                    }
+                }
+                for (size_t v = 0; v < n_vectors; v++) out[v] = left[v] / right[v];
+                if (node.type == EXPR_INT_DIV) {
+                    double *values = chunk->lanes[step->node];
+                    for (size_t j = 0; j < n_vectors * STATEMENT_LANES; j++) values[j] = floor(values[j]);
+                }
+                break;
+            default:
+                assert(false);
+                return NULL;
+        }
+    }
+    return chunk->lanes[stmt->program.length - 1];
+}
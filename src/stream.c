@@ -0,0 +1,312 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aggregate.c"
+#include "arena.c"
+#include "evaluate.c"
+#include "execute.c"
+#include "memory.c"
+#include "parse.c"
+#include "tokenize.c"
+#include "unit.c"
+
+// Rolling windows over a stream of samples, e.g. a sensor's readings,
+// one `timestamp value unit` line each, with the timestamp in seconds.
+//
+// After every sample, the ones in the window are summarized: how many,
+// their sum, mean, min and max, and the rate, the sum per second. A
+// window is either the last N samples, or the samples less than some
+// time older than the newest.
+//
+// Each sample is taken to be the amount since the one before it, e.g.
+// the distance travelled, so the rate leaves out the oldest sample's
+// amount, which came before the window began: it's the rest of the sum
+// over the time from the oldest sample to the newest. Its unit is the
+// samples' per second, e.g. km s^-1, or per the samples' own unit of
+// time if they have one, so km h^-1 samples give km h^-2.
+//
+// Samples are kept in ring buffers, and the sum is kept running, added
+// to and taken from as samples enter and leave. The min and max come
+// from monotonic queues: the samples that could still be the min (or
+// max) once everything older leaves, which is first in the queue. So
+// each sample is O(1) amortized, however big the window.
+
+typedef struct StreamSample StreamSample;
+struct StreamSample {
+    // Position in the stream, to tell whether the sample leaving the
+    // window is the one at the front of a min or max queue
+    size_t seq;
+    double time;
+    double value;
+};
+
+// Samples oldest first, growing as needed.
+typedef struct StreamRing StreamRing;
+struct StreamRing {
+    StreamSample *samples;
+    // A power of two
+    size_t capacity;
+    size_t head;
+    size_t length;
+};
+
+StreamSample *stream_ring_at(StreamRing *ring, size_t i) {
+    return &ring->samples[(ring->head + i) & (ring->capacity - 1)];
+}
+
+StreamSample *stream_ring_front(StreamRing *ring) {
+    return stream_ring_at(ring, 0);
+}
+
+StreamSample *stream_ring_back(StreamRing *ring) {
+    return stream_ring_at(ring, ring->length - 1);
+}
+
+void stream_ring_push(StreamRing *ring, StreamSample sample) {
+    if (ring->length == ring->capacity) {
+        size_t capacity = ring->capacity == 0 ? 16 : ring->capacity * 2;
+        StreamSample *samples = malloc(capacity * sizeof(StreamSample));
+        assert(samples != NULL);
+        for (size_t i = 0; i < ring->length; i++) {
+            samples[i] = *stream_ring_at(ring, i);
+        }
+        free(ring->samples);
+        *ring = (StreamRing) { .samples = samples, .capacity = capacity, .head = 0, .length = ring->length };
+    }
+    ring->length++;
+    *stream_ring_back(ring) = sample;
+}
+
+void stream_ring_pop_front(StreamRing *ring) {
+    assert(ring->length > 0);
+    ring->head = (ring->head + 1) & (ring->capacity - 1);
+    ring->length--;
+}
+
+void stream_ring_pop_back(StreamRing *ring) {
+    assert(ring->length > 0);
+    ring->length--;
+}
+
+typedef struct StreamWindow StreamWindow;
+struct StreamWindow {
+    // At most this many samples, or 0 for a time window
+    size_t max_samples;
+    // For a time window, how much older than the newest a sample can be
+    double duration;
+    StreamRing samples;
+    // Values increase from the front of `mins`, and decrease from the
+    // front of `maxes`
+    StreamRing mins;
+    StreamRing maxes;
+    // The sum is `sum - compensation`
+    double sum;
+    double compensation;
+    size_t next_seq;
+};
+
+StreamWindow stream_window_new(size_t max_samples, double duration) {
+    return (StreamWindow) { .max_samples = max_samples, .duration = duration };
+}
+
+void stream_window_free(StreamWindow *window) {
+    free(window->samples.samples);
+    free(window->mins.samples);
+    free(window->maxes.samples);
+}
+
+// Whether the oldest sample has to leave. The newest never does, even
+// if it's somehow too old for a time window itself.
+bool stream_window_full(StreamWindow *window, double newest) {
+    if (window->samples.length <= 1) return false;
+    if (window->max_samples > 0) return window->samples.length > window->max_samples;
+    return stream_ring_front(&window->samples)->time <= newest - window->duration;
+}
+
+// Add a sample no older than the newest so far, and drop those that
+// leave the window because of it.
+void stream_window_add(StreamWindow *window, double time, double value) {
+    StreamSample sample = { .seq = window->next_seq++, .time = time, .value = value };
+    stream_ring_push(&window->samples, sample);
+    compensated_add(&window->sum, &window->compensation, value);
+    // Older samples that aren't smaller (or bigger) can't be the min (or
+    // max) again while this one is in the window
+    while (window->mins.length > 0 && stream_ring_back(&window->mins)->value >= value) {
+        stream_ring_pop_back(&window->mins);
+    }
+    stream_ring_push(&window->mins, sample);
+    while (window->maxes.length > 0 && stream_ring_back(&window->maxes)->value <= value) {
+        stream_ring_pop_back(&window->maxes);
+    }
+    stream_ring_push(&window->maxes, sample);
+
+    while (stream_window_full(window, time)) {
+        StreamSample oldest = *stream_ring_front(&window->samples);
+        stream_ring_pop_front(&window->samples);
+        compensated_add(&window->sum, &window->compensation, -oldest.value);
+        if (stream_ring_front(&window->mins)->seq == oldest.seq) stream_ring_pop_front(&window->mins);
+        if (stream_ring_front(&window->maxes)->seq == oldest.seq) stream_ring_pop_front(&window->maxes);
+    }
+}
+
+size_t stream_window_count(StreamWindow *window) {
+    return window->samples.length;
+}
+
+double stream_window_sum(StreamWindow *window) {
+    return window->sum - window->compensation;
+}
+
+double stream_window_min(StreamWindow *window) {
+    return stream_ring_front(&window->mins)->value;
+}
+
+double stream_window_max(StreamWindow *window) {
+    return stream_ring_front(&window->maxes)->value;
+}
+
+// The sum per second, without the oldest sample. There's none until
+// the window spans some time.
+bool stream_window_rate(StreamWindow *window, double *rate) {
+    StreamSample oldest = *stream_ring_front(&window->samples);
+    double span = stream_ring_back(&window->samples)->time - oldest.time;
+    if (!(span > 0)) return false;
+    *rate = (stream_window_sum(window) - oldest.value) / span;
+    return true;
+}
+
+// Evaluate `tokens` as a number with a unit, e.g. `3 km`.
+bool stream_read_quantity(TokenString tokens, Memory mem, double *value, Unit *unit, String *err, Arena *arena) {
+    if (tokens_are_command(tokens) || tokens_change_memory(tokens)) return false;
+    Expression expr = parse(tokens, mem, arena);
+    if (!execute_prepare(&expr, mem, err, arena)) return false;
+    if (!expr_is_number(expr.type) || expr_has_array(expr)) return false;
+    *unit = check_unit(expr, mem, err, arena);
+    if (is_unit_unknown(*unit)) return false;
+    *value = evaluate(expr, mem, err, arena);
+    return err->len == 0;
+}
+
+const char stream_window_msg[] = "Windows look like: --window=100 for the last 100 samples, or --window=5min for the last 5 minutes";
+const char stream_sample_msg[] = "Samples look like: timestamp value unit, e.g. 12.5 3 km";
+
+// The window `--window=SIZE` asks for: a number of samples, or if SIZE
+// has a unit of time, a duration in seconds.
+bool stream_read_window(const char *spec, StreamWindow *window, Memory mem, Arena *arena) {
+    double size;
+    Unit unit;
+    String err = string_empty(arena);
+    if (!stream_read_quantity(tokenize(spec, arena), mem, &size, &unit, &err, arena)) return false;
+    if (is_unit_none(unit)) {
+        if (!(size >= 1) || size != floor(size) || size > 1e15) return false;
+        *window = stream_window_new((size_t)size, 0);
+        return true;
+    }
+    Unit seconds = unit_new_single_builtin(UNIT_SECOND, 1, arena);
+    if (!unit_convert_valid(unit, seconds, &err, arena)) return false;
+    double duration = unit_convert(size, unit, seconds, arena);
+    if (!(duration > 0) || !isfinite(duration)) return false;
+    *window = stream_window_new(0, duration);
+    return true;
+}
+
+// What the rate's unit is for samples in `unit`, and what a rate in
+// that unit is per rate in `unit` per second.
+Unit stream_rate_unit(Unit unit, double *scale, Arena *arena) {
+    *scale = 1;
+    Unit per_second = unit_new_single_builtin(UNIT_SECOND, -1, arena);
+    Unit rate_unit = unit_combine(unit, per_second, true, arena);
+    if (!is_unit_unknown(rate_unit)) return rate_unit;
+    // The samples have some other unit of time, so go per that instead
+    for (size_t i = 0; i < unit.length; i++) {
+        UnitType type = unit.types[i].type;
+        if (unit_category(type) == UNIT_CATEGORY_TIME) {
+            Unit seconds = unit_new_single_builtin(UNIT_SECOND, 1, arena);
+            *scale = unit_convert(1, unit_new_single_builtin(type, 1, arena), seconds, arena);
+            return unit_combine(unit, unit_new_single_builtin(type, -1, arena), false, arena);
+        }
+    }
+    assert(false);
+    return rate_unit;
+}
+
+// `--window=SIZE`: read samples from `input_fd`, and after each one,
+// show a summary of the window to `output_fd`, e.g.
+// `30: 3 samples, sum 9 km, mean 3 km, min 2 km, max 4 km, rate 0.35 km s^-1`.
+// Later samples are converted to the first one's unit. Returns nonzero
+// if SIZE isn't a window.
+int stream(FILE *input_fd, FILE *output_fd, const char *window_spec) {
+    Arena repl_arena = arena_create();
+    Arena arena = arena_create();
+    Memory mem = memory_new(&repl_arena);
+    StreamWindow window;
+    if (!stream_read_window(window_spec, &window, mem, &arena)) {
+        fprintf(output_fd, "%s\n", stream_window_msg);
+        memory_free(&mem);
+        arena_free(&arena);
+        arena_free(&repl_arena);
+        return 1;
+    }
+    arena_clear(&arena);
+
+    // Set from the first sample
+    Unit unit = unit_new_unknown(&repl_arena);
+    const char *unit_str = NULL;
+    const char *rate_unit_str = NULL;
+    double rate_scale = 1;
+    double newest = 0;
+
+    char line[MAX_LINE];
+    while (batch_read_line(input_fd, line)) {
+        TokenString tokens = tokenize(line, &arena);
+        if (tokens.length == 0) continue;
+        double time, value;
+        Unit sample_unit;
+        String err = string_empty(&arena);
+        size_t i = 0;
+        bool ok = tokens.tokens[0].type != TOK_INVALID && sweep_read_number(tokens, &i, &time) && i < tokens.length;
+        TokenString rest = { .tokens = tokens.tokens + i, .length = tokens.length - i };
+        ok = ok && stream_read_quantity(rest, mem, &value, &sample_unit, &err, &arena);
+        ok = ok && isfinite(time) && isfinite(value);
+        if (!ok) {
+            fprintf(output_fd, "%s\n", err.len > 0 ? err.s : stream_sample_msg);
+        } else if (window.next_seq > 0 && time < newest) {
+            fprintf(output_fd, "Timestamps can't go backwards: %g after %g\n", time, newest);
+        } else if (window.next_seq > 0 && !unit_convert_valid(sample_unit, unit, &err, &arena)) {
+            fprintf(output_fd, "%s\n", err.s);
+        } else {
+            if (window.next_seq == 0) {
+                unit = unit_copy(sample_unit, &repl_arena);
+                Unit rate_unit = stream_rate_unit(unit, &rate_scale, &repl_arena);
+                unit_str = display_unit(unit, &repl_arena);
+                rate_unit_str = display_unit(rate_unit, &repl_arena);
+            } else {
+                value = unit_convert(value, sample_unit, unit, &arena);
+            }
+            newest = time;
+            stream_window_add(&window, time, value);
+
+            size_t count = stream_window_count(&window);
+            double sum = stream_window_sum(&window);
+            const char *space = unit_str[0] != '\0' ? " " : "";
+            fprintf(output_fd, "%g: %zu sample%s, sum %g%s%s, mean %g%s%s, min %g%s%s, max %g%s%s", time,
+                    count, count == 1 ? "" : "s", sum, space, unit_str, sum / count, space, unit_str,
+                    stream_window_min(&window), space, unit_str, stream_window_max(&window), space, unit_str);
+            double rate;
+            if (stream_window_rate(&window, &rate)) {
+                fprintf(output_fd, ", rate %g%s%s", rate * rate_scale, rate_unit_str[0] != '\0' ? " " : "", rate_unit_str);
+            }
+            fprintf(output_fd, "\n");
+        }
+        arena_clear(&arena);
+    }
+    stream_window_free(&window);
+    memory_free(&mem);
+    arena_free(&arena);
+    arena_free(&repl_arena);
+    return 0;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aggregate.c"
+#include "arena.c"
+#include "statement.c"
+#include "work_deque.c"
+
+// Evaluate a prepared statement over a range of values of its
+// placeholder, on every core.
+//
+// The range is split into tasks of a fixed number of points, a few
+// chunks each, regardless of how many threads there are. Tasks are dealt
+// out in order, a run of them per worker, and idle workers steal from
+// the others. Each task reduces its points to an aggregate of its own,
+// and those are combined in a fixed tree over task indexes at the end,
+// so the result is the same, to the bit, on any number of threads.
+
+#define SWEEP_TASK_CHUNKS 16
+#define SWEEP_TASK_POINTS (SWEEP_TASK_CHUNKS * STATEMENT_CHUNK)
+#define SWEEP_MAX_THREADS 64
+#define SWEEP_MAX_ERROR 256
+
+typedef struct Sweep Sweep;
+
+typedef struct SweepWorker SweepWorker;
+struct SweepWorker {
+    Sweep *sweep;
+    pthread_t thread;
+    WorkDeque deque;
+    // Buffers for the statement, and conversions that need one
+    Arena arena;
+    StatementChunk chunk;
+    // Where to start looking for work to steal
+    size_t steal_from;
+};
+
+struct Sweep {
+    const Statement *stmt;
+    double start;
+    double step;
+    size_t n_points;
+    size_t n_tasks;
+    // One per task, in task order
+    Aggregate *summaries;
+    _Atomic size_t remaining;
+    // Set when a task fails, so the rest can stop early. The first to
+    // set it writes why to `error`.
+    _Atomic bool failed;
+    char error[SWEEP_MAX_ERROR];
+    SweepWorker *workers;
+    size_t n_workers;
+};
+
+// How many threads to sweep with by default: one per core.
+size_t sweep_default_threads() {
+    long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return n_cores > 0 ? (size_t)n_cores : 1;
+}
+
+// Sets `failed` if the statement fails on one of the task's points.
+void sweep_run_task(SweepWorker *worker, size_t task) {
+    Sweep *sweep = worker->sweep;
+    StatementChunk *chunk = &worker->chunk;
+    size_t begin = task * SWEEP_TASK_POINTS;
+    size_t end = begin + SWEEP_TASK_POINTS < sweep->n_points ? begin + SWEEP_TASK_POINTS : sweep->n_points;
+    Aggregate summary = aggregate_empty;
+    for (size_t done = begin; done < end; ) {
+        size_t n = end - done < STATEMENT_CHUNK ? end - done : STATEMENT_CHUNK;
+        for (size_t j = 0; j < n; j++) {
+            chunk->input[j] = sweep->start + (done + j) * sweep->step;
+        }
+        char error[SWEEP_MAX_ERROR];
+        const double *results = statement_run_chunk(sweep->stmt, chunk, n, error, sizeof(error), &worker->arena);
+        if (results == NULL) {
+            if (!atomic_exchange(&sweep->failed, true)) memcpy(sweep->error, error, sizeof(error));
+            return;
+        }
+        aggregate_add_values(&summary, results, n);
+        done += n;
+    }
+    sweep->summaries[task] = summary;
+}
+
+bool sweep_steal(SweepWorker *worker, size_t *task) {
+    Sweep *sweep = worker->sweep;
+    for (size_t i = 0; i < sweep->n_workers; i++) {
+        SweepWorker *victim = &sweep->workers[(worker->steal_from + i) % sweep->n_workers];
+        if (victim != worker && work_deque_steal(&victim->deque, task)) {
+            worker->steal_from = (worker->steal_from + i) % sweep->n_workers;
+            return true;
+        }
+    }
+    return false;
+}
+
+void *sweep_worker(void *worker_opaque) {
+    SweepWorker *worker = (SweepWorker *)worker_opaque;
+    Sweep *sweep = worker->sweep;
+    while (atomic_load_explicit(&sweep->remaining, memory_order_acquire) > 0) {
+        size_t task;
+        if (work_deque_pop(&worker->deque, &task) || sweep_steal(worker, &task)) {
+            if (!atomic_load_explicit(&sweep->failed, memory_order_relaxed)) sweep_run_task(worker, task);
+            atomic_fetch_sub_explicit(&sweep->remaining, 1, memory_order_release);
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Evaluate `stmt`, which has at most one placeholder, for `n_points`
+// values of it from `start`, `step` apart, on up to `n_threads` threads
+// including this one. Returns false, with the reason in `output`, if it
+// fails on any of them. With no points, `summary` is empty.
+bool sweep_run(const Statement *stmt, double start, double step, size_t n_points, size_t n_threads,
+               Aggregate *summary, char *output, size_t output_len) {
+    if (n_points == 0) {
+        *summary = (Aggregate) {0};
+        return true;
+    }
+    Sweep sweep = {
+        .stmt = stmt,
+        .start = start,
+        .step = step,
+        .n_points = n_points,
+        .n_tasks = (n_points + SWEEP_TASK_POINTS - 1) / SWEEP_TASK_POINTS,
+    };
+    sweep.summaries = malloc(sweep.n_tasks * sizeof(Aggregate));
+    assert(sweep.summaries != NULL);
+    atomic_init(&sweep.remaining, sweep.n_tasks);
+    atomic_init(&sweep.failed, false);
+    if (n_threads > SWEEP_MAX_THREADS) n_threads = SWEEP_MAX_THREADS;
+    sweep.n_workers = n_threads < sweep.n_tasks ? n_threads : sweep.n_tasks;
+    if (sweep.n_workers == 0) sweep.n_workers = 1;
+    sweep.workers = calloc(sweep.n_workers, sizeof(SweepWorker));
+    assert(sweep.workers != NULL);
+
+    size_t capacity = 1;
+    while (capacity < sweep.n_tasks) capacity *= 2;
+    for (size_t i = 0; i < sweep.n_workers; i++) {
+        SweepWorker *worker = &sweep.workers[i];
+        *worker = (SweepWorker) {
+            .sweep = &sweep,
+            .deque = work_deque_new(capacity),
+            .arena = arena_create(),
+            .steal_from = i + 1,
+        };
+        worker->chunk = statement_chunk_new(stmt, &worker->arena);
+        // A run of tasks each, pushed backwards so the owner goes
+        // forwards through it and thieves take from the far end
+        size_t first = sweep.n_tasks * i / sweep.n_workers;
+        size_t last = sweep.n_tasks * (i + 1) / sweep.n_workers;
+        for (size_t task = last; task > first; task--) {
+            work_deque_push(&worker->deque, task - 1);
+        }
+    }
+    // Start the others once every deque is ready, since they steal
+    for (size_t i = 1; i < sweep.n_workers; i++) {
+        assert(pthread_create(&sweep.workers[i].thread, NULL, sweep_worker, &sweep.workers[i]) == 0);
+    }
+    sweep_worker(&sweep.workers[0]);
+    for (size_t i = 1; i < sweep.n_workers; i++) {
+        pthread_join(sweep.workers[i].thread, NULL);
+    }
+
+    bool ok = !atomic_load(&sweep.failed);
+    if (ok) {
+        // Pairs of neighbours, then pairs of those, and so on
+        for (size_t width = 1; width < sweep.n_tasks; width *= 2) {
+            for (size_t i = 0; i + width < sweep.n_tasks; i += width * 2) {
+                sweep.summaries[i] = aggregate_combine(sweep.summaries[i], sweep.summaries[i + width]);
+            }
+        }
+        *summary = sweep.summaries[0];
+    } else {
+        snprintf(output, output_len, "%s", sweep.error);
+    }
+    for (size_t i = 0; i < sweep.n_workers; i++) {
+        free(sweep.workers[i].deque.tasks);
+        arena_free(&sweep.workers[i].arena);
+    }
+    free(sweep.workers);
+    free(sweep.summaries);
+    return ok;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.c"
+#include "concurrent_map.c"
+
+// Names of variables and user defined units, interned into small
+// integer ids, so memory refers to a name by its id: comparing two is
+// comparing integers, and memory is an array indexed by them instead of
+// a hash map.
+//
+// Every session has a table of its own, freed along with it, so ids
+// count up from 1 in the order the session first stored something
+// under each name, and arrays indexed by them only need to be as big as
+// the session's own names. Names are only interned when something is
+// stored under them: everything else, e.g. a typo, only looks them up,
+// so it doesn't grow the table.
+//
+// A name's id and its interned copy never change or go away while the
+// table does. Looking up a name or an id's name never locks. Interning
+// a name that's already there doesn't either, and new names are added
+// one at a time.
+
+typedef uint32_t Symbol;
+
+// Never a name's id, so arrays indexed by symbol can use it for "none"
+#define SYMBOL_NONE 0
+#define SYMBOL_PAGE_SIZE 1024
+#define SYMBOL_MAX_PAGES 64
+// Id 0 is SYMBOL_NONE, so a table has room for 65535 names
+#define SYMBOL_MAX_NAMES (SYMBOL_MAX_PAGES * SYMBOL_PAGE_SIZE - 1)
+
+typedef struct SymbolTable SymbolTable;
+struct SymbolTable {
+    // Held while adding a name
+    pthread_mutex_t lock;
+    // Interned names and the map
+    Arena arena;
+    // Name -> id
+    ConcurrentMap *ids;
+    // Id -> interned name, in pages so they never move
+    _Atomic(unsigned char **) pages[SYMBOL_MAX_PAGES];
+    _Atomic uint32_t count;
+};
+
+SymbolTable *symbol_table_new(void) {
+    SymbolTable *table = calloc(1, sizeof(SymbolTable));
+    assert(table != NULL);
+    pthread_mutex_init(&table->lock, NULL);
+    table->arena = arena_create();
+    table->ids = concurrent_map_new(sizeof(Symbol), &table->arena);
+    return table;
+}
+
+void symbol_table_free(SymbolTable *table) {
+    if (table == NULL) return;
+    pthread_mutex_destroy(&table->lock);
+    arena_free(&table->arena);
+    free(table);
+}
+
+// How many names have been interned, which is also the biggest id.
+uint32_t symbol_count(SymbolTable *table) {
+    return atomic_load_explicit(&table->count, memory_order_acquire);
+}
+
+// The id of the name that's the first `len` bytes of `name` if it's
+// been interned, or SYMBOL_NONE. `name` doesn't need to end there.
+Symbol symbol_lookup_len(SymbolTable *table, const unsigned char *name, size_t len) {
+    Symbol *symbol = concurrent_map_get_len(table->ids, name, len, CONCURRENT_MAP_LATEST);
+    return symbol != NULL ? *symbol : SYMBOL_NONE;
+}
+
+// The id of `name` if it's been interned, or SYMBOL_NONE.
+Symbol symbol_lookup(SymbolTable *table, const unsigned char *name) {
+    return symbol_lookup_len(table, name, strlen((char *)name));
+}
+
+// The id of the first `len` bytes of `name`, interning a copy of them
+// if they're new. A name that's been seen before isn't copied at all.
+// Returns SYMBOL_NONE if it's new and the table is full.
+Symbol symbol_intern_len(SymbolTable *table, const unsigned char *name, size_t len) {
+    Symbol symbol = symbol_lookup_len(table, name, len);
+    if (symbol != SYMBOL_NONE) return symbol;
+    pthread_mutex_lock(&table->lock);
+    // Someone else may have added it while we waited
+    symbol = symbol_lookup_len(table, name, len);
+    if (symbol == SYMBOL_NONE && atomic_load(&table->count) < SYMBOL_MAX_NAMES) {
+        symbol = atomic_load(&table->count) + 1;
+        size_t page = symbol / SYMBOL_PAGE_SIZE;
+        unsigned char **names = atomic_load(&table->pages[page]);
+        if (names == NULL) {
+            names = arena_alloc_aligned(&table->arena, SYMBOL_PAGE_SIZE * sizeof(unsigned char *),
+                                        alignof(unsigned char *));
+            atomic_store(&table->pages[page], names);
+        }
+        unsigned char *name_copy = arena_alloc(&table->arena, len + 1);
+        memcpy(name_copy, name, len);
+        name_copy[len] = '\0';
+        // Named before the id can be looked up
+        names[symbol % SYMBOL_PAGE_SIZE] = name_copy;
+        atomic_store(&table->count, symbol);
+        concurrent_map_insert(table->ids, name_copy, &symbol, 0, &table->arena);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return symbol;
+}
+
+// The id of `name`, interning it if it's new, or SYMBOL_NONE if the
+// table is full.
+Symbol symbol_intern(SymbolTable *table, const unsigned char *name) {
+    return symbol_intern_len(table, name, strlen((char *)name));
+}
+
+// The interned name of `symbol`, which has to be an id `symbol_intern`
+// returned.
+unsigned char *symbol_name(SymbolTable *table, Symbol symbol) {
+    assert(symbol != SYMBOL_NONE);
+    unsigned char **names = atomic_load_explicit(&table->pages[symbol / SYMBOL_PAGE_SIZE], memory_order_acquire);
+    return names[symbol % SYMBOL_PAGE_SIZE];
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "arena.c"
+#include "concurrent_map.c"
+#include "symbol.c"
+
+// Like `ConcurrentMap`, but keyed by symbol: values are in an array
+// indexed by the symbol's id, so a lookup is one load with no hashing
+// or string compares. Values are versioned the same way, and readers
+// never lock or wait.
+//
+// Ids are dense and count up from 1 within a session's own symbol
+// table, so the array is only as big as the names the session stored,
+// however many other sessions there are.
+//
+// Like `ConcurrentMap`, it keeps every value ever written to it until
+// its arenas are freed, see `memory_compact` for how that's bounded.
+
+typedef struct SymbolSlots SymbolSlots;
+struct SymbolSlots {
+    size_t capacity;
+    _Atomic(ConcurrentValue *) values[];
+};
+
+typedef struct SymbolMap SymbolMap;
+struct SymbolMap {
+    _Atomic(SymbolSlots *) slots;
+    // Number of symbols with a value, including ones whose only
+    // value is newer than what a reader can see.
+    _Atomic size_t size;
+    size_t value_size;
+    // Held shared by inserts, exclusively by resizes
+    pthread_rwlock_t resize_lock;
+};
+
+SymbolSlots *symbol_slots_new(size_t capacity, Arena *arena) {
+    size_t size = sizeof(SymbolSlots) + capacity * sizeof(ConcurrentValue *);
+    SymbolSlots *slots = arena_alloc_aligned(arena, size, alignof(SymbolSlots));
+    slots->capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&slots->values[i], NULL);
+    }
+    return slots;
+}
+
+SymbolMap *symbol_map_new(size_t value_size, Arena *arena) {
+    SymbolMap *map = arena_alloc_aligned(arena, sizeof(SymbolMap), alignof(SymbolMap));
+    atomic_init(&map->slots, symbol_slots_new(HASH_MAP_INIT_CAPACITY, arena));
+    atomic_init(&map->size, 0);
+    map->value_size = value_size;
+    pthread_rwlock_init(&map->resize_lock, NULL);
+    return map;
+}
+
+size_t symbol_map_size(SymbolMap *map) {
+    return atomic_load(&map->size);
+}
+
+// The value of `symbol` as of `version`, or NULL if it wasn't in the map yet.
+void *symbol_map_get(SymbolMap *map, Symbol symbol, uint64_t version) {
+    SymbolSlots *slots = atomic_load_explicit(&map->slots, memory_order_acquire);
+    if (symbol >= slots->capacity) return NULL;
+    return concurrent_value_at(atomic_load_explicit(&slots->values[symbol], memory_order_acquire), version);
+}
+
+bool symbol_map_contains(SymbolMap *map, Symbol symbol, uint64_t version) {
+    return symbol_map_get(map, symbol, version) != NULL;
+}
+
+void symbol_map_resize(SymbolMap *map, SymbolSlots *full, Symbol symbol, Arena *arena) {
+    pthread_rwlock_wrlock(&map->resize_lock);
+    // Someone else may have resized while we waited
+    if (atomic_load(&map->slots) == full) {
+        size_t capacity = full->capacity * 2;
+        while (capacity <= symbol) capacity *= 2;
+        SymbolSlots *slots = symbol_slots_new(capacity, arena);
+        for (size_t i = 0; i < full->capacity; i++) {
+            atomic_store_explicit(&slots->values[i], atomic_load(&full->values[i]), memory_order_relaxed);
+        }
+        atomic_store_explicit(&map->slots, slots, memory_order_release);
+    }
+    pthread_rwlock_unlock(&map->resize_lock);
+}
+
+// Set `symbol` to `value` as of `version`, as if it had first been set
+// at `first_version` if it hasn't been yet, e.g. when copying it from
+// another map. Threads inserting at the same time must each pass their
+// own `arena`, and the arenas have to live as long as the map. `value`
+// MUST have the map's `value_size`.
+void symbol_map_insert_first(SymbolMap *map, Symbol symbol, void *value, uint64_t version,
+                             uint64_t first_version, Arena *arena) {
+    ConcurrentValue *new_value = arena_alloc_aligned(arena, sizeof(ConcurrentValue) + map->value_size,
+                                                     alignof(ConcurrentValue));
+    new_value->version = version;
+    memcpy(new_value->data, value, map->value_size);
+    while (true) {
+        pthread_rwlock_rdlock(&map->resize_lock);
+        SymbolSlots *slots = atomic_load(&map->slots);
+        if (symbol >= slots->capacity) {
+            pthread_rwlock_unlock(&map->resize_lock);
+            symbol_map_resize(map, slots, symbol, arena);
+            continue;
+        }
+        ConcurrentValue *prev = atomic_load(&slots->values[symbol]);
+        do {
+            new_value->prev = prev;
+            new_value->first_version = prev != NULL ? prev->first_version : first_version;
+        } while (!atomic_compare_exchange_weak(&slots->values[symbol], &prev, new_value));
+        if (prev == NULL) atomic_fetch_add(&map->size, 1);
+        pthread_rwlock_unlock(&map->resize_lock);
+        return;
+    }
+}
+
+// Set `symbol` to `value` as of `version`, like `symbol_map_insert_first`.
+void symbol_map_insert(SymbolMap *map, Symbol symbol, void *value, uint64_t version, Arena *arena) {
+    symbol_map_insert_first(map, symbol, value, version, version, arena);
+}
+
+// For walking every symbol visible as of some version, in id order:
+// SymbolIter iter = symbol_map_iter(map, version);
+// while (symbol_map_iter_next(&iter)) { iter.symbol, iter.value }
+typedef struct SymbolIter SymbolIter;
+struct SymbolIter {
+    SymbolSlots *slots;
+    uint64_t version;
+    size_t idx;
+    Symbol symbol;
+    void *value;
+    // Version the symbol was first set at
+    uint64_t first_version;
+};
+
+SymbolIter symbol_map_iter(SymbolMap *map, uint64_t version) {
+    return (SymbolIter) { .slots = atomic_load(&map->slots), .version = version };
+}
+
+bool symbol_map_iter_next(SymbolIter *iter) {
+    while (iter->idx < iter->slots->capacity) {
+        Symbol symbol = iter->idx++;
+        ConcurrentValue *newest = atomic_load(&iter->slots->values[symbol]);
+        void *value = concurrent_value_at(newest, iter->version);
+        if (value == NULL) continue;
+        iter->symbol = symbol;
+        iter->value = value;
+        iter->first_version = newest->first_version;
+        return true;
+    }
+    return false;
+}
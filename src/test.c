@@ -3,14 +3,25 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "arena.c"
+#include "calculator.c"
+#include "convert_csv.c"
 #include "evaluate.c"
+#include "execute.c"
+#include "explain.c"
 #include "hash_map.c"
 #include "memory.c"
+#include "options.c"
 #include "parse.c"
+#include "pipeline.c"
+#include "scheduler.c"
+#include "server.c"
+#include "stream.c"
 #include "string.c"
 #include "tokenize.c"
+#include "trace.c"
 #include "debug.c"
 #include "unit.c"
+#include "watch.c"
 
 // Only global variable in this file. So
 // we don't have to pipe an extra bool through
@@ -84,10 +95,18 @@ bool tokens_equal(Token a, Token b) {
             builtin_unit_strings[a.unit_type]);
         return false;
     }
+    if ((a.type == TOK_VAR || a.type == TOK_PARAM) && !token_same_name(a, b)) {
+        printf("Expected variable %.*s, got %.*s\n", (int)b.var_len, b.var_name, (int)a.var_len, a.var_name);
+        return false;
+    }
     if (a.type == TOK_NUM && !eq_diff(a.number, b.number)) {
         printf("Expected number %f, got %f\n", b.number, a.number);
         return false;
     }
+    if (a.type == TOK_ARRAY && !array_values_identical(a.array, b.array)) {
+        printf("Expected array of %zu numbers, got %zu\n", b.array.length, a.array.length);
+        return false;
+    }
     return true;
 }
 
@@ -102,6 +121,26 @@ void test_tokenize_case(void *c_opaque) {
     for (size_t i = 0; i < tokens.length; i++) {
         assert(tokens_equal(tokens.tokens[i], c.expected[i]));
     }
+    // The same without the NUL, where reading on would change the tokens,
+    // and every token is where it says it is. The longest case has no
+    // NUL, so only go as far as `tokenize` does.
+    size_t input_len = strnlen(c.input, MAX_INPUT + 1);
+    char *view = arena_alloc(&arena, input_len + 2);
+    memcpy(view, c.input, input_len);
+    memcpy(view + input_len, "7x", 2);
+    TokenString view_tokens = tokenize_view(view, input_len, &arena);
+    assert_eq(view_tokens.length, c.length);
+    for (size_t i = 0; i < view_tokens.length; i++) {
+        assert(tokens_equal(view_tokens.tokens[i], c.expected[i]));
+        assert(view_tokens.tokens[i].offset + view_tokens.tokens[i].length <= input_len);
+        if (i > 0) assert(view_tokens.tokens[i].offset >= view_tokens.tokens[i - 1].offset + view_tokens.tokens[i - 1].length);
+        Token token = view_tokens.tokens[i];
+        if (token.type == TOK_VAR) {
+            // Names are slices of the input
+            assert_eq(token.var_len, token.length);
+            assert((const char *)token.var_name == view + token.offset);
+        }
+    }
     arena_free(&arena);
 }
 
@@ -122,11 +161,13 @@ void test_tokenize(void *case_idx_opaque) {
         {"2e3", 1, {token_new_num(2000)}},
         {"3.32e2", 1, {token_new_num(332)}},
         {"3.32E2", 1, {token_new_num(332)}},
-        {"3.32e-2", 1, {invalid_token}}, // TODO: handle negatives generally + in scientific notation?
-        {"asdf", 1, {token_new_variable("asdf", &case_arena)}},
+        {"3.32e-2", 1, {token_new_num(0.0332)}},
+        {"15e12", 1, {token_new_num(15e12)}},
+        {"3.32e", 1, {invalid_token}},
+        {"asdf", 1, {token_new_variable("asdf")}},
         {"quit", 1, {quit_token}},
         {"exit", 1, {quit_token}},
-        {"quitX", 1, {token_new_variable("quitX", &case_arena)}},
+        {"quitX", 1, {token_new_variable("quitX")}},
         {max_len_input, 1, {invalid_token}},
         // Units
         {"3 cm + 5.5min", 5, {
@@ -147,9 +188,21 @@ void test_tokenize(void *case_idx_opaque) {
             sub_token, token_new_num(50), token_new_unit(UNIT_KILOGRAM), caret_token, token_new_num(2),
             token_new_unit(UNIT_KILOMETER), caret_token, sub_token, token_new_num(2)
         }},
-        {"x = 4", 3, {token_new_variable("x", &case_arena), equals_token, token_new_num(4)}},
-        {"aSd4_f8", 1, {token_new_variable("aSd4_f8", &case_arena)}},
-        {"aS&4_f8", 2, {token_new_variable("aS", &case_arena), invalid_token}},
+        {"x = 4", 3, {token_new_variable("x"), equals_token, token_new_num(4)}},
+        {"y:=x", 3, {token_new_variable("y"), bind_token, token_new_variable("x")}},
+        {"aSd4_f8", 1, {token_new_variable("aSd4_f8")}},
+        {"aS&4_f8", 2, {token_new_variable("aS"), invalid_token}},
+        {"?speed km", 2, {token_new_param("speed"), token_new_unit(UNIT_KILOMETER)}},
+        {"sweep v = 1..2.5 step 0.5:", 9, {sweep_token, token_new_variable("v"), equals_token,
+            token_new_num(1), range_token, token_new_num(2.5), step_token, token_new_num(0.5), colon_token}},
+        {"? x", 1, {invalid_token}},
+        {"[1, -2.5,7] km", 2, {token_new_array((double[]) {1, -2.5, 7}, 3, &case_arena),
+            token_new_unit(UNIT_KILOMETER)}},
+        {"[ 4 ]", 1, {token_new_array((double[]) {4}, 1, &case_arena)}},
+        {"[1 2]", 1, {invalid_token}},
+        {"sum(x) -> 5 min", 7, {token_new_aggregate(AGGREGATE_SUM), lparen_token, token_new_variable("x"),
+            rparen_token, convert_token, token_new_num(5), token_new_unit(UNIT_MINUTE)}},
+        {"[]", 1, {invalid_token}},
         // Some units
         {"s sec secs second seconds", 5, {token_new_unit(UNIT_SECOND),
             token_new_unit(UNIT_SECOND), token_new_unit(UNIT_SECOND),
@@ -191,6 +244,13 @@ bool exprs_equal(Expression a, Expression b, Arena *arena) {
                 return false;
             }
             return true;
+        case EXPR_ARRAY:
+            if (!array_values_identical(a.expr.array, b.expr.array)) {
+                printf("Expected array %s, got %s\n", display_array_value(b.expr.array, arena).s,
+                    display_array_value(a.expr.array, arena).s);
+                return false;
+            }
+            return true;
         case EXPR_UNIT:
             if (!units_equal(a.expr.unit, b.expr.unit, arena)) {
                 printf("Expected unit %s, got %s\n", display_unit(b.expr.unit, arena),
@@ -199,13 +259,20 @@ bool exprs_equal(Expression a, Expression b, Arena *arena) {
             }
             return true;
         case EXPR_VAR:
-            if (strncmp((char *)a.expr.var_name, (char *)b.expr.var_name, MAX_INPUT) != 0) {
+            if (strcmp((const char *)a.expr.var_name, (const char *)b.expr.var_name) != 0) {
                 printf("Expected var %s, got %s\n", b.expr.var_name, a.expr.var_name);
                 return false;
             }
             return true;
         case EXPR_NEG:
             return exprs_equal(*a.expr.unary_expr.right, *b.expr.unary_expr.right, arena);
+        case EXPR_AGGREGATE:
+            if (a.expr.unary_expr.aggregate != b.expr.unary_expr.aggregate) {
+                printf("Expected %s, got %s\n", aggregate_names[b.expr.unary_expr.aggregate],
+                    aggregate_names[a.expr.unary_expr.aggregate]);
+                return false;
+            }
+            return exprs_equal(*a.expr.unary_expr.right, *b.expr.unary_expr.right, arena);
         case EXPR_CONST_UNIT: case EXPR_COMP_UNIT:
         case EXPR_ADD: case EXPR_SUB: case EXPR_MUL: case EXPR_DIV: case EXPR_INT_DIV:
         case EXPR_CONVERT: case EXPR_POW: case EXPR_DIV_UNIT: case EXPR_SET_VAR:
@@ -234,6 +301,7 @@ void test_parse_case(void *c_opaque) {
     assert(exprs_equal(expr, c->expected, &arena));
     String err = string_empty(&arena);
     assert(check_valid_expr(expr, &err, &arena));
+    memory_free(&mem);
     arena_free(&arena);
 }
 
@@ -317,7 +385,7 @@ void test_parse(void *case_idx_opaque) {
             expr_new_neg(expr_new_neg(expr_new_const_unit(7, expr_new_unit_degree(UNIT_OUNCE, expr_new_neg(expr_new_const(8), &case_arena), &case_arena), &case_arena), &case_arena), &case_arena),
         &case_arena)},
         {"x = 4", expr_new_bin(EXPR_SET_VAR,
-            expr_new_var((unsigned char *)"x", &case_arena),
+            expr_new_var((const unsigned char *)"x", SYMBOL_NONE),
             expr_new_const(4),
         &case_arena)},
         /*{"1 + 2km * 3 h / 2 km ^-2"}*/
@@ -348,6 +416,7 @@ void test_invalid_expr_case(void *c_opaque) {
     Expression expr = parse(tokens, mem, &arena);
     String err = string_empty(&arena);
     assert(!check_valid_expr(expr, &err, &arena));
+    memory_free(&mem);
     arena_free(&arena);
 }
 
@@ -405,6 +474,7 @@ void test_check_unit_case(void *c_opaque) {
     /*assert(check_valid_expr(expr, &err, &arena));*/
     Unit unit = check_unit(expr, mem, &err, &arena);
     assert(units_equal(unit, c->expected, &arena));
+    memory_free(&mem);
     arena_free(&arena);
 }
 
@@ -483,6 +553,7 @@ void test_evaluate_case(void *c_opaque) {
         debug("Expected: %f, got: %f\n", c->expected, result);
         assert(eq_diff(result, c->expected));
     }
+    memory_free(&mem);
     arena_free(&arena);
 }
 
@@ -577,15 +648,15 @@ void test_memory_case(void *c_opaque) {
         TokenString tokens = tokenize(c->input[i], &line_arena);
         if (tokens.length == 2 && tokens.tokens[0].type == TOK_ADD_UNIT
             && tokens.tokens[1].type == TOK_VAR) {
-            unsigned char *unit_name = tokens.tokens[1].var_name;
-            if (!memory_contains_unit(mem, unit_name)) {
-                memory_add_unit(&mem, unit_name, &mem_arena);
+            Symbol unit_symbol = symbol_intern_len(mem.symbols, tokens.tokens[1].var_name, tokens.tokens[1].var_len);
+            if (!memory_contains_unit(mem, unit_symbol)) {
+                memory_add_unit(&mem, unit_symbol, &mem_arena);
             }
             if (i < c->n_inputs - 1) arena_clear(&line_arena);
             continue;
         }
         Expression expr = parse(tokens, mem, &line_arena);
-        substitute_variables(&expr, mem);
+        substitute_variables(&expr, mem, &line_arena);
         substitute_units(&expr, mem, &line_arena);
         display_expr(0, expr, &line_arena);
         String err = string_empty(&line_arena);
@@ -593,19 +664,19 @@ void test_memory_case(void *c_opaque) {
         debug("err: %s\n", err.s);
         assert(valid);
         if (expr.type == EXPR_SET_VAR) {
-            unsigned char * var_name = expr.expr.binary_expr.left->expr.var_name;
-            Expression value = *expr.expr.binary_expr.right;
-            unit = check_unit(value, mem, &err, &line_arena);
-            if (expr_is_number(value.type)) {
-                double result = evaluate(value, mem, &err, &line_arena);
+            Symbol var = symbol_intern(mem.symbols, expr.expr.binary_expr.left->expr.var_name);
+            Expression value_expr = *expr.expr.binary_expr.right;
+            unit = check_unit(value_expr, mem, &err, &line_arena);
+            MemoryValue value;
+            if (expr_is_number(value_expr.type)) {
+                double result = evaluate(value_expr, mem, &err, &line_arena);
                 debug("err: %s\n", err.s);
                 assert(err.len == 0);
-                value = expr_new_const_unit(result, expr_new_unit_full(unit, &mem_arena),
-                    &mem_arena);
+                value = memory_value_number(result, unit, &mem_arena);
             } else {
-                value = expr_new_unit_full(unit, &mem_arena);
+                value = memory_value_unit(unit, &mem_arena);
             }
-            memory_add_var(&mem, var_name, value, &mem_arena);
+            memory_add_var(&mem, var, value, &mem_arena);
         } else {
             unit = check_unit(expr, mem, &err, &line_arena);
             result = evaluate(expr, mem, &err, &line_arena);
@@ -615,6 +686,7 @@ void test_memory_case(void *c_opaque) {
     assert(units_equal(unit, c->expected_unit, &line_arena));
     debug("Expected: %f, got: %f\n", c->expected_result, result);
     assert(eq_diff(result, c->expected_result));
+    memory_free(&mem);
 }
 
 void test_memory(void *case_idx_opaque) {
@@ -681,16 +753,16 @@ void test_memory(void *case_idx_opaque) {
 void test_memory_show(void *case_idx_opaque) {
     Arena arena = arena_create();
     Memory mem = memory_new(&arena);
-    unsigned char *var1 = (unsigned char *)"x";
-    Expression val1 = expr_new_const_unit(3, expr_new_unit_full(unit_new_none(&arena), &arena), &arena);
+    Symbol var1 = symbol_intern(mem.symbols, (unsigned char *)"x");
+    MemoryValue val1 = memory_value_number(3, unit_new_none(&arena), &arena);
     memory_add_var(&mem, var1, val1, &arena);
 
-    unsigned char *var2 = (unsigned char *)"y";
-    Expression val2 = expr_new_unit_builtin(UNIT_KILOGRAM, &arena);
+    Symbol var2 = symbol_intern(mem.symbols, (unsigned char *)"y");
+    MemoryValue val2 = memory_value_unit(unit_new_single_builtin(UNIT_KILOGRAM, 1, &arena), &arena);
     memory_add_var(&mem, var2, val2, &arena);
 
-    unsigned char *var3 = (unsigned char *)"z";
-    Expression val3 = expr_new_const_unit(8, expr_new_unit_builtin(UNIT_KILOMETER, &arena), &arena);
+    Symbol var3 = symbol_intern(mem.symbols, (unsigned char *)"z");
+    MemoryValue val3 = memory_value_number(8, unit_new_single_builtin(UNIT_KILOMETER, 1, &arena), &arena);
     memory_add_var(&mem, var3, val3, &arena);
 
     String mem_str = memory_show(mem, &arena);
@@ -698,14 +770,234 @@ void test_memory_show(void *case_idx_opaque) {
     assert(strncmp(mem_str.s, "x = 3none\ny = kg\nz = 8 km", 25) == 0);
 #else
     assert(strncmp(mem_str.s, "x = 3\ny = kg\nz = 8 km", 21) == 0);
+    memory_free(&mem);
 #endif
 }
 
+// Execute `input` and check it outputs `expected`
+void test_formula_line(Memory *mem, Arena *arena, const char *input, const char *expected) {
+    char output[MAX_OUTPUT] = {0};
+    execute_line(input, output, sizeof(output), mem, arena);
+    debug("%s -> %s\n", input, output);
+    assert(strcmp(output, expected) == 0);
+}
+
+bool test_formula_dirty(Memory mem, const char *var_name) {
+    const Formula *formula = memory_get_formula(mem, symbol_lookup(mem.symbols, (unsigned char *)var_name));
+    assert(formula != NULL);
+    return formula->dirty;
+}
+
+void test_formulas(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    test_formula_line(&mem, &arena, "x = 2", "x = 2");
+    test_formula_line(&mem, &arena, "y := x * 3 km", "y = 6 km");
+    test_formula_line(&mem, &arena, "z := y + 1 km", "z = 7 km");
+    test_formula_line(&mem, &arena, "w := 5 m", "w = 5 m");
+
+    // Changes mark what depends on them, and nothing else,
+    // and are only recomputed when read
+    test_formula_line(&mem, &arena, "x = 4", "x = 4");
+    assert(test_formula_dirty(mem, "y"));
+    assert(test_formula_dirty(mem, "z"));
+    assert(!test_formula_dirty(mem, "w"));
+    test_formula_line(&mem, &arena, "y", "12 km");
+    assert(!test_formula_dirty(mem, "y"));
+    assert(test_formula_dirty(mem, "z"));
+    test_formula_line(&mem, &arena, "z -> m", "13000 m");
+    assert(!test_formula_dirty(mem, "z"));
+    test_formula_line(&mem, &arena, "memory", "x = 4\ny := x * 3 km\nz := y + 1 km\nw := 5 m");
+
+    // Errors stick until an input changes again
+    test_formula_line(&mem, &arena, "x = 1 s", "x = 1 s");
+    test_formula_line(&mem, &arena, "z * 2", "Formula z: Convert invalid: lengths not equal: From: km To: s km");
+    test_formula_line(&mem, &arena, "x = 1", "x = 1");
+    test_formula_line(&mem, &arena, "z * 2", "8 km");
+
+    test_formula_line(&mem, &arena, "y := z", "Formula can't depend on itself: y");
+    test_formula_line(&mem, &arena, "q := q + 1", "Formula can't depend on itself: q");
+    test_formula_line(&mem, &arena, "r := x = 3", "Formulas look like: name := expression");
+    test_formula_line(&mem, &arena, "3 := x", "Formulas look like: name := expression");
+
+    // Assigning a formula makes it a regular variable
+    test_formula_line(&mem, &arena, "y = 2 km", "y = 2 km");
+    assert(memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"y")) == NULL);
+    test_formula_line(&mem, &arena, "x = 5", "x = 5");
+    test_formula_line(&mem, &arena, "z", "3 km");
+
+    // What a formula parses to depends on what its variables are
+    test_formula_line(&mem, &arena, "u := x km", "u = 5 km");
+    test_formula_line(&mem, &arena, "x = h", "x = h");
+    test_formula_line(&mem, &arena, "u", "h km");
+
+    // Parts that don't depend on variables are folded when it's defined
+    test_formula_line(&mem, &arena, "t = 1 h", "t = 1 h");
+    test_formula_line(&mem, &arena, "v := t + 3600 s * 2 + 30 min", "v = 3.5 h");
+    const Expression *compiled = memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"v"))->compiled;
+    assert_eq(compiled->type, EXPR_ADD);
+    Expression inner = *compiled->expr.binary_expr.left;
+    assert_eq(inner.type, EXPR_ADD);
+    assert_eq(inner.expr.binary_expr.right->type, EXPR_CONST_UNIT);
+    assert_eq(inner.expr.binary_expr.right->expr.binary_expr.left->expr.constant, 7200);
+    test_formula_line(&mem, &arena, "t = 2 h", "t = 2 h");
+    test_formula_line(&mem, &arena, "v", "4.5 h");
+    test_formula_line(&mem, &arena, "p := 5 km / 1000 m * t", "p = 10 h");
+    compiled = memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"p"))->compiled;
+    assert_eq(compiled->type, EXPR_MUL);
+    assert_eq(compiled->expr.binary_expr.left->type, EXPR_CONST_UNIT);
+
+    // Equal parts of formulas are the same node
+    test_formula_line(&mem, &arena, "q := t * 2 km / h + t * 2 km / h", "q = 8 km");
+    compiled = memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"q"))->compiled;
+    assert(compiled->expr.binary_expr.left == compiled->expr.binary_expr.right);
+    // and only in its program once, before the root
+    ExprArray program = memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"q"))->program;
+    ExprNode root = program.nodes[program.length - 1];
+    assert_eq(root.type, EXPR_ADD);
+    assert_eq(root.left, root.right);
+    assert(root.left < program.length - 1);
+    for (uint32_t i = 0; i < program.length - 1; i++) {
+        assert(program.nodes[i].type != EXPR_ADD);
+    }
+    assert_eq(program.symbols[0], symbol_intern(mem.symbols, (unsigned char *)"t"));
+    test_formula_line(&mem, &arena, "r := t * 2 km / h", "r = 4 km");
+    assert(memory_get_formula(mem, symbol_intern(mem.symbols, (unsigned char *)"r"))->compiled == compiled->expr.binary_expr.left);
+    test_formula_line(&mem, &arena, "t = 3 h", "t = 3 h");
+    test_formula_line(&mem, &arena, "q", "12 km");
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
 typedef struct {
     const Unit unit;
     const char *expected;
 } DisplayUnitCase;
 
+void test_sweep(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    test_formula_line(&mem, &arena, "sweep v = 1..1000000: v km/h -> m/s",
+        "1000000 points: min 0.277778 m s^-1, max 277778 m s^-1, mean 138889 m s^-1, stddev 80187.6 m s^-1");
+    test_formula_line(&mem, &arena, "sweep v = 0..100 step 0.5: v C -> F", "201 points: min 32 F, max 212 F, mean 122 F, stddev 52.3511 F");
+    test_formula_line(&mem, &arena, "sweep v = -2..2: -v * 3", "5 points: min -6, max 6, mean 0, stddev 4.74342");
+    // Chunks that don't fill the last vector
+    test_formula_line(&mem, &arena, "sweep v = 1..1027: 7 // v", "1027 points: min 0, max 7, mean 0.0155794, stddev 0.253149");
+    // Parts that don't depend on what's swept, and variables
+    test_formula_line(&mem, &arena, "len = 1 mi", "len = 1 mi");
+    test_formula_line(&mem, &arena, "sweep v = 1..3: v km + len -> m", "3 points: min 2609.34 m, max 4609.34 m, mean 3609.34 m, stddev 1000 m");
+    test_formula_line(&mem, &arena, "sweep v = 1..3: 2 * len", "3 points: min 2 mi, max 2 mi, mean 2 mi, stddev 0 mi");
+    test_formula_line(&mem, &arena, "sweep v = 0..3: 10 km / v h", "Cannot divide by zero");
+    test_formula_line(&mem, &arena, "sweep v = 1..3: km", "Sweeps need an expression with a value, not just a unit: km");
+    test_formula_line(&mem, &arena, "sweep v = 3..1: v", "Sweep has no points: 3..1 step 1");
+    test_formula_line(&mem, &arena, "sweep v = 1e999..1e999: v", "Sweep bounds have to be finite: inf..inf step 1");
+    test_formula_line(&mem, &arena, "sweep v = 1..2 step 1e-999: v", "Sweep has no points: 1..2 step 0");
+    test_formula_line(&mem, &arena, "sweep v = 1..3 v", "Sweeps look like: sweep x = 1..100 step 0.5: expression");
+    test_formula_line(&mem, &arena, "sweep v = 1..3: v = 2", "Sweeps can only evaluate expressions");
+
+    // The same to the bit on any number of threads
+    char output[MAX_OUTPUT];
+    Statement stmt;
+    assert(statement_prepare(tokenize("?v km/h * 3 -> m/s", &arena), mem, &stmt, "Prepared statements", output, sizeof(output), &arena));
+    Aggregate one;
+    assert(sweep_run(&stmt, 0.1, 0.37, SWEEP_TASK_POINTS * 9 + 3, 1, &one, output, sizeof(output)));
+    const size_t n_threads[] = {2, 3, 8};
+    for (size_t i = 0; i < sizeof(n_threads) / sizeof(n_threads[0]); i++) {
+        Aggregate many;
+        assert(sweep_run(&stmt, 0.1, 0.37, SWEEP_TASK_POINTS * 9 + 3, n_threads[i], &many, output, sizeof(output)));
+        assert(memcmp(&one, &many, sizeof(Aggregate)) == 0);
+    }
+    assert(statement_prepare(tokenize("1 km / ?v h", &arena), mem, &stmt, "Prepared statements", output, sizeof(output), &arena));
+    assert(!sweep_run(&stmt, -SWEEP_TASK_POINTS * 2, 1, SWEEP_TASK_POINTS * 4, 4, &one, output, sizeof(output)));
+    assert(sweep_run(&stmt, 0, 1, 0, 4, &one, output, sizeof(output)));
+    assert_eq(one.count, 0);
+    assert(strcmp(output, "Cannot divide by zero") == 0);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+void test_arrays(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    test_formula_line(&mem, &arena, "dist = [1, 2.5, 7] km", "dist = [1, 2.5, 7] km");
+    // Units are worked out once for the whole array
+    test_formula_line(&mem, &arena, "dist + 500 m", "[1.5, 3, 7.5] km");
+    test_formula_line(&mem, &arena, "dist -> mi", "[0.621371, 1.55343, 4.3496] mi");
+    test_formula_line(&mem, &arena, "dist * dist", "[1, 6.25, 49] km^2");
+    test_formula_line(&mem, &arena, "-dist // 2 km", "[-1, -2, -4] ");
+    test_formula_line(&mem, &arena, "temps = [0, 37, 100] C", "temps = [0, 37, 100] C");
+    test_formula_line(&mem, &arena, "temps -> F", "[32, 98.6, 212] F");
+    // Longer than a vector, with a remainder
+    test_formula_line(&mem, &arena, "[1, 2, 3, 4, 5, 6] s * [6, 5, 4, 3, 2, 1]", "[6, 10, 12, 12, 10, 6] s");
+    test_formula_line(&mem, &arena, "dist / [1, 0, 2]", "Cannot divide by zero");
+    test_formula_line(&mem, &arena, "dist + [1, 2] km", "Arrays have different lengths: 3 and 2");
+    test_formula_line(&mem, &arena, "km ^ [1, 2]", "Unit degrees can't be arrays");
+    // Formulas fall back to the tree for arrays
+    test_formula_line(&mem, &arena, "total := dist + 1 km", "total = [2, 3.5, 8] km");
+    test_formula_line(&mem, &arena, "dist = [5] m", "dist = [5] m");
+    test_formula_line(&mem, &arena, "total", "[1005] m");
+    test_formula_line(&mem, &arena, "sweep v = 1..3: v * dist", "Sweeps can't use arrays");
+
+    // Conversions worked out as a scale and an offset are exact, and
+    // give what converting one number at a time does, to the bit
+    Unit celsius = unit_new_single_builtin(UNIT_CELSIUS, 1, &arena);
+    Unit fahrenheit = unit_new_single_builtin(UNIT_FAHRENHEIT, 1, &arena);
+    double scale, offset;
+    assert(unit_convert_affine(celsius, fahrenheit, &scale, &offset));
+    assert(scale == 1.8 && offset == 32);
+    assert(unit_convert_affine(fahrenheit, unit_new_single_builtin(UNIT_KELVIN, 1, &arena), &scale, &offset));
+    assert(scale == 5.0 / 9.0 && offset == 45967.0 * 5 / 900);
+    assert(!unit_convert_affine(unit_new_single_builtin(UNIT_CELSIUS, -1, &arena), fahrenheit, &scale, &offset));
+    ArrayValue temps = array_value_new(5, &arena);
+    const double celsius_values[] = {36, 100, -40, 37.5, -273.15};
+    memcpy(temps.values, celsius_values, sizeof(celsius_values));
+    ArrayValue converted = array_value_convert(temps, celsius, fahrenheit, &arena);
+    for (size_t i = 0; i < 5; i++) {
+        assert(converted.values[i] == unit_convert(celsius_values[i], celsius, fahrenheit, &arena));
+    }
+    assert(converted.values[0] == 96.8 && converted.values[1] == 212);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+void test_aggregates(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    test_formula_line(&mem, &arena, "dist = [1, 2.5, 7, 0.5, 4] km", "dist = [1, 2.5, 7, 0.5, 4] km");
+    test_formula_line(&mem, &arena, "sum(dist) -> mi", "9.32057 mi");
+    test_formula_line(&mem, &arena, "mean(dist)", "3 km");
+    test_formula_line(&mem, &arena, "min(dist) + max(dist)", "7.5 km");
+    test_formula_line(&mem, &arena, "stddev(dist * 2)", "5.24404 km");
+    test_formula_line(&mem, &arena, "sum(3 km)", "3 km");
+    test_formula_line(&mem, &arena, "5 min -> s", "300 s");
+    test_formula_line(&mem, &arena, "mean(dist) km", "Invalid expression: Aggregates look like: mean(expression)");
+    test_formula_line(&mem, &arena, "sum(km)", "Expected to sum numbers, instead got: unit");
+    test_formula_line(&mem, &arena, "total := sum(dist - 1 km)", "total = 10 km");
+    test_formula_line(&mem, &arena, "memory", "dist = [1, 2.5, 7, 0.5, 4] km\ntotal := sum(dist - 1 km)");
+    // Compensated, so the ones aren't lost next to the large number
+    test_formula_line(&mem, &arena, "sum([10000000000000000, 1, 1, 1, 1, 1, 1, 1, 1]) - 10000000000000000", "8 ");
+
+    // The same in any number of pieces
+    double values[1003];
+    for (size_t i = 0; i < 1003; i++) values[i] = 0.1 * (i % 7);
+    Aggregate whole = aggregate_empty;
+    aggregate_add_values(&whole, values, 1003);
+    Aggregate one_by_one = aggregate_empty;
+    for (size_t i = 0; i < 1003; i++) aggregate_add(&one_by_one, values[i]);
+    Aggregate halves = aggregate_empty;
+    aggregate_add_values(&halves, values, 500);
+    Aggregate rest = aggregate_empty;
+    aggregate_add_values(&rest, values + 500, 503);
+    halves = aggregate_combine(halves, rest);
+    for (AggregateType type = AGGREGATE_SUM; type <= AGGREGATE_STDDEV; type++) {
+        assert(eq_diff(aggregate_result(whole, type), aggregate_result(one_by_one, type)));
+        assert(eq_diff(aggregate_result(whole, type), aggregate_result(halves, type)));
+    }
+    assert(eq_diff(aggregate_result(whole, AGGREGATE_MAX), 0.6));
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
 void test_display_unit(void *case_idx_opaque) {
     Arena arena = arena_create();
     DisplayUnitCase cases[] = {
@@ -853,10 +1145,205 @@ void test_hash_map_struct(void *_) {
     assert(test_struct_eq(*(TestStruct *)hash_map_get(map, key4), val4));
 }
 
+void test_concurrent_map_versions(void *_) {
+    const unsigned char *key1 = (unsigned char *)"x";
+    const unsigned char *key2 = (unsigned char *)"abcdefghijklmnoppqrstuvwxyz";
+    int val1 = 1;
+    int val2 = 2;
+    int val1_replace = 3;
+
+    Arena arena = arena_create();
+    ConcurrentMap *map = concurrent_map_new(sizeof(int), &arena);
+    concurrent_map_insert(map, key1, (void *)&val1, 1, &arena);
+    concurrent_map_insert(map, key2, (void *)&val2, 2, &arena);
+    concurrent_map_insert(map, key1, (void *)&val1_replace, 3, &arena);
+
+    assert_eq(concurrent_map_size(map), 2);
+    assert(!concurrent_map_contains(map, key1, 0));
+    assert_eq(*(int *)concurrent_map_get(map, key1, 1), val1);
+    assert(!concurrent_map_contains(map, key2, 1));
+    assert_eq(*(int *)concurrent_map_get(map, key1, 2), val1);
+    assert_eq(*(int *)concurrent_map_get(map, key2, 2), val2);
+    assert_eq(*(int *)concurrent_map_get(map, key1, CONCURRENT_MAP_LATEST), val1_replace);
+    assert(concurrent_map_get_key(map, key2) != key2);
+    assert(strcmp((char *)concurrent_map_get_key(map, key2), (char *)key2) == 0);
+
+    size_t seen = 0;
+    ConcurrentIter iter = concurrent_map_iter(map, 1);
+    while (concurrent_map_iter_next(&iter)) {
+        assert(strcmp((char *)iter.key, (char *)key1) == 0);
+        seen++;
+    }
+    assert_eq(seen, 1);
+    arena_free(&arena);
+}
+
+void test_symbol_map(void *_) {
+    SymbolTable *symbols = symbol_table_new();
+    Symbol x = symbol_intern(symbols, (unsigned char *)"x");
+    Symbol long_name = symbol_intern(symbols, (unsigned char *)"abcdefghijklmnoppqrstuvwxyz");
+    assert(x != SYMBOL_NONE && long_name != SYMBOL_NONE && x != long_name);
+    assert_eq(symbol_intern(symbols, (unsigned char *)"x"), x);
+    assert_eq(symbol_lookup(symbols, (unsigned char *)"x"), x);
+    assert_eq(symbol_lookup(symbols, (unsigned char *)"never_interned"), SYMBOL_NONE);
+    assert_eq(symbol_lookup_len(symbols, (unsigned char *)"xyz", 1), x);
+    assert(strcmp((char *)symbol_name(symbols, long_name), "abcdefghijklmnoppqrstuvwxyz") == 0);
+    // Ids past the initial capacity grow the map
+    char name[16];
+    Symbol last = SYMBOL_NONE;
+    for (size_t i = 0; i < HASH_MAP_INIT_CAPACITY * 4; i++) {
+        snprintf(name, sizeof(name), "sym%zu", i);
+        last = symbol_intern(symbols, (unsigned char *)name);
+    }
+    int val1 = 1;
+    int val2 = 2;
+    int val1_replace = 3;
+
+    Arena arena = arena_create();
+    SymbolMap *map = symbol_map_new(sizeof(int), &arena);
+    symbol_map_insert(map, x, (void *)&val1, 1, &arena);
+    symbol_map_insert(map, last, (void *)&val2, 2, &arena);
+    symbol_map_insert(map, x, (void *)&val1_replace, 3, &arena);
+
+    assert_eq(symbol_map_size(map), 2);
+    assert(!symbol_map_contains(map, x, 0));
+    assert_eq(*(int *)symbol_map_get(map, x, 1), val1);
+    assert(!symbol_map_contains(map, last, 1));
+    assert(!symbol_map_contains(map, long_name, CONCURRENT_MAP_LATEST));
+    assert_eq(*(int *)symbol_map_get(map, last, 2), val2);
+    assert_eq(*(int *)symbol_map_get(map, x, CONCURRENT_MAP_LATEST), val1_replace);
+
+    size_t seen = 0;
+    SymbolIter iter = symbol_map_iter(map, 1);
+    while (symbol_map_iter_next(&iter)) {
+        assert_eq(iter.symbol, x);
+        seen++;
+    }
+    assert_eq(seen, 1);
+    symbol_table_free(symbols);
+    arena_free(&arena);
+}
+
+void test_symbol_ids_dense(void *_) {
+    Arena arena = arena_create();
+    Memory busy = memory_new(&arena);
+    Memory mem = memory_new(&arena);
+    char output[MAX_OUTPUT];
+    char line[32];
+    for (size_t i = 0; i < HASH_MAP_INIT_CAPACITY * 4; i++) {
+        snprintf(line, sizeof(line), "v%zu = %zu", i, i);
+        execute_line(line, output, sizeof(output), &busy, &arena);
+    }
+    // Another session's names don't use up ids, and ids are given out
+    // in the order names are first stored
+    execute_line("b = 1", output, sizeof(output), &mem, &arena);
+    execute_line("c + 1", output, sizeof(output), &mem, &arena);
+    execute_line("speed := b * 2", output, sizeof(output), &mem, &arena);
+    assert_eq(symbol_lookup(mem.symbols, (unsigned char *)"b"), 1);
+    assert_eq(symbol_lookup(mem.symbols, (unsigned char *)"speed"), 2);
+    assert_eq(symbol_lookup(mem.symbols, (unsigned char *)"c"), SYMBOL_NONE);
+    assert_eq(atomic_load(&mem.vars->slots)->capacity, HASH_MAP_INIT_CAPACITY);
+    assert(atomic_load(&busy.vars->slots)->capacity > HASH_MAP_INIT_CAPACITY * 4);
+    memory_free(&busy);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+void test_symbol_table_full(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    char output[MAX_OUTPUT];
+    // Names that are only read aren't interned
+    execute_line("x = 1", output, sizeof(output), &mem, &arena);
+    execute_line("typo + 1", output, sizeof(output), &mem, &arena);
+    execute_line("y = typo", output, sizeof(output), &mem, &arena);
+    assert_eq(symbol_count(mem.symbols), 1);
+
+    char name[16];
+    for (size_t i = symbol_count(mem.symbols); i < SYMBOL_MAX_NAMES; i++) {
+        snprintf(name, sizeof(name), "v%zu", i);
+        assert(symbol_intern(mem.symbols, (unsigned char *)name) != SYMBOL_NONE);
+    }
+    assert_eq(symbol_intern(mem.symbols, (unsigned char *)"one_too_many"), SYMBOL_NONE);
+    // Names already there still work
+    execute_line("x = 2", output, sizeof(output), &mem, &arena);
+    assert(strcmp(output, "x = 2") == 0);
+    execute_line("z = 2", output, sizeof(output), &mem, &arena);
+    assert(strcmp(output, "Too many names, a session can have at most 65535") == 0);
+    execute_line("w := x", output, sizeof(output), &mem, &arena);
+    assert(strcmp(output, "Too many names, a session can have at most 65535") == 0);
+    execute_line("addunit widget", output, sizeof(output), &mem, &arena);
+    assert(strcmp(output, "Too many names, a session can have at most 65535") == 0);
+    execute_line("memory", output, sizeof(output), &mem, &arena);
+    assert(strcmp(output, "x = 2") == 0);
+    memory_free(&mem);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+#define CONCURRENT_MAP_TEST_THREADS 8
+#define CONCURRENT_MAP_TEST_KEYS 1000
+
+typedef struct ConcurrentMapTest ConcurrentMapTest;
+struct ConcurrentMapTest {
+    ConcurrentMap *map;
+    Arena arena;
+    size_t thread;
+};
+
+void *concurrent_map_test_thread(void *test_opaque) {
+    ConcurrentMapTest *test = (ConcurrentMapTest *)test_opaque;
+    // Every thread inserts every key, and checks the keys it's already
+    // inserted while other threads are inserting and resizing
+    for (size_t i = 0; i < CONCURRENT_MAP_TEST_KEYS; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "v%zu", i);
+        concurrent_map_insert(test->map, (unsigned char *)key, &i, test->thread, &test->arena);
+        for (size_t j = 0; j <= i; j += 97) {
+            snprintf(key, sizeof(key), "v%zu", j);
+            size_t *value = concurrent_map_get(test->map, (unsigned char *)key, CONCURRENT_MAP_LATEST);
+            assert(value != NULL);
+            assert_eq(*value, j);
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_map_threads(void *_) {
+    Arena arena = arena_create();
+    ConcurrentMap *map = concurrent_map_new(sizeof(size_t), &arena);
+    ConcurrentMapTest tests[CONCURRENT_MAP_TEST_THREADS];
+    pthread_t threads[CONCURRENT_MAP_TEST_THREADS];
+    for (size_t i = 0; i < CONCURRENT_MAP_TEST_THREADS; i++) {
+        tests[i] = (ConcurrentMapTest) { .map = map, .arena = arena_create(), .thread = i };
+        assert(pthread_create(&threads[i], NULL, concurrent_map_test_thread, &tests[i]) == 0);
+    }
+    for (size_t i = 0; i < CONCURRENT_MAP_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert_eq(concurrent_map_size(map), CONCURRENT_MAP_TEST_KEYS);
+    size_t seen = 0;
+    ConcurrentIter iter = concurrent_map_iter(map, CONCURRENT_MAP_LATEST);
+    while (concurrent_map_iter_next(&iter)) {
+        assert_eq(*(size_t *)iter.value, strtoul((char *)iter.key + 1, NULL, 10));
+        seen++;
+    }
+    assert_eq(seen, CONCURRENT_MAP_TEST_KEYS);
+    for (size_t i = 0; i < CONCURRENT_MAP_TEST_THREADS; i++) {
+        arena_free(&tests[i].arena);
+    }
+    arena_free(&arena);
+}
+
 void test_hash_map(void *case_idx_opaque) {
     void (*cases[])(void *) = {
         test_hash_map_int,
         test_hash_map_struct,
+        test_concurrent_map_versions,
+        test_concurrent_map_threads,
+        test_symbol_map,
+        test_symbol_ids_dense,
+        test_symbol_table_full,
     };
     const size_t n_tests = sizeof(cases) / sizeof(cases[0]);
     bool all_passed = true;
@@ -867,6 +1354,863 @@ void test_hash_map(void *case_idx_opaque) {
     assert(all_passed);
 }
 
+typedef struct TraceThreadTest TraceThreadTest;
+struct TraceThreadTest {
+    _Atomic int step;
+};
+
+// Records once, waits for the test to shut tracing down, then records again.
+void *trace_test_thread(void *test_opaque) {
+    TraceThreadTest *test = test_opaque;
+    trace_instant(TRACE_EXECUTE, "before", NULL, 0);
+    atomic_store(&test->step, 1);
+    while (atomic_load(&test->step) != 2) usleep(100);
+    trace_instant(TRACE_EXECUTE, "after", NULL, 0);
+    return NULL;
+}
+
+void test_trace(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    FILE *out = tmpfile();
+    assert(out != NULL);
+
+    // Nothing is recorded while disabled
+    memory_contains_var(mem, symbol_intern(mem.symbols, (unsigned char *)"x"));
+    assert_eq(trace_flush(out), 0);
+
+    trace_set_enabled(TRACE_MEMORY, true);
+    memory_contains_var(mem, symbol_intern(mem.symbols, (unsigned char *)"x"));
+    trace_begin(TRACE_PARSE, "parse"); // Parse still disabled
+    trace_set_enabled(TRACE_MEMORY, false);
+    memory_contains_var(mem, symbol_intern(mem.symbols, (unsigned char *)"y"));
+    assert_eq(trace_flush(out), 1);
+
+    char line[128] = {0};
+    rewind(out);
+    assert(fgets(line, sizeof(line), out) != NULL);
+    debug("Trace line: %s", line);
+    assert(strstr(line, "memory i contains_var x") != NULL);
+
+    assert(trace_enable_list("parse,evaluate"));
+    assert(trace_enabled(TRACE_PARSE) && trace_enabled(TRACE_EVALUATE));
+    assert(!trace_enabled(TRACE_MEMORY));
+    assert(!trace_enable_list("parse,bogus"));
+    trace_set_all(false);
+
+    // A full ring drops instead of blocking
+    trace_set_enabled(TRACE_ARENA, true);
+    for (size_t i = 0; i < TRACE_RING_SIZE + 10; i++) {
+        trace_instant(TRACE_ARENA, "spam", NULL, i);
+    }
+    assert_eq(atomic_load(&trace_ring_get()->dropped), 10);
+    assert_eq(trace_flush(out), TRACE_RING_SIZE);
+    trace_set_all(false);
+    fclose(out);
+
+    // Chrome trace events, muted threads record nothing
+    out = tmpfile();
+    TraceFormat format = tracer.format;
+    tracer.format = TRACE_FORMAT_CHROME;
+    trace_set_enabled(TRACE_PARSE, true);
+    trace_event(TRACE_PARSE, TRACE_BEGIN, "parse", "x = \"y\"", 0);
+    trace_set_muted(true);
+    trace_end(TRACE_PARSE, "parse");
+    trace_set_muted(false);
+    assert_eq(trace_flush(out), 1);
+    char json[256] = {0};
+    rewind(out);
+    assert(fread(json, 1, sizeof(json) - 1, out) > 0);
+    debug("Chrome event: %s\n", json);
+    assert(strstr(json, "\"name\":\"parse\",\"cat\":\"parse\",\"ph\":\"B\"") != NULL);
+    assert(strstr(json, "\"detail\":\"x = \\\"y\\\"\"") != NULL);
+    trace_set_all(false);
+    tracer.format = format;
+    fclose(out);
+
+    // Shutting down frees rings other threads still have cached, so they
+    // have to make new ones rather than record into the freed ones
+    trace_set_enabled(TRACE_EXECUTE, true);
+    trace_start(tmpfile(), TRACE_FORMAT_TEXT);
+    TraceThreadTest thread_test = {0};
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, trace_test_thread, &thread_test) == 0);
+    while (atomic_load(&thread_test.step) != 1) usleep(100);
+    trace_shutdown();
+    trace_set_enabled(TRACE_EXECUTE, true);
+    atomic_store(&thread_test.step, 2);
+    assert(pthread_join(thread, NULL) == 0);
+    trace_set_all(false);
+    out = tmpfile();
+    assert_eq(trace_flush(out), 1);
+    rewind(out);
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strstr(line, "execute i after") != NULL);
+    fclose(out);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+void test_explain(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    MemoryValue x = memory_value_number(3, unit_new_single_builtin(UNIT_KILOMETER, 1, &arena), &arena);
+    memory_add_var(&mem, symbol_intern(mem.symbols, (unsigned char *)"x"), x, &arena);
+
+    TokenString tokens = tokenize("x + 2 mi -> ft", &arena);
+    String s = explain(tokens, mem, &arena);
+    debug("Explain:\n%s\n", s.s);
+    assert(strstr(s.s, "  x = 3 km\n") != NULL);
+    assert(strstr(s.s, "-> [ft] (convert km -> ft: x 3280.84)") != NULL);
+    assert(strstr(s.s, "+ [km] (convert mi -> km: x 1.60934)") != NULL);
+    assert(strstr(s.s, "Result: 20402.5 ft") != NULL);
+    // With x substituted, ((3 km) + (2 mi)) -> ft is 9 nodes with 2
+    // conversions. Units get checked once up front, 1 call a node, and
+    // evaluating works each node's unit out as it goes rather than
+    // checking subtrees again.
+    const char *stats = strstr(s.s, "Cost: ");
+    assert(stats != NULL);
+    size_t n_nodes, n_check_unit, n_conversions;
+    assert(sscanf(stats, "Cost: %zu nodes visited, %zu check_unit calls, %zu unit conversions",
+                  &n_nodes, &n_check_unit, &n_conversions) == 3);
+    assert(n_nodes == 9);
+    assert(n_check_unit == 9);
+    assert(n_conversions == 2);
+
+    tokens = tokenize("y = 50 f -> c", &arena);
+    s = explain(tokens, mem, &arena);
+    assert(strstr(s.s, "Assigns to: y") != NULL);
+    assert(strstr(s.s, "(convert F -> C: x 0.555556 - 17.7778)") != NULL);
+    assert(!memory_contains_var(mem, symbol_intern(mem.symbols, (unsigned char *)"y")));
+
+    tokens = tokenize("1 + z", &arena);
+    s = explain(tokens, mem, &arena);
+    assert(strstr(s.s, "z = undefined") != NULL);
+
+    char output[MAX_OUTPUT];
+    execute_line("explain", output, sizeof(output), &mem, &arena);
+    assert(strncmp(output, "Explanations look like:", 23) == 0);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+void test_execute_batch(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    const char input[] = "x = 3 km\nx + 1000 m\n1 +\n\nkm/h\nquit\n1 + 1";
+    CalcBatchResult results[8];
+    char strings[MAX_OUTPUT * 2] = {0};
+    size_t n = execute_batch(input, sizeof(input) - 1, results, 8, strings, sizeof(strings), &mem, &arena);
+    assert_eq(n, 6);
+
+    assert_eq(results[0].flags, CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    assert(eq_diff(results[0].value, 3));
+    assert(strcmp(strings + results[0].output_offset, "x = 3 km") == 0);
+    assert_eq(results[0].output_len, 8);
+    assert(strcmp(strings + results[0].unit_offset, "km") == 0);
+
+    assert_eq(results[1].flags, CALC_HAS_VALUE);
+    assert(eq_diff(results[1].value, 4));
+    assert(strcmp(strings + results[1].output_offset, "4 km") == 0);
+
+    assert_eq(results[2].flags, CALC_ERROR);
+    assert(results[2].output_len > 0);
+    assert_eq(results[3].flags, 0);
+    assert_eq(results[3].output_len, 0);
+    assert_eq(results[4].flags, 0);
+    assert(strcmp(strings + results[4].output_offset, "km h^-1") == 0);
+    assert_eq(results[5].flags, CALC_QUIT);
+
+    // Out of result slots, and out of string space
+    n = execute_batch(input, sizeof(input) - 1, results, 2, strings, MAX_OUTPUT + 11, &mem, &arena);
+    assert_eq(n, 2);
+    assert_eq(results[0].flags, CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    assert_eq(results[1].flags, CALC_HAS_VALUE | CALC_TRUNCATED);
+    assert_eq(results[1].output_len, 0);
+    memory_free(&mem);
+    arena_free(&arena);
+}
+
+// Read all of `file` from the start into `buf`
+size_t test_read_file(FILE *file, char *buf, size_t len) {
+    rewind(file);
+    size_t n = fread(buf, 1, len - 1, file);
+    buf[n] = '\0';
+    return n;
+}
+
+void test_pipeline(void *_) {
+    // Lines whose parse depends on the line before,
+    // then commands, errors, and lines after a quit
+    FILE *script = tmpfile();
+    for (size_t i = 0; i < 100; i++) {
+        fprintf(script, "x = %zu\n2 x\nx = km\n2 x -> m\ny = x + 1\n", i);
+    }
+    fprintf(script, "f := y * 2\nf\ny = 3 m\nf -> cm\nexplain f\n");
+    fprintf(script, "addunit foo = 3 m\n2 foo -> m\nexplain x\nmemory\n1 +\n\nquit\n1 + 1\n");
+
+    FILE *expected = tmpfile();
+    rewind(script);
+    batch(script, expected, 1);
+    FILE *actual = tmpfile();
+    rewind(script);
+    batch_pipelined(script, actual, 1);
+
+    static char expected_buf[1 << 16];
+    static char actual_buf[1 << 16];
+    size_t expected_len = test_read_file(expected, expected_buf, sizeof(expected_buf));
+    assert(expected_len > 0);
+    assert_eq(test_read_file(actual, actual_buf, sizeof(actual_buf)), expected_len);
+    assert(strcmp(expected_buf, actual_buf) == 0);
+    fclose(script);
+    fclose(expected);
+    fclose(actual);
+}
+
+void test_batch_file(void *_) {
+    // Lines long enough to be errors, names seen for the first time, and
+    // a last line without a newline
+    FILE *script = tmpfile();
+    for (size_t i = 0; i < 50; i++) {
+        fprintf(script, "name%zu = %zu km\nname%zu -> m\nsum([1, 2] name%zu) -> m\n", i, i, i, i);
+    }
+    for (size_t i = 0; i < MAX_INPUT + 1; i++) fputc('x', script);
+    fprintf(script, "\nmemory\n1 +\n\nname7 + 1 m");
+
+    FILE *expected = tmpfile();
+    rewind(script);
+    batch(script, expected, 1);
+    FILE *actual = tmpfile();
+    rewind(script);
+    batch_file(script, actual, 1);
+
+    static char expected_buf[1 << 16];
+    static char actual_buf[1 << 16];
+    size_t expected_len = test_read_file(expected, expected_buf, sizeof(expected_buf));
+    assert(expected_len > 0);
+    assert_eq(test_read_file(actual, actual_buf, sizeof(actual_buf)), expected_len);
+    assert(strcmp(expected_buf, actual_buf) == 0);
+    fclose(script);
+    fclose(expected);
+    fclose(actual);
+}
+
+void test_schedule(void *_) {
+    Arena arena = arena_create();
+    Memory mem = memory_new(&arena);
+    const char *input[] = {"x = 1 km", "y = 2", "z = x + y m", "x = 3", "explain x", "memory", "y"};
+    size_t n = sizeof(input) / sizeof(input[0]);
+    TokenString tokens[sizeof(input) / sizeof(input[0])];
+    for (size_t i = 0; i < n; i++) {
+        tokens[i] = tokenize(input[i], &arena);
+    }
+    Schedule *schedule = schedule_new(tokens, n, mem, 1);
+    assert_eq(atomic_load(&schedule->lines[0].pending), 0);
+    assert_eq(atomic_load(&schedule->lines[1].pending), 0);
+    assert_eq(atomic_load(&schedule->lines[2].pending), 2);
+    // Overwriting x waits for the line that assigned it before,
+    // but not for lines reading that assignment
+    assert_eq(atomic_load(&schedule->lines[3].pending), 1);
+    assert_eq(atomic_load(&schedule->lines[4].pending), 1);
+    assert_eq(atomic_load(&schedule->lines[5].pending), 5);
+    assert_eq(atomic_load(&schedule->lines[6].pending), 1);
+    schedule_free(schedule);
+    memory_free(&mem);
+    arena_free(&arena);
+
+    // Same output as executing in order, including lines whose parse
+    // depends on an earlier line, barriers, errors, and lines after a quit
+    FILE *script = tmpfile();
+    for (size_t i = 0; i < 100; i++) {
+        fprintf(script, "a%zu = %zu km\nb%zu = a%zu + 1 m\nx = %zu\n2 x\nx = km\n2 x -> m\n", i, i, i, i, i);
+    }
+    fprintf(script, "f := a3 + b3\ng := f * 2\na3 = 7 km\ng -> m\na4 = 1 m\nf = 2\ng\n");
+    fprintf(script, "addunit foo\n2 foo\nmemory\nexplain b3\n1 +\n\nunits\nquit\n1 + 1\n");
+    FILE *expected = tmpfile();
+    rewind(script);
+    batch(script, expected, 1);
+    FILE *actual = tmpfile();
+    rewind(script);
+    batch_parallel(script, actual, 4, 1);
+
+    static char expected_buf[1 << 16];
+    static char actual_buf[1 << 16];
+    size_t expected_len = test_read_file(expected, expected_buf, sizeof(expected_buf));
+    assert(expected_len > 0);
+    assert_eq(test_read_file(actual, actual_buf, sizeof(actual_buf)), expected_len);
+    assert(strcmp(expected_buf, actual_buf) == 0);
+    fclose(script);
+    fclose(expected);
+    fclose(actual);
+}
+
+// Run `script` as the next version of a watched file, checking every
+// line's output is what executing it from scratch gives, and returning
+// how many lines were executed.
+size_t test_watch_run(WatchRun *run, WatchRun *prev, const char *script) {
+    FILE *input = tmpfile();
+    fputs(script, input);
+    FILE *expected = tmpfile();
+    rewind(input);
+    batch(input, expected, 1);
+    FILE *printed = tmpfile();
+    rewind(input);
+    watch_run(run, prev, input, printed);
+    FILE *actual = tmpfile();
+    for (size_t i = 0; i < run->n_lines && run->lines[i].ran; i++) {
+        if (run->lines[i].output[0] != '\0') fprintf(actual, "%s\n", run->lines[i].output);
+    }
+    static char expected_buf[1 << 14];
+    static char actual_buf[1 << 14];
+    size_t expected_len = test_read_file(expected, expected_buf, sizeof(expected_buf));
+    assert_eq(test_read_file(actual, actual_buf, sizeof(actual_buf)), expected_len);
+    assert(strcmp(expected_buf, actual_buf) == 0);
+    if (prev == NULL) {
+        // Everything is printed the first time
+        assert_eq(test_read_file(printed, actual_buf, sizeof(actual_buf)), expected_len);
+    }
+    fclose(input);
+    fclose(expected);
+    fclose(printed);
+    fclose(actual);
+    return run->executed;
+}
+
+void test_watch(void *_) {
+    WatchRun runs[2];
+    const char *scripts[] = {
+        "dist = 1 km\ntotal = dist + 1 m\ncount = 5\ntwice = count * 2\ntotal * twice\naddunit foo\n2 foo\n",
+        // Only what reads dist, directly or not
+        "dist = 2 km\ntotal = dist + 1 m\ncount = 5\ntwice = count * 2\ntotal * twice\naddunit foo\n2 foo\n",
+        // Same value, nothing that reads it is executed
+        "dist = 1 km + 1 km\ntotal = dist + 1 m\ncount = 5\ntwice = count * 2\ntotal * twice\naddunit foo\n2 foo\n",
+        // Replacing a line other lines read
+        "dist = 1 km + 1 km\ntotal = dist + 1 m\ncount = 5\ncount\ntotal * twice\naddunit foo\n2 foo\n",
+        // Units added before others renumber them
+        "addunit bar\ndist = 1 km + 1 km\ntotal = dist + 1 m\ncount = 5\ncount\ntotal * twice\naddunit foo\n2 foo\n",
+        // Formulas and what they refer to are always executed, as are commands
+        "addunit bar\ndist = 1 km + 1 km\ntotal = dist + 1 m\ncount = 5\ncount\ndouble := count * 2\ndouble\nmemory\nquit\ncount\n",
+        "addunit bar\ndist = 1 km + 1 km\ntotal = dist + 1 m\ncount = 6\ncount\ndouble := count * 2\ndouble\nmemory\nquit\ncount\n",
+    };
+    // addunit is always executed
+    const size_t executed[] = {7, 4, 2, 3, 8, 5, 6};
+    size_t n = sizeof(scripts) / sizeof(scripts[0]);
+    for (size_t i = 0; i < n; i++) {
+        WatchRun *prev = i > 0 ? &runs[(i - 1) % 2] : NULL;
+        assert_eq(test_watch_run(&runs[i % 2], prev, scripts[i]), executed[i]);
+        if (prev != NULL) watch_run_free(prev);
+    }
+    watch_run_free(&runs[(n - 1) % 2]);
+}
+
+void test_stream(void *_) {
+    // The min and max leave with the samples they came from
+    StreamWindow window = stream_window_new(3, 0);
+    const double values[] = {5, 1, 4, 2, 8, 3, 3};
+    const double mins[] = {5, 1, 1, 1, 2, 2, 3};
+    const double maxes[] = {5, 5, 5, 4, 8, 8, 8};
+    for (size_t i = 0; i < 7; i++) {
+        stream_window_add(&window, i, values[i]);
+        assert(eq_diff(stream_window_min(&window), mins[i]));
+        assert(eq_diff(stream_window_max(&window), maxes[i]));
+    }
+    assert_eq(stream_window_count(&window), 3);
+    assert(eq_diff(stream_window_sum(&window), 14));
+    double rate;
+    assert(stream_window_rate(&window, &rate));
+    assert(eq_diff(rate, 3));
+    stream_window_free(&window);
+
+    // Many more samples than fit at first, with gaps in time
+    window = stream_window_new(0, 100);
+    stream_window_add(&window, 0, 1);
+    assert(!stream_window_rate(&window, &rate));
+    for (size_t i = 1; i <= 1000; i++) {
+        stream_window_add(&window, i % 10 == 0 ? i + 0.5 : i, 1);
+    }
+    assert_eq(stream_window_count(&window), 100);
+    assert(eq_diff(stream_window_sum(&window), 100));
+    stream_window_free(&window);
+
+    // The newest sample never leaves, even if it's too old for itself
+    window = stream_window_new(0, 100);
+    stream_window_add(&window, 0, 1);
+    stream_window_add(&window, INFINITY, 2);
+    assert_eq(stream_window_count(&window), 1);
+    assert(eq_diff(stream_window_max(&window), 2));
+    stream_window_free(&window);
+
+    FILE *input = tmpfile();
+    fputs("0 100 m\n10 0.2 km\n5 1 m\n20 3 s\n20 1 ft\nbogus\n", input);
+    rewind(input);
+    FILE *output = tmpfile();
+    assert_eq(stream(input, output, "15s"), 0);
+    char buf[1024];
+    test_read_file(output, buf, sizeof(buf));
+    debug("Stream output:\n%s", buf);
+    assert(strcmp(buf,
+        "0: 1 sample, sum 100 m, mean 100 m, min 100 m, max 100 m\n"
+        "10: 2 samples, sum 300 m, mean 150 m, min 100 m, max 200 m, rate 20 m s^-1\n"
+        "Timestamps can't go backwards: 5 after 10\n"
+        "Convert invalid: From: s To m\n"
+        "20: 2 samples, sum 200.305 m, mean 100.152 m, min 0.3048 m, max 200 m, rate 0.03048 m s^-1\n"
+        "Samples look like: timestamp value unit, e.g. 12.5 3 km\n") == 0);
+    fclose(input);
+    fclose(output);
+
+    // Timestamps and values have to be finite
+    input = tmpfile();
+    fputs("0 1 km\n1e999 2 km\n5 1e999 km\n10 2 km\n", input);
+    rewind(input);
+    output = tmpfile();
+    assert_eq(stream(input, output, "5min"), 0);
+    test_read_file(output, buf, sizeof(buf));
+    assert(strcmp(buf,
+        "0: 1 sample, sum 1 km, mean 1 km, min 1 km, max 1 km\n"
+        "Samples look like: timestamp value unit, e.g. 12.5 3 km\n"
+        "Samples look like: timestamp value unit, e.g. 12.5 3 km\n"
+        "10: 2 samples, sum 3 km, mean 1.5 km, min 1 km, max 2 km, rate 0.2 km s^-1\n") == 0);
+    fclose(input);
+    fclose(output);
+
+    // Rates of something per hour are per hour
+    input = tmpfile();
+    fputs("0 60 km/h\n1800 30 km/h\n", input);
+    rewind(input);
+    output = tmpfile();
+    assert_eq(stream(input, output, "1h"), 0);
+    test_read_file(output, buf, sizeof(buf));
+    assert(strstr(buf, "rate 60 km h^-2\n") != NULL);
+    fclose(input);
+    fclose(output);
+
+    const char *bad_windows[] = {"0", "2.5", "3 km", "x", "-5 min"};
+    for (size_t i = 0; i < 5; i++) {
+        input = tmpfile();
+        output = tmpfile();
+        assert_eq(stream(input, output, bad_windows[i]), 1);
+        fclose(input);
+        fclose(output);
+    }
+}
+
+void test_convert_csv(void *_) {
+    Arena arena = arena_create();
+    const char data[] = "time,\"speed, avg\",note\r\n1,36,a\r\n2, 72 ,\"x,y\"\r\n3,,b\r\n4,-1.8e1,c\r\n5,abc,d";
+    size_t size = sizeof(data) - 1;
+    size_t column;
+    assert(csv_find_column("speed, avg", data, size, &column));
+    assert_eq(column, 1);
+    assert(csv_find_column("3", data, size, &column));
+    assert_eq(column, 2);
+    assert(!csv_find_column("speed", data, size, &column));
+    assert(!csv_find_column("0", data, size, &column));
+    assert(csv_find_column("3", data, size, &column));
+    assert(!csv_find_column("4", data, size, &column));
+    assert(!csv_find_column("1", data, 0, &column));
+
+    CsvConversion conversion = {
+        .column = 1,
+        .from = unit_new_single_builtin(UNIT_KILOMETER, 1, &arena),
+        .to = unit_new_single_builtin(UNIT_METER, 1, &arena),
+        .affine = true,
+        .scale = 1000,
+    };
+    const char expected[] = "time,\"speed, avg\",note\r\n1,36000,a\r\n2, 72000 ,\"x,y\"\r\n3,,b\r\n4,-18000,c\r\n5,abc,d";
+    char buf[256];
+    // However it's split up, the output is the same
+    const size_t chunk_sizes[] = {1, 7, 1000};
+    const size_t n_threads[] = {1, 3, 2};
+    for (size_t i = 0; i < 3; i++) {
+        FILE *output = tmpfile();
+        csv_convert(data, size, &conversion, chunk_sizes[i], n_threads[i], output);
+        test_read_file(output, buf, sizeof(buf));
+        debug("Converted:\n%s\n", buf);
+        assert(strcmp(buf, expected) == 0);
+        fclose(output);
+    }
+
+    // The whole file, and specs that aren't conversions
+    char path[] = "/tmp/calc_test_csv_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, data, size) == (ssize_t)size);
+    close(fd);
+    FILE *output = tmpfile();
+    assert_eq(convert_csv(path, "2:C:F", 2, output), 0);
+    test_read_file(output, buf, sizeof(buf));
+    // Exactly what `36 C -> F` and the rest work out to. -18 C is -0.4 F,
+    // but 1.8 * -18 + 32 in doubles is the one just above it, which
+    // converting it on its own gives too.
+    assert(strcmp(buf, "time,\"speed, avg\",note\r\n1,96.8,a\r\n2, 161.6 ,\"x,y\"\r\n3,,b\r\n"
+                       "4,-0.3999999999999986,c\r\n5,abc,d") == 0);
+    Unit celsius = unit_new_single_builtin(UNIT_CELSIUS, 1, &arena);
+    Unit fahrenheit = unit_new_single_builtin(UNIT_FAHRENHEIT, 1, &arena);
+    assert(unit_convert(-18, celsius, fahrenheit, &arena) == -0.3999999999999986);
+    fclose(output);
+    // Converting to the same unit leaves the file as it was
+    output = tmpfile();
+    assert_eq(convert_csv(path, "2:m:meter", 2, output), 0);
+    test_read_file(output, buf, sizeof(buf));
+    assert(strcmp(buf, data) == 0);
+    fclose(output);
+
+    // Converted numbers keep every digit they need, and no more
+    char number[32];
+    csv_format_number(number, sizeof(number), 0.1 + 0.2);
+    assert(strcmp(number, "0.30000000000000004") == 0);
+    csv_format_number(number, sizeof(number), 1234.56789012345);
+    assert(strcmp(number, "1234.56789012345") == 0);
+    csv_format_number(number, sizeof(number), 36000);
+    assert(strcmp(number, "36000") == 0);
+    const char *bad_specs[] = {"2:km", "km:m", "2:km:s", "2:3:m", "nope:km:m", "9:km:m"};
+    for (size_t i = 0; i < 6; i++) {
+        assert_eq(convert_csv(path, bad_specs[i], 1, stdout), 1);
+    }
+    assert_eq(convert_csv("-", "2:km:m", 1, stdout), 1);
+    unlink(path);
+    arena_free(&arena);
+}
+
+#define CALC_TEST_THREADS 8
+#define CALC_TEST_LINES 200
+
+void *calc_session_thread(void *ctx_opaque) {
+    CalcContext *ctx = (CalcContext *)ctx_opaque;
+    char output[MAX_OUTPUT];
+    for (size_t i = 0; i < CALC_TEST_LINES; i++) {
+        assert_eq(calc_execute(ctx, "x = x + 1 km", output, sizeof(output), NULL),
+                  CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    }
+    return NULL;
+}
+
+void test_calculator(void *_) {
+    CalcContext *a = calc_create();
+    CalcContext *b = calc_create();
+    char output[MAX_OUTPUT];
+    double value = 0;
+    assert_eq(calc_execute(a, "x = 2 km", output, sizeof(output), &value),
+              CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    assert_eq(calc_execute(b, "x = km", output, sizeof(output), NULL), CALC_CHANGED_MEMORY);
+    assert_eq(calc_execute(a, "x -> m", output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, 2000));
+    assert(strcmp(output, "2000 m") == 0);
+    assert_eq(calc_execute(b, "5 x -> m", output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, 5000));
+    assert_eq(calc_execute(b, "y", output, sizeof(output), NULL), CALC_ERROR);
+    // Reading a formula that needs recomputing
+    assert_eq(calc_execute(a, "y := x * 2", output, sizeof(output), NULL),
+              CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    assert_eq(calc_execute(a, "x = 1 m", output, sizeof(output), NULL),
+              CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    assert_eq(calc_execute(a, "y", output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, 2));
+    assert_eq(calc_execute(b, "exit", output, sizeof(output), NULL), CALC_QUIT);
+
+    // Isolated sessions on their own threads, plus one session shared by all threads
+    CalcContext *shared = calc_create();
+    assert_eq(calc_execute(shared, "x = 0 km", output, sizeof(output), NULL),
+              CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+    CalcContext *sessions[CALC_TEST_THREADS];
+    pthread_t threads[CALC_TEST_THREADS * 2];
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        sessions[i] = calc_create();
+        assert_eq(calc_execute(sessions[i], "x = 0 km", output, sizeof(output), NULL),
+                  CALC_HAS_VALUE | CALC_CHANGED_MEMORY);
+        assert(pthread_create(&threads[i * 2], NULL, calc_session_thread, sessions[i]) == 0);
+        assert(pthread_create(&threads[i * 2 + 1], NULL, calc_session_thread, shared) == 0);
+    }
+    for (size_t i = 0; i < CALC_TEST_THREADS * 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        assert_eq(calc_execute(sessions[i], "x", output, sizeof(output), &value), CALC_HAS_VALUE);
+        assert(eq_diff(value, CALC_TEST_LINES));
+        calc_destroy(sessions[i]);
+    }
+    assert_eq(calc_execute(shared, "x", output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, CALC_TEST_LINES * CALC_TEST_THREADS));
+
+    const char input[] = "y = 3\ny * 2";
+    CalcBatchResult results[2];
+    char strings[MAX_OUTPUT * 2];
+    assert_eq(calc_execute_batch(shared, input, sizeof(input) - 1, results, 2, strings, sizeof(strings)), 2);
+    assert(eq_diff(results[1].value, 6));
+
+    calc_destroy(shared);
+    calc_destroy(a);
+    calc_destroy(b);
+}
+
+typedef struct CalcReader CalcReader;
+struct CalcReader {
+    CalcContext *ctx;
+    _Atomic bool *done;
+};
+
+void *calc_writer_thread(void *ctx_opaque) {
+    CalcContext *ctx = (CalcContext *)ctx_opaque;
+    char output[MAX_OUTPUT];
+    for (size_t i = 0; i < CALC_TEST_LINES; i++) {
+        calc_execute(ctx, "x = x + 1 km", output, sizeof(output), NULL);
+        char line[32];
+        snprintf(line, sizeof(line), "v%zu = x", i);
+        calc_execute(ctx, line, output, sizeof(output), NULL);
+    }
+    return NULL;
+}
+
+void *calc_reader_thread(void *reader_opaque) {
+    CalcReader *reader = (CalcReader *)reader_opaque;
+    char output[MAX_OUTPUT];
+    double last = 0;
+    while (!atomic_load(reader->done)) {
+        double value = 0;
+        assert_eq(calc_execute(reader->ctx, "x -> m", output, sizeof(output), &value), CALC_HAS_VALUE);
+        // Each read sees one whole version, and versions only go forwards
+        assert(value >= last);
+        assert(eq_diff(fmod(value, 1000), 0));
+        last = value;
+        calc_execute(reader->ctx, "memory", output, sizeof(output), NULL);
+    }
+    return NULL;
+}
+
+void test_calculator_readers(void *_) {
+    CalcContext *ctx = calc_create();
+    char output[MAX_OUTPUT];
+    calc_execute(ctx, "x = 0 km", output, sizeof(output), NULL);
+    _Atomic bool done = false;
+    CalcReader reader = { .ctx = ctx, .done = &done };
+    pthread_t writer;
+    pthread_t readers[CALC_TEST_THREADS];
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        assert(pthread_create(&readers[i], NULL, calc_reader_thread, &reader) == 0);
+    }
+    assert(pthread_create(&writer, NULL, calc_writer_thread, ctx) == 0);
+    pthread_join(writer, NULL);
+    atomic_store(&done, true);
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    double value = 0;
+    calc_execute(ctx, "x", output, sizeof(output), &value);
+    assert(eq_diff(value, CALC_TEST_LINES));
+    calc_execute(ctx, "v99", output, sizeof(output), &value);
+    assert(eq_diff(value, 100));
+    // Lines that don't change memory don't publish
+    assert_eq(calc_execute(ctx, "explain y = 1", output, sizeof(output), NULL), 0);
+    assert_eq(calc_execute(ctx, "y", output, sizeof(output), NULL), CALC_ERROR);
+    calc_destroy(ctx);
+}
+
+#define CALC_TEST_WRITES 3000
+
+void test_calculator_compaction(void *_) {
+    CalcContext *ctx = calc_create();
+    char output[MAX_OUTPUT];
+    double value = 0;
+    calc_execute(ctx, "x = 0 km", output, sizeof(output), NULL);
+    calc_execute(ctx, "speed = 3 km", output, sizeof(output), NULL);
+    calc_execute(ctx, "addunit widget", output, sizeof(output), NULL);
+    calc_execute(ctx, "total := speed * 2 widget", output, sizeof(output), NULL);
+    CalcStatement *stmt = calc_prepare(ctx, "?n widget * speed -> m widget", output, sizeof(output));
+    assert(stmt != NULL);
+    _Atomic bool done = false;
+    CalcReader reader = { .ctx = ctx, .done = &done };
+    pthread_t readers[CALC_TEST_THREADS];
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        assert(pthread_create(&readers[i], NULL, calc_reader_thread, &reader) == 0);
+    }
+    for (size_t i = 0; i < CALC_TEST_WRITES; i++) {
+        calc_execute(ctx, "x = x + 1 km", output, sizeof(output), NULL);
+    }
+    atomic_store(&done, true);
+    for (size_t i = 0; i < CALC_TEST_THREADS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    // Only what's current was kept, and everything older was freed
+    CalcGeneration *generation = atomic_load(&ctx->generation);
+    assert(arena_used(&generation->arena) < 2 * CALC_COMPACT_MIN_SIZE);
+    calc_execute(ctx, "x = x + 1 km", output, sizeof(output), NULL);
+    assert(generation->retired == NULL);
+
+    assert_eq(calc_execute(ctx, "x", output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, CALC_TEST_WRITES + 1));
+    assert_eq(calc_execute(ctx, "total", output, sizeof(output), NULL), CALC_HAS_VALUE);
+    assert(strcmp(output, "6 km widget") == 0);
+    calc_execute(ctx, "speed = 4 km", output, sizeof(output), NULL);
+    assert_eq(calc_execute(ctx, "total", output, sizeof(output), NULL), CALC_HAS_VALUE);
+    assert(strcmp(output, "8 km widget") == 0);
+    // Still in the order they were first defined
+    calc_execute(ctx, "memory", output, sizeof(output), NULL);
+    assert(strcmp(output, "x = 3001 km\nspeed = 4 km\ntotal := speed * 2 widget") == 0);
+    // Statements don't point into memory that was freed
+    calc_bind(stmt, 0, 2);
+    assert_eq(calc_execute_prepared(stmt, output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, 6000));
+    assert(strcmp(output, "6000 m widget") == 0);
+    calc_finalize(stmt);
+    calc_destroy(ctx);
+}
+
+void test_calculator_prepare(void *_) {
+    CalcContext *ctx = calc_create();
+    char output[MAX_OUTPUT];
+    char expected[MAX_OUTPUT];
+    double value = 0;
+    double expected_value = 0;
+    calc_execute(ctx, "factor = 3", output, sizeof(output), NULL);
+    CalcStatement *stmt = calc_prepare(ctx, "?speed km/h * factor -> mi/h", output, sizeof(output));
+    assert(stmt != NULL);
+    int speed = calc_param_index(stmt, "speed");
+    assert_eq(speed, 0);
+    assert_eq(calc_param_index(stmt, "factor"), -1);
+    assert_eq(calc_bind(stmt, 1, 2), CALC_ERROR);
+    assert_eq(calc_execute_prepared(stmt, output, sizeof(output), &value), CALC_ERROR);
+    assert(strcmp(output, "Placeholder not bound: ?speed") == 0);
+    // Variables were read when it was prepared
+    calc_execute(ctx, "factor = 4", output, sizeof(output), NULL);
+    for (int i = -2; i < 50; i++) {
+        assert_eq(calc_bind(stmt, speed, i * 7.5), 0);
+        assert_eq(calc_execute_prepared(stmt, output, sizeof(output), &value), CALC_HAS_VALUE);
+        char line[MAX_INPUT];
+        snprintf(line, sizeof(line), "%g km/h * 3 -> mi/h", i * 7.5);
+        assert_eq(calc_execute(ctx, line, expected, sizeof(expected), &expected_value), CALC_HAS_VALUE);
+        assert(eq_diff(value, expected_value));
+        assert(strcmp(output, expected) == 0);
+    }
+    calc_finalize(stmt);
+
+    // Conversions with an offset, and the same placeholder twice
+    stmt = calc_prepare(ctx, "?temp C + ?temp F -> F", output, sizeof(output));
+    assert(stmt != NULL);
+    calc_bind(stmt, calc_param_index(stmt, "temp"), 100);
+    assert_eq(calc_execute_prepared(stmt, output, sizeof(output), &value), CALC_HAS_VALUE);
+    assert(eq_diff(value, 280));
+    calc_finalize(stmt);
+
+    stmt = calc_prepare(ctx, "1 km / ?hours h", output, sizeof(output));
+    assert(stmt != NULL);
+    calc_bind(stmt, 0, 0);
+    assert_eq(calc_execute_prepared(stmt, output, sizeof(output), &value), CALC_ERROR);
+    assert(strcmp(output, "Cannot divide by zero") == 0);
+    calc_finalize(stmt);
+
+    assert(calc_prepare(ctx, "speed = ?speed", output, sizeof(output)) == NULL);
+    assert(strcmp(output, "Only expressions can be prepared") == 0);
+    assert(calc_prepare(ctx, "?len km^?degree", output, sizeof(output)) == NULL);
+    assert(calc_prepare(ctx, "?len km + 2 s", output, sizeof(output)) == NULL);
+    assert_eq(calc_execute(ctx, "?speed km", output, sizeof(output), NULL), CALC_ERROR);
+    assert(strstr(output, "Placeholders only work in prepared statements: ?speed") != NULL);
+    calc_destroy(ctx);
+}
+
+int server_test_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+void server_test_expect(int fd, uint32_t flags, const char *output) {
+    char expected[MAX_OUTPUT];
+    size_t len = snprintf(expected, sizeof(expected), "%u %zu\n%s\n", flags, strlen(output), output);
+    char actual[MAX_OUTPUT] = {0};
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, actual + got, len - got);
+        assert(n > 0);
+        got += n;
+    }
+    debug("Response: %s\n", actual);
+    assert(strcmp(actual, expected) == 0);
+}
+
+void test_server(void *_) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/calc_test_%d.sock", getpid());
+    Server server;
+    assert(server_start(&server, path, 4));
+
+    int a = server_test_connect(path);
+    int b = server_test_connect(path);
+    // Several requests in one write are answered in order
+    const char requests[] = "alice x = 3 km\nbob x = 2\nalice x -> m\n";
+    assert(write(a, requests, sizeof(requests) - 1) == sizeof(requests) - 1);
+    server_test_expect(a, CALC_HAS_VALUE | CALC_CHANGED_MEMORY, "x = 3 km");
+    server_test_expect(a, CALC_HAS_VALUE | CALC_CHANGED_MEMORY, "x = 2");
+    server_test_expect(a, CALC_HAS_VALUE, "3000 m");
+
+    // Sessions are shared between connections
+    const char request[] = "alice x * 2\n";
+    assert(write(b, request, sizeof(request) - 1) == sizeof(request) - 1);
+    server_test_expect(b, CALC_HAS_VALUE, "6 km");
+    const char error[] = "bob y\n";
+    assert(write(b, error, sizeof(error) - 1) == sizeof(error) - 1);
+    server_test_expect(b, CALC_ERROR, "Variable not defined: y");
+
+    // A request split across writes
+    assert(write(b, "bob x +", 7) == 7);
+    usleep(1000);
+    assert(write(b, " 1\n", 3) == 3);
+    server_test_expect(b, CALC_HAS_VALUE, "3 ");
+
+    char long_request[SERVER_MAX_REQUEST + 16];
+    memset(long_request, '1', sizeof(long_request));
+    memcpy(long_request, "bob ", 4);
+    long_request[sizeof(long_request) - 1] = '\n';
+    assert(write(b, long_request, sizeof(long_request)) == sizeof(long_request));
+    server_test_expect(b, CALC_ERROR, "Request too long");
+    assert(write(b, " 1\n", 3) == 3);
+    server_test_expect(b, CALC_ERROR, "Invalid session name");
+
+    assert(write(b, "bob quit\n", 9) == 9);
+    server_test_expect(b, CALC_QUIT, "");
+    char c;
+    assert(read(b, &c, 1) == 0);
+    close(b);
+
+    server_stop(&server);
+    close(a);
+    assert(access(path, F_OK) != 0);
+}
+
+void test_options(void *_) {
+    // Expressions can start with a minus
+    Options options = {0};
+    char *negative[] = {"main", "-3 + 2"};
+    assert(options_parse(2, negative, &options));
+    assert(strcmp(options.input, "-3 + 2") == 0);
+
+    options = (Options) {0};
+    char *separated[] = {"main", "--trace=t.json", "--", "--3"};
+    assert(options_parse(4, separated, &options));
+    assert(strcmp(options.input, "--3") == 0);
+    assert(strcmp(options.trace_path, "t.json") == 0);
+
+    options = (Options) {0};
+    char *script[] = {"main", "-f", "-", "--parallel", "--workers=3"};
+    assert(options_parse(5, script, &options));
+    assert(options.input == NULL && strcmp(options.script_path, "-") == 0);
+    assert(options.parallel && options.n_workers == 3);
+
+    char *missing_file[] = {"main", "-f"};
+    assert(!options_parse(2, missing_file, &(Options) {0}));
+    char *unknown[] = {"main", "--bogus"};
+    assert(!options_parse(2, unknown, &(Options) {0}));
+    char *two_inputs[] = {"main", "1", "2"};
+    assert(!options_parse(3, two_inputs, &(Options) {0}));
+    // Converting stdin is an error of its own, not a usage one
+    char *convert_stdin[] = {"main", "-f", "-", "--convert-csv=1:km:m"};
+    assert(options_parse(4, convert_stdin, &(Options) {0}));
+    char *watch_stdin[] = {"main", "--watch", "-f", "-"};
+    assert(!options_parse(4, watch_stdin, &(Options) {0}));
+}
+
 // TODO: history bug: if you do a command, then press up and execute,
 // then press up again, it's blank.
 
@@ -896,10 +2240,29 @@ int main(int argc, char **argv) {
         test_evaluate,
         test_memory,
         test_memory_show,
+        test_formulas,
+        test_sweep,
+        test_arrays,
+        test_aggregates,
         test_unit_mirror,
         test_display_unit,
         test_is_pow_two,
         test_hash_map,
+        test_trace,
+        test_explain,
+        test_execute_batch,
+        test_pipeline,
+        test_batch_file,
+        test_schedule,
+        test_watch,
+        test_stream,
+        test_convert_csv,
+        test_calculator,
+        test_calculator_readers,
+        test_calculator_compaction,
+        test_calculator_prepare,
+        test_server,
+        test_options,
     };
     const size_t n_tests = sizeof(tests) / sizeof(tests[0]);
     bool all_passed = true;
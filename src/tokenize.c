@@ -2,8 +2,11 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include "aggregate.c"
 #include "arena.c"
+#include "array_value.c"
 #include "unit.c"
 #include "debug.c"
 #include "string.c"
@@ -13,7 +16,16 @@ enum TokenType {
     TOK_NUM,
     TOK_UNIT,
     TOK_VAR,
+    // A named placeholder in a prepared statement, e.g. `?speed`
+    TOK_PARAM,
+    // Numbers in brackets, e.g. `[1, 2.5, 7]`
+    TOK_ARRAY,
+    // A reduction right before its parenthesis, e.g. `sum(`
+    TOK_AGGREGATE,
+    TOK_LPAREN,
+    TOK_RPAREN,
     TOK_EQUALS,
+    TOK_BIND,
     TOK_CONVERT,
     TOK_ADD,
     TOK_SUB,
@@ -26,6 +38,11 @@ enum TokenType {
     TOK_EXAMPLES,
     TOK_SHOW_UNITS,
     TOK_MEMORY,
+    TOK_EXPLAIN,
+    TOK_SWEEP,
+    TOK_STEP,
+    TOK_RANGE,
+    TOK_COLON,
     TOK_HELP,
     TOK_QUIT,
     TOK_END,
@@ -38,8 +55,18 @@ struct Token {
     union {
         UnitType unit_type;
         double number;
-        unsigned char *var_name;
+        // The name of a variable or placeholder, the `var_len` bytes at
+        // `var_name` in the input, which doesn't end there
+        struct {
+            const unsigned char *var_name;
+            size_t var_len;
+        };
+        ArrayValue array;
+        AggregateType aggregate;
     };
+    // Where the token is in the input it was read from
+    uint32_t offset;
+    uint32_t length;
 };
 
 #define MAX_INPUT 256
@@ -72,8 +99,13 @@ const Token whitespace_token = {TOK_WHITESPACE};
 const Token add_unit_token = {TOK_ADD_UNIT};
 const Token help_token = {TOK_HELP};
 const Token memory_token = {TOK_MEMORY};
+const Token explain_token = {TOK_EXPLAIN};
 const Token show_units_token = {TOK_SHOW_UNITS};
 const Token examples_token = {TOK_EXAMPLES};
+const Token sweep_token = {TOK_SWEEP};
+const Token step_token = {TOK_STEP};
+const Token range_token = {TOK_RANGE};
+const Token colon_token = {TOK_COLON};
 const Token add_token = {TOK_ADD};
 const Token sub_token = {TOK_SUB};
 const Token mul_token = {TOK_MUL};
@@ -82,6 +114,9 @@ const Token int_div_token = {TOK_INT_DIV};
 const Token caret_token = {TOK_CARET};
 const Token convert_token = {TOK_CONVERT};
 const Token equals_token = {TOK_EQUALS};
+const Token bind_token = {TOK_BIND};
+const Token lparen_token = {TOK_LPAREN};
+const Token rparen_token = {TOK_RPAREN};
 
 Token token_new_num(double num) {
     return (Token){TOK_NUM, .number = num };
@@ -91,71 +126,199 @@ Token token_new_unit(UnitType unit) {
     return (Token){TOK_UNIT, .unit_type = unit};
 }
 
-Token token_new_variable(char string_token[MAX_INPUT], Arena *arena) {
-    size_t name_len = strnlen(string_token, MAX_INPUT) + 1;
-    Token token = { .type = TOK_VAR, .var_name = arena_alloc(arena, name_len) };
-    memcpy(token.var_name, string_token, name_len);
+// A variable named by the `len` bytes at `name`, which has to live as
+// long as the token.
+Token token_new_variable_len(const char *name, size_t len) {
+    return (Token) { .type = TOK_VAR, .var_name = (const unsigned char *)name, .var_len = len };
+}
+
+Token token_new_variable(char string_token[MAX_INPUT]) {
+    return token_new_variable_len(string_token, strlen(string_token));
+}
+
+Token token_new_aggregate(AggregateType aggregate) {
+    return (Token) { .type = TOK_AGGREGATE, .aggregate = aggregate };
+}
+
+Token token_new_param(char string_token[MAX_INPUT]) {
+    Token token = token_new_variable(string_token);
+    token.type = TOK_PARAM;
+    return token;
+}
+
+// An array of a copy of `numbers` in `arena`.
+Token token_new_array(const double *numbers, size_t length, Arena *arena) {
+    Token token = { .type = TOK_ARRAY, .array = array_value_new(length, arena) };
+    memcpy(token.array.values, numbers, length * sizeof(double));
     return token;
 }
 
 // TODO: make this more generic where I can simply define
 // basically a table of strings and their corresponding tokens
-Token next_token(const char *input, size_t *pos, size_t length, Arena *arena) {
+// Read a number, e.g. `3.32e-2`, starting at a digit at `*pos` and
+// reading no further than `length`, so `input` doesn't need to end
+// there. Returns false if an exponent has no digits.
+bool next_number(const char *input, size_t *pos, size_t length, double *number) {
+    *number = 0;
+    while (*pos < length && is_digit(input[*pos])) {
+        *number = *number * 10 + char_to_digit(input[*pos]);
+        (*pos)++;
+    }
+    // Not the start of a range, e.g. `1..10`
+    if (*pos < length && input[*pos] == '.' && !(*pos + 1 < length && input[*pos + 1] == '.')) {
+        (*pos)++;
+        double decimal = 0.1;
+        while (*pos < length && is_digit(input[*pos])) {
+            *number += char_to_digit(input[*pos]) * decimal;
+            decimal /= 10;
+            (*pos)++;
+        }
+    }
+    if (*pos < length && (input[*pos] == 'e' || input[*pos] == 'E')) {
+        (*pos)++;
+        bool negative = *pos < length && input[*pos] == '-';
+        if (*pos < length && (input[*pos] == '-' || input[*pos] == '+')) (*pos)++;
+        if (*pos >= length || !is_digit(input[*pos])) {
+            return false;
+        }
+        double power = 0;
+        while (*pos < length && is_digit(input[*pos])) {
+            power = power * 10 + char_to_digit(input[*pos]);
+            (*pos)++;
+        }
+        // TODO: overflow check
+        *number *= pow(10, negative ? -power : power);
+    }
+    return true;
+}
+
+// The character at `pos`, or '\0' past the end of the input, which
+// doesn't need to be NUL-terminated.
+char char_at(const char *input, size_t pos, size_t length) {
+    return pos < length ? input[pos] : '\0';
+}
+
+// Whether the `len` bytes of a name at `name` are `word`.
+bool name_is(const char *name, size_t len, const char *word) {
+    return strlen(word) == len && strncmp(name, word, len) == 0;
+}
+
+Token next_token(const char *input, size_t *pos, size_t length) {
     if (*pos >= length || input[*pos] == '\0') {
         if (*pos != length) {
-            debug("Invalid end of input, next: %c\n", input[*pos+1]);
+            debug("Invalid end of input, next: %c\n", char_at(input, *pos + 1, length));
             return invalid_token;
         }
-        debug("End of input, next: %c\n", input[*pos+1]);
+        debug("End of input\n");
         return end_token;
     }
 
     if (is_letter(input[*pos])) {
-        debug("Letter: %c, next: %c\n", input[*pos], input[*pos+1]);
-        char string_token[MAX_INPUT] = {0};
-        for (size_t i = 0; is_letter(input[*pos]) || is_digit(input[*pos]) || input[*pos] == '_'; i++) {
-            string_token[i] = input[*pos];
+        debug("Letter: %c, next: %c\n", input[*pos], char_at(input, *pos + 1, length));
+        // Names are read in place, and only copied when something is
+        // stored under them
+        const char *name = input + *pos;
+        while (is_letter(char_at(input, *pos, length)) || is_digit(char_at(input, *pos, length))
+               || char_at(input, *pos, length) == '_') {
             (*pos)++;
         }
-        if (strnlen(string_token, 5) == 4
-            && (strncmp(string_token, "quit", 4) == 0
-                || strncmp(string_token, "exit", 4) == 0)) {
+        size_t len = input + *pos - name;
+        // Only right before a parenthesis, since `min` is also minutes
+        for (size_t i = 0; i < N_AGGREGATES && char_at(input, *pos, length) == '('; i++) {
+            if (name_is(name, len, aggregate_names[i])) {
+                return token_new_aggregate((AggregateType)i);
+            }
+        }
+        if (name_is(name, len, "quit") || name_is(name, len, "exit")) {
             return quit_token;
         }
-        if (strnlen(string_token, 5) == 4 && strncmp(string_token, "help", 4) == 0) {
+        if (name_is(name, len, "help")) {
             return help_token;
         }
-        if (strnlen(string_token, 7) == 6 && strncmp(string_token, "memory", 6) == 0) {
+        if (name_is(name, len, "memory")) {
             return memory_token;
         }
-        if (strnlen(string_token, 6) == 5 && strncmp(string_token, "units", 5) == 0) {
+        if (name_is(name, len, "explain")) {
+            return explain_token;
+        }
+        if (name_is(name, len, "units")) {
             return show_units_token;
         }
-        if (strnlen(string_token, 9) == 8 && strncmp(string_token, "examples", 8) == 0) {
+        if (name_is(name, len, "examples")) {
             return examples_token;
         }
-        if (strnlen(string_token, 3) == 2 && strncmp(string_token, "to", 2) == 0) {
+        if (name_is(name, len, "to")) {
             return convert_token;
         }
-        if (strnlen(string_token, 8) == 7 && strncmp(string_token, "addunit", 7) == 0) {
+        if (name_is(name, len, "addunit")) {
             return add_unit_token;
         }
-        UnitType unit = string_to_unit(string_token);
+        if (name_is(name, len, "sweep")) {
+            return sweep_token;
+        }
+        if (name_is(name, len, "step")) {
+            return step_token;
+        }
+        UnitType unit = string_to_unit_len(name, len);
         if (unit != UNIT_UNKNOWN) {
             return token_new_unit(unit);
         }
-        return token_new_variable(string_token, arena);
+        return token_new_variable_len(name, len);
+    }
+
+    if (input[*pos] == '?' && is_letter(char_at(input, *pos + 1, length))) {
+        debug("Placeholder, next: %c\n", input[*pos + 1]);
+        (*pos)++;
+        const char *name = input + *pos;
+        while (is_letter(char_at(input, *pos, length)) || is_digit(char_at(input, *pos, length))
+               || char_at(input, *pos, length) == '_') {
+            (*pos)++;
+        }
+        Token token = token_new_variable_len(name, input + *pos - name);
+        token.type = TOK_PARAM;
+        return token;
     }
 
     const unsigned char whitespace[3] = {' ', '\t', '\n'};
     if (char_in_set(input[*pos], whitespace, sizeof(whitespace))) {
-        debug("Whitespace, next: %c\n", input[*pos+1]);
-        while (char_in_set(input[*pos], whitespace, sizeof(whitespace))) {
+        debug("Whitespace, next: %c\n", char_at(input, *pos + 1, length));
+        while (*pos < length && char_in_set(input[*pos], whitespace, sizeof(whitespace))) {
             (*pos)++;
         }
         return whitespace_token;
     }
 
+    char next = char_at(input, *pos + 1, length);
+    if (input[*pos] == ':' && next == '=') {
+        debug("Bind\n");
+        *pos += 2;
+        return bind_token;
+    }
+
+    if (input[*pos] == ':') {
+        debug("Colon\n");
+        (*pos)++;
+        return colon_token;
+    }
+
+    if (input[*pos] == '(') {
+        debug("Left parenthesis\n");
+        (*pos)++;
+        return lparen_token;
+    }
+
+    if (input[*pos] == ')') {
+        debug("Right parenthesis\n");
+        (*pos)++;
+        return rparen_token;
+    }
+
+    if (input[*pos] == '.' && next == '.') {
+        debug("Range\n");
+        *pos += 2;
+        return range_token;
+    }
+
     const unsigned char operators[6] = {'+', '-', '*', '/', '^', '='};
     if (char_in_set(input[*pos], operators, sizeof(operators))) {
         debug("Operator: %c\n", input[*pos]);
@@ -163,23 +326,13 @@ Token next_token(const char *input, size_t *pos, size_t length, Arena *arena) {
         if (input[*pos] == '+') {
             token = add_token;
         } else if (input[*pos] == '-') {
-            token = sub_token;
-            (*pos)++;
-            if (input[*pos] == '>') {
-                token = convert_token;
-            } else {
-                (*pos)--;
-            }
+            token = next == '>' ? convert_token : sub_token;
+            if (next == '>') (*pos)++;
         } else if (input[*pos] == '*') {
             token = mul_token;
         } else if (input[*pos] == '/') {
-            token = div_token;
-            (*pos)++;
-            if (input[*pos] == '/') {
-                token = int_div_token;
-            } else {
-                (*pos)--;
-            }
+            token = next == '/' ? int_div_token : div_token;
+            if (next == '/') (*pos)++;
         } else if (input[*pos] == '^'){
             token = caret_token;
         } else {
@@ -191,32 +344,9 @@ Token next_token(const char *input, size_t *pos, size_t length, Arena *arena) {
 
     if (is_digit(input[*pos])) {
         debug("Number: %c\n", input[*pos]);
-        double number = 0;
-        while (is_digit(input[*pos])) {
-            number = number * 10 + char_to_digit(input[*pos]);
-            (*pos)++;
-        }
-        if (input[*pos] == '.') {
-            (*pos)++;
-            double decimal = 0.1;
-            while (is_digit(input[*pos])) {
-                number += char_to_digit(input[*pos]) * decimal;
-                decimal /= 10;
-                (*pos)++;
-            }
-        }
-        if (input[*pos] == 'e' || input[*pos] == 'E') {
-            (*pos)++;
-            if (!is_digit(input[*pos])) {
-                return invalid_token;
-            }
-            double power = 0;
-            while (is_digit(input[*pos])) {
-                power += power * 10 + char_to_digit(input[*pos]);
-                (*pos)++;
-            }
-            // TODO: overflow check
-            number *= pow(10, power);
+        double number;
+        if (!next_number(input, pos, length, &number)) {
+            return invalid_token;
         }
         return token_new_num(number);
     }
@@ -224,40 +354,75 @@ Token next_token(const char *input, size_t *pos, size_t length, Arena *arena) {
     return invalid_token;
 }
 
+// Read the numbers of an array, e.g. `[1, -2.5, 7]`, into `arena`.
+Token next_array(const char *input, size_t *pos, size_t length, Arena *arena) {
+    // Every number but the last needs a comma after it
+    double numbers[MAX_INPUT / 2 + 1];
+    size_t n_numbers = 0;
+    while (char_at(input, *pos, length) != ']') {
+        // Past the opening bracket or a comma
+        (*pos)++;
+        Token token = next_token(input, pos, length);
+        if (token.type == TOK_WHITESPACE) token = next_token(input, pos, length);
+        bool negative = token.type == TOK_SUB;
+        if (negative) token = next_token(input, pos, length);
+        if (token.type != TOK_NUM) return invalid_token;
+        numbers[n_numbers++] = negative ? -token.number : token.number;
+        while (char_at(input, *pos, length) == ' ' || char_at(input, *pos, length) == '\t') (*pos)++;
+        if (char_at(input, *pos, length) != ',' && char_at(input, *pos, length) != ']') return invalid_token;
+    }
+    (*pos)++;
+    return token_new_array(numbers, n_numbers, arena);
+}
+
 typedef struct TokenString TokenString;
 struct TokenString {
     Token *tokens;
     size_t length;
 };
 
-TokenString tokenize(const char *input, Arena *arena) {
+// Tokenize the `length` bytes at `input`, e.g. a line of a mapped file,
+// which don't need to be NUL-terminated or copied anywhere first. Each
+// token records where in them it came from.
+TokenString tokenize_view(const char *input, size_t length, Arena *arena) {
+    trace_begin(TRACE_TOKENIZE, "tokenize");
     TokenString tokens;
     tokens.tokens = arena_alloc(arena, sizeof(Token) * MAX_INPUT);
     tokens.length = 0;
     bool done = false;
     size_t pos = 0;
-    size_t input_length = strnlen(input, MAX_INPUT + 1);
-    if (input_length > MAX_INPUT) {
+    if (length > MAX_INPUT) {
         tokens.tokens[0] = invalid_token;
         tokens.length = 1;
+        trace_end(TRACE_TOKENIZE, "tokenize");
         return tokens;
     }
     while (!done) {
-        Token token = next_token(input, &pos, input_length, arena);
+        size_t start = pos;
+        Token token = char_at(input, pos, length) == '['
+            ? next_array(input, &pos, length, arena)
+            : next_token(input, &pos, length);
         if (token.type == TOK_INVALID || token.type == TOK_END) {
             done = true;
         } else if (token.type == TOK_WHITESPACE) {
             continue;
         }
+        token.offset = start;
+        token.length = pos - start;
         tokens.tokens[tokens.length] = token;
         tokens.length++;
     }
     if (tokens.length > 0 && tokens.tokens[tokens.length - 1].type == TOK_END) {
         tokens.length -= 1;
     }
+    trace_end(TRACE_TOKENIZE, "tokenize");
     return tokens;
 }
 
+TokenString tokenize(const char *input, Arena *arena) {
+    return tokenize_view(input, strnlen(input, MAX_INPUT + 1), arena);
+}
+
 String token_string(Token token, Arena *arena) {
     switch (token.type) {
         case TOK_END:
@@ -270,18 +435,40 @@ String token_string(Token token, Arena *arena) {
             return string_new("help", arena);
         case TOK_MEMORY:
             return string_new("memory", arena);
+        case TOK_EXPLAIN:
+            return string_new("explain", arena);
         case TOK_SHOW_UNITS:
             return string_new("units", arena);
         case TOK_EXAMPLES:
             return string_new("examples", arena);
         case TOK_ADD_UNIT:
             return string_new("addunit", arena);
+        case TOK_SWEEP:
+            return string_new("sweep", arena);
+        case TOK_STEP:
+            return string_new("step", arena);
+        case TOK_RANGE:
+            return string_new("..", arena);
+        case TOK_COLON:
+            return string_new(":", arena);
         case TOK_NUM:
             return string_new_fmt(arena, "%f", token.number);
         case TOK_VAR:
-            return string_new((char *)token.var_name, arena);
+            return string_new_fmt(arena, "%.*s", (int)token.var_len, token.var_name);
+        case TOK_PARAM:
+            return string_new_fmt(arena, "?%.*s", (int)token.var_len, token.var_name);
+        case TOK_ARRAY:
+            return display_array_value(token.array, arena);
+        case TOK_AGGREGATE:
+            return string_new((char *)aggregate_names[token.aggregate], arena);
+        case TOK_LPAREN:
+            return string_new("(", arena);
+        case TOK_RPAREN:
+            return string_new(")", arena);
         case TOK_EQUALS:
             return string_new("=", arena);
+        case TOK_BIND:
+            return string_new(":=", arena);
         case TOK_ADD:
             return string_new("+", arena);
         case TOK_SUB:
@@ -303,6 +490,51 @@ String token_string(Token token, Arena *arena) {
     }
 }
 
+// A copy of the name of the variable or placeholder `token` in `arena`.
+unsigned char *token_name(Token token, Arena *arena) {
+    unsigned char *name = arena_alloc(arena, token.var_len + 1);
+    memcpy(name, token.var_name, token.var_len);
+    name[token.var_len] = '\0';
+    return name;
+}
+
+// Whether `a` and `b` are variables or placeholders with the same name.
+bool token_same_name(Token a, Token b) {
+    return a.var_len == b.var_len && memcmp(a.var_name, b.var_name, a.var_len) == 0;
+}
+
+// Copy of `tokens` that lives in `arena`, names and all, so it doesn't
+// need the input they were read from any more.
+TokenString tokens_copy(TokenString tokens, Arena *arena) {
+    TokenString copy = { .tokens = arena_alloc(arena, sizeof(Token) * tokens.length), .length = tokens.length };
+    memcpy(copy.tokens, tokens.tokens, sizeof(Token) * tokens.length);
+    for (size_t i = 0; i < copy.length; i++) {
+        if (copy.tokens[i].type == TOK_ARRAY) copy.tokens[i].array = array_value_copy(copy.tokens[i].array, arena);
+        if (copy.tokens[i].type == TOK_VAR || copy.tokens[i].type == TOK_PARAM) {
+            copy.tokens[i].var_name = token_name(copy.tokens[i], arena);
+        }
+    }
+    return copy;
+}
+
+// `tokens` as the user might have typed them, e.g. "x * 3 km".
+String tokens_display(TokenString tokens, Arena *arena) {
+    String s = string_empty(arena);
+    for (size_t i = 0; i < tokens.length; i++) {
+        // E.g. "sum(x)"
+        bool glued = i > 0 && (tokens.tokens[i - 1].type == TOK_AGGREGATE
+            || tokens.tokens[i - 1].type == TOK_LPAREN || tokens.tokens[i].type == TOK_RPAREN);
+        if (i > 0 && !glued) {
+            s = string_concat_static(s, " ", arena);
+        }
+        String token = tokens.tokens[i].type == TOK_NUM
+            ? string_new_fmt(arena, "%g", tokens.tokens[i].number)
+            : token_string(tokens.tokens[i], arena);
+        s = string_concat(s, token, arena);
+    }
+    return s;
+}
+
 void token_display(Token token, Arena *arena) {
     debug("Token: %s\n", token_string(token, arena).s);
 }
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "debug.c"
+
+// Runtime-toggleable structured tracing.
+//
+// Unlike `debug()`, which is compiled in or out as a whole, trace points
+// are always compiled in and each subsystem can be switched on at runtime,
+// e.g. `CALC_TRACE=parse,memory build/main`. When a subsystem is off a
+// trace point costs a single relaxed load and a branch.
+//
+// Events are recorded into a per-thread ring buffer without locks or I/O.
+// A background flusher thread drains the rings into the trace file, so the
+// thread doing the work never blocks on a write. If a ring fills up faster
+// than it's drained we drop events (and count them) rather than stall.
+//
+// Events can be written as plain text lines, or as Chrome `traceEvents`
+// JSON which can be loaded into chrome://tracing or ui.perfetto.dev,
+// where every thread that recorded something gets its own lane.
+
+typedef enum TraceSubsystem TraceSubsystem;
+enum TraceSubsystem {
+    TRACE_TOKENIZE,
+    TRACE_PARSE,
+    TRACE_EVALUATE,
+    TRACE_UNIT,
+    TRACE_MEMORY,
+    TRACE_ARENA,
+    TRACE_EXECUTE,
+    TRACE_SUBSYSTEM_COUNT,
+};
+
+const char *trace_subsystem_strings[] = {
+    "tokenize",
+    "parse",
+    "evaluate",
+    "unit",
+    "memory",
+    "arena",
+    "execute",
+};
+
+typedef enum TracePhase TracePhase;
+enum TracePhase {
+    TRACE_BEGIN = 'B',
+    TRACE_END = 'E',
+    TRACE_INSTANT = 'i',
+    TRACE_METADATA = 'M',
+};
+
+typedef enum TraceFormat TraceFormat;
+enum TraceFormat {
+    TRACE_FORMAT_TEXT,
+    TRACE_FORMAT_CHROME,
+};
+
+#define TRACE_DETAIL_LEN 24
+
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent {
+    uint64_t timestamp_ns;
+    // Must point to static data, we don't copy it.
+    const char *name;
+    double value;
+    uint32_t thread_id;
+    uint8_t subsystem;
+    char phase;
+    // Small copied payload, e.g. a variable name. Truncated to fit.
+    char detail[TRACE_DETAIL_LEN];
+};
+
+// Must be a power of two.
+#define TRACE_RING_SIZE 4096
+
+// Single producer (the owning thread), single consumer (the flusher).
+typedef struct TraceRing TraceRing;
+struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic size_t dropped;
+    uint32_t thread_id;
+    TraceRing *next;
+};
+
+typedef struct Tracer Tracer;
+struct Tracer {
+    // Bit per TraceSubsystem
+    _Atomic unsigned mask;
+    // Every ring ever created. Rings are only freed on `trace_shutdown`,
+    // so the flusher can walk this without coordinating with thread exit.
+    _Atomic(TraceRing *) rings;
+    // Bumped by `trace_shutdown` once it has taken the rings to free.
+    // Other threads can't be reached to clear their `thread_trace_ring`,
+    // so they compare this against the generation their ring was made in.
+    _Atomic uint64_t generation;
+    _Atomic uint32_t next_thread_id;
+    FILE *out;
+    TraceFormat format;
+    // Whether we need a comma before the next JSON event
+    bool wrote_event;
+    pthread_mutex_t flush_lock;
+    pthread_t flusher;
+    bool flusher_running;
+    _Atomic bool stop;
+};
+
+// Process wide so that any thread can record without threading
+// a handle through every function we want to instrument.
+Tracer tracer = { .flush_lock = PTHREAD_MUTEX_INITIALIZER };
+static _Thread_local TraceRing *thread_trace_ring = NULL;
+// `tracer.generation` when `thread_trace_ring` was made. If it's behind,
+// the ring has been freed and must not be touched.
+static _Thread_local uint64_t thread_trace_generation = 0;
+// Lets a thread skip recording without touching the global mask,
+// e.g. to only trace a sample of lines in a batch.
+static _Thread_local bool thread_trace_muted = false;
+
+#define trace_enabled(subsystem) \
+    __builtin_expect((atomic_load_explicit(&tracer.mask, memory_order_relaxed) >> (subsystem)) & 1, 0)
+
+#define trace_event(subsystem, phase, name, detail, value) do { \
+    if (trace_enabled(subsystem)) trace_record(subsystem, phase, name, detail, value); \
+} while(0)
+
+#define trace_begin(subsystem, name) trace_event(subsystem, TRACE_BEGIN, name, NULL, 0)
+#define trace_end(subsystem, name) trace_event(subsystem, TRACE_END, name, NULL, 0)
+#define trace_instant(subsystem, name, detail, value) \
+    trace_event(subsystem, TRACE_INSTANT, name, detail, value)
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void trace_set_enabled(TraceSubsystem subsystem, bool enabled) {
+    assert(subsystem < TRACE_SUBSYSTEM_COUNT);
+    if (enabled) {
+        atomic_fetch_or(&tracer.mask, 1u << subsystem);
+    } else {
+        atomic_fetch_and(&tracer.mask, ~(1u << subsystem));
+    }
+}
+
+void trace_set_all(bool enabled) {
+    atomic_store(&tracer.mask, enabled ? (1u << TRACE_SUBSYSTEM_COUNT) - 1 : 0);
+}
+
+TraceSubsystem trace_subsystem_from_string(const char *s, size_t len) {
+    for (TraceSubsystem subsystem = 0; subsystem < TRACE_SUBSYSTEM_COUNT; subsystem++) {
+        const char *name = trace_subsystem_strings[subsystem];
+        if (strlen(name) == len && strncmp(s, name, len) == 0) return subsystem;
+    }
+    return TRACE_SUBSYSTEM_COUNT;
+}
+
+// Comma separated list of subsystems, or "all". Returns false
+// if any name is unrecognized, but still enables the valid ones.
+bool trace_enable_list(const char *list) {
+    bool all_valid = true;
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (len == 3 && strncmp(list, "all", 3) == 0) {
+            trace_set_all(true);
+        } else if (len > 0) {
+            TraceSubsystem subsystem = trace_subsystem_from_string(list, len);
+            if (subsystem == TRACE_SUBSYSTEM_COUNT) {
+                all_valid = false;
+            } else {
+                trace_set_enabled(subsystem, true);
+            }
+        }
+        list += len;
+        if (*list == ',') list++;
+    }
+    return all_valid;
+}
+
+TraceRing *trace_ring_get() {
+    uint64_t generation = atomic_load_explicit(&tracer.generation, memory_order_acquire);
+    if (thread_trace_ring != NULL && thread_trace_generation == generation) return thread_trace_ring;
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    assert(ring != NULL);
+    ring->thread_id = atomic_fetch_add(&tracer.next_thread_id, 1);
+    TraceRing *head = atomic_load(&tracer.rings);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&tracer.rings, &head, ring));
+    thread_trace_ring = ring;
+    thread_trace_generation = generation;
+    return ring;
+}
+
+void trace_record(TraceSubsystem subsystem, TracePhase phase, const char *name,
+                  const char *detail, double value) {
+    if (thread_trace_muted) return;
+    TraceRing *ring = trace_ring_get();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    TraceEvent *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    event->timestamp_ns = trace_now_ns();
+    event->name = name;
+    event->value = value;
+    event->thread_id = ring->thread_id;
+    event->subsystem = subsystem;
+    event->phase = phase;
+    event->detail[0] = '\0';
+    if (detail != NULL) {
+        strncpy(event->detail, detail, TRACE_DETAIL_LEN - 1);
+        event->detail[TRACE_DETAIL_LEN - 1] = '\0';
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_set_muted(bool muted) {
+    thread_trace_muted = muted;
+}
+
+// Label the calling thread's lane, e.g. "worker 3".
+void trace_set_thread_name(const char *name) {
+    if (atomic_load_explicit(&tracer.mask, memory_order_relaxed) == 0) return;
+    trace_record(TRACE_EXECUTE, TRACE_METADATA, "thread_name", name, 0);
+}
+
+void trace_write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+            fputc(*s, out);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void trace_write_chrome_event(FILE *out, TraceEvent event) {
+    fprintf(out, "%s\n{\"name\":", tracer.wrote_event ? "," : "");
+    tracer.wrote_event = true;
+    trace_write_json_string(out, event.name);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03llu",
+        trace_subsystem_strings[event.subsystem], event.phase, event.thread_id,
+        (unsigned long long)(event.timestamp_ns / 1000),
+        (unsigned long long)(event.timestamp_ns % 1000));
+    if (event.phase == TRACE_INSTANT) fprintf(out, ",\"s\":\"t\"");
+    if (event.phase == TRACE_METADATA) {
+        fprintf(out, ",\"args\":{\"name\":");
+        trace_write_json_string(out, event.detail);
+        fprintf(out, "}");
+    } else if (event.detail[0] != '\0' || event.value != 0) {
+        fprintf(out, ",\"args\":{\"detail\":");
+        trace_write_json_string(out, event.detail);
+        fprintf(out, ",\"value\":%g}", event.value);
+    }
+    fprintf(out, "}");
+}
+
+void trace_write_event(FILE *out, TraceEvent event) {
+    if (tracer.format == TRACE_FORMAT_CHROME) {
+        trace_write_chrome_event(out, event);
+        return;
+    }
+    fprintf(out, "%llu.%03llu %u %s %c %s",
+        (unsigned long long)(event.timestamp_ns / 1000),
+        (unsigned long long)(event.timestamp_ns % 1000),
+        event.thread_id, trace_subsystem_strings[event.subsystem],
+        event.phase, event.name);
+    if (event.detail[0] != '\0') fprintf(out, " %s", event.detail);
+    if (event.value != 0) fprintf(out, " %g", event.value);
+    fprintf(out, "\n");
+}
+
+// Drain every ring into `out`. Safe to call from any thread, but
+// only one drain runs at a time. Returns number of events written.
+size_t trace_flush(FILE *out) {
+    size_t written = 0;
+    pthread_mutex_lock(&tracer.flush_lock);
+    for (TraceRing *ring = atomic_load(&tracer.rings); ring != NULL; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            trace_write_event(out, ring->events[tail & (TRACE_RING_SIZE - 1)]);
+            written++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        size_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped > 0 && tracer.format == TRACE_FORMAT_CHROME) {
+            TraceEvent event = { .timestamp_ns = trace_now_ns(), .name = "dropped_events",
+                .value = dropped, .thread_id = ring->thread_id,
+                .subsystem = TRACE_EXECUTE, .phase = TRACE_INSTANT };
+            trace_write_chrome_event(out, event);
+        } else if (dropped > 0) {
+            fprintf(out, "thread %u dropped %zu events\n", ring->thread_id, dropped);
+        }
+    }
+    fflush(out);
+    pthread_mutex_unlock(&tracer.flush_lock);
+    return written;
+}
+
+#define TRACE_FLUSH_INTERVAL_US 10000
+
+void *trace_flusher_main(void *_) {
+    while (!atomic_load(&tracer.stop)) {
+        trace_flush(tracer.out);
+        usleep(TRACE_FLUSH_INTERVAL_US);
+    }
+    return NULL;
+}
+
+// Start asynchronously flushing to `out`. If we can't spawn a
+// thread (e.g. wasm without threads), the caller's `trace_shutdown`
+// will still flush everything synchronously at the end.
+void trace_start(FILE *out, TraceFormat format) {
+    assert(!tracer.flusher_running);
+    tracer.out = out;
+    tracer.format = format;
+    tracer.wrote_event = false;
+    if (format == TRACE_FORMAT_CHROME) {
+        fprintf(out, "{\"traceEvents\":[");
+    }
+    atomic_store(&tracer.stop, false);
+    tracer.flusher_running = pthread_create(&tracer.flusher, NULL, trace_flusher_main, NULL) == 0;
+}
+
+// Configure tracing from the environment:
+// CALC_TRACE = comma separated subsystems (or "all") to enable
+// CALC_TRACE_FILE = file to write events to, defaults to stderr
+// CALC_TRACE_FORMAT = "text" (default) or "chrome"
+void trace_init_from_env() {
+    const char *list = getenv("CALC_TRACE");
+    if (list == NULL || *list == '\0') return;
+    if (!trace_enable_list(list)) {
+        fprintf(stderr, "Unknown trace subsystem in CALC_TRACE: %s\n", list);
+    }
+    FILE *out = stderr;
+    const char *path = getenv("CALC_TRACE_FILE");
+    if (path != NULL && *path != '\0') {
+        out = fopen(path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not open CALC_TRACE_FILE: %s\n", path);
+            out = stderr;
+        }
+    }
+    const char *format = getenv("CALC_TRACE_FORMAT");
+    bool chrome = format != NULL && strcmp(format, "chrome") == 0;
+    trace_start(out, chrome ? TRACE_FORMAT_CHROME : TRACE_FORMAT_TEXT);
+}
+
+// Stop tracing, flush what's left and free every ring. Only call once
+// no thread is in the middle of recording. Threads that recorded before
+// and are still around get a new ring the next time they record.
+void trace_shutdown() {
+    trace_set_all(false);
+    if (tracer.out == NULL) return;
+    atomic_store(&tracer.stop, true);
+    if (tracer.flusher_running) {
+        pthread_join(tracer.flusher, NULL);
+        tracer.flusher_running = false;
+    }
+    trace_flush(tracer.out);
+    if (tracer.format == TRACE_FORMAT_CHROME) {
+        fprintf(tracer.out, "\n]}\n");
+    }
+    if (tracer.out != stderr && tracer.out != stdout) fclose(tracer.out);
+    tracer.out = NULL;
+    TraceRing *next;
+    TraceRing *ring = atomic_exchange(&tracer.rings, NULL);
+    atomic_fetch_add_explicit(&tracer.generation, 1, memory_order_release);
+    for (; ring != NULL; ring = next) {
+        next = ring->next;
+        free(ring);
+    }
+    thread_trace_ring = NULL;
+}
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "arena.c"
@@ -92,8 +93,8 @@ UnitBasic unit_basic_builtin(UnitType type) {
     return unit_basic(type, (char *)builtin_unit_strings[type]);
 }
 
-bool string_in_set(char *s, char *set[], size_t set_len) {
-    size_t len = strnlen(s, 32);
+// Whether the first `len` bytes of `s` are one of `set`.
+bool string_in_set(const char *s, size_t len, char *set[], size_t set_len) {
     for (size_t i = 0; i < set_len; i++) {
         char *curr = set[i];
         size_t curr_len = strnlen(curr, 32);
@@ -103,7 +104,9 @@ bool string_in_set(char *s, char *set[], size_t set_len) {
     return false;
 }
 
-UnitType string_to_unit(char *s) {
+// The builtin unit named by the first `len` bytes of `s`, which doesn't
+// need to end there.
+UnitType string_to_unit_len(const char *s, size_t len) {
     char *cms[] = {"cm", "centimeter", "centimeters"};
     char *ms[] = {"m", "meter", "meters"};
     char *kms[] = {"km", "kilometer", "kilometers"};
@@ -121,26 +124,30 @@ UnitType string_to_unit(char *s) {
     char *ks[] = {"K", "k", "kelvin"};
     char *cs[] = {"C", "c", "celsius"};
     char *fs[] = {"F", "f", "fahrenheit"};
-    if (string_in_set(s, cms, 3)) return UNIT_CENTIMETER;
-    if (string_in_set(s, ms, 3)) return UNIT_METER;
-    if (string_in_set(s, kms, 3)) return UNIT_KILOMETER;
-    if (string_in_set(s, ins, 3)) return UNIT_INCH;
-    if (string_in_set(s, fts, 3)) return UNIT_FOOT;
-    if (string_in_set(s, mis, 3)) return UNIT_MILE;
-    if (string_in_set(s, secs, 5)) return UNIT_SECOND;
-    if (string_in_set(s, mins, 4)) return UNIT_MINUTE;
-    if (string_in_set(s, hrs, 5)) return UNIT_HOUR;
-    if (string_in_set(s, gs, 3)) return UNIT_GRAM;
-    if (string_in_set(s, kgs, 3)) return UNIT_KILOGRAM;
-    if (string_in_set(s, lbs, 4)) return UNIT_POUND;
-    if (string_in_set(s, ozs, 4)) return UNIT_OUNCE;
-    if (string_in_set(s, amps, 5)) return UNIT_AMP;
-    if (string_in_set(s, ks, 3)) return UNIT_KELVIN;
-    if (string_in_set(s, cs, 3)) return UNIT_CELSIUS;
-    if (string_in_set(s, fs, 3)) return UNIT_FAHRENHEIT;
+    if (string_in_set(s, len, cms, 3)) return UNIT_CENTIMETER;
+    if (string_in_set(s, len, ms, 3)) return UNIT_METER;
+    if (string_in_set(s, len, kms, 3)) return UNIT_KILOMETER;
+    if (string_in_set(s, len, ins, 3)) return UNIT_INCH;
+    if (string_in_set(s, len, fts, 3)) return UNIT_FOOT;
+    if (string_in_set(s, len, mis, 3)) return UNIT_MILE;
+    if (string_in_set(s, len, secs, 5)) return UNIT_SECOND;
+    if (string_in_set(s, len, mins, 4)) return UNIT_MINUTE;
+    if (string_in_set(s, len, hrs, 5)) return UNIT_HOUR;
+    if (string_in_set(s, len, gs, 3)) return UNIT_GRAM;
+    if (string_in_set(s, len, kgs, 3)) return UNIT_KILOGRAM;
+    if (string_in_set(s, len, lbs, 4)) return UNIT_POUND;
+    if (string_in_set(s, len, ozs, 4)) return UNIT_OUNCE;
+    if (string_in_set(s, len, amps, 5)) return UNIT_AMP;
+    if (string_in_set(s, len, ks, 3)) return UNIT_KELVIN;
+    if (string_in_set(s, len, cs, 3)) return UNIT_CELSIUS;
+    if (string_in_set(s, len, fs, 3)) return UNIT_FAHRENHEIT;
     return UNIT_UNKNOWN;
 }
 
+UnitType string_to_unit(char *s) {
+    return string_to_unit_len(s, strlen(s));
+}
+
 typedef enum UnitCategory UnitCategory;
 enum UnitCategory {
     UNIT_CATEGORY_DISTANCE,
@@ -287,25 +294,47 @@ SlopeIntercept to_amp(UnitType from) {
     }
 }
 
-SlopeIntercept to_kelvin(UnitType from) {
+// Temperatures are kelvin = (value + offset / 100) * num / den, all in
+// integers, so conversions between them can be worked out exactly
+// before they're rounded to a double, e.g. C to F is exactly 1.8 * C
+// + 32, and not what 5/9 and 459.67 * 5/9 round to.
+typedef struct TemperatureScale TemperatureScale;
+struct TemperatureScale {
+    int64_t num;
+    int64_t den;
+    // In hundredths of a degree
+    int64_t offset;
+};
+
+TemperatureScale temperature_scale(UnitType from) {
     switch (from) {
-        case UNIT_KELVIN: return mb_new(1, 0);
-        case UNIT_CELSIUS: return mb_new(1, 273.15);
-        case UNIT_FAHRENHEIT:
-            return mb_new(5.0 / 9.0, 459.67 * 5.0 / 9.0);
+        case UNIT_KELVIN: return (TemperatureScale) { .num = 1, .den = 1, .offset = 0 };
+        case UNIT_CELSIUS: return (TemperatureScale) { .num = 1, .den = 1, .offset = 27315 };
+        case UNIT_FAHRENHEIT: return (TemperatureScale) { .num = 5, .den = 9, .offset = 45967 };
         default:
             assert(false);
-            return mb_new(0, 0);
+            return (TemperatureScale) { .num = 1, .den = 1, .offset = 0 };
     }
 }
 
+// Converting a temperature from `from` to `to` is `scale * value + offset`.
+void temperature_conversion(UnitType from, UnitType to, double *scale, double *offset) {
+    TemperatureScale a = temperature_scale(from);
+    TemperatureScale b = temperature_scale(to);
+    // (value + a.offset / 100) * num / den - b.offset / 100
+    int64_t num = a.num * b.den;
+    int64_t den = a.den * b.num;
+    *scale = (double)num / (double)den;
+    *offset = (double)(a.offset * num - b.offset * den) / (double)(100 * den);
+}
+
 // TODO: think more about precision, maybe rewrite some things
 // as expressions so the compiler can work some magic
 double unit_conversion(double value, UnitType from, UnitType to) {
     UnitCategory cat_from = unit_category(from);
     UnitCategory cat_to = unit_category(to);
     if (cat_from != cat_to) return 0;
-    double meters, kilograms, seconds, kelvin;
+    double meters, kilograms, seconds, scale, offset;
     switch (cat_from) {
         case UNIT_CATEGORY_DISTANCE:
             meters = solve_y(to_meters(from), value);
@@ -320,8 +349,8 @@ double unit_conversion(double value, UnitType from, UnitType to) {
             seconds = solve_y(to_amp(from), value);
             return solve_x(to_amp(to), seconds);
         case UNIT_CATEGORY_TEMPERATURE:
-            kelvin = solve_y(to_kelvin(from), value);
-            return solve_x(to_kelvin(to), kelvin);
+            temperature_conversion(from, to, &scale, &offset);
+            return scale * value + offset;
         case UNIT_CATEGORY_NONE:
             return value;
         default:
@@ -379,6 +408,28 @@ Unit unit_new_unknown(Arena *arena) {
     return unit_new_single_builtin(UNIT_UNKNOWN, 0, arena);
 }
 
+// Copy of `unit` in `arena`, including the names of user defined units.
+Unit unit_copy(Unit unit, Arena *arena) {
+    Unit copy = unit_new(unit.types, unit.degrees, unit.length, arena);
+    for (size_t i = 0; i < copy.length; i++) {
+        if ((int)copy.types[i].type < unit_type_user_min()) continue;
+        size_t name_len = strlen(copy.types[i].name) + 1;
+        copy.types[i].name = arena_alloc(arena, name_len);
+        memcpy(copy.types[i].name, unit.types[i].name, name_len);
+    }
+    return copy;
+}
+
+// Whether `a` and `b` are made of the same units in the same order.
+// Unlike `units_equal`, doesn't count reorderings as equal.
+bool units_identical(Unit a, Unit b) {
+    if (a.length != b.length) return false;
+    for (size_t i = 0; i < a.length; i++) {
+        if (a.types[i].type != b.types[i].type || a.degrees[i] != b.degrees[i]) return false;
+    }
+    return true;
+}
+
 #define MAX_UNITS_DISPLAY 32
 #define MAX_DEGREE_STRING 4
 #define MAX_UNIT_WITH_DEGREE_STRING MAX_UNIT_STRING + MAX_DEGREE_STRING
@@ -450,6 +501,7 @@ double unit_convert(double value, Unit a, Unit b, Arena *arena) {
                 double converted_degree_1 = unit_conversion(value_degree_1, a.types[i].type, b.types[j].type);
                 new_value = pow(converted_degree_1, a.degrees[i]);
                 debug("Found convertible: left: %s right: %s degree: %d pre-value: %lf post-value: %lf\n", a.types[i].name, b.types[j].name, a.degrees[i], value, new_value);
+                trace_instant(TRACE_UNIT, "convert", a.types[i].name, new_value);
                 value = new_value;
                 break;
             }
@@ -458,6 +510,47 @@ double unit_convert(double value, Unit a, Unit b, Arena *arena) {
     return value;
 }
 
+// What converting a value from `from` to `to` is, as
+// `scale * value + offset`.
+void unit_conversion_linear(UnitType from, UnitType to, double *scale, double *offset) {
+    if (unit_category(from) == UNIT_CATEGORY_TEMPERATURE && unit_category(to) == UNIT_CATEGORY_TEMPERATURE) {
+        temperature_conversion(from, to, scale, offset);
+    } else {
+        *scale = unit_conversion(1, from, to);
+        *offset = 0;
+    }
+}
+
+// Whether converting from `a` to `b` is `scale * value + offset` for
+// any value, and if so, what `scale` and `offset` are, worked out from
+// the units' definitions the way `unit_convert` would. It isn't for
+// e.g. negative degrees of temperatures, and even degrees aren't
+// counted as it, since `unit_convert` takes their roots.
+bool unit_convert_affine(Unit a, Unit b, double *scale, double *offset) {
+    *scale = 1;
+    *offset = 0;
+    for (size_t i = 0; i < a.length; i++) {
+        for (size_t j = 0; j < b.length; j++) {
+            if (unit_category(a.types[i].type) != unit_category(b.types[j].type)) continue;
+            double unit_scale, unit_offset;
+            unit_conversion_linear(a.types[i].type, b.types[j].type, &unit_scale, &unit_offset);
+            int degree = a.degrees[i];
+            if (degree == 1) {
+                *scale *= unit_scale;
+                *offset = *offset * unit_scale + unit_offset;
+            } else if (unit_offset == 0 && degree % 2 != 0) {
+                double factor = pow(unit_scale, degree);
+                *scale *= factor;
+                *offset *= factor;
+            } else {
+                return false;
+            }
+            break;
+        }
+    }
+    return isfinite(*scale) && isfinite(*offset);
+}
+
 Unit unit_combine(Unit a, Unit b, bool reject_same_category, Arena *arena) {
     assert(!is_unit_unknown(a));
     assert(!is_unit_unknown(b));
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <poll.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "arena.c"
+#include "execute.c"
+#include "hash_map.c"
+#include "memory.c"
+#include "scheduler.c"
+#include "tokenize.c"
+
+// Execute a script file again every time it's saved, only executing
+// lines whose result could be different from last time.
+//
+// Each run starts with empty memory. Lines are matched up with last
+// run's by text: the longest common prefix and suffix of the two
+// versions, so a single edit anywhere matches everything around it,
+// and several edits are treated as one changed block spanning them.
+// Lines in the block are compared with the ones they replaced by what
+// they assign.
+// A matched line that's an expression or `var = expression` isn't
+// executed again unless something it reads changed: its output is
+// reused, and what it assigned is stored again.
+//
+// A name is changed when a line that assigns it is new, removed, or
+// assigns something different than last run, and unchanged again once
+// a line assigns it the same as last run did. Everything else, e.g.
+// commands, formulas and what they refer to, is executed every run,
+// as is every line after a new or different `addunit`, since user
+// defined units are numbered in the order they're added.
+
+// Time to wait for more changes before running, since saving can take
+// several writes
+#define WATCH_SETTLE_MS 50
+
+typedef struct WatchLine WatchLine;
+struct WatchLine {
+    const char *text;
+    TokenString tokens;
+    // Not set for lines after a quit
+    bool ran;
+    bool executed;
+    // Whether the line can be skipped next run if nothing it reads changed
+    bool reusable;
+    const char *output;
+    // The name of the variable a `var = ...` or `var := ...` line
+    // assigns, or NULL
+    const unsigned char *target;
+    // Whether it stored `value` in `target`
+    bool stored;
+    MemoryValue value;
+};
+
+typedef struct WatchRun WatchRun;
+struct WatchRun {
+    // Lines and memory, needed until the next run is done
+    Arena arena;
+    Memory memory;
+    WatchLine *lines;
+    size_t n_lines;
+    size_t executed;
+};
+
+void watch_read_lines(WatchRun *run, FILE *input_fd) {
+    size_t capacity = 64;
+    run->lines = malloc(capacity * sizeof(WatchLine));
+    assert(run->lines != NULL);
+    char line[MAX_LINE];
+    while (batch_read_line(input_fd, line)) {
+        if (run->n_lines == capacity) {
+            capacity *= 2;
+            run->lines = realloc(run->lines, capacity * sizeof(WatchLine));
+            assert(run->lines != NULL);
+        }
+        const char *text = string_new_fmt(&run->arena, "%s", line).s;
+        // Tokens refer to the text, so not to `line`, which is reused
+        run->lines[run->n_lines++] = (WatchLine) {
+            .text = text,
+            .tokens = tokenize(text, &run->arena),
+            .output = "",
+        };
+    }
+}
+
+const unsigned char *watch_target(TokenString tokens, Arena *arena) {
+    if (tokens.length < 2 || tokens.tokens[0].type != TOK_VAR) return NULL;
+    if (tokens.tokens[1].type != TOK_EQUALS && tokens.tokens[1].type != TOK_BIND) return NULL;
+    return token_name(tokens.tokens[0], arena);
+}
+
+void watch_set_changed(HashMap *changed, const unsigned char *var_name, bool is_changed, Arena *arena) {
+    hash_map_insert(changed, var_name, &is_changed, arena);
+}
+
+bool watch_is_changed(HashMap changed, const unsigned char *var_name) {
+    return hash_map_contains(changed, var_name) && *(bool *)hash_map_get(changed, var_name);
+}
+
+// Mark everything a line that's no longer there might have assigned.
+void watch_remove_line(WatchLine *line, HashMap *changed, bool *units_changed, Arena *arena) {
+    TokenString tokens = line->tokens;
+    if (!line->ran || !tokens_change_memory(tokens)) return;
+    if (tokens.tokens[0].type == TOK_ADD_UNIT) *units_changed = true;
+    if (line->target != NULL) {
+        watch_set_changed(changed, line->target, true, arena);
+        return;
+    }
+    for (size_t i = 0; i < tokens.length; i++) {
+        if (tokens.tokens[i].type == TOK_VAR) watch_set_changed(changed, token_name(tokens.tokens[i], arena), true, arena);
+    }
+}
+
+// Whether `line` matched `old` and nothing it reads changed since.
+bool watch_can_reuse(WatchLine *line, WatchLine *old, HashMap changed, Arena *arena) {
+    if (old == NULL || !old->ran || !old->reusable || !line->reusable) return false;
+    for (size_t i = 0; i < line->tokens.length; i++) {
+        Token token = line->tokens.tokens[i];
+        // Assigning a changed name doesn't read it
+        if (i == 0 && line->target != NULL) continue;
+        if (token.type == TOK_VAR && watch_is_changed(changed, token_name(token, arena))) return false;
+    }
+    return true;
+}
+
+// Execute `input_fd` into `run`, reusing what it can from `prev`, which
+// is NULL the first time. Prints outputs the first time, and after that
+// only outputs that are different, prefixed with their line number.
+void watch_run(WatchRun *run, WatchRun *prev, FILE *input_fd, FILE *output_fd) {
+    *run = (WatchRun) { .arena = arena_create() };
+    run->memory = memory_new(&run->arena);
+    watch_read_lines(run, input_fd);
+    WatchLine *old_lines = prev != NULL ? prev->lines : NULL;
+    size_t n_old = prev != NULL ? prev->n_lines : 0;
+    size_t n_prefix = 0;
+    while (n_prefix < n_old && n_prefix < run->n_lines
+           && strcmp(old_lines[n_prefix].text, run->lines[n_prefix].text) == 0) {
+        n_prefix++;
+    }
+    size_t n_suffix = 0;
+    while (n_suffix < n_old - n_prefix && n_suffix < run->n_lines - n_prefix
+           && strcmp(old_lines[n_old - 1 - n_suffix].text, run->lines[run->n_lines - 1 - n_suffix].text) == 0) {
+        n_suffix++;
+    }
+
+    Arena arena = arena_create();
+    Arena scratch = arena_create();
+    // Name -> whether it could be different than last run, as of this line
+    HashMap changed = hash_map_new(sizeof(bool), &arena);
+    // Formulas and what they refer to, as in `schedule_new`
+    ScheduleNames names = schedule_names_new();
+    bool units_changed = false;
+    // Lines in the changed block are paired up with the old lines they
+    // replaced, in order, so e.g. an edit that assigns the same value as
+    // before doesn't change anything. Old lines left over are removed
+    // after the pairs, and new ones left over are new.
+    size_t n_paired = n_old - n_suffix - n_prefix;
+    if (run->n_lines - n_suffix - n_prefix < n_paired) n_paired = run->n_lines - n_suffix - n_prefix;
+    for (size_t i = 0; i < run->n_lines; i++) {
+        if (i == n_prefix + n_paired) {
+            for (size_t j = n_prefix + n_paired; j < n_old - n_suffix; j++) {
+                watch_remove_line(&old_lines[j], &changed, &units_changed, &arena);
+            }
+        }
+        WatchLine *line = &run->lines[i];
+        // The same line last run, and the line this one is instead of
+        WatchLine *old = NULL;
+        WatchLine *pair = NULL;
+        if (i < n_prefix) {
+            old = &old_lines[i];
+        } else if (i >= run->n_lines - n_suffix) {
+            old = &old_lines[i - run->n_lines + n_old];
+        } else if (i < n_prefix + n_paired) {
+            pair = &old_lines[i];
+            watch_remove_line(pair, &changed, &units_changed, &arena);
+        }
+        if (old != NULL) pair = old;
+        TokenString tokens = line->tokens;
+        bool add_unit = tokens.length > 0 && tokens.tokens[0].type == TOK_ADD_UNIT;
+        line->ran = true;
+        line->target = watch_target(tokens, &run->arena);
+        line->reusable = !schedule_is_barrier(tokens, &names);
+        schedule_add_names(&names, tokens);
+
+        bool quit = false;
+        bool reuse = !units_changed && watch_can_reuse(line, old, changed, &scratch);
+        // Where to store what the line stored last run, if it can have its name
+        Symbol reused = SYMBOL_NONE;
+        if (reuse && old->stored) {
+            String err = string_empty(&scratch);
+            reused = memory_intern(run->memory, line->target, strlen((const char *)line->target), &err, &scratch);
+            reuse = reused != SYMBOL_NONE;
+        }
+        if (reuse) {
+            line->output = string_new_fmt(&run->arena, "%s", old->output).s;
+            line->stored = old->stored;
+            if (line->stored) {
+                line->value = memory_copy_value(old->value, &run->arena);
+                memory_add_var(&run->memory, reused, line->value, &run->arena);
+                line->value = memory_get_var(run->memory, reused);
+            }
+            quit = tokens.length == 1 && tokens.tokens[0].type == TOK_QUIT;
+        } else {
+            char output[MAX_OUTPUT] = {0};
+            ExecuteResult result = execute_tokens(tokens, output, sizeof(output), &run->memory, &run->arena, &scratch);
+            line->executed = true;
+            line->output = string_new_fmt(&run->arena, "%s", output).s;
+            line->stored = line->target != NULL && result.changed_memory;
+            if (line->stored) {
+                Symbol var = memory_lookup(run->memory, line->target, strlen((const char *)line->target));
+                line->value = memory_get_var(run->memory, var);
+            }
+            quit = result.quit;
+            run->executed++;
+        }
+
+        if (add_unit && (old == NULL || strcmp(old->output, line->output) != 0)) {
+            units_changed = true;
+        }
+        if (line->target != NULL) {
+            bool same = pair != NULL && pair->ran && pair->target != NULL
+                && strcmp((const char *)pair->target, (const char *)line->target) == 0 && pair->stored == line->stored
+                && (!line->stored || memory_values_identical(pair->value, line->value));
+            watch_set_changed(&changed, line->target, !same, &arena);
+        } else if (line->executed && !add_unit && tokens_change_memory(tokens)) {
+            watch_remove_line(line, &changed, &units_changed, &arena);
+        }
+
+        bool print = prev == NULL || old == NULL || !old->ran || strcmp(old->output, line->output) != 0;
+        if (print && line->output[0] != '\0') {
+            if (prev == NULL) {
+                fprintf(output_fd, "%s\n", line->output);
+            } else {
+                fprintf(output_fd, "%zu: %s\n", i + 1, line->output);
+            }
+        }
+        arena_clear(&scratch);
+        if (quit) break;
+    }
+    schedule_names_free(&names);
+    arena_free(&scratch);
+    arena_free(&arena);
+}
+
+void watch_run_free(WatchRun *run) {
+    free(run->lines);
+    memory_free(&run->memory);
+    arena_free(&run->arena);
+}
+
+// Execute the script at `path`, then again every time it's saved, until
+// interrupted. Returns non-zero if the file can't be watched.
+int watch(const char *path, FILE *output_fd) {
+    FILE *script = fopen(path, "r");
+    if (script == NULL) {
+        printf("Could not open file: %s\n", path);
+        return 1;
+    }
+    WatchRun runs[2];
+    size_t current = 0;
+    watch_run(&runs[current], NULL, script, output_fd);
+    fclose(script);
+    fflush(output_fd);
+
+    // Watch the directory rather than the file, since editors often save
+    // by writing a new file and moving it over the old one
+    Arena arena = arena_create();
+    const char *slash = strrchr(path, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    String dir = slash != NULL ? string_new_fmt(&arena, "%.*s", (int)(slash - path) + 1, path)
+                               : string_new_fmt(&arena, ".");
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1 || inotify_add_watch(fd, dir.s, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        perror("Could not watch file");
+        if (fd != -1) close(fd);
+        arena_free(&arena);
+        watch_run_free(&runs[current]);
+        return 1;
+    }
+
+    alignas(struct inotify_event) char events[4096];
+    while (true) {
+        bool saved = false;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        // Wait for a save, then for things to settle
+        while (poll(&pfd, 1, saved ? WATCH_SETTLE_MS : -1) > 0) {
+            ssize_t len = read(fd, events, sizeof(events));
+            if (len <= 0) break;
+            for (char *p = events; p < events + len;) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                saved |= event->len > 0 && strcmp(event->name, name) == 0;
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (!saved) continue;
+        script = fopen(path, "r");
+        if (script == NULL) continue;
+        WatchRun *prev = &runs[current];
+        current = 1 - current;
+        watch_run(&runs[current], prev, script, output_fd);
+        fclose(script);
+        fprintf(output_fd, "(%zu of %zu lines executed)\n", runs[current].executed, runs[current].n_lines);
+        fflush(output_fd);
+        watch_run_free(prev);
+    }
+}
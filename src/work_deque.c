@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "debug.c"
+
+// Lock-free work-stealing deque of task indexes, e.g. lines of a script
+// or chunks of a sweep: the owning worker pushes and pops at the bottom,
+// anyone else steals from the top.
+typedef struct WorkDeque WorkDeque;
+struct WorkDeque {
+    alignas(64) _Atomic int64_t top;
+    alignas(64) _Atomic int64_t bottom;
+    // Power of two, at least the number of tasks so it never fills up
+    size_t capacity;
+    _Atomic size_t *tasks;
+};
+
+WorkDeque work_deque_new(size_t capacity) {
+    WorkDeque deque = { .capacity = capacity, .tasks = calloc(capacity, sizeof(_Atomic size_t)) };
+    assert(deque.tasks != NULL);
+    atomic_init(&deque.top, 0);
+    atomic_init(&deque.bottom, 0);
+    return deque;
+}
+
+// Owner only
+void work_deque_push(WorkDeque *deque, size_t task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    assert(bottom - atomic_load_explicit(&deque->top, memory_order_acquire) < (int64_t)deque->capacity);
+    atomic_store_explicit(&deque->tasks[bottom & (deque->capacity - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// Owner only. Returns false if the deque is empty.
+bool work_deque_pop(WorkDeque *deque, size_t *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    *task = atomic_load_explicit(&deque->tasks[bottom & (deque->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // Last one, race any thieves for it
+        bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+// Returns false if the deque is empty or another thread got there first.
+bool work_deque_steal(WorkDeque *deque, size_t *task) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return false;
+    *task = atomic_load_explicit(&deque->tasks[top & (deque->capacity - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed);
+}